@@ -0,0 +1,213 @@
+#include <common/message_io.h>
+#include <net/impaired_link.h>
+#include <net/stream_socket.h>
+#include <protocol/protocol.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Message layer over simulated links (see net/impaired_link.h), so
+ * throughput under delay, loss and limited bandwidth can be compared
+ * between releases on any box, without netem namespaces:
+ *   ping_pong  get_song_response echoed back, round trips per second
+ *   stream     get_song_response messages one way, MBps
+ * Links are the built-in profiles, or a single custom one given by
+ * options. Same seed gives the same losses, so runs are reproducible.
+ */
+
+struct bench_options {
+	uint64_t roundTrips = 200;
+	uint64_t streamBytes = 16 * 1024 * 1024;
+	bool custom = false;
+	link_options link;
+};
+
+struct link_profile {
+	std::string name;
+	link_options link;
+};
+
+struct bench_row {
+	double seconds;
+	uint64_t messages;
+	uint64_t bytes;
+	link_stats stats;
+};
+
+link_options make_link(uint64_t delayUs, uint64_t jitterUs, double loss, double reorder, uint64_t bandwidth)
+{
+	link_options link;
+	link.delay = std::chrono::microseconds(delayUs);
+	link.jitter = std::chrono::microseconds(jitterUs);
+	link.loss = loss;
+	link.reorder = reorder;
+	link.bandwidth = bandwidth;
+	return link;
+}
+
+std::vector<link_profile> link_profiles()
+{
+	return {
+		{ "ideal", make_link(0, 0, 0, 0, 0) },
+		{ "lan", make_link(100, 50, 0, 0, 125 * 1000 * 1000) },
+		{ "wan", make_link(5000, 1000, 0.001, 0.01, 12500 * 1000) },
+		{ "lossy", make_link(1000, 500, 0.03, 0.05, 0) }
+	};
+}
+
+bench_row run_ping_pong(link_options const & link, uint64_t payload, uint64_t roundTrips)
+{
+	auto pair = make_impaired_socket_pair(link);
+	std::thread echo([&pair, roundTrips] () {
+		for (uint64_t i = 0; i < roundTrips; ++i)
+			send_message(*pair.second, *recv_message(*pair.second));
+	});
+
+	get_song_response message(std::string(payload, 'x'));
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < roundTrips; ++i) {
+		send_message(*pair.first, message);
+		recv_message(*pair.first);
+	}
+	auto finish = std::chrono::steady_clock::now();
+
+	echo.join();
+	return { std::chrono::duration<double>(finish - start).count(), roundTrips,
+		2 * roundTrips * payload, get_link_stats(*pair.first) };
+}
+
+bench_row run_stream(link_options const & link, uint64_t payload, uint64_t bytes)
+{
+	uint64_t messages = std::max<uint64_t>(1, bytes / payload);
+	auto pair = make_impaired_socket_pair(link);
+	get_song_response message(std::string(payload, 'x'));
+
+	auto start = std::chrono::steady_clock::now();
+	std::thread sender([&] () {
+		for (uint64_t i = 0; i < messages; ++i)
+			send_message(*pair.first, message);
+	});
+	for (uint64_t i = 0; i < messages; ++i)
+		recv_message(*pair.second);
+	auto finish = std::chrono::steady_clock::now();
+
+	sender.join();
+	return { std::chrono::duration<double>(finish - start).count(), messages,
+		messages * payload, get_link_stats(*pair.first) };
+}
+
+void print_row(std::string const & bench, std::string const & link, uint64_t payload, bench_row const & row)
+{
+	std::cout << bench << "\t" << link << "\t" << payload << "\t" << row.messages << "\t"
+		<< std::fixed << std::setprecision(3) << row.seconds << "\t"
+		<< std::setprecision(0) << row.messages / row.seconds << "\t"
+		<< std::setprecision(1) << row.bytes / row.seconds / (1024 * 1024) << "\t"
+		<< row.stats.segments << "\t" << row.stats.lost << "\t" << row.stats.reordered << std::endl;
+}
+
+void usage(std::string const & name)
+{
+	std::cerr << "Usage: " << name << " [OPTIONS]" << std::endl << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  --round-trips=N [default = 200]    ping_pong round trips per case" << std::endl;
+	std::cerr << "  --stream-mb=N [default = 16]       stream volume per case" << std::endl;
+	std::cerr << "Any of the following runs one custom link instead of the profiles:" << std::endl;
+	std::cerr << "  --delay-us=N --jitter-us=N         one-way delay and its jitter" << std::endl;
+	std::cerr << "  --loss=P --reorder=P               probabilities in [0, 1)" << std::endl;
+	std::cerr << "  --bandwidth=BYTES_PER_SEC          zero is unlimited" << std::endl;
+	std::cerr << "  --queue=BYTES                      bytes in flight per direction" << std::endl;
+	std::cerr << "  --seed=N" << std::endl;
+	std::cerr << "scripts/netnsct.sh defaults are --delay-us=100000 --jitter-us=10000 --loss=0.3 --reorder=0.3" << std::endl;
+}
+
+bool parse_options(int argc, char * argv[], bench_options & options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto eq = arg.find('=');
+		if (arg.compare(0, 2, "--") || eq == std::string::npos)
+			return false;
+
+		std::string key = arg.substr(2, eq - 2);
+		std::string value = arg.substr(eq + 1);
+		try {
+			if (key == "round-trips") {
+				options.roundTrips = std::stoull(value);
+				continue;
+			}
+			if (key == "stream-mb") {
+				options.streamBytes = std::stoull(value) * 1024 * 1024;
+				continue;
+			}
+
+			options.custom = true;
+			if (key == "delay-us")
+				options.link.delay = std::chrono::microseconds(std::stoull(value));
+			else if (key == "jitter-us")
+				options.link.jitter = std::chrono::microseconds(std::stoull(value));
+			else if (key == "loss")
+				options.link.loss = std::stod(value);
+			else if (key == "reorder")
+				options.link.reorder = std::stod(value);
+			else if (key == "bandwidth")
+				options.link.bandwidth = std::stoull(value);
+			else if (key == "queue")
+				options.link.queueSize = std::stoull(value);
+			else if (key == "seed")
+				options.link.seed = std::stoull(value);
+			else
+				return false;
+		} catch (std::logic_error const &) {
+			std::cerr << "invalid value of option " << key << ": " << value << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		usage(argv[0]);
+		return 0;
+	}
+
+	bench_options options;
+	if (!parse_options(argc, argv, options)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<link_profile> profiles = link_profiles();
+	if (options.custom)
+		profiles = { { "custom", options.link } };
+	std::vector<uint64_t> payloads = { 64, 16 * 1024, 256 * 1024 };
+
+	std::cout << "bench\tlink\tpayload\tmessages\tseconds\tmsg_per_sec\tMBps\tsegments\tlost\treordered" << std::endl;
+	try {
+		for (auto const & profile: profiles) {
+			for (uint64_t payload: payloads) {
+				// big payloads are scaled down to keep run time reasonable
+				uint64_t roundTrips = payload <= 1024 ? options.roundTrips
+					: std::max<uint64_t>(10, options.roundTrips * 1024 / payload);
+				print_row("ping_pong", profile.name, payload, run_ping_pong(profile.link, payload, roundTrips));
+			}
+			for (uint64_t payload: payloads)
+				print_row("stream", profile.name, payload, run_stream(profile.link, payload, options.streamBytes));
+		}
+	} catch (std::invalid_argument const & e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
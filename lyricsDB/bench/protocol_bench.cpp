@@ -0,0 +1,314 @@
+#include <common/message_io.h>
+#include <common/trace.h>
+#include <net/stream_socket.h>
+#include <protocol/protocol.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Costs of the protocol layer for every message type across payload sizes:
+ *   serialize   message::serialize()
+ *   parse       parse_message()
+ *   message_io  send_message/recv_message streaming over socketpair,
+ *               with socket calls (syscalls) per message
+ * Iteration counts are calibrated to run every case for --min-time-ms.
+ * Output is TSV or JSON lines (--format=json), one row per case, so runs
+ * of different releases can be diffed. Every message_io send and receive
+ * is a traced request, so comparing runs with and without --trace-sample
+ * shows tracing overhead.
+ */
+
+using clock_type = std::chrono::steady_clock;
+
+struct bench_options {
+	std::string format = "tsv";
+	std::chrono::milliseconds minTime { 200 };
+	// zero means calibrate
+	uint64_t iterations = 0;
+	std::string only;
+	uint32_t traceSample = 0;
+};
+
+struct bench_row {
+	std::string bench;
+	std::string name;
+	uint64_t payload;
+	uint64_t frameBytes;
+	uint64_t iterations;
+	double seconds;
+	double sendCalls = 0;
+	double recvCalls = 0;
+};
+
+struct message_case {
+	std::string name;
+	// fixed-shape messages ignore payload and run once
+	bool sized;
+	std::function<message_ptr(uint64_t)> make;
+};
+
+std::vector<message_case> message_cases()
+{
+	auto songs = [] (uint64_t payload) {
+		// payload bytes of 32-byte song names
+		return std::vector<std::string>(std::max<uint64_t>(1, payload / 32), std::string(32, 's'));
+	};
+	auto text = [] (uint64_t payload) { return std::string(payload, 'x'); };
+
+	return {
+		{ "get_song_list_request", false, [] (uint64_t) {
+			return std::make_shared<get_song_list_request>("some author"); } },
+		{ "versioned_get_song_list_request", false, [] (uint64_t) {
+			return std::make_shared<get_song_list_request>("some author", 42); } },
+		{ "get_song_list_response", true, [songs] (uint64_t p) {
+			return std::make_shared<get_song_list_response>(songs(p)); } },
+		{ "versioned_get_song_list_response", true, [songs] (uint64_t p) {
+			return std::make_shared<get_song_list_response>(songs(p), 42); } },
+		{ "get_song_request", false, [] (uint64_t) {
+			return std::make_shared<get_song_request>("some author", "some song"); } },
+		{ "versioned_get_song_request", false, [] (uint64_t) {
+			return std::make_shared<get_song_request>("some author", "some song", 42); } },
+		{ "get_song_response", true, [text] (uint64_t p) {
+			return std::make_shared<get_song_response>(text(p)); } },
+		{ "versioned_get_song_response", true, [text] (uint64_t p) {
+			return std::make_shared<get_song_response>(text(p), 42); } },
+		{ "add_song_request", true, [text] (uint64_t p) {
+			return std::make_shared<add_song_request>("some author", "some song", text(p)); } },
+		{ "update_song_request", true, [text] (uint64_t p) {
+			return std::make_shared<update_song_request>("some author", "some song", digest_text(""), text(p)); } },
+		{ "add_song_response", false, [] (uint64_t) {
+			return std::make_shared<add_song_response>("OK"); } },
+		{ "not_modified_response", false, [] (uint64_t) {
+			return std::make_shared<not_modified_response>(42); } },
+		{ "subscribe_request", false, [] (uint64_t) {
+			return std::make_shared<subscribe_request>(); } },
+		{ "invalidate_message", false, [] (uint64_t) {
+			return std::make_shared<invalidate_message>("some author", "some song"); } },
+		{ "deadline_get_song_request", false, [] (uint64_t) {
+			return std::make_shared<deadline_request>(std::chrono::milliseconds(100),
+				std::make_shared<get_song_request>("some author", "some song")); } },
+		{ "overloaded_response", false, [] (uint64_t) {
+			return std::make_shared<overloaded_response>(OVERLOADED_QUEUE_FULL); } },
+	};
+}
+
+/*
+ * Runs op in growing batches until min time is reached, returns
+ * iterations and seconds of the last batch.
+ */
+std::pair<uint64_t, double> measure(bench_options const & options, std::function<void(uint64_t)> const & op)
+{
+	uint64_t iterations = options.iterations ? options.iterations : 1;
+	while (true) {
+		auto start = clock_type::now();
+		op(iterations);
+		double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+		if (options.iterations || seconds >= std::chrono::duration<double>(options.minTime).count())
+			return { iterations, seconds };
+		// aim a bit over min time, but don't jump more than 100x at once
+		double factor = seconds > 0 ? 1.2 * std::chrono::duration<double>(options.minTime).count() / seconds : 100;
+		iterations = std::max<uint64_t>(iterations + 1, uint64_t(iterations * std::min(factor, 100.0)));
+	}
+}
+
+/*
+ * Counts calls that reach the socket, each of them is a syscall
+ * for plain sockets.
+ */
+class counting_socket: public stream_socket {
+public:
+	explicit counting_socket(socket_ptr socket)
+		: m_socket(std::move(socket))
+	{}
+
+	void send(void const * buf, size_t size) override
+	{
+		++sends;
+		m_socket->send(buf, size);
+	}
+
+	void recv(void * buf, size_t size) override
+	{
+		++recvs;
+		m_socket->recv(buf, size);
+	}
+
+	uint64_t sends = 0;
+	uint64_t recvs = 0;
+
+private:
+	socket_ptr m_socket;
+};
+
+bench_row run_message_io(bench_options const & options, std::string const & name, message const & msg, uint64_t payload)
+{
+	uint64_t frameBytes = msg.serialize().size() + sizeof(uint64_t);
+	uint64_t sends = 0, recvs = 0;
+	auto result = measure(options, [&] (uint64_t iterations) {
+		auto pair = make_socket_pair();
+		counting_socket writer(pair.first);
+		counting_socket reader(pair.second);
+
+		std::thread sender([&] () {
+			for (uint64_t i = 0; i < iterations; ++i) {
+				trace_request traced;
+				send_message(writer, msg);
+			}
+		});
+		for (uint64_t i = 0; i < iterations; ++i) {
+			trace_request traced;
+			recv_message(reader);
+		}
+		sender.join();
+
+		sends = writer.sends;
+		recvs = reader.recvs;
+	});
+
+	bench_row row { "message_io", name, payload, frameBytes, result.first, result.second };
+	row.sendCalls = double(sends) / result.first;
+	row.recvCalls = double(recvs) / result.first;
+	return row;
+}
+
+void print_header(bench_options const & options)
+{
+	if (options.format == "tsv")
+		std::cout << "bench\tcase\tpayload\tframe_bytes\titerations\tns_per_op\tMBps\tsend_calls\trecv_calls" << std::endl;
+}
+
+void print_row(bench_options const & options, bench_row const & row)
+{
+	double nsPerOp = row.seconds * 1e9 / row.iterations;
+	double mbps = row.frameBytes * row.iterations / row.seconds / (1024 * 1024);
+	std::cout << std::fixed;
+	if (options.format == "json") {
+		std::cout << "{\"bench\":\"" << row.bench << "\",\"case\":\"" << row.name << "\""
+			<< ",\"payload\":" << row.payload
+			<< ",\"frame_bytes\":" << row.frameBytes
+			<< ",\"iterations\":" << row.iterations
+			<< std::setprecision(1) << ",\"ns_per_op\":" << nsPerOp
+			<< ",\"mbps\":" << mbps
+			<< std::setprecision(2) << ",\"send_calls\":" << row.sendCalls
+			<< ",\"recv_calls\":" << row.recvCalls
+			<< "}" << std::endl;
+		return;
+	}
+	std::cout << row.bench << "\t" << row.name << "\t" << row.payload << "\t" << row.frameBytes << "\t"
+		<< row.iterations << "\t" << std::setprecision(1) << nsPerOp << "\t" << mbps << "\t"
+		<< std::setprecision(2) << row.sendCalls << "\t" << row.recvCalls << std::endl;
+}
+
+void usage(std::string const & name)
+{
+	std::cerr << "Usage: " << name << " [OPTIONS]" << std::endl << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  --format=F [default = tsv]       tsv or json (one object per line)" << std::endl;
+	std::cerr << "  --min-time-ms=N [default = 200]  run every case at least N ms" << std::endl;
+	std::cerr << "  --iterations=N [default = 0]     fixed iteration count instead of calibration" << std::endl;
+	std::cerr << "  --bench=B [default = all]        serialize, parse or message_io" << std::endl;
+	std::cerr << "  --trace-sample=N [default = 0]   trace every N-th message_io request" << std::endl;
+}
+
+bool parse_options(int argc, char * argv[], bench_options & options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto eq = arg.find('=');
+		if (arg.compare(0, 2, "--") || eq == std::string::npos)
+			return false;
+
+		std::string key = arg.substr(2, eq - 2);
+		std::string value = arg.substr(eq + 1);
+		try {
+			if (key == "format" && (value == "tsv" || value == "json"))
+				options.format = value;
+			else if (key == "min-time-ms")
+				options.minTime = std::chrono::milliseconds(std::stoul(value));
+			else if (key == "iterations")
+				options.iterations = std::stoul(value);
+			else if (key == "bench")
+				options.only = value;
+			else if (key == "trace-sample")
+				options.traceSample = std::stoul(value);
+			else
+				return false;
+		} catch (std::logic_error const &) {
+			std::cerr << "invalid value of option " << key << ": " << value << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		usage(argv[0]);
+		return 0;
+	}
+
+	bench_options options;
+	if (!parse_options(argc, argv, options)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	trace_options trace;
+	trace.sampleEvery = options.traceSample;
+	configure_tracing(trace);
+
+	std::vector<uint64_t> payloads = { 64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024 };
+	auto enabled = [&options] (std::string const & bench) {
+		return options.only.empty() || options.only == bench;
+	};
+
+	print_header(options);
+	for (auto const & c: message_cases()) {
+		for (uint64_t payload: payloads) {
+			if (!c.sized && payload != payloads.front())
+				break;
+			auto msg = c.make(payload);
+			uint64_t reported = c.sized ? payload : 0;
+			message_bytes frame = msg->serialize();
+
+			if (enabled("serialize")) {
+				uint64_t sink = 0;
+				auto r = measure(options, [&] (uint64_t iterations) {
+					sink = 0;
+					for (uint64_t i = 0; i < iterations; ++i)
+						sink += msg->serialize().size();
+				});
+				if (sink != r.first * frame.size())
+					std::cerr << "unexpected serialize result" << std::endl;
+				print_row(options, { "serialize", c.name, reported, frame.size(), r.first, r.second });
+			}
+
+			if (enabled("parse")) {
+				uint64_t sink = 0;
+				auto r = measure(options, [&] (uint64_t iterations) {
+					sink = 0;
+					for (uint64_t i = 0; i < iterations; ++i)
+						sink += parse_message(frame) != nullptr;
+				});
+				if (sink != r.first)
+					std::cerr << "unexpected parse result" << std::endl;
+				print_row(options, { "parse", c.name, reported, frame.size(), r.first, r.second });
+			}
+
+			if (enabled("message_io"))
+				print_row(options, run_message_io(options, c.name, *msg, reported));
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include <common/message_io.h>
+#include <net/stream_socket.h>
+#include <protocol/protocol.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Ping-pong of get_song_response messages over TCP loopback, unix
+ * sockets and shared memory for every socket backend, so transports
+ * can be compared on the same message sizes.
+ */
+
+const char * BENCH_ADDR = "127.0.0.1";
+const char * BENCH_UNIX_ADDR = "unix:@lyricsdb-socket-bench";
+const uint16_t BENCH_BASE_PORT = 40010;
+
+struct bench_result {
+	double seconds;
+	uint64_t roundTrips;
+	uint64_t payload;
+};
+
+bench_result run_ping_pong(std::string const & address, socket_backend backend, uint16_t port,
+	uint64_t payload, uint64_t roundTrips)
+{
+	auto server = make_server_socket(address, port, backend);
+
+	std::thread echo([server, roundTrips] () {
+		auto peer = server->accept_one_client();
+		for (uint64_t i = 0; i < roundTrips; ++i)
+			send_message(*peer, *recv_message(*peer));
+	});
+
+	auto client = make_client_socket(address, port, true, backend);
+	get_song_response message(std::string(payload, 'x'));
+
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < roundTrips; ++i) {
+		send_message(*client, message);
+		recv_message(*client);
+	}
+	auto finish = std::chrono::steady_clock::now();
+
+	echo.join();
+	return { std::chrono::duration<double>(finish - start).count(), roundTrips, payload };
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc > 2 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))) {
+		std::cerr << "Usage: " << argv[0] << " [ROUND_TRIPS]" << std::endl;
+		return (argc == 2 ? 0 : 1);
+	}
+
+	uint64_t roundTrips = argc == 2 ? std::stoul(argv[1]) : 20000;
+
+	struct transport {
+		std::string name;
+		std::string address;
+		socket_backend backend;
+	};
+	std::vector<transport> transports = {
+		{ "tcp", BENCH_ADDR, socket_backend::TCP },
+		{ "uring", BENCH_ADDR, socket_backend::URING },
+		{ "unix", BENCH_UNIX_ADDR, socket_backend::TCP },
+		{ "unix-uring", BENCH_UNIX_ADDR, socket_backend::URING },
+		{ "shm", BENCH_UNIX_ADDR, socket_backend::SHM }
+	};
+	std::vector<uint64_t> payloads = { 64, 1024, 16 * 1024, 256 * 1024 };
+
+	std::cout << "transport\tpayload\tround_trips\tseconds\trps\tMBps" << std::endl;
+	uint16_t port = BENCH_BASE_PORT;
+	for (auto const & t: transports) {
+		for (uint64_t payload: payloads) {
+			// big payloads are scaled down to keep run time reasonable
+			uint64_t count = payload <= 1024 ? roundTrips : std::max<uint64_t>(100, roundTrips * 1024 / payload);
+			auto r = run_ping_pong(t.address, t.backend, port++, payload, count);
+			double rps = r.roundTrips / r.seconds;
+			std::cout << t.name << "\t" << r.payload << "\t" << r.roundTrips << "\t"
+				<< std::fixed << std::setprecision(3) << r.seconds << "\t"
+				<< std::setprecision(0) << rps << "\t"
+				<< std::setprecision(1) << 2 * rps * r.payload / (1024 * 1024) << std::endl;
+		}
+	}
+
+	return 0;
+}
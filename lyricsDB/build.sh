@@ -2,7 +2,7 @@ mkdir -p bin
 cd src
 
 
-for d in net protocol common server client; do
+for d in net protocol common db async server client importer; do
 	cd "$d"
 	printf "building %s... " "$(basename "$d")"
 	make 1>/dev/null
@@ -0,0 +1,48 @@
+#include <common/message_io.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+/*
+ * Feeds fuzzer input as if it came from the network.
+ */
+class memory_socket: public stream_socket {
+public:
+	memory_socket(uint8_t const * data, size_t size)
+		: m_data(data)
+		, m_size(size)
+	{}
+
+	void send(void const *, size_t) override
+	{}
+
+	void recv(void * buf, size_t size) override
+	{
+		if (size > m_size)
+			throw socket_exception("not enough data");
+		memcpy(buf, m_data, size);
+		m_data += size;
+		m_size -= size;
+	}
+
+private:
+	uint8_t const * m_data;
+	size_t m_size;
+};
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const * data, size_t size)
+{
+	memory_socket socket(data, size);
+	try {
+		while (recv_message(socket))
+			;
+	} catch (socket_exception const &) {
+	} catch (protocol_exception const &) {
+	}
+	return 0;
+}
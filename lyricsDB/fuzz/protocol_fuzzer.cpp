@@ -0,0 +1,19 @@
+#include <protocol/protocol.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+/*
+ * Anything that parses must serialize back into the same frame.
+ */
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const * data, size_t size)
+{
+	message_bytes bytes(data, data + size);
+	try {
+		auto message = parse_message(bytes);
+		if (message && message->serialize() != bytes)
+			abort();
+	} catch (protocol_exception const &) {
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include <protocol/protocol.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * Replacement for libFuzzer main when fuzzers are built without clang:
+ * replays files given in arguments or runs a fixed number of
+ * deterministic mutations of valid frames.
+ */
+
+extern "C" int LLVMFuzzerTestOneInput(uint8_t const * data, size_t size);
+
+size_t constexpr STANDALONE_ITERATIONS = 200000;
+
+namespace {
+
+std::vector<message_bytes> make_seeds()
+{
+	std::vector<message_bytes> frames = {
+		get_song_list_request("author").serialize(),
+		get_song_list_response({ "first", "", "third song" }).serialize(),
+		get_song_request("author", "song").serialize(),
+		get_song_response("la-la-la").serialize(),
+		add_song_request("author", "song", "text").serialize(),
+		add_song_response("OK").serialize()
+	};
+
+	// message_io fuzzer expects size-prefixed frames
+	std::vector<message_bytes> seeds = frames;
+	for (auto const & frame: frames) {
+		uint64_t size = frame.size();
+		message_bytes prefixed(sizeof(size));
+		memcpy(prefixed.data(), &size, sizeof(size));
+		prefixed.insert(prefixed.end(), frame.begin(), frame.end());
+		seeds.push_back(prefixed);
+	}
+	return seeds;
+}
+
+void mutate(message_bytes & bytes, std::mt19937_64 & rng)
+{
+	switch (rng() % 5) {
+		case 0: // flip random byte
+			if (!bytes.empty())
+				bytes[rng() % bytes.size()] ^= uint8_t(1 + rng() % 255);
+			break;
+		case 1: // truncate
+			bytes.resize(bytes.empty() ? 0 : rng() % bytes.size());
+			break;
+		case 2: // append garbage
+			for (size_t n = rng() % 16; n > 0; --n)
+				bytes.push_back(uint8_t(rng()));
+			break;
+		case 3: // overwrite some 8 bytes with huge or small length
+			if (bytes.size() >= 8) {
+				uint64_t value = rng() % 2 ? rng() : rng() % 64;
+				memcpy(bytes.data() + rng() % (bytes.size() - 7), &value, sizeof(value));
+			}
+			break;
+		default: // random message type
+			if (!bytes.empty())
+				bytes[0] = uint8_t(rng() % 2 ? rng() % 3 : 64 + rng() % 3);
+			break;
+	}
+}
+
+} // namespace
+
+int main(int argc, char * argv[])
+{
+	for (int i = 1; i < argc; ++i) {
+		std::ifstream stream(argv[i], std::ios::binary);
+		message_bytes bytes { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+		LLVMFuzzerTestOneInput(bytes.data(), bytes.size());
+	}
+	if (argc > 1)
+		return 0;
+
+	auto seeds = make_seeds();
+	std::mt19937_64 rng(42);
+	for (size_t i = 0; i < STANDALONE_ITERATIONS; ++i) {
+		auto bytes = seeds[rng() % seeds.size()];
+		for (size_t n = 1 + rng() % 4; n > 0; --n)
+			mutate(bytes, rng);
+		LLVMFuzzerTestOneInput(bytes.data(), bytes.size());
+	}
+
+	std::cerr << STANDALONE_ITERATIONS << " inputs processed" << std::endl;
+	return 0;
+}
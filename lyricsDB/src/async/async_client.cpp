@@ -0,0 +1,307 @@
+#include "async_client.h"
+
+#include <net/socket_common.h>
+#include <net/stream_socket.h>
+#include <protocol/text_delta.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+constexpr size_t ASYNC_RECV_CHUNK_SIZE = 64 * 1024;
+
+namespace {
+
+template<typename Response>
+std::shared_ptr<Response> expect_response(message_ptr const & response)
+{
+	if (auto overloaded = std::dynamic_pointer_cast<overloaded_response>(response))
+		throw overloaded_exception(overloaded->get_reason());
+	auto typed = std::dynamic_pointer_cast<Response>(response);
+	if (!typed)
+		throw protocol_exception("unexpected response type");
+	return typed;
+}
+
+bool would_block()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+} // namespace
+
+async_connection::async_connection(event_loop & loop, std::string hostname, uint16_t port)
+	: m_loop(loop)
+	, m_hostname(std::move(hostname))
+	, m_port(port)
+{}
+
+async_connection::~async_connection()
+{
+	if (m_descriptor >= 0) {
+		m_loop.remove_descriptor(m_descriptor);
+		close(m_descriptor);
+	}
+}
+
+task<void> async_connection::connect()
+{
+	if (m_descriptor >= 0)
+		throw socket_exception("socket already connected");
+
+	socket_address addr = resolve_address(m_hostname, m_port, false);
+	m_descriptor = create_stream_socket(addr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	configure_stream_socket(m_descriptor, addr.family());
+	m_loop.add_descriptor(m_descriptor);
+
+	if (::connect(m_descriptor, addr.get(), addr.length) < 0) {
+		if (errno != EINPROGRESS)
+			throw_errno("failed to connect to host");
+		co_await m_loop.writable(m_descriptor);
+
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(m_descriptor, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+			throw_errno("failed to connect to host");
+		if (error)
+			throw_errno("failed to connect to host", error);
+	}
+}
+
+task<message_ptr> async_connection::call(message_bytes request)
+{
+	if (m_error)
+		std::rethrow_exception(m_error);
+	if (m_descriptor < 0)
+		throw socket_exception("socket not connected");
+
+	uint64_t size = request.size();
+	auto const * sizeBytes = reinterpret_cast<uint8_t const *>(&size);
+	m_out.insert(m_out.end(), sizeBytes, sizeBytes + sizeof(size));
+	m_out.insert(m_out.end(), request.begin(), request.end());
+
+	pending_call call;
+	m_pending.push_back(&call);
+
+	if (!m_writing) {
+		m_writing = true;
+		m_loop.spawn(write_loop());
+	}
+	if (!m_reading) {
+		m_reading = true;
+		m_loop.spawn(read_loop());
+	}
+
+	co_await response_awaiter { call };
+	if (call.error)
+		std::rethrow_exception(call.error);
+	co_return std::move(call.response);
+}
+
+task<void> async_connection::write_loop()
+{
+	while (!m_error && m_outOffset < m_out.size()) {
+		ssize_t sent = ::send(m_descriptor, m_out.data() + m_outOffset,
+			m_out.size() - m_outOffset, MSG_NOSIGNAL);
+		if (sent >= 0) {
+			m_outOffset += sent;
+		} else if (would_block()) {
+			co_await m_loop.writable(m_descriptor);
+		} else if (errno != EINTR) {
+			fail(std::make_exception_ptr(socket_exception(
+				std::string("failed to send: ") + strerror(errno))));
+		}
+	}
+
+	m_out.clear();
+	m_outOffset = 0;
+	m_writing = false;
+}
+
+task<void> async_connection::read_loop()
+{
+	while (!m_error && !m_pending.empty()) {
+		if (parse_responses())
+			continue;
+
+		size_t used = m_in.size();
+		m_in.resize(used + ASYNC_RECV_CHUNK_SIZE);
+		ssize_t received = ::recv(m_descriptor, m_in.data() + used, ASYNC_RECV_CHUNK_SIZE, 0);
+		m_in.resize(used + std::max<ssize_t>(received, 0));
+
+		if (received > 0)
+			continue;
+		if (received == 0)
+			fail(std::make_exception_ptr(socket_exception("connection closed by server")));
+		else if (would_block())
+			co_await m_loop.readable(m_descriptor);
+		else if (errno != EINTR)
+			fail(std::make_exception_ptr(socket_exception(
+				std::string("failed to recv: ") + strerror(errno))));
+	}
+
+	m_reading = false;
+}
+
+/*
+ * Hands all complete responses in m_in to their callers,
+ * returns false if there was none.
+ */
+bool async_connection::parse_responses()
+{
+	bool parsed = false;
+	while (!m_pending.empty() && m_in.size() - m_inOffset >= sizeof(uint64_t)) {
+		uint64_t size = 0;
+		memcpy(&size, m_in.data() + m_inOffset, sizeof(size));
+		if (size > MAX_MESSAGE_SIZE) {
+			fail(std::make_exception_ptr(protocol_exception("response exceeds size limit")));
+			return true;
+		}
+		if (m_in.size() - m_inOffset - sizeof(size) < size)
+			break;
+
+		uint8_t const * begin = m_in.data() + m_inOffset + sizeof(size);
+		message_ptr response;
+		try {
+			response = parse_message(message_bytes(begin, begin + size));
+			if (!response)
+				throw protocol_exception("empty response");
+		} catch (protocol_exception const &) {
+			fail(std::current_exception());
+			return true;
+		}
+		m_inOffset += sizeof(size) + size;
+
+		pending_call * call = m_pending.front();
+		m_pending.pop_front();
+		call->response = std::move(response);
+		if (call->waiter)
+			m_loop.post(call->waiter);
+		parsed = true;
+	}
+
+	if (m_inOffset == m_in.size()) {
+		m_in.clear();
+		m_inOffset = 0;
+	} else if (m_inOffset > m_in.size() / 2) {
+		m_in.erase(m_in.begin(), m_in.begin() + m_inOffset);
+		m_inOffset = 0;
+	}
+	return parsed;
+}
+
+void async_connection::fail(std::exception_ptr error)
+{
+	m_error = error;
+	for (pending_call * call: m_pending) {
+		call->error = error;
+		if (call->waiter)
+			m_loop.post(call->waiter);
+	}
+	m_pending.clear();
+	// wakes up read and write loops, they see m_error and stop
+	m_loop.remove_descriptor(m_descriptor);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+async_client::async_client(event_loop & loop, std::string const & hostname, uint16_t port, size_t connections)
+{
+	for (size_t i = 0; i < std::max<size_t>(1, connections); ++i)
+		m_connections.emplace_back(new async_connection(loop, hostname, port));
+}
+
+task<void> async_client::connect()
+{
+	for (auto & connection: m_connections)
+		co_await connection->connect();
+}
+
+template<typename Request>
+message_bytes async_client::frame(Request request) const
+{
+	if (m_budget.count() <= 0)
+		return request.serialize();
+	return deadline_request(m_budget, std::make_shared<Request>(std::move(request))).serialize();
+}
+
+task<std::vector<std::string>> async_client::get_song_list(std::string author)
+{
+	auto response = co_await pick_connection().call(frame(get_song_list_request(std::move(author))));
+	co_return expect_response<get_song_list_response>(response)->get_songs();
+}
+
+task<std::string> async_client::get_song(std::string author, std::string song)
+{
+	auto response = co_await pick_connection().call(
+		frame(get_song_request(std::move(author), std::move(song))));
+	co_return expect_response<get_song_response>(response)->get_text();
+}
+
+task<std::string> async_client::add_song(std::string author, std::string song, std::string text)
+{
+	auto response = co_await pick_connection().call(
+		frame(add_song_request(std::move(author), std::move(song), std::move(text))));
+	co_return expect_response<add_song_response>(response)->get_result();
+}
+
+task<versioned_song_list> async_client::get_song_list_if_modified(std::string author, uint64_t knownVersion)
+{
+	auto response = co_await pick_connection().call(
+		frame(get_song_list_request(std::move(author), knownVersion)));
+
+	versioned_song_list result;
+	if (auto notModified = std::dynamic_pointer_cast<not_modified_response>(response)) {
+		result.version = notModified->get_version();
+		co_return result;
+	}
+	auto list = expect_response<get_song_list_response>(response);
+	result.modified = true;
+	result.version = list->get_version();
+	result.songs = list->get_songs();
+	co_return result;
+}
+
+task<versioned_song> async_client::get_song_if_modified(std::string author, std::string song, uint64_t knownVersion)
+{
+	auto response = co_await pick_connection().call(
+		frame(get_song_request(std::move(author), std::move(song), knownVersion)));
+
+	versioned_song result;
+	if (auto notModified = std::dynamic_pointer_cast<not_modified_response>(response)) {
+		result.version = notModified->get_version();
+		co_return result;
+	}
+	auto text = expect_response<get_song_response>(response);
+	result.modified = true;
+	result.version = text->get_version();
+	result.text = text->get_text();
+	co_return result;
+}
+
+task<std::string> async_client::update_song(std::string author, std::string song, std::string base, std::string text)
+{
+	std::string delta = make_text_delta(base, text);
+	if (delta.size() < text.size()) {
+		auto response = co_await pick_connection().call(
+			frame(update_song_request(author, song, digest_text(base), std::move(delta))));
+		std::string result = expect_response<add_song_response>(response)->get_result();
+		if (result != UPDATE_BASE_MISMATCH)
+			co_return result;
+	}
+	co_return co_await add_song(std::move(author), std::move(song), std::move(text));
+}
+
+async_connection & async_client::pick_connection()
+{
+	auto it = std::min_element(m_connections.begin(), m_connections.end(),
+		[] (std::unique_ptr<async_connection> const & a, std::unique_ptr<async_connection> const & b) {
+			return a->outstanding() < b->outstanding();
+		});
+	return **it;
+}
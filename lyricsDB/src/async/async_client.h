@@ -0,0 +1,141 @@
+#pragma once
+
+#include "event_loop.h"
+#include "task.h"
+
+#include <protocol/protocol.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Non-blocking connection to lyrics server. Requests are pipelined:
+ * every request is written as soon as possible without waiting for
+ * previous responses, server answers them in order.
+ */
+class async_connection {
+public:
+	async_connection(event_loop & loop, std::string hostname, uint16_t port);
+	~async_connection();
+
+	async_connection(async_connection const &) = delete;
+	async_connection & operator=(async_connection const &) = delete;
+
+	task<void> connect();
+
+	/*
+	 * Throws socket_exception if connection breaks before response
+	 * arrives, all the following requests fail too.
+	 */
+	task<message_ptr> call(message_bytes request);
+
+	size_t outstanding() const { return m_pending.size(); }
+
+private:
+	struct pending_call {
+		std::coroutine_handle<> waiter;
+		message_ptr response;
+		std::exception_ptr error;
+	};
+
+	struct response_awaiter {
+		pending_call & call;
+
+		bool await_ready() const noexcept { return call.response || call.error; }
+		void await_suspend(std::coroutine_handle<> h) noexcept { call.waiter = h; }
+		void await_resume() const {}
+	};
+
+	task<void> write_loop();
+	task<void> read_loop();
+	bool parse_responses();
+	void fail(std::exception_ptr error);
+
+	event_loop & m_loop;
+	std::string m_hostname;
+	uint16_t m_port;
+	int m_descriptor = -1;
+	std::exception_ptr m_error;
+
+	std::vector<uint8_t> m_out;
+	size_t m_outOffset = 0;
+	bool m_writing = false;
+
+	std::vector<uint8_t> m_in;
+	size_t m_inOffset = 0;
+	bool m_reading = false;
+
+	std::deque<pending_call *> m_pending;
+};
+
+/*
+ * Result of conditional get, text/songs are set only if modified.
+ */
+struct versioned_song {
+	bool modified = false;
+	uint64_t version = 0;
+	std::string text;
+};
+
+struct versioned_song_list {
+	bool modified = false;
+	uint64_t version = 0;
+	std::vector<std::string> songs;
+};
+
+/*
+ * C++20 coroutine API to lyrics server:
+ *
+ *   event_loop loop;
+ *   async_client client(loop, "127.0.0.1", 40001, 2);
+ *   loop.run_until_complete(client.connect());
+ *   auto text = loop.run_until_complete(client.get_song("author", "song"));
+ *
+ * or co_await client.get_song(...) from another coroutine. Any number of
+ * concurrent requests share the given number of connections, each request
+ * goes to the connection with the fewest outstanding ones.
+ */
+class async_client {
+public:
+	async_client(event_loop & loop, std::string const & hostname, uint16_t port, size_t connections = 1);
+
+	task<void> connect();
+
+	task<std::vector<std::string>> get_song_list(std::string author);
+	task<std::string> get_song(std::string author, std::string song);
+	task<std::string> add_song(std::string author, std::string song, std::string text);
+
+	/*
+	 * Server answers with a short not modified response if knownVersion
+	 * is current, zero asks for whatever there is.
+	 */
+	task<versioned_song_list> get_song_list_if_modified(std::string author, uint64_t knownVersion);
+	task<versioned_song> get_song_if_modified(std::string author, std::string song, uint64_t knownVersion);
+
+	/*
+	 * Sends text as delta against base, the version client believes
+	 * server has. If server has another one, falls back to add_song.
+	 */
+	task<std::string> update_song(std::string author, std::string song, std::string base, std::string text);
+
+	/*
+	 * Requests made after this carry a deadline budget, server answers
+	 * them with overloaded_response if it can't start in time and they
+	 * fail with overloaded_exception. Zero sends requests without one.
+	 */
+	void set_deadline(std::chrono::microseconds budget) { m_budget = budget; }
+
+private:
+	async_connection & pick_connection();
+
+	template<typename Request>
+	message_bytes frame(Request request) const;
+
+	std::vector<std::unique_ptr<async_connection>> m_connections;
+	std::chrono::microseconds m_budget { 0 };
+};
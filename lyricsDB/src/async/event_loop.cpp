@@ -0,0 +1,117 @@
+#include "event_loop.h"
+
+#include <net/stream_socket.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+constexpr int EVENT_LOOP_MAX_EVENTS = 64;
+
+namespace {
+
+detail::detached_task run_detached(task<void> t)
+{
+	try {
+		co_await std::move(t);
+	} catch (std::exception const & e) {
+		std::cerr << "background task failed: " << e.what() << std::endl;
+	}
+}
+
+} // namespace
+
+event_loop::event_loop()
+	: m_epoll(epoll_create1(EPOLL_CLOEXEC))
+{
+	if (m_epoll < 0)
+		throw socket_exception(std::string("failed to create epoll: ") + strerror(errno));
+}
+
+event_loop::~event_loop()
+{
+	close(m_epoll);
+}
+
+void event_loop::add_descriptor(int fd)
+{
+	// edge-triggered: waiter always tries the operation before awaiting
+	epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.fd = fd;
+	if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+		throw socket_exception(std::string("failed to add descriptor to epoll: ") + strerror(errno));
+	m_waiters[fd];
+}
+
+void event_loop::remove_descriptor(int fd)
+{
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+
+	auto it = m_waiters.find(fd);
+	if (it == m_waiters.end())
+		return;
+	// let waiters observe the failure of their next operation
+	if (it->second.reader)
+		post(it->second.reader);
+	if (it->second.writer)
+		post(it->second.writer);
+	m_waiters.erase(it);
+}
+
+void event_loop::io_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+	auto & w = loop.m_waiters.at(fd);
+	(write ? w.writer : w.reader) = h;
+}
+
+void event_loop::post(std::coroutine_handle<> h)
+{
+	m_ready.push_back(h);
+}
+
+void event_loop::spawn(task<void> t)
+{
+	run_detached(std::move(t));
+}
+
+void event_loop::run_until(bool const & done)
+{
+	while (!done) {
+		while (!m_ready.empty() && !done) {
+			auto h = m_ready.front();
+			m_ready.pop_front();
+			h.resume();
+		}
+		if (!done && m_ready.empty())
+			poll();
+	}
+}
+
+void event_loop::poll()
+{
+	epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	int count = epoll_wait(m_epoll, events, EVENT_LOOP_MAX_EVENTS, -1);
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		throw socket_exception(std::string("failed to wait on epoll: ") + strerror(errno));
+	}
+
+	for (int i = 0; i < count; ++i) {
+		auto it = m_waiters.find(events[i].data.fd);
+		if (it == m_waiters.end())
+			continue;
+
+		uint32_t flags = events[i].events;
+		bool failed = flags & (EPOLLERR | EPOLLHUP);
+		if ((flags & (EPOLLIN | EPOLLRDHUP) || failed) && it->second.reader)
+			post(std::exchange(it->second.reader, nullptr));
+		if ((flags & EPOLLOUT || failed) && it->second.writer)
+			post(std::exchange(it->second.writer, nullptr));
+	}
+}
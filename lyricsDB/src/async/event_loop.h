@@ -0,0 +1,131 @@
+#pragma once
+
+#include "task.h"
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+
+/*
+ * Single-threaded epoll loop driving coroutines. Nothing here is
+ * thread-safe: coroutines run in the thread calling run_until_complete().
+ */
+class event_loop {
+public:
+	event_loop();
+	~event_loop();
+
+	event_loop(event_loop const &) = delete;
+	event_loop & operator=(event_loop const &) = delete;
+
+	/*
+	 * Descriptor must be non-blocking and registered before awaiting it.
+	 */
+	void add_descriptor(int fd);
+	void remove_descriptor(int fd);
+
+	struct io_awaiter {
+		event_loop & loop;
+		int fd;
+		bool write;
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h);
+		void await_resume() const noexcept {}
+	};
+
+	/*
+	 * Resumes caller once fd may be read/written. Wakeups may be spurious,
+	 * call them only after operation returned EAGAIN.
+	 */
+	io_awaiter readable(int fd) { return { *this, fd, false }; }
+	io_awaiter writable(int fd) { return { *this, fd, true }; }
+
+	/*
+	 * Schedules h to be resumed on the next loop iteration.
+	 */
+	void post(std::coroutine_handle<> h);
+
+	/*
+	 * Starts t in background, exceptions escaping it are reported to stderr.
+	 */
+	void spawn(task<void> t);
+
+	/*
+	 * Runs the loop until t is finished and returns its result.
+	 */
+	template<typename T>
+	T run_until_complete(task<T> t);
+
+private:
+	struct waiters {
+		std::coroutine_handle<> reader;
+		std::coroutine_handle<> writer;
+	};
+
+	void run_until(bool const & done);
+	void poll();
+
+	int m_epoll;
+	std::unordered_map<int, waiters> m_waiters;
+	std::deque<std::coroutine_handle<>> m_ready;
+};
+
+namespace detail {
+
+struct detached_task {
+	struct promise_type {
+		detached_task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+template<typename T>
+detached_task complete_into(task<T> t, std::optional<T> & result, std::exception_ptr & error, bool & done)
+{
+	try {
+		result.emplace(co_await std::move(t));
+	} catch (...) {
+		error = std::current_exception();
+	}
+	done = true;
+}
+
+inline detached_task complete_into(task<void> t, std::exception_ptr & error, bool & done)
+{
+	try {
+		co_await std::move(t);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	done = true;
+}
+
+} // namespace detail
+
+template<typename T>
+T event_loop::run_until_complete(task<T> t)
+{
+	bool done = false;
+	std::exception_ptr error;
+	if constexpr (std::is_void_v<T>) {
+		detail::complete_into(std::move(t), error, done);
+		run_until(done);
+		if (error)
+			std::rethrow_exception(error);
+	} else {
+		std::optional<T> result;
+		detail::complete_into(std::move(t), result, error, done);
+		run_until(done);
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*result);
+	}
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+/*
+ * Lazy coroutine: body starts when task is awaited and the awaiting
+ * coroutine is resumed right after the body finishes.
+ */
+template<typename T>
+class task;
+
+namespace detail {
+
+template<typename Promise>
+struct final_awaiter {
+	bool await_ready() noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+	{
+		auto continuation = h.promise().continuation;
+		return continuation ? continuation : std::noop_coroutine();
+	}
+
+	void await_resume() noexcept {}
+};
+
+struct promise_base {
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+};
+
+} // namespace detail
+
+template<typename T>
+class task {
+public:
+	struct promise_type: detail::promise_base {
+		task get_return_object() { return task(handle::from_promise(*this)); }
+		detail::final_awaiter<promise_type> final_suspend() noexcept { return {}; }
+		void return_value(T v) { value = std::move(v); }
+
+		std::optional<T> value;
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	task(task && other) noexcept
+		: m_handle(std::exchange(other.m_handle, nullptr))
+	{}
+
+	task(task const &) = delete;
+	task & operator=(task const &) = delete;
+
+	~task()
+	{
+		if (m_handle)
+			m_handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		m_handle.promise().continuation = awaiting;
+		return m_handle;
+	}
+
+	T await_resume()
+	{
+		if (m_handle.promise().error)
+			std::rethrow_exception(m_handle.promise().error);
+		return std::move(*m_handle.promise().value);
+	}
+
+private:
+	explicit task(handle h)
+		: m_handle(h)
+	{}
+
+	handle m_handle;
+};
+
+template<>
+class task<void> {
+public:
+	struct promise_type: detail::promise_base {
+		task get_return_object() { return task(handle::from_promise(*this)); }
+		detail::final_awaiter<promise_type> final_suspend() noexcept { return {}; }
+		void return_void() {}
+	};
+	using handle = std::coroutine_handle<promise_type>;
+
+	task(task && other) noexcept
+		: m_handle(std::exchange(other.m_handle, nullptr))
+	{}
+
+	task(task const &) = delete;
+	task & operator=(task const &) = delete;
+
+	~task()
+	{
+		if (m_handle)
+			m_handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		m_handle.promise().continuation = awaiting;
+		return m_handle;
+	}
+
+	void await_resume()
+	{
+		if (m_handle.promise().error)
+			std::rethrow_exception(m_handle.promise().error);
+	}
+
+private:
+	explicit task(handle h)
+		: m_handle(h)
+	{}
+
+	handle m_handle;
+};
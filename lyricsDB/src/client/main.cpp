@@ -1,11 +1,13 @@
-#include <common/message_io.h>
 #include <net/stream_socket.h>
 #include <protocol/protocol.h>
 
+#include "requester.h"
+
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -15,6 +17,7 @@ void usage(std::string const & name)
 	std::cerr << "Usage: " << name << " [SERVER_ADDR] [SERVER_PORT]" << std::endl << std::endl;
 	std::cerr << "Options:" << std::endl;
 	std::cerr << "  SERVER_ADDR [default = 127.0.0.1]  ip4-address of server with db" << std::endl;
+	std::cerr << "                                     or unix:PATH of its unix socket" << std::endl;
 	std::cerr << "  SERVER_PORT [default = 40001]      port of server with db" << std::endl;
 }
 
@@ -23,6 +26,12 @@ void help()
 	std::cerr << "  get <author>         get list of songs of author <author>" << std::endl;
 	std::cerr << "  get <author> <song>  get song with name <song> of author <author>" << std::endl;
 	std::cerr << "  add <author> <song>  upload song from file <song> of author <author>" << std::endl;
+	std::cerr << "  top [K] [WINDOWS]    K most requested songs and authors over last WINDOWS" << std::endl;
+	std::cerr << "                       time windows of server [default = 10 1]" << std::endl;
+	std::cerr << "  scan songs|authors|occurrences [MIN_LINES] [PATTERN]" << std::endl;
+	std::cerr << "                       count songs with at least MIN_LINES lines containing PATTERN," << std::endl;
+	std::cerr << "                       such songs per author or PATTERN occurrences in them per author" << std::endl;
+	std::cerr << "                       (lines if PATTERN is empty) over the whole catalog [default = 0]" << std::endl;
 	std::cerr << "  help                 see this help" << std::endl;
 	std::cerr << "  exit                 stop using this app" << std::endl;
 }
@@ -32,89 +41,110 @@ bool validate_command(std::string const & command)
 	return command == "get" || command == "add";
 }
 
-struct server_response_visitor: public response_visitor {
-
-	void visit(get_song_list_response & request) override
-	{
-		songs = request.get_songs();
-	}
+std::string load_file(std::string const & path)
+{
+	std::ifstream stream(path);
+	return { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+}
 
-	void visit(get_song_response & request) override
-	{
-		songs = { request.get_text() };
+/*
+ * Throws socket_exception if connection to server is lost.
+ */
+void run_command(requester & r, std::string const & command)
+{
+	std::stringstream ss(command);
+
+	std::string cmd;
+	ss >> cmd;
+	if (cmd == "top") {
+		uint64_t count = 10;
+		uint64_t windows = 1;
+		ss >> count >> windows;
+		std::vector<song_popularity> songs;
+		std::vector<author_popularity> authors;
+		r.request_top_songs(count, windows, songs, authors);
+		std::cout << "songs:" << std::endl;
+		for (auto const & song: songs)
+			std::cout << "  " << song.requests << "\t" << song.author << " - " << song.song << std::endl;
+		std::cout << "authors:" << std::endl;
+		for (auto const & author: authors)
+			std::cout << "  " << author.requests << "\t" << author.author << std::endl;
+		return;
 	}
 
-	void visit(add_song_response & request) override
-	{
-		result = request.get_result();
+	if (cmd == "scan") {
+		std::string aggregate;
+		scan_query query;
+		ss >> aggregate;
+		if (aggregate == "authors")
+			query.aggregate = scan_aggregate::SONGS_PER_AUTHOR;
+		else if (aggregate == "occurrences")
+			query.aggregate = scan_aggregate::OCCURRENCES_PER_AUTHOR;
+		else if (aggregate != "songs") {
+			std::cerr << "invalid command arguments, type `help` to see list of supported commands" << std::endl;
+			return;
+		}
+		// minLines is zeroed if pattern goes right after aggregate
+		if (!(ss >> query.minLines))
+			ss.clear();
+		ss >> std::ws;
+		std::getline(ss, query.pattern);
+		scan_result result = r.request_scan(query);
+		std::cout << "total " << result.total << ", " << result.scannedSongs << " songs scanned" << std::endl;
+		for (auto const & group: result.groups)
+			std::cout << "  " << group.value << "\t" << group.author << std::endl;
+		return;
 	}
 
-	std::string result;
-	std::vector<std::string> songs;
-};
-
-class requester {
-public:
-	explicit requester(client_socket_ptr socket)
-		: m_socket(socket)
-	{}
-
-	std::vector<std::string> request_get_song_list(std::string const & author)
-	{
-		get_song_list_request request(author);
-		send_message(*m_socket, request);
-
-		auto response = recv_message(*m_socket);
-		server_response_visitor v;
-		response->accept(v);
-
-		return v.songs;
+	if (!validate_command(cmd)) {
+		std::cerr << "invalid command, type `help` to see list of supported commands" << std::endl;
+		return;
 	}
 
-	std::string request_get_song(std::string const & author, std::string const & song)
-	{
-		get_song_request request(author, song);
-		send_message(*m_socket, request);
-
-		auto response = recv_message(*m_socket);
-		server_response_visitor v;
-		response->accept(v);
-
-		return v.songs.front();
+	std::string author;
+	ss >> author;
+	if (author.empty()) {
+		std::cerr << "invalid command arguments, type `help` to see list of supported commands" << std::endl;
+		return;
 	}
 
-	std::string request_add_song(
-		std::string const & author,
-		std::string const & song,
-		std::string const & text)
-	{
-		add_song_request request(author, song, text);
-		send_message(*m_socket, request);
-
-		auto response = recv_message(*m_socket);
-		server_response_visitor v;
-		response->accept(v);
-
-		return v.result;
+	std::string song;
+	ss >> song;
+	if (song.empty()) {
+		for (auto& song: r.request_get_song_list(author)) {
+			std::cout << song << std::endl;
+			std::cout  << "==============================" << std::endl;
+		}
+	} else {
+		if (cmd == "get") {
+			std::vector<song_name> suggestions;
+			std::string text = r.request_get_song(author, song, suggestions);
+			if (text.empty() && !suggestions.empty()) {
+				std::cout << "no such song, did you mean:" << std::endl;
+				for (auto const & suggestion: suggestions)
+					std::cout << "  " << suggestion.author << " - " << suggestion.song << std::endl;
+			} else {
+				std::cout << text << std::endl;
+			}
+		} else { // cmd == "add"
+			std::string textFile;
+			ss >> textFile;
+			if (textFile.empty()) {
+				std::cerr << "you should specify file with text" << std::endl;
+				return;
+			}
+			std::cout << r.request_add_song(author, song, load_file(textFile)) << std::endl;
+		}
 	}
-
-private:
-	client_socket_ptr m_socket;
-};
-
-std::string load_file(std::string const & path)
-{
-	std::ifstream stream(path);
-	return { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
 }
 
-void loop(client_socket_ptr & socket)
+void loop(std::string const & address, uint16_t port)
 {
 	std::cout << "Welcome to lyrics DB 1.0!" << std::endl;
 	std::cout << "Type `help` to see list of supported commands." << std::endl;
 
 	std::string command;
-	requester r(socket);
+	std::unique_ptr<requester> r(new requester(make_client_socket(address, port, true)));
 	while (std::cin) {
 		std::cout << "> ";
 		std::getline(std::cin, command);
@@ -130,41 +160,20 @@ void loop(client_socket_ptr & socket)
 		if ("exit" == command)
 			break;
 
-		std::stringstream ss(command);
-
-		std::string cmd;
-		ss >> cmd;
-		if (!validate_command(cmd)) {
-			std::cerr << "invalid command, type `help` to see list of supported commands" << std::endl;
-			continue;
-		}
-
-		std::string author;
-		ss >> author;
-		if (author.empty()) {
-			std::cerr << "invalid command arguments, type `help` to see list of supported commands" << std::endl;
-			continue;
-		}
-
-		std::string song;
-		ss >> song;
-		if (song.empty()) {
-			for (auto& song: r.request_get_song_list(author)) {
-				std::cout << song << std::endl;
-				std::cout  << "==============================" << std::endl;
-			}
-		} else {
-			if (cmd == "get")
-				std::cout << r.request_get_song(author, song) << std::endl;
-			else { // cmd == "add"
-				std::string textFile;
-				ss >> textFile;
-				if (textFile.empty()) {
-					std::cerr << "you should specify file with text" << std::endl;
-					continue;
-				}
-				std::cout << r.request_add_song(author, song, load_file(textFile)) << std::endl;
+		for (bool reconnected = false; ; reconnected = true) {
+			try {
+				run_command(*r, command);
+			} catch (overloaded_exception const & e) {
+				std::cerr << "server is overloaded: " << e.what() << std::endl;
+			} catch (socket_exception const & e) {
+				// restarting server closes connections, the new one listens at the same address
+				if (reconnected)
+					throw;
+				std::cerr << "connection lost (" << e.what() << "), reconnecting" << std::endl;
+				r.reset(new requester(make_client_socket(address, port, true)));
+				continue;
 			}
+			break;
 		}
 	}
 	std::cout << std::endl;
@@ -195,8 +204,7 @@ int main(int argc, char * argv[])
 		port = p;
 	}
 
-	auto socket = make_client_socket(address, port, true);
-	loop(socket);
+	loop(address, port);
 
 	return 0;
 }
@@ -0,0 +1,193 @@
+#include "requester.h"
+
+#include <common/message_io.h>
+
+namespace {
+
+struct server_response_visitor: public response_visitor {
+
+	void visit(get_song_list_response & request) override
+	{
+		songs = request.get_songs();
+	}
+
+	void visit(get_song_response & request) override
+	{
+		songs = { request.get_text() };
+		suggestions = request.get_suggestions();
+	}
+
+	void visit(add_song_response & request) override
+	{
+		result = request.get_result();
+	}
+
+	void visit(not_modified_response &) override
+	{
+		// requests of this client are not versioned
+		throw protocol_exception("unexpected not modified response");
+	}
+
+	void visit(invalidate_message &) override
+	{
+		// requester takes them out of the stream before responses
+		throw protocol_exception("unexpected invalidation");
+	}
+
+	void visit(overloaded_response & request) override
+	{
+		throw overloaded_exception(request.get_reason());
+	}
+
+	void visit(top_songs_response & request) override
+	{
+		topSongs = request.get_songs();
+		topAuthors = request.get_authors();
+	}
+
+	void visit(scan_response & request) override
+	{
+		scan = request.get_result();
+	}
+
+	std::string result;
+	std::vector<std::string> songs;
+	std::vector<song_popularity> topSongs;
+	std::vector<author_popularity> topAuthors;
+	scan_result scan;
+	std::vector<song_name> suggestions;
+};
+
+} // namespace
+
+requester::requester(client_socket_ptr socket)
+	: m_socket(socket)
+	, m_cache(CLIENT_CACHE_SIZE)
+{
+	send_message(*m_socket, subscribe_request());
+	auto response = std::dynamic_pointer_cast<add_song_response>(read_response());
+	m_caching = response && response->get_result() == "OK";
+}
+
+std::vector<std::string> requester::request_get_song_list(std::string const & author)
+{
+	drain_invalidations();
+	std::vector<std::string> songs;
+	if (m_caching && m_cache.get_song_list(author, songs))
+		return songs;
+
+	get_song_list_request request(author);
+	send_message(*m_socket, request);
+
+	begin_read(author, nullptr);
+	auto response = read_response();
+	server_response_visitor v;
+	response->accept(v);
+
+	if (m_caching && !m_readInvalidated)
+		m_cache.put_song_list(author, v.songs);
+	return v.songs;
+}
+
+std::string requester::request_get_song(
+	std::string const & author,
+	std::string const & song,
+	std::vector<song_name> & suggestions)
+{
+	drain_invalidations();
+	suggestions.clear();
+	std::string text;
+	if (m_caching && m_cache.get_song(author, song, text))
+		return text;
+
+	find_song_request request(author, song, CLIENT_SUGGESTIONS);
+	send_message(*m_socket, request);
+
+	begin_read(author, &song);
+	auto response = read_response();
+	server_response_visitor v;
+	response->accept(v);
+
+	// misses are not cached, suggestions may change with every write
+	if (m_caching && !m_readInvalidated && !v.songs.front().empty())
+		m_cache.put_song(author, song, v.songs.front());
+	suggestions = std::move(v.suggestions);
+	return v.songs.front();
+}
+
+std::string requester::request_add_song(
+	std::string const & author,
+	std::string const & song,
+	std::string const & text)
+{
+	add_song_request request(author, song, text);
+	send_message(*m_socket, request);
+
+	auto response = read_response();
+	server_response_visitor v;
+	response->accept(v);
+
+	// server doesn't push our own writes back to us
+	m_cache.invalidate(author, song);
+	return v.result;
+}
+
+void requester::request_top_songs(uint64_t count, uint64_t windows,
+	std::vector<song_popularity> & songs,
+	std::vector<author_popularity> & authors)
+{
+	send_message(*m_socket, top_songs_request(count, windows));
+
+	auto response = read_response();
+	server_response_visitor v;
+	response->accept(v);
+
+	songs = std::move(v.topSongs);
+	authors = std::move(v.topAuthors);
+}
+
+scan_result requester::request_scan(scan_query const & query)
+{
+	send_message(*m_socket, scan_request(query));
+
+	auto response = read_response();
+	server_response_visitor v;
+	response->accept(v);
+	return std::move(v.scan);
+}
+
+void requester::begin_read(std::string const & author, std::string const * song)
+{
+	m_readAuthor = author;
+	m_readSong = song ? *song : std::string();
+	m_readList = !song;
+	m_readInvalidated = false;
+}
+
+void requester::apply(invalidate_message const & message)
+{
+	m_cache.invalidate(message.get_author(), message.get_song());
+	if (message.get_author() == m_readAuthor && (m_readList || message.get_song() == m_readSong))
+		m_readInvalidated = true;
+}
+
+message_ptr requester::read_response()
+{
+	while (true) {
+		auto message = recv_message(*m_socket);
+		auto invalidation = std::dynamic_pointer_cast<invalidate_message>(message);
+		if (!invalidation)
+			return message;
+		apply(*invalidation);
+	}
+}
+
+void requester::drain_invalidations()
+{
+	while (m_caching && m_socket->poll_readable()) {
+		auto invalidation = std::dynamic_pointer_cast<invalidate_message>(recv_message(*m_socket));
+		if (!invalidation)
+			throw protocol_exception("unexpected message from server");
+		apply(*invalidation);
+	}
+}
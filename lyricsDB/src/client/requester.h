@@ -0,0 +1,71 @@
+#pragma once
+
+#include <net/stream_socket.h>
+#include <protocol/protocol.h>
+
+#include "song_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// songs and song lists kept locally, invalidated by the server
+constexpr size_t CLIENT_CACHE_SIZE = 16 * 1024 * 1024;
+// songs with close names shown when get misses
+constexpr uint64_t CLIENT_SUGGESTIONS = 5;
+
+/*
+ * Serves repeated reads from local cache. Server pushes invalidations over
+ * the same connection, they are taken from the socket before every request
+ * and while waiting for a response, so cached entry is never served after
+ * its invalidation has arrived.
+ */
+class requester {
+public:
+	explicit requester(client_socket_ptr socket);
+
+	std::vector<std::string> request_get_song_list(std::string const & author);
+
+	/*
+	 * Empty text means there's no such song, then suggestions are
+	 * the songs with close names.
+	 */
+	std::string request_get_song(
+		std::string const & author,
+		std::string const & song,
+		std::vector<song_name> & suggestions);
+
+	std::string request_add_song(
+		std::string const & author,
+		std::string const & song,
+		std::string const & text);
+
+	void request_top_songs(uint64_t count, uint64_t windows,
+		std::vector<song_popularity> & songs,
+		std::vector<author_popularity> & authors);
+
+	scan_result request_scan(scan_query const & query);
+
+	song_cache const & cache() const { return m_cache; }
+
+private:
+	/*
+	 * Remembers what is being read, invalidation of it arriving before
+	 * the response means the response may be stale already.
+	 */
+	void begin_read(std::string const & author, std::string const * song);
+
+	void apply(invalidate_message const & message);
+	message_ptr read_response();
+	void drain_invalidations();
+
+	client_socket_ptr m_socket;
+	song_cache m_cache;
+	bool m_caching = false;
+
+	std::string m_readAuthor;
+	std::string m_readSong;
+	bool m_readList = false;
+	bool m_readInvalidated = false;
+};
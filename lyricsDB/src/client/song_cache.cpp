@@ -0,0 +1,98 @@
+#include "song_cache.h"
+
+namespace {
+
+std::string song_key(std::string const & author, std::string const & song)
+{
+	return "s" + std::to_string(author.size()) + ":" + author + song;
+}
+
+std::string song_list_key(std::string const & author)
+{
+	return "l" + author;
+}
+
+} // namespace
+
+song_cache::song_cache(size_t capacity)
+	: m_capacity(capacity)
+{}
+
+bool song_cache::get_song(std::string const & author, std::string const & song, std::string & text)
+{
+	entry const * e = find(song_key(author, song));
+	if (!e)
+		return false;
+	text = e->text;
+	return true;
+}
+
+void song_cache::put_song(std::string const & author, std::string const & song, std::string text)
+{
+	entry e;
+	e.key = song_key(author, song);
+	e.size = e.key.size() + text.size();
+	e.text = std::move(text);
+	put(std::move(e));
+}
+
+bool song_cache::get_song_list(std::string const & author, std::vector<std::string> & songs)
+{
+	entry const * e = find(song_list_key(author));
+	if (!e)
+		return false;
+	songs = e->songs;
+	return true;
+}
+
+void song_cache::put_song_list(std::string const & author, std::vector<std::string> songs)
+{
+	entry e;
+	e.key = song_list_key(author);
+	e.size = e.key.size();
+	for (auto const & song: songs)
+		e.size += song.size();
+	e.songs = std::move(songs);
+	put(std::move(e));
+}
+
+void song_cache::invalidate(std::string const & author, std::string const & song)
+{
+	erase(song_key(author, song));
+	erase(song_list_key(author));
+}
+
+song_cache::entry const * song_cache::find(std::string const & key)
+{
+	auto it = m_index.find(key);
+	if (it == m_index.end()) {
+		++m_misses;
+		return nullptr;
+	}
+	++m_hits;
+	m_entries.splice(m_entries.begin(), m_entries, it->second);
+	return &*it->second;
+}
+
+void song_cache::put(entry e)
+{
+	erase(e.key);
+	if (e.size > m_capacity)
+		return;
+
+	m_size += e.size;
+	m_entries.push_front(std::move(e));
+	m_index[m_entries.front().key] = m_entries.begin();
+	while (m_size > m_capacity)
+		erase(m_entries.back().key);
+}
+
+void song_cache::erase(std::string const & key)
+{
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+		return;
+	m_size -= it->second->size;
+	m_entries.erase(it->second);
+	m_index.erase(it);
+}
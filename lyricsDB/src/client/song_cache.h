@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * LRU cache of songs and song lists bounded by total size of texts and
+ * song names. Entries stay until evicted or invalidated, so the cache is
+ * only correct together with server-pushed invalidations.
+ */
+class song_cache {
+public:
+	explicit song_cache(size_t capacity);
+
+	bool get_song(std::string const & author, std::string const & song, std::string & text);
+	void put_song(std::string const & author, std::string const & song, std::string text);
+
+	bool get_song_list(std::string const & author, std::vector<std::string> & songs);
+	void put_song_list(std::string const & author, std::vector<std::string> songs);
+
+	/*
+	 * Drops the song and the song list of its author.
+	 */
+	void invalidate(std::string const & author, std::string const & song);
+
+	size_t hits() const { return m_hits; }
+	size_t misses() const { return m_misses; }
+
+private:
+	struct entry {
+		std::string key;
+		std::string text;
+		std::vector<std::string> songs;
+		size_t size;
+	};
+	using entry_list = std::list<entry>;
+
+	entry const * find(std::string const & key);
+	void put(entry e);
+	void erase(std::string const & key);
+
+	size_t m_capacity;
+	size_t m_size = 0;
+	// most recently used first
+	entry_list m_entries;
+	std::unordered_map<std::string, entry_list::iterator> m_index;
+	size_t m_hits = 0;
+	size_t m_misses = 0;
+};
@@ -1,15 +1,68 @@
 #include "message_io.h"
+#include "trace.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstring>
 
 uint64_t constexpr BUCKET_SIZE = 1024;
+uint64_t constexpr RECV_INITIAL_SIZE = 64 * 1024;
+
+namespace {
+
+/*
+ * Socket calls of one message share one timeout, see stream_socket::begin_message.
+ */
+class message_timeout {
+public:
+	message_timeout(stream_socket & socket, socket_direction direction)
+		: m_socket(socket)
+		, m_direction(direction)
+	{
+		m_socket.begin_message(m_direction);
+	}
+
+	~message_timeout()
+	{
+		m_socket.end_message(m_direction);
+	}
+
+	message_timeout(message_timeout const &) = delete;
+	message_timeout & operator=(message_timeout const &) = delete;
+
+private:
+	stream_socket & m_socket;
+	socket_direction m_direction;
+};
+
+message_bytes recv_body(stream_socket & socket, uint64_t size)
+{
+	// grow buffer as data arrives, so bogus size can't make us allocate a lot upfront
+	message_bytes bytes(std::min(size, RECV_INITIAL_SIZE));
+	uint64_t recvSize = 0;
+	while (recvSize < size) {
+		if (recvSize == bytes.size())
+			bytes.resize(std::min(size, 2 * bytes.size()));
+
+		uint64_t needRecv = std::min(BUCKET_SIZE, bytes.size() - recvSize);
+		socket.recv(bytes.data() + recvSize, needRecv);
+		recvSize += needRecv;
+	}
+	return bytes;
+}
+
+} // namespace
 
 void send_message(stream_socket & socket, message const & message)
 {
-	auto bytes = message.serialize();
+	message_bytes bytes;
+	{
+		trace_span span("serialize");
+		bytes = message.serialize();
+	}
 
+	trace_span span("send");
+	message_timeout timeout(socket, socket_direction::SEND);
 	uint64_t size = bytes.size();
 	socket.send(&size, sizeof(size));
 
@@ -20,21 +73,24 @@ void send_message(stream_socket & socket, message const & message)
 		socket.send(data + sendSize, needSend);
 		sendSize += needSend;
 	}
+	socket.flush();
 }
 
 message_ptr recv_message(stream_socket & socket)
 {
 	uint64_t size = 0;
-	socket.recv(&size, sizeof(size));
+	message_bytes bytes;
+	{
+		message_timeout timeout(socket, socket_direction::RECV);
+		socket.recv(&size, sizeof(size));
+		if (size > MAX_MESSAGE_SIZE)
+			throw protocol_exception("message size " + std::to_string(size) + " exceeds limit");
 
-	message_bytes bytes(size);
-	uint64_t recvSize = 0;
-	uint8_t * data = bytes.data();
-	while (recvSize < size) {
-		uint64_t needRecv = std::min(BUCKET_SIZE, size - recvSize);
-		socket.recv(data + recvSize, needRecv);
-		recvSize += needRecv;
+		// waiting for the size is idle time, request starts once it arrives
+		trace_span span("recv");
+		bytes = recv_body(socket, size);
 	}
 
+	trace_span span("parse");
 	return parse_message(bytes);
 }
@@ -0,0 +1,255 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+struct span_slot {
+	// position + 1 once the slot is written, zero while it is being written
+	std::atomic<uint64_t> seq { 0 };
+	std::atomic<char const *> name { nullptr };
+	std::atomic<uint64_t> request { 0 };
+	std::atomic<uint64_t> thread { 0 };
+	std::atomic<uint64_t> start { 0 };
+	std::atomic<uint64_t> end { 0 };
+};
+
+struct span_record {
+	char const * name;
+	uint64_t request;
+	uint64_t thread;
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * Single-producer ring, readers copy slots seqlock-style and skip the
+ * ones overwritten while being copied.
+ */
+class trace_ring {
+public:
+	explicit trace_ring(size_t capacity)
+		: m_capacity(capacity)
+		, m_slots(new span_slot[capacity])
+	{}
+
+	void push(span_record const & span)
+	{
+		uint64_t pos = m_written.load(std::memory_order_relaxed);
+		span_slot & slot = m_slots[pos % m_capacity];
+		slot.seq.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.name.store(span.name, std::memory_order_relaxed);
+		slot.request.store(span.request, std::memory_order_relaxed);
+		slot.thread.store(span.thread, std::memory_order_relaxed);
+		slot.start.store(span.start, std::memory_order_relaxed);
+		slot.end.store(span.end, std::memory_order_relaxed);
+		slot.seq.store(pos + 1, std::memory_order_release);
+		m_written.store(pos + 1, std::memory_order_release);
+	}
+
+	void read(std::vector<span_record> & spans) const
+	{
+		for (size_t i = 0; i < m_capacity; ++i) {
+			span_slot const & slot = m_slots[i];
+			uint64_t seq = slot.seq.load(std::memory_order_acquire);
+			if (!seq)
+				continue;
+			span_record span;
+			span.name = slot.name.load(std::memory_order_relaxed);
+			span.request = slot.request.load(std::memory_order_relaxed);
+			span.thread = slot.thread.load(std::memory_order_relaxed);
+			span.start = slot.start.load(std::memory_order_relaxed);
+			span.end = slot.end.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.seq.load(std::memory_order_relaxed) == seq)
+				spans.push_back(span);
+		}
+	}
+
+	uint64_t written() const { return m_written.load(std::memory_order_acquire); }
+	size_t capacity() const { return m_capacity; }
+
+private:
+	size_t const m_capacity;
+	std::unique_ptr<span_slot[]> m_slots;
+	std::atomic<uint64_t> m_written { 0 };
+};
+
+/*
+ * Rings are never freed: ring of a finished thread is kept for dumps
+ * and handed to the next thread that starts tracing.
+ */
+struct ring_registry {
+	std::mutex guard;
+	std::vector<std::unique_ptr<trace_ring>> rings;
+	std::vector<trace_ring *> free;
+};
+
+// leaked so that threads still running at exit can use it
+ring_registry & registry = *new ring_registry();
+
+/*
+ * Ticks are converted to steady clock time by the rate measured between
+ * start of the program and the dump.
+ */
+struct time_base {
+	time_base()
+		: ticks(trace_detail::now_ticks())
+		, nanos(steady_nanos())
+	{}
+
+	static uint64_t steady_nanos()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	uint64_t ticks;
+	uint64_t nanos;
+};
+
+time_base const programStart;
+
+std::atomic<uint32_t> sampleEvery { 0 };
+std::atomic<size_t> ringCapacity { trace_options().ringCapacity };
+std::atomic<uint64_t> startedRequests { 0 };
+std::atomic<uint64_t> sampledRequests { 0 };
+
+struct ring_owner {
+	~ring_owner()
+	{
+		if (!ring)
+			return;
+		std::lock_guard<std::mutex> g(registry.guard);
+		registry.free.push_back(ring);
+	}
+
+	trace_ring * ring = nullptr;
+	uint64_t thread = 0;
+};
+
+thread_local ring_owner t_owner;
+
+ring_owner & current_owner()
+{
+	if (t_owner.ring)
+		return t_owner;
+
+	t_owner.thread = syscall(SYS_gettid);
+	std::lock_guard<std::mutex> g(registry.guard);
+	if (!registry.free.empty()) {
+		t_owner.ring = registry.free.back();
+		registry.free.pop_back();
+	} else {
+		registry.rings.emplace_back(new trace_ring(ringCapacity.load(std::memory_order_relaxed)));
+		t_owner.ring = registry.rings.back().get();
+	}
+	return t_owner;
+}
+
+void write_json_string(std::ostream & out, char const * s)
+{
+	out << '"';
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			out << '\\';
+		out << *s;
+	}
+	out << '"';
+}
+
+} // namespace
+
+namespace trace_detail {
+
+thread_local request_context t_context;
+
+bool sample_request()
+{
+	uint32_t every = sampleEvery.load(std::memory_order_relaxed);
+	if (!every || startedRequests.fetch_add(1, std::memory_order_relaxed) % every)
+		return false;
+	t_context.request = sampledRequests.fetch_add(1, std::memory_order_relaxed) + 1;
+	t_context.start = 0;
+	return true;
+}
+
+void record_span(char const * name, uint64_t start, uint64_t end)
+{
+	ring_owner & owner = current_owner();
+	owner.ring->push({ name, t_context.request, owner.thread, start, end });
+}
+
+} // namespace trace_detail
+
+void configure_tracing(trace_options const & options)
+{
+	ringCapacity.store(std::max<size_t>(1, options.ringCapacity), std::memory_order_relaxed);
+	sampleEvery.store(options.sampleEvery, std::memory_order_relaxed);
+}
+
+trace_request::~trace_request()
+{
+	if (!m_sampled)
+		return;
+	if (trace_detail::t_context.start)
+		trace_detail::record_span("request", trace_detail::t_context.start, trace_detail::now_ticks());
+	trace_detail::t_context = trace_detail::request_context();
+}
+
+trace_stats tracing_stats()
+{
+	trace_stats stats;
+	stats.sampledRequests = sampledRequests.load(std::memory_order_relaxed);
+	std::lock_guard<std::mutex> g(registry.guard);
+	for (auto const & ring: registry.rings) {
+		uint64_t written = ring->written();
+		stats.spans += written;
+		if (written > ring->capacity())
+			stats.droppedSpans += written - ring->capacity();
+	}
+	return stats;
+}
+
+void write_chrome_trace(std::ostream & out)
+{
+	std::vector<span_record> spans;
+	{
+		std::lock_guard<std::mutex> g(registry.guard);
+		for (auto const & ring: registry.rings)
+			ring->read(spans);
+	}
+
+	time_base now;
+	double nanosPerTick = now.ticks > programStart.ticks
+		? double(now.nanos - programStart.nanos) / (now.ticks - programStart.ticks) : 1;
+	auto micros = [&] (uint64_t ticks) {
+		return (programStart.nanos + (double(ticks) - programStart.ticks) * nanosPerTick) / 1e3;
+	};
+
+	pid_t pid = getpid();
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	for (auto const & span: spans) {
+		out << (first ? "\n" : ",\n") << "{\"name\":";
+		write_json_string(out, span.name);
+		// timestamps are in microseconds
+		out << ",\"cat\":\"request\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << span.thread
+			<< std::fixed << std::setprecision(3)
+			<< ",\"ts\":" << micros(span.start)
+			<< ",\"dur\":" << (span.end - span.start) * nanosPerTick / 1e3
+			<< ",\"args\":{\"request\":" << span.request << "}}";
+		first = false;
+	}
+	out << "\n]}" << std::endl;
+}
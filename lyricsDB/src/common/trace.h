@@ -0,0 +1,126 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Sampled per-request tracing. A sampled request marks its thread, spans
+ * recorded on that thread until the request ends go to the thread's own
+ * ring buffer, so recording takes no locks and shares no cache lines.
+ * Rings keep the latest spans and are dumped in Chrome trace-event format
+ * (chrome://tracing, Perfetto) while threads keep running.
+ */
+
+struct trace_options {
+	// trace every N-th request, 0 disables tracing
+	uint32_t sampleEvery = 0;
+	// spans kept per thread, older ones are overwritten
+	size_t ringCapacity = 4096;
+};
+
+/*
+ * Applies to requests started afterwards, capacity to rings created
+ * afterwards.
+ */
+void configure_tracing(trace_options const & options);
+
+namespace trace_detail {
+
+/*
+ * Spans are stamped with TSC ticks where available, they are several
+ * times cheaper to read than the clock and are converted to time on dump.
+ */
+inline uint64_t now_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct request_context {
+	// zero if current request is not sampled
+	uint64_t request = 0;
+	// start of the first span of the request
+	uint64_t start = 0;
+};
+
+extern thread_local request_context t_context;
+
+bool sample_request();
+void record_span(char const * name, uint64_t start, uint64_t end);
+
+} // namespace trace_detail
+
+/*
+ * Request running on the calling thread until destroyed. If sampled, it
+ * is recorded as span "request" from the start of its first span.
+ */
+class trace_request {
+public:
+	trace_request()
+	{
+		m_sampled = trace_detail::sample_request();
+	}
+
+	~trace_request();
+
+	trace_request(trace_request const &) = delete;
+	trace_request & operator=(trace_request const &) = delete;
+
+	bool sampled() const { return m_sampled; }
+
+private:
+	bool m_sampled;
+};
+
+/*
+ * Scoped span of the current request, no-op if it is not sampled.
+ * Name must outlive the trace, e.g. be a string literal.
+ */
+class trace_span {
+public:
+	explicit trace_span(char const * name)
+		: m_name(name)
+		, m_start(trace_detail::t_context.request ? trace_detail::now_ticks() : 0)
+	{
+		if (m_start && !trace_detail::t_context.start)
+			trace_detail::t_context.start = m_start;
+	}
+
+	~trace_span()
+	{
+		if (m_start && trace_detail::t_context.request)
+			trace_detail::record_span(m_name, m_start, trace_detail::now_ticks());
+	}
+
+	trace_span(trace_span const &) = delete;
+	trace_span & operator=(trace_span const &) = delete;
+
+private:
+	char const * m_name;
+	uint64_t m_start;
+};
+
+struct trace_stats {
+	uint64_t sampledRequests = 0;
+	uint64_t spans = 0;
+	// overwritten before being dumped
+	uint64_t droppedSpans = 0;
+};
+
+trace_stats tracing_stats();
+
+/*
+ * Writes spans currently held by all rings as Chrome trace-event JSON,
+ * safe to call while requests are being traced.
+ */
+void write_chrome_trace(std::ostream & out);
@@ -0,0 +1,82 @@
+#include "blob_file.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+[[noreturn]] void throw_errno(std::string const & msg)
+{
+	throw std::runtime_error(msg + ": " + strerror(errno));
+}
+
+int open_temporary()
+{
+	char const * dir = getenv("TMPDIR");
+	std::string pattern = std::string(dir && *dir ? dir : "/tmp") + "/lyricsdb-blob-XXXXXX";
+	std::vector<char> path(pattern.begin(), pattern.end());
+	path.push_back('\0');
+
+	int descriptor = mkstemp(path.data());
+	if (descriptor < 0)
+		throw_errno("failed to create blob file");
+	unlink(path.data());
+	return descriptor;
+}
+
+} // namespace
+
+blob_file::blob_file(std::string const & path)
+	: m_descriptor(path.empty()
+		? open_temporary()
+		: open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
+{
+	if (m_descriptor < 0)
+		throw_errno("failed to open blob file " + path);
+}
+
+blob_file::~blob_file()
+{
+	close(m_descriptor);
+}
+
+uint64_t blob_file::append(std::string const & text)
+{
+	uint64_t offset = m_size;
+	size_t written = 0;
+	while (written < text.size()) {
+		ssize_t n = pwrite(m_descriptor, text.data() + written, text.size() - written, offset + written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw_errno("failed to write blob file");
+		}
+		written += n;
+	}
+	m_size += text.size();
+	return offset;
+}
+
+std::string blob_file::read(uint64_t offset, size_t size) const
+{
+	std::string text(size, '\0');
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = pread(m_descriptor, &text[done], size - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			throw_errno("failed to read blob file");
+		if (n == 0)
+			throw std::runtime_error("blob file is truncated");
+		done += n;
+	}
+	return text;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Append-only file of song texts evicted from memory. Written bytes are
+ * never changed, so read() needs no locking against append().
+ * Throws std::runtime_error on I/O errors.
+ */
+class blob_file {
+public:
+	/*
+	 * Empty path means anonymous temporary file, removed on exit.
+	 */
+	explicit blob_file(std::string const & path);
+	~blob_file();
+
+	blob_file(blob_file const &) = delete;
+	blob_file & operator=(blob_file const &) = delete;
+
+	/*
+	 * Not thread-safe, returns offset of the written text.
+	 */
+	uint64_t append(std::string const & text);
+
+	std::string read(uint64_t offset, size_t size) const;
+
+	uint64_t size() const { return m_size; }
+
+private:
+	int m_descriptor;
+	uint64_t m_size = 0;
+};
@@ -0,0 +1,123 @@
+#include "catalog_image.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+size_t constexpr WRITE_BUFFER_SIZE = 1024 * 1024;
+
+[[noreturn]] void throw_errno(std::string const & msg)
+{
+	throw std::runtime_error(msg + ": " + strerror(errno));
+}
+
+} // namespace
+
+image_writer::image_writer()
+	: m_descriptor(int(syscall(SYS_memfd_create, "lyricsdb-catalog", MFD_CLOEXEC | MFD_ALLOW_SEALING)))
+{
+	if (m_descriptor < 0)
+		throw_errno("failed to create catalog image");
+	m_buffer.reserve(WRITE_BUFFER_SIZE);
+}
+
+image_writer::~image_writer()
+{
+	if (m_descriptor >= 0)
+		close(m_descriptor);
+}
+
+void image_writer::write(void const * data, size_t size)
+{
+	if (m_buffer.size() + size > WRITE_BUFFER_SIZE)
+		flush();
+	char const * bytes = static_cast<char const *>(data);
+	m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+}
+
+void image_writer::write_number(uint64_t value)
+{
+	write(&value, sizeof(value));
+}
+
+void image_writer::write_string(std::string const & value)
+{
+	write_number(value.size());
+	write(value.data(), value.size());
+}
+
+int image_writer::finish()
+{
+	flush();
+	if (fcntl(m_descriptor, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		throw_errno("failed to seal catalog image");
+	int descriptor = m_descriptor;
+	m_descriptor = -1;
+	return descriptor;
+}
+
+void image_writer::flush()
+{
+	size_t written = 0;
+	while (written < m_buffer.size()) {
+		ssize_t n = ::write(m_descriptor, m_buffer.data() + written, m_buffer.size() - written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw_errno("failed to write catalog image");
+		}
+		written += n;
+	}
+	m_buffer.clear();
+}
+
+image_reader::image_reader(int descriptor)
+{
+	struct stat info;
+	if (fstat(descriptor, &info) < 0)
+		throw_errno("failed to stat catalog image");
+	m_size = info.st_size;
+	if (!m_size)
+		return;
+
+	void * data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	if (data == MAP_FAILED)
+		throw_errno("failed to map catalog image");
+	m_data = static_cast<char const *>(data);
+}
+
+image_reader::~image_reader()
+{
+	if (m_data)
+		munmap(const_cast<char *>(m_data), m_size);
+}
+
+char const * image_reader::read(size_t size)
+{
+	if (size > m_size - m_position)
+		throw std::runtime_error("malformed catalog image: unexpected end");
+	char const * data = m_data + m_position;
+	m_position += size;
+	return data;
+}
+
+uint64_t image_reader::read_number()
+{
+	uint64_t value;
+	memcpy(&value, read(sizeof(value)), sizeof(value));
+	return value;
+}
+
+std::string image_reader::read_string()
+{
+	uint64_t size = read_number();
+	return std::string(read(size), size);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Sealed memfd with a database catalog, so that it can be passed to
+ * another process over unix socket (SCM_RIGHTS) and read there from
+ * mapped memory, without a file on disk. Values are written in host
+ * byte order, image is only read on the same host. Throw
+ * std::runtime_error on I/O errors and malformed images.
+ */
+class image_writer {
+public:
+	image_writer();
+	~image_writer();
+
+	image_writer(image_writer const &) = delete;
+	image_writer & operator=(image_writer const &) = delete;
+
+	void write(void const * data, size_t size);
+	void write_number(uint64_t value);
+	void write_string(std::string const & value);
+
+	/*
+	 * Seals the image against changes and returns its descriptor,
+	 * owned by caller from now on.
+	 */
+	int finish();
+
+private:
+	void flush();
+
+	int m_descriptor;
+	std::vector<char> m_buffer;
+};
+
+class image_reader {
+public:
+	/*
+	 * Maps the image, descriptor stays owned by caller.
+	 */
+	explicit image_reader(int descriptor);
+	~image_reader();
+
+	image_reader(image_reader const &) = delete;
+	image_reader & operator=(image_reader const &) = delete;
+
+	/*
+	 * Pointer into the mapping, valid while reader lives.
+	 */
+	char const * read(size_t size);
+	uint64_t read_number();
+	std::string read_string();
+
+	bool done() const { return m_position == m_size; }
+
+private:
+	char const * m_data = nullptr;
+	size_t m_size = 0;
+	size_t m_position = 0;
+};
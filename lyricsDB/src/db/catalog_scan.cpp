@@ -0,0 +1,269 @@
+#include "catalog_scan.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+// chunks are small enough for stealing to even out the threads
+size_t constexpr CHUNK_BYTES = 256 * 1024;
+size_t constexpr CHUNK_SONGS = 1024;
+
+uint64_t constexpr UNLIMITED = std::numeric_limits<uint64_t>::max();
+
+struct chunk {
+	size_t begin;
+	size_t end;
+};
+
+/*
+ * Chunks of one thread. Owner takes them from the front and thieves
+ * from the back, so they meet only on the last chunk.
+ */
+class chunk_queue {
+public:
+	// only before threads start
+	void push(chunk c)
+	{
+		m_chunks.push_back(c);
+	}
+
+	bool take(chunk & c)
+	{
+		std::lock_guard<std::mutex> g(m_guard);
+		if (m_chunks.empty())
+			return false;
+		c = m_chunks.front();
+		m_chunks.pop_front();
+		return true;
+	}
+
+	bool steal(chunk & c)
+	{
+		std::lock_guard<std::mutex> g(m_guard);
+		if (m_chunks.empty())
+			return false;
+		c = m_chunks.back();
+		m_chunks.pop_back();
+		return true;
+	}
+
+private:
+	std::mutex m_guard;
+	std::deque<chunk> m_chunks;
+};
+
+struct partial_result {
+	uint64_t total = 0;
+	// by author index
+	std::unordered_map<size_t, uint64_t> groups;
+};
+
+/*
+ * Lines up to limit, the last one may have no newline.
+ */
+uint64_t count_lines(std::string const & text, uint64_t limit)
+{
+	uint64_t lines = 0;
+	char const * data = text.data();
+	char const * end = data + text.size();
+	while (data != end && lines < limit) {
+		auto eol = static_cast<char const *>(memchr(data, '\n', end - data));
+		++lines;
+		data = eol ? eol + 1 : end;
+	}
+	return lines;
+}
+
+/*
+ * Non-overlapping occurrences up to limit.
+ */
+uint64_t count_occurrences(std::string const & text, std::string const & pattern, uint64_t limit)
+{
+	uint64_t occurrences = 0;
+	size_t pos = text.find(pattern);
+	while (pos != std::string::npos && occurrences < limit) {
+		++occurrences;
+		pos = text.find(pattern, pos + pattern.size());
+	}
+	return occurrences;
+}
+
+void scan_text(std::string const & text, scan_query const & query, size_t author, partial_result & result)
+{
+	bool occurrencesNeeded = query.aggregate == scan_aggregate::OCCURRENCES_PER_AUTHOR;
+	uint64_t occurrences = 0;
+	if (!query.pattern.empty()) {
+		occurrences = count_occurrences(text, query.pattern, occurrencesNeeded ? UNLIMITED : 1);
+		if (!occurrences)
+			return;
+	}
+	if (query.minLines && count_lines(text, query.minLines) < query.minLines)
+		return;
+
+	uint64_t value = 1;
+	if (occurrencesNeeded)
+		value = query.pattern.empty() ? count_lines(text, UNLIMITED) : occurrences;
+	result.total += value;
+	if (query.aggregate != scan_aggregate::SONGS && value)
+		result.groups[author] += value;
+}
+
+void scan_chunks(
+	catalog_snapshot const & snapshot,
+	scan_query const & query,
+	std::vector<chunk_queue> & queues,
+	size_t self,
+	partial_result & result,
+	std::atomic<bool> const & failed)
+{
+	std::string evicted;
+	chunk c;
+	while (!failed.load(std::memory_order_relaxed)) {
+		// chunks are never added, so nothing to take or steal means done
+		bool found = queues[self].take(c);
+		for (size_t i = 1; !found && i < queues.size(); ++i)
+			found = queues[(self + i) % queues.size()].steal(c);
+		if (!found)
+			return;
+
+		for (size_t i = c.begin; i < c.end; ++i) {
+			catalog_snapshot::song const & song = snapshot.songs[i];
+			if (song.text) {
+				scan_text(*song.text, query, song.author, result);
+			} else {
+				evicted = snapshot.blob->read(song.offset, song.size);
+				scan_text(evicted, query, song.author, result);
+			}
+		}
+	}
+}
+
+std::vector<chunk> split_into_chunks(catalog_snapshot const & snapshot)
+{
+	std::vector<chunk> chunks;
+	size_t begin = 0;
+	size_t bytes = 0;
+	for (size_t i = 0; i < snapshot.songs.size(); ++i) {
+		bytes += snapshot.songs[i].size;
+		if (bytes >= CHUNK_BYTES || i + 1 - begin >= CHUNK_SONGS) {
+			chunks.push_back({ begin, i + 1 });
+			begin = i + 1;
+			bytes = 0;
+		}
+	}
+	if (begin != snapshot.songs.size())
+		chunks.push_back({ begin, snapshot.songs.size() });
+	return chunks;
+}
+
+/*
+ * Helper threads of one scan, given back however the scan ends.
+ */
+class helper_lease {
+public:
+	helper_lease(scan_thread_budget & budget, size_t wanted)
+		: m_budget(budget)
+		, m_threads(budget.take(wanted))
+	{}
+
+	~helper_lease()
+	{
+		m_budget.give_back(m_threads);
+	}
+
+	helper_lease(helper_lease const &) = delete;
+	helper_lease & operator=(helper_lease const &) = delete;
+
+	size_t threads() const { return m_threads; }
+
+private:
+	scan_thread_budget & m_budget;
+	size_t m_threads;
+};
+
+} // namespace
+
+scan_thread_budget::scan_thread_budget(size_t threads)
+	: m_free(threads)
+{}
+
+size_t scan_thread_budget::take(size_t wanted)
+{
+	std::lock_guard<std::mutex> g(m_guard);
+	size_t taken = std::min(wanted, m_free);
+	m_free -= taken;
+	return taken;
+}
+
+void scan_thread_budget::give_back(size_t threads)
+{
+	std::lock_guard<std::mutex> g(m_guard);
+	m_free += threads;
+}
+
+scan_result run_catalog_scan(catalog_snapshot const & snapshot, scan_query const & query, scan_thread_budget & helpers)
+{
+	std::vector<chunk> chunks = split_into_chunks(snapshot);
+	// scans running meanwhile may have taken the helpers, this one runs with fewer then
+	helper_lease lease(helpers, chunks.empty() ? 0 : chunks.size() - 1);
+	size_t threads = 1 + lease.threads();
+
+	// every thread starts with a contiguous range, songs of an author are adjacent
+	std::vector<chunk_queue> queues(threads);
+	for (size_t i = 0; i < chunks.size(); ++i)
+		queues[i * threads / chunks.size()].push(chunks[i]);
+
+	std::vector<partial_result> partials(threads);
+	std::atomic<bool> failed { false };
+	std::mutex errorGuard;
+	std::exception_ptr error;
+	auto work = [&] (size_t self) {
+		try {
+			scan_chunks(snapshot, query, queues, self, partials[self], failed);
+		} catch (...) {
+			std::lock_guard<std::mutex> g(errorGuard);
+			if (!error)
+				error = std::current_exception();
+			failed = true;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	try {
+		for (size_t i = 1; i < threads; ++i)
+			workers.emplace_back(work, i);
+	} catch (std::system_error const &) {
+		// started threads and this one steal the chunks of the rest
+	}
+	work(0);
+	for (auto & worker: workers)
+		worker.join();
+	if (error)
+		std::rethrow_exception(error);
+
+	scan_result result;
+	result.scannedSongs = snapshot.songs.size();
+	std::unordered_map<size_t, uint64_t> groups;
+	for (auto const & partial: partials) {
+		result.total += partial.total;
+		for (auto const & it: partial.groups)
+			groups[it.first] += it.second;
+	}
+
+	result.groups.reserve(groups.size());
+	for (auto const & it: groups)
+		result.groups.push_back({ snapshot.authors[it.first], it.second });
+	std::sort(result.groups.begin(), result.groups.end(), [] (scan_group const & a, scan_group const & b) {
+		return a.value != b.value ? a.value > b.value : a.author < b.author;
+	});
+	return result;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "blob_file.h"
+#include <protocol/protocol.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Songs of a database at one moment. Resident texts are shared with
+ * the database and never change, evicted ones are read from its blob
+ * file when scanned.
+ */
+struct catalog_snapshot {
+	struct song {
+		// index in authors
+		size_t author;
+		// null if text was evicted
+		std::shared_ptr<std::string const> text;
+		uint64_t offset;
+		size_t size;
+	};
+
+	std::vector<std::string> authors;
+	std::vector<song> songs;
+	blob_file const * blob = nullptr;
+};
+
+/*
+ * Helper threads shared by scans running at the same time, so that
+ * concurrent scans don't multiply the number of threads. Thread-safe.
+ */
+class scan_thread_budget {
+public:
+	explicit scan_thread_budget(size_t threads);
+
+	scan_thread_budget(scan_thread_budget const &) = delete;
+	scan_thread_budget & operator=(scan_thread_budget const &) = delete;
+
+	/*
+	 * Takes up to wanted threads without waiting, returns how many.
+	 */
+	size_t take(size_t wanted);
+	void give_back(size_t threads);
+
+private:
+	std::mutex m_guard;
+	size_t m_free;
+};
+
+/*
+ * Runs query over the snapshot in the calling thread and as many helper
+ * threads as it can take from helpers. Songs are split into chunks of
+ * similar text size, every thread takes chunks from its own queue and
+ * steals from others once it runs out, so slow disk reads of evicted
+ * texts don't leave threads idle. Throws std::runtime_error if evicted
+ * text can't be read.
+ */
+scan_result run_catalog_scan(catalog_snapshot const & snapshot, scan_query const & query, scan_thread_budget & helpers);
@@ -0,0 +1,575 @@
+#include "database.h"
+#include "catalog_image.h"
+#include <common/trace.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// "lyrcat01", changes with every change of image layout
+uint64_t constexpr CATALOG_IMAGE_MAGIC = 0x313074616372796c;
+
+/*
+ * Lock waits are traced separately, they are where readers queue
+ * behind batches of writes.
+ */
+template<typename Lock>
+void lock_traced(Lock & lock)
+{
+	trace_span span("db_lock");
+	lock.lock();
+}
+
+size_t scan_threads(database_options const & options)
+{
+	if (options.scanThreads)
+		return options.scanThreads;
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+} // namespace
+
+database::database(database_options const & options)
+	: m_options(options)
+	, m_scanHelpers(scan_threads(options) - 1)
+{
+	if (m_options.writeBatchSize == 0)
+		m_options.writeBatchSize = 1;
+	if (tiered())
+		m_blob.reset(new blob_file(m_options.spillPath));
+	m_applier = std::thread([this] () { apply_loop(); });
+}
+
+database::~database()
+{
+	{
+		std::lock_guard<std::mutex> g(m_applierGuard);
+		m_stopping = true;
+	}
+	m_applierWakeup.notify_one();
+	m_applier.join();
+}
+
+void database::add_song(
+	std::string const & author,
+	std::string const & song,
+	std::string const & text)
+{
+	pending_write write;
+	write.author = author;
+	write.song = song;
+	write.text = text;
+	write_song(write);
+}
+
+bool database::replace_song(
+	std::string const & author,
+	std::string const & song,
+	text_digest const & base,
+	std::string const & text)
+{
+	pending_write write;
+	write.author = author;
+	write.song = song;
+	write.text = text;
+	write.base = &base;
+	return write_song(write);
+}
+
+/*
+ * Queues the write and waits until applier is done with it.
+ */
+bool database::write_song(pending_write & write)
+{
+	trace_span span("db_write");
+	write.digest = digest_text(write.text);
+
+	pending_write * head = m_writeQueue.load(std::memory_order_relaxed);
+	do {
+		write.next = head;
+	} while (!m_writeQueue.compare_exchange_weak(head, &write,
+		std::memory_order_release, std::memory_order_relaxed));
+
+	size_t queued = m_queuedWrites.fetch_add(1, std::memory_order_relaxed) + 1;
+	// applier sleeps only on empty queue or while filling a batch
+	if (!head || queued >= m_options.writeBatchSize) {
+		std::lock_guard<std::mutex> g(m_applierGuard);
+		m_applierWakeup.notify_one();
+	}
+
+	std::unique_lock<std::mutex> g(m_doneGuard);
+	m_doneWakeup.wait(g, [&write] () { return write.done; });
+	return write.applied;
+}
+
+std::string database::get_song(std::string const & author, std::string const & song)
+{
+	std::string text;
+	text_digest digest;
+	uint64_t version;
+	read_song(author, song, 0, text, digest, version);
+	return text;
+}
+
+bool database::find_song(
+	std::string const & author,
+	std::string const & song,
+	std::string & text,
+	text_digest & digest)
+{
+	uint64_t version;
+	return read_song(author, song, 0, text, digest, version) == lookup_result::FOUND;
+}
+
+bool database::get_song_if_modified(
+	std::string const & author,
+	std::string const & song,
+	uint64_t knownVersion,
+	std::string & text,
+	uint64_t & version)
+{
+	text_digest digest;
+	read_song(author, song, knownVersion, text, digest, version);
+	return version != knownVersion;
+}
+
+/*
+ * Text is read only if song version differs from knownVersion,
+ * which is never the case for zero.
+ */
+database::lookup_result database::read_song(
+	std::string const & author,
+	std::string const & song,
+	uint64_t knownVersion,
+	std::string & text,
+	text_digest & digest,
+	uint64_t & version)
+{
+	uint64_t offset;
+	size_t size;
+	{
+		std::shared_lock<std::shared_timed_mutex> g(m_guard, std::defer_lock);
+		lock_traced(g);
+
+		version = 0;
+		auto authorIt = m_authors.find(author);
+		if (authorIt == m_authors.end()) {
+			++m_misses;
+			return lookup_result::MISSING;
+		}
+
+		auto songIt = authorIt->second.songs.find(song);
+		if (songIt == authorIt->second.songs.end()) {
+			++m_misses;
+			return lookup_result::MISSING;
+		}
+
+		version = songIt->second.version;
+		if (version == knownVersion)
+			return lookup_result::NOT_MODIFIED;
+
+		stored_text & entry = *songIt->second.text;
+		digest = entry.digest;
+		if (entry.resident) {
+			entry.referenced.store(true, std::memory_order_relaxed);
+			++m_memoryHits;
+			text = *entry.text;
+			return lookup_result::FOUND;
+		}
+		offset = entry.offset;
+		size = entry.size;
+	}
+
+	// blob file is append-only, so it is read without holding the lock
+	auto start = std::chrono::steady_clock::now();
+	{
+		trace_span span("disk_read");
+		text = m_blob->read(offset, size);
+	}
+	uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	++m_diskReads;
+	m_diskReadNanos += nanos;
+	uint64_t maxNanos = m_maxDiskReadNanos.load(std::memory_order_relaxed);
+	while (nanos > maxNanos && !m_maxDiskReadNanos.compare_exchange_weak(maxNanos, nanos))
+		;
+
+	// bring text back unless it was dropped or promoted meanwhile
+	std::lock_guard<std::shared_timed_mutex> g(m_guard);
+	auto textIt = m_texts.find(digest);
+	if (textIt != m_texts.end()) {
+		stored_text & entry = textIt->second;
+		if (!entry.resident && entry.onDisk && entry.offset == offset) {
+			make_resident(entry, text);
+			entry.onDisk = true;
+			entry.referenced.store(true, std::memory_order_relaxed);
+			evict_over_budget();
+		}
+	}
+	return lookup_result::FOUND;
+}
+
+std::vector<std::string> database::get_song_list(std::string const & author)
+{
+	std::vector<std::string> songs;
+	uint64_t version;
+	get_song_list_if_modified(author, 0, songs, version);
+	return songs;
+}
+
+bool database::get_song_list_if_modified(
+	std::string const & author,
+	uint64_t knownVersion,
+	std::vector<std::string> & songs,
+	uint64_t & version)
+{
+	std::shared_lock<std::shared_timed_mutex> g(m_guard, std::defer_lock);
+	lock_traced(g);
+	auto authorIt = m_authors.find(author);
+	version = authorIt != m_authors.end() ? authorIt->second.version : 0;
+	if (version == knownVersion)
+		return false;
+
+	songs.clear();
+	// client knows a version of author that is gone, e.g. from another server
+	if (authorIt == m_authors.end())
+		return true;
+	songs.reserve(authorIt->second.songs.size());
+	for (auto const & it: authorIt->second.songs)
+		songs.push_back(it.first);
+	return true;
+}
+
+scan_result database::scan(scan_query const & query)
+{
+	trace_span span("db_scan");
+	catalog_snapshot snapshot;
+	snapshot.blob = m_blob.get();
+	{
+		std::shared_lock<std::shared_timed_mutex> g(m_guard, std::defer_lock);
+		lock_traced(g);
+		snapshot.authors.reserve(m_authors.size());
+		for (auto const & author: m_authors) {
+			size_t index = snapshot.authors.size();
+			snapshot.authors.push_back(author.first);
+			for (auto const & song: author.second.songs) {
+				stored_text const & entry = *song.second.text;
+				// blob file is append-only, offset stays valid after the lock
+				snapshot.songs.push_back({ index, entry.resident ? entry.text : nullptr, entry.offset, entry.size });
+			}
+		}
+	}
+
+	return run_catalog_scan(snapshot, query, m_scanHelpers);
+}
+
+std::vector<song_name> database::suggest_songs(
+	std::string const & author,
+	std::string const & song,
+	size_t limit) const
+{
+	trace_span span("db_suggest");
+	std::shared_lock<std::shared_timed_mutex> g(m_guard, std::defer_lock);
+	lock_traced(g);
+	return m_names.suggest(author, song, limit);
+}
+
+database_stats database::stats() const
+{
+	database_stats stats;
+	stats.memoryHits = m_memoryHits;
+	stats.diskReads = m_diskReads;
+	stats.misses = m_misses;
+	stats.evictions = m_evictions;
+	stats.diskReadTime = std::chrono::nanoseconds(m_diskReadNanos.load());
+	stats.maxDiskReadTime = std::chrono::nanoseconds(m_maxDiskReadNanos.load());
+
+	std::shared_lock<std::shared_timed_mutex> g(m_guard);
+	stats.residentBytes = m_residentBytes;
+	stats.spilledBytes = m_blob ? m_blob->size() : 0;
+	stats.uniqueTexts = m_texts.size();
+	stats.logicalBytes = m_logicalBytes;
+	stats.storedBytes = m_storedBytes;
+	return stats;
+}
+
+int database::export_catalog() const
+{
+	trace_span span("db_export");
+	image_writer image;
+	std::shared_lock<std::shared_timed_mutex> g(m_guard, std::defer_lock);
+	lock_traced(g);
+
+	image.write_number(CATALOG_IMAGE_MAGIC);
+	image.write_number(m_version);
+
+	// songs refer to texts by their position in the image
+	std::unordered_map<stored_text const *, uint64_t> textIndex;
+	textIndex.reserve(m_texts.size());
+	image.write_number(m_texts.size());
+	for (auto const & it: m_texts) {
+		stored_text const & entry = it.second;
+		textIndex.emplace(&entry, textIndex.size());
+		image.write(entry.digest.bytes.data(), entry.digest.bytes.size());
+		image.write_string(entry.resident ? *entry.text : m_blob->read(entry.offset, entry.size));
+	}
+
+	image.write_number(m_authors.size());
+	for (auto const & author: m_authors) {
+		image.write_string(author.first);
+		image.write_number(author.second.version);
+		image.write_number(author.second.songs.size());
+		for (auto const & song: author.second.songs) {
+			image.write_string(song.first);
+			image.write_number(song.second.version);
+			image.write_number(textIndex.at(song.second.text));
+		}
+	}
+	return image.finish();
+}
+
+void database::import_catalog(int descriptor)
+{
+	trace_span span("db_import");
+	image_reader image(descriptor);
+	if (image.read_number() != CATALOG_IMAGE_MAGIC)
+		throw std::runtime_error("not a catalog image of this server version");
+
+	std::lock_guard<std::shared_timed_mutex> g(m_guard);
+	if (m_version || !m_authors.empty())
+		throw std::runtime_error("catalog can be imported only into empty database");
+	uint64_t version = image.read_number();
+
+	std::vector<stored_text *> texts;
+	for (uint64_t count = image.read_number(); count > 0; --count) {
+		text_digest digest;
+		memcpy(digest.bytes.data(), image.read(digest.bytes.size()), digest.bytes.size());
+		if (m_texts.count(digest))
+			throw std::runtime_error("malformed catalog image: repeated text");
+		stored_text & entry = m_texts[digest];
+		entry.digest = digest;
+		std::string text = image.read_string();
+		m_storedBytes += text.size();
+		make_resident(entry, std::move(text));
+		texts.push_back(&entry);
+		// big catalog is spilled while loading rather than after it
+		evict_over_budget();
+	}
+
+	for (uint64_t authors = image.read_number(); authors > 0; --authors) {
+		std::string author = image.read_string();
+		if (m_authors.count(author))
+			throw std::runtime_error("malformed catalog image: repeated author");
+		author_entry & entry = m_authors[author];
+		entry.version = image.read_number();
+		for (uint64_t songs = image.read_number(); songs > 0; --songs) {
+			std::string song = image.read_string();
+			song_slot & slot = entry.songs[song];
+			slot.version = image.read_number();
+			uint64_t index = image.read_number();
+			if (slot.text || index >= texts.size())
+				throw std::runtime_error("malformed catalog image: bad song " + song);
+			slot.text = texts[index];
+			++slot.text->refs;
+			m_logicalBytes += slot.text->size;
+			m_names.add(author, song);
+		}
+	}
+
+	if (!image.done())
+		throw std::runtime_error("malformed catalog image: trailing data");
+	for (stored_text const * text: texts) {
+		if (!text->refs)
+			throw std::runtime_error("malformed catalog image: text without songs");
+	}
+	m_version = version;
+}
+
+void database::apply_loop()
+{
+	std::vector<pending_write *> writes;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> g(m_applierGuard);
+			m_applierWakeup.wait(g, [this] () {
+				return m_stopping || m_writeQueue.load(std::memory_order_relaxed);
+			});
+
+			if (m_options.writeBatchDelay.count() > 0)
+				m_applierWakeup.wait_for(g, m_options.writeBatchDelay, [this] () {
+					return m_stopping
+						|| m_queuedWrites.load(std::memory_order_relaxed) >= m_options.writeBatchSize;
+				});
+
+			if (m_stopping && !m_writeQueue.load(std::memory_order_relaxed))
+				return;
+		}
+
+		pending_write * head = m_writeQueue.exchange(nullptr, std::memory_order_acquire);
+		writes.clear();
+		for (; head; head = head->next)
+			writes.push_back(head);
+		m_queuedWrites.fetch_sub(writes.size(), std::memory_order_relaxed);
+		// queue is LIFO, restore arrival order so that the last write wins
+		std::reverse(writes.begin(), writes.end());
+
+		for (size_t begin = 0; begin < writes.size(); begin += m_options.writeBatchSize) {
+			size_t end = std::min(writes.size(), begin + m_options.writeBatchSize);
+			apply_batch(writes.data() + begin, writes.data() + end);
+		}
+	}
+}
+
+void database::apply_batch(pending_write ** begin, pending_write ** end)
+{
+	// group by author to look each author up once per batch,
+	// stable sort keeps order of writes to the same song
+	std::stable_sort(begin, end, [] (pending_write * a, pending_write * b) {
+		return a->author < b->author;
+	});
+
+	{
+		std::lock_guard<std::shared_timed_mutex> g(m_guard);
+		author_entry * entry = nullptr;
+		std::string const * author = nullptr;
+		for (auto it = begin; it != end; ++it) {
+			pending_write * write = *it;
+			if (!author || *author != write->author) {
+				author = &write->author;
+				auto found = m_authors.find(write->author);
+				entry = found != m_authors.end() ? &found->second : nullptr;
+			}
+			if (write->base) {
+				write->applied = false;
+				if (entry) {
+					auto songIt = entry->songs.find(write->song);
+					write->applied = songIt != entry->songs.end() && songIt->second.text->digest == *write->base;
+				}
+				if (!write->applied)
+					continue;
+			}
+			// author appears only with a write that applies, scans never see it empty
+			if (!entry)
+				entry = &m_authors[write->author];
+
+			song_slot & slot = entry->songs[write->song];
+			// unchanged text keeps its version, pollers see no change
+			if (slot.text && slot.text->digest == write->digest)
+				continue;
+			if (slot.text) {
+				release_text(slot.text);
+			} else {
+				entry->version = m_version + 1;
+				m_names.add(write->author, write->song);
+			}
+			slot.text = acquire_text(write->digest, std::move(write->text));
+			slot.version = ++m_version;
+		}
+		evict_over_budget();
+	}
+
+	{
+		std::lock_guard<std::mutex> g(m_doneGuard);
+		for (auto it = begin; it != end; ++it)
+			(*it)->done = true;
+	}
+	m_doneWakeup.notify_all();
+}
+
+/*
+ * Returns stored text with given digest adding a reference to it,
+ * caller holds exclusive lock.
+ */
+database::stored_text * database::acquire_text(text_digest const & digest, std::string text)
+{
+	stored_text & entry = m_texts[digest];
+	if (entry.refs++ == 0) {
+		entry.digest = digest;
+		m_storedBytes += text.size();
+		make_resident(entry, std::move(text));
+	}
+	m_logicalBytes += entry.size;
+	return &entry;
+}
+
+/*
+ * Drops a reference, text without songs is removed from memory. Its blob
+ * copy stays, blob file is append-only. Caller holds exclusive lock.
+ */
+void database::release_text(stored_text * entry)
+{
+	m_logicalBytes -= entry->size;
+	if (--entry->refs > 0)
+		return;
+
+	m_storedBytes -= entry->size;
+	if (entry->resident) {
+		m_residentBytes -= entry->size;
+		if (tiered())
+			remove_from_clock(*entry);
+	}
+	text_digest digest = entry->digest;
+	m_texts.erase(digest);
+}
+
+/*
+ * Puts text into memory, caller holds exclusive lock.
+ */
+void database::make_resident(stored_text & entry, std::string text)
+{
+	if (!entry.resident && tiered()) {
+		entry.clockSlot = m_clock.size();
+		m_clock.push_back(&entry);
+	}
+	m_residentBytes += text.size();
+	entry.size = text.size();
+	entry.text = std::make_shared<std::string const>(std::move(text));
+	entry.resident = true;
+	entry.onDisk = false;
+}
+
+/*
+ * CLOCK sweep: referenced entries get second chance, others are moved
+ * to blob file. Caller holds exclusive lock.
+ */
+void database::evict_over_budget()
+{
+	while (tiered() && m_residentBytes > m_options.memoryBudget && !m_clock.empty()) {
+		if (m_clockHand >= m_clock.size())
+			m_clockHand = 0;
+
+		stored_text & entry = *m_clock[m_clockHand];
+		if (entry.referenced.exchange(false, std::memory_order_relaxed)) {
+			++m_clockHand;
+			continue;
+		}
+
+		if (!entry.onDisk) {
+			try {
+				entry.offset = m_blob->append(*entry.text);
+			} catch (std::runtime_error const & e) {
+				// keep everything in memory rather than lose writes
+				std::cerr << "eviction failed: " << e.what() << std::endl;
+				return;
+			}
+			entry.onDisk = true;
+		}
+		m_residentBytes -= entry.size;
+		entry.text.reset();
+		entry.resident = false;
+		++m_evictions;
+
+		// hand stays, it now points to the entry moved from the back
+		remove_from_clock(entry);
+	}
+}
+
+void database::remove_from_clock(stored_text & entry)
+{
+	size_t slot = entry.clockSlot;
+	m_clock[slot] = m_clock.back();
+	m_clock[slot]->clockSlot = slot;
+	m_clock.pop_back();
+}
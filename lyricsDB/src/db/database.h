@@ -0,0 +1,283 @@
+#pragma once
+
+#include "blob_file.h"
+#include "catalog_scan.h"
+#include "name_index.h"
+#include <protocol/text_digest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct database_options {
+	/*
+	 * Max number of writes applied under one lock acquisition.
+	 */
+	size_t writeBatchSize = 64;
+	/*
+	 * How long applier may wait for batch to fill up after the first
+	 * write arrived. Zero means apply whatever is queued right away.
+	 */
+	std::chrono::microseconds writeBatchDelay { 0 };
+	/*
+	 * Max total size of song texts kept in memory, zero means unlimited.
+	 * Texts not read recently are moved to blob file, index stays in memory.
+	 */
+	size_t memoryBudget = 0;
+	/*
+	 * Blob file for evicted texts, empty means anonymous temporary file.
+	 */
+	std::string spillPath;
+	/*
+	 * Threads running catalog scans, shared by the scans running at the
+	 * same time. Every scan runs in its calling thread and the helpers
+	 * that are free, scanThreads - 1 of them over all scans. Zero means
+	 * one per cpu.
+	 */
+	size_t scanThreads = 0;
+};
+
+struct database_stats {
+	uint64_t memoryHits;
+	uint64_t diskReads;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t residentBytes;
+	uint64_t spilledBytes;
+	std::chrono::nanoseconds diskReadTime;
+	std::chrono::nanoseconds maxDiskReadTime;
+	// songs may share text, it is stored once
+	uint64_t uniqueTexts;
+	uint64_t logicalBytes;
+	uint64_t storedBytes;
+
+	double hit_ratio() const
+	{
+		uint64_t found = memoryHits + diskReads;
+		return found ? double(memoryHits) / found : 1.0;
+	}
+
+	double dedup_ratio() const
+	{
+		return storedBytes ? double(logicalBytes) / storedBytes : 1.0;
+	}
+};
+
+/*
+ * All the methods are thread-safe.
+ *
+ * Writes are group-committed: add_song pushes the write into lock-free
+ * queue and blocks until single applier thread has put it into the store
+ * together with other writes queued at the same time.
+ *
+ * Texts are content-addressed: songs point to reference counted text
+ * keyed by its SHA-256, so covers and compilations cost one copy. Digest
+ * is computed by writer before the write is queued.
+ *
+ * With memory budget texts are evicted by CLOCK: reads only set referenced
+ * bit under shared lock, the hand sweeps under exclusive one. Missing
+ * songs are answered from in-memory index and never touch the disk.
+ */
+class database {
+public:
+	explicit database(database_options const & options = database_options());
+	~database();
+
+	database(database const &) = delete;
+	database & operator=(database const &) = delete;
+
+	void add_song(
+		std::string const & author,
+		std::string const & song,
+		std::string const & text);
+
+	/*
+	 * Writes text only if the song currently has text with digest base,
+	 * returns false otherwise. Ordered with add_song like any other write.
+	 */
+	bool replace_song(
+		std::string const & author,
+		std::string const & song,
+		text_digest const & base,
+		std::string const & text);
+
+	std::string get_song(std::string const & author, std::string const & song);
+
+	/*
+	 * Like get_song, also gives digest of the text. Returns false if
+	 * there is no such song.
+	 */
+	bool find_song(
+		std::string const & author,
+		std::string const & song,
+		std::string & text,
+		text_digest & digest);
+
+	std::vector<std::string> get_song_list(std::string const & author);
+
+	/*
+	 * At most limit songs with names close to the given ones, closest
+	 * first, for lookups that missed. Case and punctuation are ignored.
+	 */
+	std::vector<song_name> suggest_songs(
+		std::string const & author,
+		std::string const & song,
+		size_t limit) const;
+
+	/*
+	 * Every applied write gets next version, song keeps version of its
+	 * last write and author's song list the version of write that added
+	 * its last song. Zero version means no such song or author.
+	 * Return false and leave text/songs alone if knownVersion is current.
+	 */
+	bool get_song_if_modified(
+		std::string const & author,
+		std::string const & song,
+		uint64_t knownVersion,
+		std::string & text,
+		uint64_t & version);
+
+	bool get_song_list_if_modified(
+		std::string const & author,
+		uint64_t knownVersion,
+		std::vector<std::string> & songs,
+		uint64_t & version);
+
+	/*
+	 * Runs query over all songs as of the call, writes applied meanwhile
+	 * are not seen. Writers wait only while songs are listed, texts are
+	 * scanned without the lock. Evicted texts are read from blob file and
+	 * stay evicted, scans don't push hot texts out of memory.
+	 */
+	scan_result scan(scan_query const & query);
+
+	database_stats stats() const;
+
+	/*
+	 * Writes all songs with their texts and versions into a sealed memfd
+	 * (see catalog_image.h) for another process to take over, returns its
+	 * descriptor owned by caller. Writes wait meanwhile. Evicted texts are
+	 * read from blob file, image holds them all. Throws std::runtime_error.
+	 */
+	int export_catalog() const;
+
+	/*
+	 * Loads image made by export_catalog of the same server version into
+	 * empty database. Versions stay as they were, so clients polling with
+	 * versions they know see no change. Throws std::runtime_error if image
+	 * is malformed or database is not empty, database may be left partly
+	 * loaded then.
+	 */
+	void import_catalog(int descriptor);
+
+private:
+	struct stored_text {
+		text_digest digest;
+		// number of songs with this text
+		size_t refs = 0;
+		// never changed once set, so snapshots share it
+		std::shared_ptr<std::string const> text;
+		// new entry becomes resident once text is set
+		bool resident = false;
+		// text is also in blob file at offset, eviction needs no write
+		bool onDisk = false;
+		uint64_t offset = 0;
+		size_t size = 0;
+		size_t clockSlot = 0;
+		std::atomic<bool> referenced { false };
+	};
+	using text_map = std::unordered_map<text_digest, stored_text, text_digest_hash>;
+
+	struct song_slot {
+		stored_text * text = nullptr;
+		uint64_t version = 0;
+	};
+	using song_map = std::unordered_map<std::string, song_slot>;
+
+	struct author_entry {
+		song_map songs;
+		uint64_t version = 0;
+	};
+
+	struct pending_write {
+		std::string author;
+		std::string song;
+		std::string text;
+		text_digest digest;
+		// set for replace_song, write is skipped on mismatch
+		text_digest const * base = nullptr;
+		bool applied = true;
+		bool done = false;
+		pending_write * next = nullptr;
+	};
+
+	enum class lookup_result {
+		MISSING,
+		NOT_MODIFIED,
+		FOUND
+	};
+	lookup_result read_song(
+		std::string const & author,
+		std::string const & song,
+		uint64_t knownVersion,
+		std::string & text,
+		text_digest & digest,
+		uint64_t & version);
+
+	bool write_song(pending_write & write);
+	void apply_loop();
+	void apply_batch(pending_write ** begin, pending_write ** end);
+
+	stored_text * acquire_text(text_digest const & digest, std::string text);
+	void release_text(stored_text * entry);
+
+	bool tiered() const { return m_options.memoryBudget > 0; }
+	void make_resident(stored_text & entry, std::string text);
+	void remove_from_clock(stored_text & entry);
+	void evict_over_budget();
+
+	database_options m_options;
+	scan_thread_budget m_scanHelpers;
+
+	mutable std::shared_timed_mutex m_guard;
+	std::unordered_map<std::string, author_entry> m_authors;
+
+	// following members are guarded by m_guard
+	uint64_t m_version = 0;
+	text_map m_texts;
+	name_index m_names;
+	uint64_t m_logicalBytes = 0;
+	uint64_t m_storedBytes = 0;
+	std::unique_ptr<blob_file> m_blob;
+	std::vector<stored_text *> m_clock;
+	size_t m_clockHand = 0;
+	uint64_t m_residentBytes = 0;
+
+	std::atomic<uint64_t> m_memoryHits { 0 };
+	std::atomic<uint64_t> m_diskReads { 0 };
+	std::atomic<uint64_t> m_misses { 0 };
+	std::atomic<uint64_t> m_evictions { 0 };
+	std::atomic<uint64_t> m_diskReadNanos { 0 };
+	std::atomic<uint64_t> m_maxDiskReadNanos { 0 };
+
+	// writers push to the head, applier takes the whole list at once
+	std::atomic<pending_write *> m_writeQueue { nullptr };
+	std::atomic<size_t> m_queuedWrites { 0 };
+
+	std::mutex m_applierGuard;
+	std::condition_variable m_applierWakeup;
+	bool m_stopping = false;
+
+	std::mutex m_doneGuard;
+	std::condition_variable m_doneWakeup;
+
+	std::thread m_applier;
+};
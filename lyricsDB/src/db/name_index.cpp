@@ -0,0 +1,248 @@
+#include "name_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <numeric>
+
+namespace {
+
+// songs sharing most trigrams with the query, they get edit distance computed
+size_t constexpr CANDIDATES = 64;
+// longer queries are cut, that bounds the work and trigram counts
+size_t constexpr MAX_QUERY_NAME = 128;
+// trigrams of more than 1/FREQUENT_SHARE names, like first letters, barely
+// tell names apart, they are skipped if the query has enough other ones
+size_t constexpr FREQUENT_SHARE = 32;
+size_t constexpr MIN_RARE_TRIGRAMS = 3;
+// idle overlap counters kept, more concurrent queries allocate their own
+size_t constexpr IDLE_SCRATCH = 4;
+
+std::string normalize(std::string const & name)
+{
+	std::string result;
+	result.reserve(name.size());
+	bool space = false;
+	for (unsigned char c: name) {
+		// bytes of utf-8 sequences are kept as they are
+		if (std::isalnum(c) || c >= 0x80) {
+			if (space && !result.empty())
+				result.push_back(' ');
+			space = false;
+			result.push_back(std::tolower(c));
+		} else if (std::isspace(c)) {
+			space = true;
+		}
+	}
+	return result;
+}
+
+/*
+ * Distinct trigrams of name padded with spaces, so that short names
+ * and first letters get trigrams of their own.
+ */
+std::vector<uint32_t> trigrams(std::string const & normalized)
+{
+	std::string padded = "  " + normalized + " ";
+	std::vector<uint32_t> result;
+	result.reserve(padded.size() - 2);
+	for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+		result.push_back(uint32_t(uint8_t(padded[i])) << 16
+			| uint32_t(uint8_t(padded[i + 1])) << 8
+			| uint8_t(padded[i + 2]));
+	}
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+	return result;
+}
+
+/*
+ * Levenshtein distance, max + 1 once it is sure to exceed max.
+ */
+size_t edit_distance(std::string const & a, std::string const & b, size_t max)
+{
+	if (a.size() > b.size())
+		return edit_distance(b, a, max);
+	if (b.size() - a.size() > max)
+		return max + 1;
+
+	thread_local std::vector<size_t> row;
+	row.resize(a.size() + 1);
+	std::iota(row.begin(), row.end(), 0);
+	for (size_t j = 1; j <= b.size(); ++j) {
+		size_t diagonal = row[0];
+		row[0] = j;
+		size_t best = row[0];
+		for (size_t i = 1; i <= a.size(); ++i) {
+			size_t above = row[i];
+			row[i] = std::min({ row[i] + 1, row[i - 1] + 1, diagonal + (a[i - 1] != b[j - 1]) });
+			diagonal = above;
+			best = std::min(best, row[i]);
+		}
+		if (best > max)
+			return max + 1;
+	}
+	return std::min(row[a.size()], max + 1);
+}
+
+/*
+ * Trigrams shared with the query per name id. Counters are dense and
+ * reused by the next queries, so counting long posting lists is a plain
+ * increment.
+ */
+class overlap_counter {
+public:
+	void count(std::unordered_map<uint32_t, std::vector<uint32_t>> const & index,
+		std::vector<uint32_t> const & query, size_t names)
+	{
+		if (m_counts.size() < names)
+			m_counts.resize(names);
+
+		m_postings.clear();
+		size_t rare = 0;
+		for (uint32_t trigram: query) {
+			auto it = index.find(trigram);
+			if (it == index.end())
+				continue;
+			m_postings.push_back(&it->second);
+			rare += it->second.size() * FREQUENT_SHARE <= names;
+		}
+		bool skipFrequent = rare >= MIN_RARE_TRIGRAMS;
+
+		for (auto postings: m_postings) {
+			if (skipFrequent && postings->size() * FREQUENT_SHARE > names)
+				continue;
+			for (uint32_t id: *postings) {
+				if (!m_counts[id]++)
+					m_touched.push_back(id);
+			}
+		}
+	}
+
+	uint32_t operator[](uint32_t id) const { return id < m_counts.size() ? m_counts[id] : 0; }
+	std::vector<uint32_t> const & touched() const { return m_touched; }
+
+	void reset()
+	{
+		for (uint32_t id: m_touched)
+			m_counts[id] = 0;
+		m_touched.clear();
+	}
+
+private:
+	std::vector<uint16_t> m_counts;
+	std::vector<uint32_t> m_touched;
+	std::vector<std::vector<uint32_t> const *> m_postings;
+};
+
+} // namespace
+
+struct name_index::overlap_scratch {
+	overlap_counter authors;
+	overlap_counter songs;
+};
+
+name_index::name_index() = default;
+
+name_index::~name_index() = default;
+
+std::unique_ptr<name_index::overlap_scratch> name_index::take_scratch() const
+{
+	{
+		std::lock_guard<std::mutex> g(m_scratchGuard);
+		if (!m_idleScratch.empty()) {
+			auto scratch = std::move(m_idleScratch.back());
+			m_idleScratch.pop_back();
+			return scratch;
+		}
+	}
+	return std::unique_ptr<overlap_scratch>(new overlap_scratch());
+}
+
+/*
+ * Counters must be reset already.
+ */
+void name_index::give_back(std::unique_ptr<overlap_scratch> scratch) const
+{
+	std::lock_guard<std::mutex> g(m_scratchGuard);
+	if (m_idleScratch.size() < IDLE_SCRATCH)
+		m_idleScratch.push_back(std::move(scratch));
+}
+
+void name_index::add(std::string const & author, std::string const & song)
+{
+	auto authorIt = m_authorIds.find(author);
+	if (authorIt == m_authorIds.end()) {
+		uint32_t id = m_authors.size();
+		authorIt = m_authorIds.emplace(author, id).first;
+		m_authors.push_back({ author, normalize(author) });
+		for (uint32_t trigram: trigrams(m_authors.back().normalized))
+			m_authorTrigrams[trigram].push_back(id);
+	}
+
+	uint32_t id = m_songs.size();
+	m_songs.push_back({ song, normalize(song) });
+	m_songAuthors.push_back(authorIt->second);
+	for (uint32_t trigram: trigrams(m_songs.back().normalized))
+		m_songTrigrams[trigram].push_back(id);
+}
+
+std::vector<song_name> name_index::suggest(std::string const & author, std::string const & song, size_t limit) const
+{
+	std::vector<song_name> suggestions;
+	if (!limit || m_songs.empty())
+		return suggestions;
+
+	std::string queryAuthor = normalize(author.substr(0, MAX_QUERY_NAME));
+	std::string querySong = normalize(song.substr(0, MAX_QUERY_NAME));
+	// about a typo per four characters of both names
+	size_t maxDistance = std::max<size_t>(1, (queryAuthor.size() + querySong.size()) / 4);
+
+	auto scratch = take_scratch();
+	overlap_counter & authorOverlap = scratch->authors;
+	overlap_counter & songOverlap = scratch->songs;
+	authorOverlap.count(m_authorTrigrams, trigrams(queryAuthor), m_authors.size());
+	songOverlap.count(m_songTrigrams, trigrams(querySong), m_songs.size());
+
+	// songs sharing nothing with the song name, or much less than the best
+	// ones, are not close enough
+	uint32_t best = 0;
+	for (uint32_t id: songOverlap.touched())
+		best = std::max(best, songOverlap[id]);
+	std::vector<std::pair<uint32_t, uint32_t>> ranked;
+	for (uint32_t id: songOverlap.touched()) {
+		uint32_t overlap = songOverlap[id];
+		if (2 * overlap >= best)
+			ranked.emplace_back(overlap + authorOverlap[m_songAuthors[id]], id);
+	}
+	authorOverlap.reset();
+	songOverlap.reset();
+	give_back(std::move(scratch));
+
+	size_t candidates = std::min(CANDIDATES, ranked.size());
+	std::partial_sort(ranked.begin(), ranked.begin() + candidates, ranked.end(),
+		[] (std::pair<uint32_t, uint32_t> const & a, std::pair<uint32_t, uint32_t> const & b) {
+			return a.first != b.first ? a.first > b.first : a.second < b.second;
+		});
+
+	std::vector<std::pair<size_t, uint32_t>> close;
+	for (size_t i = 0; i < candidates; ++i) {
+		song_entry const & entry = m_songs[ranked[i].second];
+		author_entry const & entryAuthor = m_authors[m_songAuthors[ranked[i].second]];
+		size_t distance = edit_distance(queryAuthor, entryAuthor.normalized, maxDistance);
+		if (distance <= maxDistance)
+			distance += edit_distance(querySong, entry.normalized, maxDistance - distance);
+		if (distance <= maxDistance)
+			close.emplace_back(distance, ranked[i].second);
+	}
+	// ties keep the overlap order
+	std::stable_sort(close.begin(), close.end(),
+		[] (std::pair<size_t, uint32_t> const & a, std::pair<size_t, uint32_t> const & b) {
+			return a.first < b.first;
+		});
+
+	for (size_t i = 0; i < close.size() && i < limit; ++i) {
+		uint32_t id = close[i].second;
+		suggestions.push_back({ m_authors[m_songAuthors[id]].name, m_songs[id].name });
+	}
+	return suggestions;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <protocol/protocol.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Trigram index of author and song names for lookups that missed.
+ * Names are compared normalized: lowercase, punctuation dropped, runs
+ * of spaces squeezed. Songs sharing most trigrams with the query are
+ * ranked by edit distance of both names, so case, punctuation and a
+ * few typos still find the song. suggest() may run in several threads
+ * at once, add() needs exclusive access.
+ */
+class name_index {
+public:
+	name_index();
+	~name_index();
+
+	void add(std::string const & author, std::string const & song);
+
+	/*
+	 * At most limit songs closest to the query, closest first. Songs
+	 * too far from it are not suggested at all.
+	 */
+	std::vector<song_name> suggest(std::string const & author, std::string const & song, size_t limit) const;
+
+	size_t size() const { return m_songs.size(); }
+
+private:
+	struct author_entry {
+		std::string name;
+		std::string normalized;
+	};
+
+	struct song_entry {
+		std::string name;
+		std::string normalized;
+	};
+
+	std::vector<author_entry> m_authors;
+	std::unordered_map<std::string, uint32_t> m_authorIds;
+	std::vector<song_entry> m_songs;
+	// author of every song, apart from entries to keep candidate ranking in cache
+	std::vector<uint32_t> m_songAuthors;
+	// trigram -> ids of names containing it, ascending
+	std::unordered_map<uint32_t, std::vector<uint32_t>> m_authorTrigrams;
+	std::unordered_map<uint32_t, std::vector<uint32_t>> m_songTrigrams;
+
+	// counters are as long as the index, so idle ones are kept for the next
+	// queries instead of per thread, and only a few of them
+	struct overlap_scratch;
+	std::unique_ptr<overlap_scratch> take_scratch() const;
+	void give_back(std::unique_ptr<overlap_scratch> scratch) const;
+
+	mutable std::mutex m_scratchGuard;
+	mutable std::vector<std::unique_ptr<overlap_scratch>> m_idleScratch;
+};
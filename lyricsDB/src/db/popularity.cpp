@@ -0,0 +1,409 @@
+#include "popularity.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+
+namespace {
+
+uint64_t mix(uint64_t x)
+{
+	// splitmix64 finalizer, std::hash of strings isn't guaranteed to be 64-bit
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+size_t round_up_to_power_of_two(size_t n)
+{
+	size_t result = 1;
+	while (result < n)
+		result *= 2;
+	return result;
+}
+
+class count_min_sketch {
+public:
+	count_min_sketch(size_t width, size_t depth)
+		: m_mask(width - 1)
+		, m_depth(depth)
+		, m_counters(width * depth)
+	{}
+
+	/*
+	 * Returns new estimate of the key.
+	 */
+	uint64_t add(uint64_t hash)
+	{
+		uint64_t estimate = UINT64_MAX;
+		for (size_t row = 0; row < m_depth; ++row) {
+			uint32_t & counter = m_counters[index(hash, row)];
+			++counter;
+			estimate = std::min<uint64_t>(estimate, counter);
+		}
+		return estimate;
+	}
+
+	uint64_t estimate(uint64_t hash) const
+	{
+		uint64_t estimate = UINT64_MAX;
+		for (size_t row = 0; row < m_depth; ++row)
+			estimate = std::min<uint64_t>(estimate, m_counters[index(hash, row)]);
+		return estimate;
+	}
+
+	void merge(count_min_sketch const & other)
+	{
+		for (size_t i = 0; i < m_counters.size(); ++i)
+			m_counters[i] += other.m_counters[i];
+	}
+
+	void clear()
+	{
+		std::fill(m_counters.begin(), m_counters.end(), 0);
+	}
+
+private:
+	size_t index(uint64_t hash, size_t row) const
+	{
+		// double hashing, rows use different bits of one 64-bit hash
+		uint32_t h1 = hash;
+		uint32_t h2 = (hash >> 32) | 1;
+		return row * (m_mask + 1) + ((h1 + row * h2) & m_mask);
+	}
+
+	size_t const m_mask;
+	size_t const m_depth;
+	std::vector<uint32_t> m_counters;
+};
+
+/*
+ * Keys with the largest estimates seen so far. Entry is song_popularity
+ * or author_popularity, its requests field holds the estimate.
+ */
+template<typename Entry>
+class candidate_table {
+public:
+	template<typename MakeEntry>
+	void offer(uint64_t key, uint64_t estimate, size_t capacity, MakeEntry && make)
+	{
+		auto it = m_entries.find(key);
+		if (it != m_entries.end()) {
+			it->second.requests = estimate;
+			if (key == m_minKey)
+				update_min();
+			return;
+		}
+
+		if (m_entries.size() >= capacity) {
+			if (estimate <= m_entries[m_minKey].requests)
+				return;
+			m_entries.erase(m_minKey);
+		}
+		Entry entry = make();
+		entry.requests = estimate;
+		m_entries.emplace(key, std::move(entry));
+		update_min();
+	}
+
+	/*
+	 * Adds keys of other table, their estimates are recomputed
+	 * by the caller.
+	 */
+	void merge(candidate_table const & other)
+	{
+		m_entries.insert(other.m_entries.begin(), other.m_entries.end());
+	}
+
+	/*
+	 * Sets entries to estimates of sketch and keeps count largest ones.
+	 */
+	void reestimate(count_min_sketch const & sketch, size_t count)
+	{
+		for (auto & it: m_entries)
+			it.second.requests = sketch.estimate(it.first);
+		if (m_entries.size() <= count)
+			return;
+
+		std::vector<std::pair<uint64_t, uint64_t>> ranked;
+		ranked.reserve(m_entries.size());
+		for (auto const & it: m_entries)
+			ranked.emplace_back(it.second.requests, it.first);
+		std::nth_element(ranked.begin(), ranked.begin() + count, ranked.end(),
+			std::greater<std::pair<uint64_t, uint64_t>>());
+		for (auto it = ranked.begin() + count; it != ranked.end(); ++it)
+			m_entries.erase(it->second);
+		update_min();
+	}
+
+	std::vector<Entry> top(size_t count) const
+	{
+		std::vector<Entry> entries;
+		entries.reserve(m_entries.size());
+		for (auto const & it: m_entries)
+			entries.push_back(it.second);
+		count = std::min(count, entries.size());
+		std::partial_sort(entries.begin(), entries.begin() + count, entries.end(),
+			[] (Entry const & a, Entry const & b) { return a.requests > b.requests; });
+		entries.resize(count);
+		return entries;
+	}
+
+	size_t size() const { return m_entries.size(); }
+
+	void clear()
+	{
+		m_entries.clear();
+	}
+
+private:
+	void update_min()
+	{
+		uint64_t minEstimate = UINT64_MAX;
+		for (auto const & it: m_entries) {
+			if (it.second.requests < minEstimate) {
+				minEstimate = it.second.requests;
+				m_minKey = it.first;
+			}
+		}
+	}
+
+	std::unordered_map<uint64_t, Entry> m_entries;
+	uint64_t m_minKey = 0;
+};
+
+std::atomic<uint64_t> nextTrackerId { 1 };
+
+} // namespace
+
+struct popularity_tracker::window_counts {
+	explicit window_counts(popularity_options const & options)
+		: songSketch(round_up_to_power_of_two(options.sketchWidth), options.sketchDepth)
+		, authorSketch(round_up_to_power_of_two(options.sketchWidth), options.sketchDepth)
+	{}
+
+	void merge(window_counts const & other)
+	{
+		songSketch.merge(other.songSketch);
+		authorSketch.merge(other.authorSketch);
+		songs.merge(other.songs);
+		authors.merge(other.authors);
+		empty = empty && other.empty;
+	}
+
+	void clear()
+	{
+		songSketch.clear();
+		authorSketch.clear();
+		songs.clear();
+		authors.clear();
+		empty = true;
+	}
+
+	uint64_t window = 0;
+	bool empty = true;
+	count_min_sketch songSketch;
+	count_min_sketch authorSketch;
+	candidate_table<song_popularity> songs;
+	candidate_table<author_popularity> authors;
+};
+
+/*
+ * Counts of one thread for the window it recorded last. Besides the
+ * owner only queries take the lock, they also flush shards of threads
+ * that stopped recording.
+ */
+struct popularity_tracker::shard {
+	explicit shard(popularity_options const & options)
+		: counts(options)
+	{}
+
+	std::mutex guard;
+	window_counts counts;
+};
+
+struct popularity_tracker::shard_pool {
+	std::mutex guard;
+	bool alive = true;
+	std::vector<shard *> free;
+};
+
+namespace {
+
+/*
+ * Shards owned by the thread, returned to their pools on thread exit.
+ */
+struct thread_shards {
+	struct ref {
+		uint64_t tracker;
+		std::shared_ptr<popularity_tracker::shard_pool> pool;
+		popularity_tracker::shard * shard;
+	};
+
+	~thread_shards()
+	{
+		for (auto & r: refs) {
+			std::lock_guard<std::mutex> g(r.pool->guard);
+			if (r.pool->alive)
+				r.pool->free.push_back(r.shard);
+		}
+	}
+
+	std::vector<ref> refs;
+};
+
+thread_local thread_shards t_shards;
+
+} // namespace
+
+popularity_tracker::popularity_tracker(popularity_options const & options)
+	: m_options(options)
+	, m_id(nextTrackerId.fetch_add(1, std::memory_order_relaxed))
+	, m_epoch(std::chrono::steady_clock::now())
+	, m_pool(std::make_shared<shard_pool>())
+{
+	if (m_options.window.count() <= 0)
+		m_options.window = std::chrono::milliseconds(1);
+	m_options.sketchWidth = std::max<size_t>(1, m_options.sketchWidth);
+	m_options.sketchDepth = std::max<size_t>(1, m_options.sketchDepth);
+	m_options.candidates = std::max<size_t>(1, m_options.candidates);
+}
+
+popularity_tracker::~popularity_tracker()
+{
+	std::lock_guard<std::mutex> g(m_pool->guard);
+	m_pool->alive = false;
+	m_pool->free.clear();
+}
+
+void popularity_tracker::record(std::string const & author, std::string const & song)
+{
+	uint64_t authorHash = mix(std::hash<std::string>()(author));
+	uint64_t songHash = mix(authorHash ^ std::hash<std::string>()(song));
+	uint64_t window = current_window();
+
+	shard & s = current_shard();
+	std::lock_guard<std::mutex> g(s.guard);
+	if (s.counts.window != window)
+		flush(s, window);
+
+	window_counts & counts = s.counts;
+	counts.empty = false;
+	counts.songs.offer(songHash, counts.songSketch.add(songHash), m_options.candidates, [&] () {
+		return song_popularity { author, song, 0 };
+	});
+	counts.authors.offer(authorHash, counts.authorSketch.add(authorHash), m_options.candidates, [&] () {
+		return author_popularity { author, 0 };
+	});
+}
+
+void popularity_tracker::top(size_t count, size_t windows,
+	std::vector<song_popularity> & songs,
+	std::vector<author_popularity> & authors)
+{
+	uint64_t window = current_window();
+	count = std::min(count, m_options.candidates);
+	windows = std::min(windows, max_windows());
+	window_counts combined(m_options);
+
+	std::vector<shard *> shards;
+	{
+		std::lock_guard<std::mutex> g(m_pool->guard);
+		for (auto const & s: m_shards)
+			shards.push_back(s.get());
+	}
+	for (shard * s: shards) {
+		std::lock_guard<std::mutex> g(s->guard);
+		if (s->counts.window != window)
+			flush(*s, window);
+		else if (windows > 0)
+			combined.merge(s->counts);
+	}
+
+	{
+		std::lock_guard<std::mutex> g(m_windowsGuard);
+		for (auto const & w: m_windows) {
+			if (w->window + windows > window)
+				combined.merge(*w);
+		}
+	}
+
+	combined.songs.reestimate(combined.songSketch, count);
+	combined.authors.reestimate(combined.authorSketch, count);
+	songs = combined.songs.top(count);
+	authors = combined.authors.top(count);
+}
+
+uint64_t popularity_tracker::current_window() const
+{
+	return (std::chrono::steady_clock::now() - m_epoch) / m_options.window;
+}
+
+popularity_tracker::shard & popularity_tracker::current_shard()
+{
+	for (auto const & r: t_shards.refs) {
+		if (r.tracker == m_id)
+			return *r.shard;
+	}
+
+	shard * s;
+	{
+		std::lock_guard<std::mutex> g(m_pool->guard);
+		if (!m_pool->free.empty()) {
+			s = m_pool->free.back();
+			m_pool->free.pop_back();
+		} else {
+			m_shards.emplace_back(new shard(m_options));
+			s = m_shards.back().get();
+		}
+	}
+
+	// drop shards of destroyed trackers
+	auto & refs = t_shards.refs;
+	refs.erase(std::remove_if(refs.begin(), refs.end(), [] (thread_shards::ref const & r) {
+		std::lock_guard<std::mutex> g(r.pool->guard);
+		return !r.pool->alive;
+	}), refs.end());
+	refs.push_back({ m_id, m_pool, s });
+	return *s;
+}
+
+/*
+ * Moves counts of the shard to completed windows and starts the given
+ * window in it. Caller holds shard lock.
+ */
+void popularity_tracker::flush(shard & s, uint64_t window)
+{
+	if (!s.counts.empty)
+		merge_into_windows(s.counts);
+	s.counts.clear();
+	s.counts.window = window;
+}
+
+void popularity_tracker::merge_into_windows(window_counts const & counts)
+{
+	std::lock_guard<std::mutex> g(m_windowsGuard);
+
+	auto it = m_windows.begin();
+	while (it != m_windows.end() && (*it)->window < counts.window)
+		++it;
+	if (it == m_windows.end() || (*it)->window != counts.window) {
+		it = m_windows.emplace(it, new window_counts(m_options));
+		(*it)->window = counts.window;
+	}
+	window_counts & merged = **it;
+	merged.merge(counts);
+	// union of shard candidates, keep it bounded
+	if (merged.songs.size() > 4 * m_options.candidates)
+		merged.songs.reestimate(merged.songSketch, 2 * m_options.candidates);
+	if (merged.authors.size() > 4 * m_options.candidates)
+		merged.authors.reestimate(merged.authorSketch, 2 * m_options.candidates);
+
+	uint64_t newest = m_windows.back()->window;
+	while (m_windows.front()->window + max_windows() <= newest)
+		m_windows.pop_front();
+}
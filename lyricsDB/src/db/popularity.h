@@ -0,0 +1,77 @@
+#pragma once
+
+#include <protocol/protocol.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct popularity_options {
+	std::chrono::milliseconds window { 10000 };
+	// completed windows kept besides the current one
+	size_t windows = 6;
+	// count-min sketch size, width is rounded up to a power of two
+	size_t sketchWidth = 1024;
+	size_t sketchDepth = 4;
+	// heavy hitter candidates kept per thread and window
+	size_t candidates = 64;
+};
+
+/*
+ * Request counts of songs and authors per time window without storing
+ * every key: counts go to count-min sketches, and keys with the largest
+ * estimates are kept as heavy hitter candidates. Every thread records
+ * into its own shard whose lock is contended only while a query merges
+ * shards, so recording costs a few cache-local counter increments.
+ * Estimates may exceed real counts by about e / sketchWidth of all
+ * requests in the window, they are never lower. Thread-safe.
+ */
+class popularity_tracker {
+public:
+	explicit popularity_tracker(popularity_options const & options = popularity_options());
+	~popularity_tracker();
+
+	popularity_tracker(popularity_tracker const &) = delete;
+	popularity_tracker & operator=(popularity_tracker const &) = delete;
+
+	void record(std::string const & author, std::string const & song);
+
+	/*
+	 * Top count songs and authors over the last windows windows,
+	 * the current one included. Count is capped by candidates, keys
+	 * below that are rarely tracked accurately.
+	 */
+	void top(size_t count, size_t windows,
+		std::vector<song_popularity> & songs,
+		std::vector<author_popularity> & authors);
+
+	size_t max_windows() const { return m_options.windows + 1; }
+
+	struct window_counts;
+	struct shard;
+	struct shard_pool;
+
+private:
+	uint64_t current_window() const;
+	shard & current_shard();
+	void flush(shard & s, uint64_t window);
+	void merge_into_windows(window_counts const & counts);
+
+	popularity_options m_options;
+	uint64_t const m_id;
+	std::chrono::steady_clock::time_point const m_epoch;
+
+	// all shards ever created, guarded by pool lock
+	std::vector<std::unique_ptr<shard>> m_shards;
+	// shared with threads owning shards, outlives the tracker
+	std::shared_ptr<shard_pool> m_pool;
+
+	std::mutex m_windowsGuard;
+	// completed windows merged from all shards, oldest first
+	std::deque<std::unique_ptr<window_counts>> m_windows;
+};
@@ -0,0 +1,99 @@
+#include "corpus.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::vector<song_file> list_directory(fs::path const & root)
+{
+	std::vector<song_file> songs;
+	for (auto const & authorDir: fs::directory_iterator(root)) {
+		if (!authorDir.is_directory())
+			continue;
+		std::string author = authorDir.path().filename().string();
+		for (auto const & file: fs::recursive_directory_iterator(authorDir.path())) {
+			if (!file.is_regular_file())
+				continue;
+			fs::path song = file.path().lexically_relative(authorDir.path()).replace_extension();
+			songs.push_back({ author, song.string(), file.path().string() });
+		}
+	}
+	return songs;
+}
+
+std::vector<song_file> read_manifest(fs::path const & manifest)
+{
+	std::ifstream stream(manifest);
+	if (!stream)
+		throw std::runtime_error("failed to open manifest " + manifest.string());
+
+	fs::path base = manifest.parent_path();
+	std::vector<song_file> songs;
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(stream, line); ++lineNumber) {
+		if (line.empty() || line[0] == '#')
+			continue;
+		auto first = line.find('\t');
+		auto second = first == std::string::npos ? first : line.find('\t', first + 1);
+		if (second == std::string::npos)
+			throw std::runtime_error("malformed manifest line " + std::to_string(lineNumber));
+
+		fs::path path = line.substr(second + 1);
+		if (path.is_relative())
+			path = base / path;
+		songs.push_back({ line.substr(0, first), line.substr(first + 1, second - first - 1), path.string() });
+	}
+	return songs;
+}
+
+} // namespace
+
+std::vector<song_file> list_songs(std::string const & source)
+{
+	std::error_code error;
+	if (fs::is_directory(source, error))
+		return list_directory(source);
+	if (fs::is_regular_file(source, error))
+		return read_manifest(source);
+	throw std::runtime_error("no such directory or manifest: " + source);
+}
+
+std::string read_text(std::string const & path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+
+	// read straight into the string, one extra read() detects EOF
+	struct stat st;
+	size_t capacity = fstat(fd, &st) == 0 && st.st_size > 0 ? st.st_size + 1 : 64 * 1024;
+	std::string text(capacity, '\0');
+	size_t used = 0;
+	while (true) {
+		if (used == text.size())
+			text.resize(text.size() * 2);
+		ssize_t n = read(fd, &text[used], text.size() - used);
+		if (n > 0) {
+			used += n;
+		} else if (n == 0) {
+			break;
+		} else if (errno != EINTR) {
+			int error = errno;
+			close(fd);
+			throw std::runtime_error("failed to read " + path + ": " + strerror(error));
+		}
+	}
+	text.resize(used);
+	close(fd);
+	return text;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct song_file {
+	std::string author;
+	std::string song;
+	std::string path;
+};
+
+/*
+ * SOURCE is either a directory laid out as <author>/<song>[.ext]
+ * (song name is the path below author directory without extension)
+ * or a manifest: one `author<TAB>song<TAB>path` per line, relative
+ * paths are resolved against manifest directory, lines starting with
+ * '#' are skipped. Throws std::runtime_error if SOURCE can't be read.
+ */
+std::vector<song_file> list_songs(std::string const & source);
+
+/*
+ * Reads whole file, throws std::runtime_error.
+ */
+std::string read_text(std::string const & path);
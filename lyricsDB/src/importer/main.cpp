@@ -0,0 +1,394 @@
+#include <async/async_client.h>
+
+#include "corpus.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+void usage(std::string const & name)
+{
+	std::cerr << "Usage: " << name << " [OPTIONS] SOURCE [SERVER_ADDR] [SERVER_PORT]" << std::endl << std::endl;
+	std::cerr << "Uploads all songs from SOURCE to lyrics server." << std::endl << std::endl;
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  SOURCE                             directory of <author>/<song> files or manifest" << std::endl;
+	std::cerr << "                                     with `author<TAB>song<TAB>path` lines" << std::endl;
+	std::cerr << "  SERVER_ADDR [default = 127.0.0.1]  ip4-address of server with db" << std::endl;
+	std::cerr << "  SERVER_PORT [default = 40001]      port of server with db" << std::endl;
+	std::cerr << "  --readers=N [default = 4]          threads reading files" << std::endl;
+	std::cerr << "  --connections=N [default = 4]      connections to server" << std::endl;
+	std::cerr << "  --window=N [default = 64]          max uploads in flight over all connections" << std::endl;
+	std::cerr << "  --stats-interval=S [default = 1]   print progress every S seconds, 0 disables it" << std::endl;
+}
+
+struct import_options {
+	std::string source;
+	std::string hostname = "127.0.0.1";
+	uint16_t port = 40001;
+	size_t readers = 4;
+	size_t connections = 4;
+	size_t window = 64;
+	std::chrono::seconds statsInterval{1};
+};
+
+/*
+ * Returns false if arguments are malformed.
+ */
+bool parse_options(int argc, char * argv[], import_options & options)
+{
+	std::vector<std::string> positional;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--")) {
+			positional.push_back(arg);
+			continue;
+		}
+
+		auto eq = arg.find('=');
+		if (eq == std::string::npos) {
+			std::cerr << "option " << arg << " requires value" << std::endl;
+			return false;
+		}
+		std::string key = arg.substr(2, eq - 2);
+		std::string value = arg.substr(eq + 1);
+		try {
+			if (key == "readers")
+				options.readers = std::max<size_t>(1, std::stoul(value));
+			else if (key == "connections")
+				options.connections = std::max<size_t>(1, std::stoul(value));
+			else if (key == "window")
+				options.window = std::max<size_t>(1, std::stoul(value));
+			else if (key == "stats-interval")
+				options.statsInterval = std::chrono::seconds(std::stoul(value));
+			else {
+				std::cerr << "unknown option: " << arg << std::endl;
+				return false;
+			}
+		} catch (std::exception const & e) {
+			std::cerr << "invalid value of " << key << ": " << e.what() << std::endl;
+			return false;
+		}
+	}
+
+	if (positional.empty() || positional.size() > 3)
+		return false;
+
+	options.source = positional[0];
+
+	if (positional.size() >= 2) {
+		options.hostname = positional[1];
+	}
+
+	if (positional.size() >= 3) {
+		uint64_t p = std::stoul(positional[2]);
+		uint16_t maxPort = std::numeric_limits<uint16_t>::max();
+		if (p > maxPort) {
+			std::cerr << "invalid port: should be in interval [0, " << maxPort << "]" << std::endl;
+			return false;
+		}
+		options.port = p;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct loaded_song {
+	std::string author;
+	std::string song;
+	std::string text;
+};
+
+/*
+ * Bounded queue between reader threads and the upload loop. Readers block
+ * while it is full, the loop never blocks: it polls with try_pop() and
+ * sleeps on the eventfd which is signalled on every push and on close.
+ */
+class song_queue {
+public:
+	enum class pop_result { SONG, EMPTY, CLOSED };
+
+	song_queue(size_t capacity, size_t producers)
+		: m_capacity(capacity)
+		, m_producers(producers)
+		, m_event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+	{
+		if (m_event < 0)
+			throw std::runtime_error(std::string("failed to create eventfd: ") + strerror(errno));
+	}
+
+	~song_queue()
+	{
+		close(m_event);
+	}
+
+	int event_descriptor() const { return m_event; }
+
+	void push(loaded_song song)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notFull.wait(lock, [this] () { return m_songs.size() < m_capacity; });
+			m_songs.push_back(std::move(song));
+		}
+		signal();
+	}
+
+	/*
+	 * Called by every producer once, the queue closes after the last one.
+	 */
+	void producer_done()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_producers;
+		}
+		signal();
+	}
+
+	pop_result try_pop(loaded_song & song)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_songs.empty())
+			return m_producers ? pop_result::EMPTY : pop_result::CLOSED;
+		song = std::move(m_songs.front());
+		m_songs.pop_front();
+		m_notFull.notify_one();
+		return pop_result::SONG;
+	}
+
+	void reset_event()
+	{
+		uint64_t value;
+		while (read(m_event, &value, sizeof(value)) < 0 && errno == EINTR)
+			;
+	}
+
+private:
+	void signal()
+	{
+		uint64_t one = 1;
+		while (write(m_event, &one, sizeof(one)) < 0 && errno == EINTR)
+			;
+	}
+
+	size_t const m_capacity;
+	size_t m_producers;
+	int const m_event;
+
+	std::mutex m_mutex;
+	std::condition_variable m_notFull;
+	std::deque<loaded_song> m_songs;
+};
+
+void read_songs(std::vector<song_file> const & files, std::atomic<size_t> & next,
+	std::atomic<uint64_t> & readFailures, song_queue & queue)
+{
+	for (size_t i = next++; i < files.size(); i = next++) {
+		try {
+			queue.push({ files[i].author, files[i].song, read_text(files[i].path) });
+		} catch (std::runtime_error const & e) {
+			std::cerr << e.what() << std::endl;
+			++readFailures;
+		}
+	}
+	queue.producer_done();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+using import_clock = std::chrono::steady_clock;
+
+struct import_stats {
+	import_clock::time_point start = import_clock::now();
+	import_clock::time_point lastReport = start;
+	std::chrono::seconds reportInterval;
+	size_t total;
+
+	uint64_t songs = 0;
+	uint64_t bytes = 0;
+	uint64_t failures = 0;
+
+	void print(std::ostream & out, char const * prefix, uint64_t readFailures) const
+	{
+		double seconds = std::chrono::duration<double>(import_clock::now() - start).count();
+		if (seconds <= 0)
+			seconds = 1e-9;
+		out << std::fixed << std::setprecision(1) << prefix
+			<< songs << "/" << total << " songs, " << bytes / 1e6 << " MB in " << seconds << "s: "
+			<< songs / seconds << " songs/s, " << bytes / 1e6 / seconds << " MB/s, "
+			<< failures + readFailures << " failed" << std::endl;
+	}
+};
+
+/*
+ * Limits number of uploads in flight, the only waiter is the dispatcher.
+ */
+class upload_window {
+public:
+	explicit upload_window(event_loop & loop, size_t size)
+		: m_loop(loop)
+		, m_size(size)
+		, m_free(size)
+	{}
+
+	struct awaiter {
+		upload_window & window;
+		size_t needed;
+
+		bool await_ready() const noexcept { return window.m_free >= needed; }
+		void await_suspend(std::coroutine_handle<> h) noexcept { window.m_waiter = h; window.m_needed = needed; }
+		void await_resume() const noexcept {}
+	};
+
+	/*
+	 * Waits for one free slot, caller takes it with acquire().
+	 */
+	awaiter slot() { return { *this, 1 }; }
+
+	/*
+	 * Waits until every upload finished.
+	 */
+	awaiter all() { return { *this, m_size }; }
+
+	void acquire() { --m_free; }
+
+	void release()
+	{
+		++m_free;
+		if (m_waiter && m_free >= m_needed)
+			m_loop.post(std::exchange(m_waiter, nullptr));
+	}
+
+private:
+	event_loop & m_loop;
+	size_t const m_size;
+	size_t m_free;
+	size_t m_needed = 0;
+	std::coroutine_handle<> m_waiter;
+};
+
+task<void> upload(async_client & client, loaded_song song, upload_window & window, import_stats & stats)
+{
+	size_t size = song.text.size();
+	try {
+		std::string result = co_await client.add_song(std::move(song.author), std::move(song.song), std::move(song.text));
+		if (result == "OK") {
+			++stats.songs;
+			stats.bytes += size;
+		} else {
+			++stats.failures;
+		}
+	} catch (std::exception const & e) {
+		if (!stats.failures)
+			std::cerr << "upload failed: " << e.what() << std::endl;
+		++stats.failures;
+	}
+	window.release();
+}
+
+task<void> dispatch(event_loop & loop, async_client & client, song_queue & queue,
+	upload_window & window, import_stats & stats, std::atomic<uint64_t> const & readFailures)
+{
+	co_await client.connect();
+
+	loaded_song song;
+	while (true) {
+		auto result = queue.try_pop(song);
+		if (result == song_queue::pop_result::CLOSED)
+			break;
+		if (result == song_queue::pop_result::EMPTY) {
+			// reset edge before checking again so no push is missed
+			queue.reset_event();
+			result = queue.try_pop(song);
+			if (result == song_queue::pop_result::EMPTY)
+				co_await loop.readable(queue.event_descriptor());
+			if (result != song_queue::pop_result::SONG)
+				continue;
+		}
+
+		co_await window.slot();
+		window.acquire();
+		loop.spawn(upload(client, std::move(song), window, stats));
+
+		if (stats.reportInterval.count() > 0 && import_clock::now() - stats.lastReport >= stats.reportInterval) {
+			stats.print(std::cerr, "progress: ", readFailures);
+			stats.lastReport = import_clock::now();
+		}
+	}
+
+	co_await window.all();
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+		usage(argv[0]);
+		return 0;
+	}
+
+	import_options options;
+	if (!parse_options(argc, argv, options)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<song_file> files;
+	try {
+		files = list_songs(options.source);
+	} catch (std::exception const & e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	event_loop loop;
+	async_client client(loop, options.hostname, options.port, options.connections);
+	// enough read-ahead to keep the window full while readers catch up
+	song_queue queue(2 * options.window, options.readers);
+	loop.add_descriptor(queue.event_descriptor());
+
+	std::atomic<size_t> next{0};
+	std::atomic<uint64_t> readFailures{0};
+	std::vector<std::thread> readers;
+	for (size_t i = 0; i < options.readers; ++i)
+		readers.emplace_back(read_songs, std::cref(files), std::ref(next), std::ref(readFailures), std::ref(queue));
+
+	import_stats stats;
+	stats.reportInterval = options.statsInterval;
+	stats.total = files.size();
+	upload_window window(loop, options.window);
+
+	int code = 0;
+	try {
+		loop.run_until_complete(dispatch(loop, client, queue, window, stats, readFailures));
+	} catch (std::exception const & e) {
+		std::cerr << "import failed: " << e.what() << std::endl;
+		// unblock readers waiting on full queue
+		next = files.size();
+		loaded_song song;
+		while (queue.try_pop(song) != song_queue::pop_result::CLOSED)
+			std::this_thread::yield();
+		code = 1;
+	}
+
+	for (auto & t: readers)
+		t.join();
+	loop.remove_descriptor(queue.event_descriptor());
+
+	stats.print(std::cout, "", readFailures);
+	return code || stats.failures || readFailures ? 1 : 0;
+}
@@ -0,0 +1,284 @@
+#include "impaired_link.h"
+#include "socket_common.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// derived retransmit timeout is never shorter, a zero-delay link would spin otherwise
+std::chrono::microseconds constexpr MIN_RETRANSMIT_TIMEOUT { 1000 };
+
+struct segment {
+	socket_clock::time_point arrival;
+	std::string data;
+};
+
+/*
+ * One direction of the link. Segments are queued in the order they were
+ * sent, each with its own arrival time, and received in that order, so
+ * a segment can't be received before all the ones in front of it.
+ */
+struct channel {
+	explicit channel(uint64_t seed)
+		: random(seed)
+	{}
+
+	/*
+	 * Arrival time of a new segment of size bytes sent now.
+	 */
+	socket_clock::time_point transmit(link_options const & options, size_t size)
+	{
+		std::chrono::nanoseconds serialization { 0 };
+		if (options.bandwidth)
+			serialization = std::chrono::nanoseconds(size * 1000000000ull / options.bandwidth);
+
+		// link carries one segment at a time, retransmissions take their turn too
+		linkFreeAt = std::max(socket_clock::now(), linkFreeAt) + serialization;
+		socket_clock::time_point arrival = linkFreeAt;
+		std::bernoulli_distribution lost(options.loss);
+		while (lost(random)) {
+			++stats.lost;
+			linkFreeAt += serialization;
+			arrival += options.retransmitTimeout + serialization;
+		}
+
+		std::bernoulli_distribution reordered(options.reorder);
+		std::uniform_int_distribution<int64_t> jitter(0, options.jitter.count());
+		if (reordered(random))
+			++stats.reordered;
+		else
+			arrival += options.delay + std::chrono::microseconds(jitter(random));
+
+		++stats.segments;
+		stats.bytes += size;
+		return arrival;
+	}
+
+	bool readable(socket_clock::time_point now) const
+	{
+		return !segments.empty() && segments.front().arrival <= now;
+	}
+
+	/*
+	 * Waits for a change until wakeup or deadline, whichever comes first,
+	 * max means no limit. Returns false once deadline has passed.
+	 */
+	bool wait(std::unique_lock<std::mutex> & lock, socket_clock::time_point wakeup, socket_clock::time_point deadline)
+	{
+		socket_clock::time_point until = std::min(wakeup, deadline);
+		if (until == socket_clock::time_point::max())
+			changed.wait(lock);
+		else
+			changed.wait_until(lock, until);
+		return socket_clock::now() < deadline;
+	}
+
+	std::mutex guard;
+	std::condition_variable changed;
+	std::mt19937_64 random;
+	std::deque<segment> segments;
+	// bytes of the front segment already received
+	size_t received = 0;
+	// sent and not received yet
+	size_t queued = 0;
+	socket_clock::time_point linkFreeAt;
+	bool senderClosed = false;
+	bool receiverClosed = false;
+	link_stats stats;
+};
+
+struct link_state {
+	explicit link_state(link_options const & linkOptions)
+		: options(linkOptions)
+		, forward(linkOptions.seed)
+		, backward(linkOptions.seed ^ 0x9e3779b97f4a7c15ull)
+	{}
+
+	link_options options;
+	channel forward;
+	channel backward;
+};
+
+class impaired_socket: public stream_socket {
+public:
+	impaired_socket(std::shared_ptr<link_state> link, channel & in, channel & out)
+		: m_link(std::move(link))
+		, m_in(in)
+		, m_out(out)
+	{}
+
+	~impaired_socket()
+	{
+		{
+			std::lock_guard<std::mutex> g(m_out.guard);
+			m_out.senderClosed = true;
+		}
+		m_out.changed.notify_all();
+		{
+			std::lock_guard<std::mutex> g(m_in.guard);
+			m_in.receiverClosed = true;
+		}
+		m_in.changed.notify_all();
+	}
+
+	void send(void const * buf, size_t size) override
+	{
+		link_options const & options = m_link->options;
+		char const * data = static_cast<char const *>(buf);
+		socket_clock::time_point deadline = m_deadlines.next(socket_direction::SEND, m_limits);
+
+		std::unique_lock<std::mutex> lock(m_out.guard);
+		while (size) {
+			if (m_out.receiverClosed)
+				throw socket_exception("impaired link closed by peer");
+			size_t chunk = std::min(size, options.segmentSize);
+			// a segment bigger than the whole queue still goes into an empty one
+			if (m_out.queued && m_out.queued + chunk > options.queueSize) {
+				if (!m_out.wait(lock, socket_clock::time_point::max(), deadline))
+					throw socket_timeout_exception("send timed out, " + std::to_string(size) + " bytes left");
+				continue;
+			}
+
+			socket_clock::time_point arrival = m_out.transmit(options, chunk);
+			m_out.segments.push_back({ arrival, std::string(data, chunk) });
+			m_out.queued += chunk;
+			data += chunk;
+			size -= chunk;
+			m_out.changed.notify_all();
+		}
+	}
+
+	void recv(void * buf, size_t size) override
+	{
+		char * data = static_cast<char *>(buf);
+		socket_clock::time_point deadline = m_deadlines.next(socket_direction::RECV, m_limits);
+
+		std::unique_lock<std::mutex> lock(m_in.guard);
+		while (size) {
+			if (!m_in.readable(socket_clock::now())) {
+				if (m_in.segments.empty() && m_in.senderClosed)
+					throw socket_exception("impaired link closed by peer, " + std::to_string(size) + " bytes left");
+				socket_clock::time_point wakeup = m_in.segments.empty()
+					? socket_clock::time_point::max() : m_in.segments.front().arrival;
+				if (!m_in.wait(lock, wakeup, deadline))
+					throw socket_timeout_exception("recv timed out, " + std::to_string(size) + " bytes left");
+				continue;
+			}
+
+			segment & front = m_in.segments.front();
+			size_t chunk = std::min(size, front.data.size() - m_in.received);
+			memcpy(data, front.data.data() + m_in.received, chunk);
+			data += chunk;
+			size -= chunk;
+			m_in.queued -= chunk;
+			m_in.received += chunk;
+			if (m_in.received == front.data.size()) {
+				m_in.segments.pop_front();
+				m_in.received = 0;
+			}
+			m_in.changed.notify_all();
+		}
+	}
+
+	void set_limits(socket_limits const & limits) override
+	{
+		m_limits = limits;
+	}
+
+	void begin_message(socket_direction direction) override
+	{
+		m_deadlines.begin(direction, m_limits);
+	}
+
+	void end_message(socket_direction direction) override
+	{
+		m_deadlines.end(direction);
+	}
+
+	bool wait_readable(std::chrono::milliseconds timeout) override
+	{
+		socket_clock::time_point deadline = deadline_after(timeout);
+		std::unique_lock<std::mutex> lock(m_in.guard);
+		while (!ready()) {
+			socket_clock::time_point wakeup = m_in.segments.empty()
+				? socket_clock::time_point::max() : m_in.segments.front().arrival;
+			if (!m_in.wait(lock, wakeup, deadline))
+				return ready();
+		}
+		return true;
+	}
+
+	bool poll_readable() override
+	{
+		std::lock_guard<std::mutex> g(m_in.guard);
+		return ready();
+	}
+
+	bool full_duplex() const override
+	{
+		return true;
+	}
+
+	link_stats stats() const
+	{
+		link_stats result;
+		for (channel * c: { &m_link->forward, &m_link->backward }) {
+			std::lock_guard<std::mutex> g(c->guard);
+			result.segments += c->stats.segments;
+			result.bytes += c->stats.bytes;
+			result.lost += c->stats.lost;
+			result.reordered += c->stats.reordered;
+		}
+		return result;
+	}
+
+private:
+	// under m_in.guard, also true on closed link so that recv throws
+	bool ready() const
+	{
+		return m_in.readable(socket_clock::now()) || (m_in.segments.empty() && m_in.senderClosed);
+	}
+
+	std::shared_ptr<link_state> m_link;
+	channel & m_in;
+	channel & m_out;
+	socket_limits m_limits;
+	call_deadlines m_deadlines;
+};
+
+} // namespace
+
+std::pair<socket_ptr, socket_ptr> make_impaired_socket_pair(link_options const & options)
+{
+	if (!(options.loss >= 0 && options.loss < 1))
+		throw std::invalid_argument("link loss must be in [0, 1)");
+	if (!(options.reorder >= 0 && options.reorder < 1))
+		throw std::invalid_argument("link reorder must be in [0, 1)");
+	if (!options.segmentSize)
+		throw std::invalid_argument("link segment size must not be zero");
+
+	link_options linkOptions = options;
+	if (!linkOptions.retransmitTimeout.count())
+		linkOptions.retransmitTimeout = std::max(MIN_RETRANSMIT_TIMEOUT, 2 * (options.delay + options.jitter));
+
+	auto link = std::make_shared<link_state>(linkOptions);
+	socket_ptr first(new impaired_socket(link, link->backward, link->forward));
+	socket_ptr second(new impaired_socket(link, link->forward, link->backward));
+	return { first, second };
+}
+
+link_stats get_link_stats(stream_socket const & socket)
+{
+	auto impaired = dynamic_cast<impaired_socket const *>(&socket);
+	if (!impaired)
+		throw std::invalid_argument("socket is not on an impaired link");
+	return impaired->stats();
+}
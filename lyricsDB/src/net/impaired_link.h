@@ -0,0 +1,82 @@
+#pragma once
+
+#include "stream_socket.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Impairments of a simulated link, the same in both directions.
+ */
+struct link_options {
+	/*
+	 * One-way delay of every segment.
+	 */
+	std::chrono::microseconds delay { 0 };
+	/*
+	 * Extra delay uniformly distributed in [0, jitter].
+	 */
+	std::chrono::microseconds jitter { 0 };
+	/*
+	 * Probability that a segment is lost, it is retransmitted after
+	 * retransmitTimeout (and may be lost again). Must be below 1.
+	 */
+	double loss = 0;
+	/*
+	 * Probability that a segment skips delay and jitter and overtakes
+	 * the ones sent before it. Must be below 1.
+	 */
+	double reorder = 0;
+	/*
+	 * Bytes per second, zero means unlimited.
+	 */
+	uint64_t bandwidth = 0;
+	size_t segmentSize = 1400;
+	/*
+	 * Bytes sent but not yet received, send blocks above it like on a
+	 * full socket buffer. Together with delay it bounds throughput.
+	 */
+	size_t queueSize = 256 * 1024;
+	/*
+	 * Zero derives it from delay and jitter.
+	 */
+	std::chrono::microseconds retransmitTimeout { 0 };
+	/*
+	 * Same seed and same sends give the same losses, delays and reorders.
+	 */
+	uint64_t seed = 1;
+};
+
+/*
+ * Counters of both directions.
+ */
+struct link_stats {
+	uint64_t segments = 0;
+	uint64_t bytes = 0;
+	// retransmissions
+	uint64_t lost = 0;
+	uint64_t reordered = 0;
+};
+
+/*
+ * Pair of connected in-process stream sockets over a simulated link,
+ * so transports and the message layer can be benchmarked under delay,
+ * loss and limited bandwidth without netem and root (see
+ * scripts/netnsct.sh). Sent data is cut into segments, each gets its
+ * arrival time from the options and a random generator seeded by them.
+ * Like TCP the stream stays ordered and complete: lost segments arrive
+ * late, and a late segment holds back the ones behind it. Sockets
+ * support limits, wait_readable and full duplex. Once one of them is
+ * destroyed, the other one receives what was in flight and then throws.
+ * Throws std::invalid_argument on loss or reorder out of [0, 1) or zero
+ * segmentSize.
+ */
+std::pair<socket_ptr, socket_ptr> make_impaired_socket_pair(link_options const & options);
+
+/*
+ * Stats of the link of either socket made by make_impaired_socket_pair,
+ * throws std::invalid_argument for other sockets.
+ */
+link_stats get_link_stats(stream_socket const & socket);
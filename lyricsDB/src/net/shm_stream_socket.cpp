@@ -0,0 +1,531 @@
+#include "shm_stream_socket.h"
+#include "socket_common.h"
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <thread>
+
+constexpr size_t SHM_RING_CAPACITY = 1024 * 1024; // must be power of 2
+constexpr uint32_t SHM_SEGMENT_MAGIC = 0x6c797231; // "lyr1"
+constexpr auto SHM_SERVER_SOCKET_BACKLOG_LENGTH = 128;
+// how long waiter spins before going to futex, only with several cpus
+constexpr int SHM_SPIN_ITERATIONS = 20000;
+// futex sleeps are sliced to check that peer process is alive
+constexpr auto SHM_LIVENESS_CHECK_PERIOD = std::chrono::milliseconds(20);
+
+namespace {
+
+/*
+ * Positions grow forever, offset in data is position % capacity.
+ * Waiting side raises its flag and sleeps on seq, the other side
+ * bumps seq and wakes it if the flag is raised.
+ */
+struct shm_ring {
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	alignas(64) std::atomic<uint32_t> dataSeq;
+	std::atomic<uint32_t> consumerWaiting;
+	alignas(64) std::atomic<uint32_t> spaceSeq;
+	std::atomic<uint32_t> producerWaiting;
+	std::atomic<uint32_t> producerClosed;
+	std::atomic<uint32_t> consumerClosed;
+	alignas(64) uint8_t data[SHM_RING_CAPACITY];
+};
+
+struct shm_segment {
+	uint32_t magic;
+	// rings[0]: client -> server, rings[1]: server -> client
+	shm_ring rings[2];
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs plain 32-bit words");
+
+void futex_wait(std::atomic<uint32_t> & word, uint32_t expected, std::chrono::nanoseconds timeout)
+{
+	timespec ts;
+	ts.tv_sec = timeout.count() / 1000000000;
+	ts.tv_nsec = timeout.count() % 1000000000;
+	// not FUTEX_PRIVATE: the word is shared between processes
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> & word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+bool spinning_helps()
+{
+	static bool const several = std::thread::hardware_concurrency() > 1;
+	return several;
+}
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+class shm_stream_client_socket: public stream_client_socket, public with_descriptor {
+public:
+	/*
+	 * Server side: takes accepted unix socket, the segment is sent to it
+	 * on first use, so a client gone already fails only its connection.
+	 */
+	explicit shm_stream_client_socket(int unixSocket)
+		: with_descriptor(unixSocket)
+		, m_serverSide(true)
+	{
+		if (!is_valid())
+			throw_errno("invalid socket descriptor");
+	}
+
+	explicit shm_stream_client_socket(std::string const & hostname)
+		: with_descriptor(-1)
+		, m_hostname(hostname)
+	{}
+
+	~shm_stream_client_socket()
+	{
+		if (m_segment) {
+			m_out->producerClosed.store(1);
+			wake(m_out->dataSeq, m_out->consumerWaiting);
+			m_in->consumerClosed.store(1);
+			wake(m_in->spaceSeq, m_in->producerWaiting);
+			munmap(m_segment, sizeof(shm_segment));
+		}
+	}
+
+	void send(void const * buf, size_t size) override
+	{
+		auto deadline = m_deadlines.next(socket_direction::SEND, m_limits);
+		ensure_segment(deadline);
+
+		uint8_t const * data = static_cast<uint8_t const *>(buf);
+		uint64_t & tail = m_outTail;
+		while (size > 0) {
+			if (m_out->consumerClosed.load(std::memory_order_relaxed))
+				throw socket_exception("failed to send: connection closed by peer");
+
+			uint64_t free = SHM_RING_CAPACITY - ring_distance(m_out->head.load(std::memory_order_acquire), tail);
+			if (!free) {
+				// anything but a full ring wakes us, a broken head is caught above
+				wait(m_out->spaceSeq, m_out->producerWaiting, deadline, "send", [this, tail] () {
+					return tail - m_out->head.load() != SHM_RING_CAPACITY
+						|| m_out->consumerClosed.load();
+				});
+				continue;
+			}
+
+			size_t portion = std::min<uint64_t>(size, free);
+			copy_in(*m_out, tail, data, portion);
+			tail += portion;
+			data += portion;
+			size -= portion;
+			m_out->tail.store(tail, std::memory_order_seq_cst);
+			wake(m_out->dataSeq, m_out->consumerWaiting);
+		}
+	}
+
+	void recv(void * buf, size_t size) override
+	{
+		auto deadline = m_deadlines.next(socket_direction::RECV, m_limits);
+		ensure_segment(deadline);
+
+		uint8_t * data = static_cast<uint8_t *>(buf);
+		uint64_t & head = m_inHead;
+		while (size > 0) {
+			uint64_t available = ring_distance(head, m_in->tail.load(std::memory_order_acquire));
+			if (!available) {
+				if (m_in->producerClosed.load(std::memory_order_acquire) || m_peerGone)
+					throw socket_exception("failed to recv: connection closed by peer");
+				wait(m_in->dataSeq, m_in->consumerWaiting, deadline, "recv", [this, head] () {
+					return m_in->tail.load() != head || m_in->producerClosed.load();
+				});
+				continue;
+			}
+
+			size_t portion = std::min<uint64_t>(size, available);
+			copy_out(*m_in, head, data, portion);
+			head += portion;
+			data += portion;
+			size -= portion;
+			m_in->head.store(head, std::memory_order_seq_cst);
+			wake(m_in->spaceSeq, m_in->producerWaiting);
+		}
+	}
+
+	void connect() override
+	{
+		if (is_valid())
+			throw socket_exception("socket already connected");
+
+		socket_address addr = resolve_address(m_hostname, 0, false);
+		if (addr.family() != AF_UNIX)
+			throw socket_exception("shm socket needs unix: address, got " + m_hostname);
+		m_descriptor = create_stream_socket(addr, SOCK_CLOEXEC);
+		if (::connect(m_descriptor, addr.get(), addr.length) < 0)
+			throw_errno("failed to connect to host");
+		// segment arrives once server accepts, see ensure_segment()
+	}
+
+	void set_limits(socket_limits const & limits) override
+	{
+		m_limits = limits;
+	}
+
+	void begin_message(socket_direction direction) override
+	{
+		m_deadlines.begin(direction, m_limits);
+	}
+
+	void end_message(socket_direction direction) override
+	{
+		m_deadlines.end(direction);
+	}
+
+	bool wait_readable(std::chrono::milliseconds timeout) override
+	{
+		auto deadline = deadline_after(timeout);
+		uint64_t head = 0;
+		try {
+			ensure_segment(deadline);
+			head = m_inHead;
+			wait(m_in->dataSeq, m_in->consumerWaiting, deadline, "wait", [this, head] () {
+				return m_in->tail.load() != head || m_in->producerClosed.load();
+			});
+		} catch (socket_timeout_exception const &) {
+			return false;
+		}
+		return true;
+	}
+
+	bool poll_readable() override
+	{
+		if (!m_segment) {
+			if (!is_valid())
+				throw socket_exception("socket not connected");
+			pollfd pfd { m_descriptor, POLLIN, 0 };
+			if (!m_serverSide && poll(&pfd, 1, 0) <= 0)
+				return false;
+			ensure_segment(socket_clock::time_point::max());
+		}
+		return m_in->tail.load(std::memory_order_acquire) != m_inHead
+			|| m_in->producerClosed.load() || peer_gone();
+	}
+
+	bool full_duplex() const override
+	{
+		// rings are independent, only peer_gone() is shared and it is atomic
+		return true;
+	}
+
+	void shutdown() override
+	{
+		// waits check unix socket every SHM_LIVENESS_CHECK_PERIOD, peer_gone() sees it
+		shutdown_descriptor();
+	}
+
+private:
+	/*
+	 * Like TCP connect, ours completes before server accepts us, so client
+	 * gets the segment on first use. Server sends it on first use too,
+	 * out of the accepting thread. First use is by the connection's own
+	 * thread, pushes from others come only after a request was received.
+	 */
+	void ensure_segment(socket_clock::time_point deadline)
+	{
+		if (m_segment)
+			return;
+		if (!is_valid())
+			throw socket_exception("socket not connected");
+		if (m_serverSide) {
+			create_segment();
+			return;
+		}
+		if (!wait_descriptor(m_descriptor, POLLIN, deadline))
+			throw socket_timeout_exception("timed out waiting for shared memory from server");
+
+		int memfd = receive_segment();
+		try {
+			attach_segment(memfd);
+		} catch (...) {
+			close(memfd);
+			throw;
+		}
+		close(memfd);
+	}
+
+	void create_segment()
+	{
+		int memfd = int(syscall(SYS_memfd_create, "lyricsdb-shm", MFD_CLOEXEC));
+		if (memfd < 0)
+			throw_errno("failed to create shared memory");
+		if (ftruncate(memfd, sizeof(shm_segment)) < 0) {
+			close(memfd);
+			throw_errno("failed to size shared memory");
+		}
+		try {
+			attach_segment(memfd);
+			new (m_segment) shm_segment();
+			m_segment->magic = SHM_SEGMENT_MAGIC;
+			send_segment(memfd);
+		} catch (...) {
+			// socket outlives the failure now, the destructor must not see it
+			if (m_segment)
+				munmap(m_segment, sizeof(shm_segment));
+			m_segment = nullptr;
+			m_out = m_in = nullptr;
+			close(memfd);
+			throw;
+		}
+		close(memfd);
+
+		// server produces into the second ring
+		std::swap(m_in, m_out);
+	}
+
+	void attach_segment(int memfd)
+	{
+		void * mem = mmap(nullptr, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		if (mem == MAP_FAILED)
+			throw_errno("failed to map shared memory");
+		m_segment = static_cast<shm_segment *>(mem);
+		m_out = &m_segment->rings[0];
+		m_in = &m_segment->rings[1];
+	}
+
+	void send_segment(int memfd)
+	{
+		uint32_t magic = SHM_SEGMENT_MAGIC;
+		iovec iov { &magic, sizeof(magic) };
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(control, 0, sizeof(control));
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+		if (sendmsg(m_descriptor, &msg, MSG_NOSIGNAL) != ssize_t(sizeof(magic)))
+			throw_errno("failed to send shared memory to client");
+	}
+
+	/*
+	 * Client side: returns memfd of segment created by server.
+	 */
+	int receive_segment()
+	{
+		uint32_t magic = 0;
+		iovec iov { &magic, sizeof(magic) };
+		char control[CMSG_SPACE(sizeof(int))];
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t received = recvmsg(m_descriptor, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+		if (received < 0)
+			throw_errno("failed to receive shared memory");
+		cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		if (received != sizeof(magic) || magic != SHM_SEGMENT_MAGIC || !cmsg
+			|| cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			throw socket_exception("server didn't send shared memory, is it using shm backend?");
+
+		int memfd;
+		memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+		return memfd;
+	}
+
+	/*
+	 * Bytes between our index and the one peer writes into the segment.
+	 * Peer is not trusted with it: a distance over the capacity would make
+	 * copies run past the ring, so the socket fails for good instead.
+	 */
+	uint64_t ring_distance(uint64_t from, uint64_t to)
+	{
+		if (to - from > SHM_RING_CAPACITY) {
+			m_corrupted = true;
+			// peer can't be told apart from a dead one, make it see a close
+			m_out->producerClosed.store(1);
+			m_in->consumerClosed.store(1);
+		}
+		if (m_corrupted)
+			throw socket_exception("shared memory ring corrupted by peer");
+		return to - from;
+	}
+
+	static void copy_in(shm_ring & ring, uint64_t position, uint8_t const * data, size_t size)
+	{
+		size_t offset = position & (SHM_RING_CAPACITY - 1);
+		size_t first = std::min(size, SHM_RING_CAPACITY - offset);
+		memcpy(ring.data + offset, data, first);
+		memcpy(ring.data, data + first, size - first);
+	}
+
+	static void copy_out(shm_ring & ring, uint64_t position, uint8_t * data, size_t size)
+	{
+		size_t offset = position & (SHM_RING_CAPACITY - 1);
+		size_t first = std::min(size, SHM_RING_CAPACITY - offset);
+		memcpy(data, ring.data + offset, first);
+		memcpy(data + first, ring.data, size - first);
+	}
+
+	/*
+	 * Called after position update (seq_cst store), so either waiter
+	 * sees the new position or we see its flag.
+	 */
+	static void wake(std::atomic<uint32_t> & seq, std::atomic<uint32_t> & waiting)
+	{
+		if (waiting.load(std::memory_order_seq_cst)) {
+			seq.fetch_add(1);
+			futex_wake(seq);
+		}
+	}
+
+	/*
+	 * Spins, then sleeps on futex until ready() or deadline, in which case
+	 * throws socket_timeout_exception. Peer death is noticed through
+	 * unix socket and treated as close.
+	 */
+	template<typename Ready>
+	void wait(std::atomic<uint32_t> & seq, std::atomic<uint32_t> & waiting,
+		socket_clock::time_point deadline, char const * what, Ready ready)
+	{
+		if (spinning_helps())
+			for (int i = 0; i < SHM_SPIN_ITERATIONS; ++i) {
+				if (ready())
+					return;
+				cpu_relax();
+			}
+
+		while (!ready()) {
+			if (peer_gone())
+				return;
+			auto now = socket_clock::now();
+			if (now >= deadline)
+				throw socket_timeout_exception(std::string(what) + " timed out");
+			auto slice = std::min<socket_clock::duration>(deadline - now, SHM_LIVENESS_CHECK_PERIOD);
+
+			uint32_t expected = seq.load();
+			waiting.store(1, std::memory_order_seq_cst);
+			if (!ready())
+				futex_wait(seq, expected, slice);
+			waiting.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	bool peer_gone()
+	{
+		if (m_peerGone)
+			return true;
+		pollfd pfd { m_descriptor, POLLRDHUP, 0 };
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+			m_peerGone = true;
+			// make further sends fail as they would after clean close
+			m_out->consumerClosed.store(1);
+		}
+		return m_peerGone;
+	}
+
+	std::string m_hostname;
+	bool const m_serverSide = false;
+	socket_limits m_limits;
+	call_deadlines m_deadlines;
+	shm_segment * m_segment = nullptr;
+	shm_ring * m_out = nullptr;
+	shm_ring * m_in = nullptr;
+	// own ring indices, the copies in the segment are only for the peer
+	uint64_t m_outTail = 0;
+	uint64_t m_inHead = 0;
+	std::atomic<bool> m_corrupted { false };
+	std::atomic<bool> m_peerGone { false };
+};
+
+class shm_stream_server_socket: public stream_server_socket, public with_descriptor {
+public:
+	explicit shm_stream_server_socket(std::string const & hostname)
+		: with_descriptor(-1)
+		, m_address(resolve_address(hostname, 0, true))
+	{
+		if (m_address.family() != AF_UNIX)
+			throw socket_exception("shm socket needs unix: address, got " + hostname);
+		m_descriptor = create_stream_socket(m_address, SOCK_CLOEXEC);
+		bind_and_listen(m_descriptor, m_address, SHM_SERVER_SOCKET_BACKLOG_LENGTH);
+	}
+
+	explicit shm_stream_server_socket(int descriptor)
+		: with_descriptor(descriptor)
+		, m_address(local_address(descriptor))
+	{
+		if (m_address.family() != AF_UNIX)
+			throw socket_exception("shm socket needs unix listening socket");
+	}
+
+	~shm_stream_server_socket()
+	{
+		if (!m_handedOver)
+			unlink_address(m_address);
+	}
+
+	socket_ptr accept_one_client() override
+	{
+		int client = m_stopper.accept(m_descriptor, SOCK_CLOEXEC);
+		return socket_ptr(new shm_stream_client_socket(client));
+	}
+
+	int descriptor() const override
+	{
+		return m_descriptor;
+	}
+
+	void hand_over() override
+	{
+		m_handedOver = true;
+		m_stopper.stop();
+	}
+
+private:
+	socket_address m_address;
+	accept_stopper m_stopper;
+	bool m_handedOver = false;
+};
+
+} // namespace
+
+client_socket_ptr make_shm_client_socket(std::string const & hostname)
+{
+	return client_socket_ptr(new shm_stream_client_socket(hostname));
+}
+
+server_socket_ptr make_shm_server_socket(std::string const & hostname)
+{
+	return server_socket_ptr(new shm_stream_server_socket(hostname));
+}
+
+server_socket_ptr adopt_shm_server_socket(int descriptor)
+{
+	return server_socket_ptr(new shm_stream_server_socket(descriptor));
+}
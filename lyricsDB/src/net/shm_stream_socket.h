@@ -0,0 +1,24 @@
+#pragma once
+
+#include "stream_socket.h"
+
+/*
+ * Shared memory sockets for peers on the same host. Connection is set up
+ * over unix socket: server creates memfd segment with two single-producer
+ * single-consumer byte rings (one per direction) and passes it with
+ * SCM_RIGHTS. After that send/recv are plain memcpy into the ring, peers
+ * spin shortly and then sleep on futex in the segment, so an active
+ * connection makes no syscalls. Unix socket stays open to notice a peer
+ * that died without closing the rings.
+ * Use make_client_socket/make_server_socket with socket_backend::SHM
+ * and "unix:PATH" address.
+ */
+
+client_socket_ptr make_shm_client_socket(std::string const & hostname);
+
+server_socket_ptr make_shm_server_socket(std::string const & hostname);
+
+/*
+ * See adopt_server_socket.
+ */
+server_socket_ptr adopt_shm_server_socket(int descriptor);
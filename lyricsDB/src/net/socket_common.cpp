@@ -0,0 +1,276 @@
+#include "socket_common.h"
+#include "stream_socket.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+void throw_errno(std::string const & msg)
+{
+	throw_errno(msg, errno);
+}
+
+void throw_errno(std::string const & msg, int error)
+{
+	throw socket_exception(msg + ": " + strerror(error));
+}
+
+void set_listen_options(int descriptor, bool reusePort)
+{
+	int option = 1;
+	if (setsockopt(descriptor, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) < 0)
+		throw_errno("failed to set socket options");
+	if (reusePort && setsockopt(descriptor, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)) < 0)
+		throw_errno("failed to set SO_REUSEPORT");
+}
+
+void disable_nagle(int descriptor)
+{
+	int option = 1;
+	if (setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option)) < 0)
+		throw_errno("failed to disable nagle");
+}
+
+void set_send_buffer_size(int descriptor, size_t size)
+{
+	if (!size)
+		return;
+	int option = int(std::min<size_t>(size, INT32_MAX));
+	if (setsockopt(descriptor, SOL_SOCKET, SO_SNDBUF, &option, sizeof(option)) < 0)
+		throw_errno("failed to set send buffer size");
+}
+
+socket_clock::time_point deadline_after(std::chrono::milliseconds timeout)
+{
+	if (timeout.count() <= 0)
+		return socket_clock::time_point::max();
+	return socket_clock::now() + timeout;
+}
+
+namespace {
+
+std::chrono::milliseconds timeout_of(socket_direction direction, socket_limits const & limits)
+{
+	return direction == socket_direction::RECV ? limits.recvTimeout : limits.sendTimeout;
+}
+
+} // namespace
+
+void call_deadlines::begin(socket_direction direction, socket_limits const & limits)
+{
+	m_message[size_t(direction)] = deadline_after(timeout_of(direction, limits));
+	m_inMessage[size_t(direction)] = true;
+}
+
+void call_deadlines::end(socket_direction direction)
+{
+	m_inMessage[size_t(direction)] = false;
+}
+
+socket_clock::time_point call_deadlines::next(socket_direction direction, socket_limits const & limits) const
+{
+	if (m_inMessage[size_t(direction)])
+		return m_message[size_t(direction)];
+	return deadline_after(timeout_of(direction, limits));
+}
+
+bool wait_descriptor(int descriptor, short events, socket_clock::time_point deadline)
+{
+	pollfd pfd;
+	pfd.fd = descriptor;
+	pfd.events = events;
+	while (true) {
+		int timeout = -1;
+		if (deadline != socket_clock::time_point::max()) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - socket_clock::now());
+			if (left.count() <= 0)
+				return false;
+			timeout = int(std::min<int64_t>(left.count() + 1, INT32_MAX));
+		}
+
+		pfd.revents = 0;
+		int ret = poll(&pfd, 1, timeout);
+		if (ret > 0)
+			return true;
+		if (ret < 0 && errno != EINTR)
+			throw_errno("failed to poll socket");
+	}
+}
+
+sockaddr_in create_addr(
+	std::string const & hostname,
+	uint16_t port,
+	bool passive)
+{
+	addrinfo hints;
+	addrinfo * result = nullptr;
+
+	hints.ai_addr = nullptr;
+	hints.ai_canonname = nullptr;
+	hints.ai_family = AF_INET;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	hints.ai_next = nullptr;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_socktype = SOCK_STREAM;
+
+	auto portStr = std::to_string(port);
+	int ret = getaddrinfo(hostname.c_str(), portStr.c_str(), &hints, &result);
+	if (ret)
+		throw socket_exception(std::string("failed to get addr info: ") + gai_strerror(ret));
+
+	sockaddr_in addr;
+	if (result->ai_addr)
+		// pick first address
+		memcpy(&addr, result->ai_addr, result->ai_addrlen);
+	else {
+		freeaddrinfo(result);
+		throw socket_exception("addr info is null");
+	}
+	freeaddrinfo(result);
+
+	memset(&addr.sin_zero, 0, sizeof(addr.sin_zero));
+
+	return addr;
+}
+
+namespace {
+
+char const UNIX_SCHEME[] = "unix:";
+
+} // namespace
+
+socket_address resolve_address(std::string const & hostname, uint16_t port, bool passive)
+{
+	socket_address address;
+	memset(&address.storage, 0, sizeof(address.storage));
+
+	if (hostname.compare(0, sizeof(UNIX_SCHEME) - 1, UNIX_SCHEME)) {
+		sockaddr_in addr = create_addr(hostname, port, passive);
+		memcpy(&address.storage, &addr, sizeof(addr));
+		address.length = sizeof(addr);
+		return address;
+	}
+
+	std::string path = hostname.substr(sizeof(UNIX_SCHEME) - 1);
+	auto & addr = reinterpret_cast<sockaddr_un &>(address.storage);
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		throw socket_exception("invalid unix socket path: " + path);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.data(), path.size());
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+	address.length = socklen_t(offsetof(sockaddr_un, sun_path) + path.size()
+		+ (path[0] == '@' ? 0 : 1));
+	return address;
+}
+
+int create_stream_socket(socket_address const & address, int flags)
+{
+	int protocol = address.family() == AF_INET ? IPPROTO_TCP : 0;
+	int descriptor = ::socket(address.family(), SOCK_STREAM | flags, protocol);
+	if (descriptor < 0)
+		throw_errno("failed to create socket");
+	return descriptor;
+}
+
+void configure_stream_socket(int descriptor, int family)
+{
+	if (family == AF_INET)
+		disable_nagle(descriptor);
+}
+
+void bind_and_listen(int descriptor, socket_address const & address, int backlog)
+{
+	remove_stale_socket(address);
+	if (::bind(descriptor, address.get(), address.length) < 0)
+		throw_errno("failed to bind socket");
+	if (::listen(descriptor, backlog) < 0)
+		throw_errno("failed to start listen");
+}
+
+void unlink_address(socket_address const & address)
+{
+	auto const & addr = reinterpret_cast<sockaddr_un const &>(address.storage);
+	if (address.family() == AF_UNIX && addr.sun_path[0])
+		unlink(addr.sun_path);
+}
+
+void remove_stale_socket(socket_address const & address, int type)
+{
+	auto const & addr = reinterpret_cast<sockaddr_un const &>(address.storage);
+	if (address.family() != AF_UNIX || !addr.sun_path[0])
+		return;
+	struct stat info;
+	if (lstat(addr.sun_path, &info) < 0 || !S_ISSOCK(info.st_mode))
+		return;
+
+	// nonblocking, so a live server with full backlog says EAGAIN instead of blocking us
+	int probe = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (probe < 0)
+		return;
+	bool stale = ::connect(probe, address.get(), address.length) < 0 && errno == ECONNREFUSED;
+	close(probe);
+	if (stale)
+		unlink(addr.sun_path);
+}
+
+socket_address local_address(int descriptor)
+{
+	socket_address address;
+	memset(&address.storage, 0, sizeof(address.storage));
+	address.length = sizeof(address.storage);
+	if (getsockname(descriptor, reinterpret_cast<sockaddr *>(&address.storage), &address.length) < 0)
+		throw_errno("failed to get socket address");
+	return address;
+}
+
+accept_stopper::accept_stopper()
+	: with_descriptor(eventfd(0, EFD_CLOEXEC))
+{
+	if (!is_valid())
+		throw_errno("failed to create eventfd");
+}
+
+void accept_stopper::stop()
+{
+	uint64_t one = 1;
+	if (::write(m_descriptor, &one, sizeof(one)) < 0)
+		throw_errno("failed to stop accepting");
+}
+
+int accept_stopper::accept(int listening, int flags) const
+{
+	int status = fcntl(listening, F_GETFL);
+	if (status < 0 || (!(status & O_NONBLOCK) && fcntl(listening, F_SETFL, status | O_NONBLOCK) < 0))
+		throw_errno("failed to make listening socket nonblocking");
+
+	pollfd pfds[2] = { { listening, POLLIN, 0 }, { m_descriptor, POLLIN, 0 } };
+	while (true) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			throw_errno("failed to wait for connections");
+		}
+		// eventfd is never read, so stop wins over pending connections
+		if (pfds[1].revents)
+			throw socket_exception("listening socket was handed over");
+		if (!pfds[0].revents)
+			continue;
+
+		int client = ::accept4(listening, nullptr, nullptr, flags);
+		if (client >= 0)
+			return client;
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+			throw_errno("failed to accept client");
+	}
+}
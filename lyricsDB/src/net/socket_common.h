@@ -0,0 +1,188 @@
+#pragma once
+
+#include "stream_socket.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * Helpers shared by socket implementations. Not a part of public interface.
+ */
+
+class with_descriptor {
+protected:
+	with_descriptor(int descriptor)
+		: m_descriptor(descriptor)
+	{}
+
+	with_descriptor(with_descriptor const &) = delete;
+	with_descriptor & operator=(with_descriptor const &) = delete;
+
+	with_descriptor(with_descriptor && other)
+	{
+		m_descriptor = other.m_descriptor;
+		other.m_descriptor = -1;
+	}
+
+	with_descriptor & operator=(with_descriptor && other)
+	{
+		std::swap(m_descriptor, other.m_descriptor);
+		return *this;
+	}
+
+	~with_descriptor()
+	{
+		if (is_valid())
+			close(m_descriptor);
+	}
+
+	bool is_valid() const
+	{
+		return m_descriptor >= 0;
+	}
+
+	/*
+	 * For stream_socket::shutdown, descriptor stays open until destruction.
+	 */
+	void shutdown_descriptor()
+	{
+		if (is_valid())
+			::shutdown(m_descriptor, SHUT_RDWR);
+	}
+
+protected:
+	int m_descriptor;
+};
+
+[[noreturn]] void throw_errno(std::string const & msg);
+
+[[noreturn]] void throw_errno(std::string const & msg, int error);
+
+/*
+ * Common options of listening sockets: SO_REUSEADDR and optionally SO_REUSEPORT.
+ */
+void set_listen_options(int descriptor, bool reusePort);
+
+/*
+ * Message layer does its own batching, so Nagle only adds
+ * delayed-ack stalls between header and payload writes.
+ */
+void disable_nagle(int descriptor);
+
+/*
+ * SO_SNDBUF, zero keeps system default.
+ */
+void set_send_buffer_size(int descriptor, size_t size);
+
+using socket_clock = std::chrono::steady_clock;
+
+/*
+ * Deadline for operation with timeout, zero timeout means no deadline.
+ */
+socket_clock::time_point deadline_after(std::chrono::milliseconds timeout);
+
+/*
+ * Deadlines of send and recv calls from socket_limits, shared by the calls
+ * between begin and end of a direction (see stream_socket::begin_message).
+ * Each direction is used by one thread at a time.
+ */
+class call_deadlines {
+public:
+	void begin(socket_direction direction, socket_limits const & limits);
+	void end(socket_direction direction);
+
+	/*
+	 * Deadline of a call starting now.
+	 */
+	socket_clock::time_point next(socket_direction direction, socket_limits const & limits) const;
+
+private:
+	socket_clock::time_point m_message[2];
+	bool m_inMessage[2] = { false, false };
+};
+
+/*
+ * Polls descriptor for events until deadline, returns false on timeout.
+ */
+bool wait_descriptor(int descriptor, short events, socket_clock::time_point deadline);
+
+sockaddr_in create_addr(
+	std::string const & hostname,
+	uint16_t port,
+	bool passive);
+
+/*
+ * Address of stream socket: "unix:PATH" is AF_UNIX socket at PATH
+ * ("unix:@NAME" is in abstract namespace), port is ignored for them.
+ * Anything else is ip4 host name resolved by create_addr.
+ */
+struct socket_address {
+	sockaddr_storage storage;
+	socklen_t length;
+
+	int family() const { return storage.ss_family; }
+	sockaddr const * get() const { return reinterpret_cast<sockaddr const *>(&storage); }
+};
+
+socket_address resolve_address(std::string const & hostname, uint16_t port, bool passive);
+
+/*
+ * Creates unconnected SOCK_STREAM socket of the address family.
+ */
+int create_stream_socket(socket_address const & address, int flags = 0);
+
+/*
+ * TCP_NODELAY for TCP sockets, nothing to do for others.
+ */
+void configure_stream_socket(int descriptor, int family);
+
+/*
+ * Binds and starts listening, stale AF_UNIX socket file is replaced
+ * (see remove_stale_socket).
+ */
+void bind_and_listen(int descriptor, socket_address const & address, int backlog);
+
+/*
+ * Removes AF_UNIX socket file left by listening socket, if any.
+ */
+void unlink_address(socket_address const & address);
+
+/*
+ * Removes AF_UNIX socket file of a server that is gone: only a socket
+ * that refuses connections. Other files and sockets somebody listens on
+ * are left for bind to fail on, so a mistyped path or a second server
+ * doesn't destroy them.
+ */
+void remove_stale_socket(socket_address const & address, int type = SOCK_STREAM);
+
+/*
+ * Address descriptor is bound to.
+ */
+socket_address local_address(int descriptor);
+
+/*
+ * Wakes the thread waiting for connections on a listening socket that is
+ * handed over to another process. Stays stopped once stopped.
+ */
+class accept_stopper: public with_descriptor {
+public:
+	accept_stopper();
+
+	void stop();
+
+	/*
+	 * Accepts the next connection of listening descriptor with accept4
+	 * flags, throws socket_exception once stopped. Makes the descriptor
+	 * nonblocking: another process sharing it may take the connection
+	 * between poll and accept, or client may abort meanwhile.
+	 */
+	int accept(int listening, int flags) const;
+
+	int descriptor() const { return m_descriptor; }
+};
@@ -1,98 +1,22 @@
 #include "stream_socket.h"
+#include "shm_stream_socket.h"
+#include "socket_common.h"
+#include "uring_stream_socket.h"
 
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <unistd.h>
+#include <poll.h>
 
-#include <algorithm>
+#include <cerrno>
 #include <cstring>
 
 constexpr auto TCP_SERVER_SOCKET_BACKLOG_LENGTH = 128;
 
-namespace {
-
-class with_descriptor {
-protected:
-	with_descriptor(int descriptor)
-		: m_descriptor(descriptor)
-	{}
-
-	with_descriptor(with_descriptor const &) = delete;
-	with_descriptor & operator=(with_descriptor const &) = delete;
-
-	with_descriptor(with_descriptor && other)
-	{
-		m_descriptor = other.m_descriptor;
-		other.m_descriptor = -1;
-	}
-
-	with_descriptor & operator=(with_descriptor && other)
-	{
-		std::swap(m_descriptor, other.m_descriptor);
-		return *this;
-	}
-
-	~with_descriptor()
-	{
-		if (is_valid())
-			close(m_descriptor);
-	}
-
-	bool is_valid() const
-	{
-		return m_descriptor >= 0;
-	}
-
-protected:
-	int m_descriptor;
-};
-
-void throw_errno(std::string const & msg)
-{
-	throw socket_exception(msg + ": " + strerror(errno));
-}
-
-sockaddr_in create_addr(
-	std::string const & hostname,
-	uint16_t port,
-	bool passive)
-{
-	addrinfo hints;
-	addrinfo * result = nullptr;
-
-	hints.ai_addr = nullptr;
-	hints.ai_canonname = nullptr;
-	hints.ai_family = AF_INET;
-	hints.ai_flags = passive ? AI_PASSIVE : 0;
-	hints.ai_next = nullptr;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_socktype = SOCK_STREAM;
-
-	auto portStr = std::to_string(port);
-	int ret = getaddrinfo(hostname.c_str(), portStr.c_str(), &hints, &result);
-	if (ret)
-		throw socket_exception(std::string("failed to get addr info: ") + gai_strerror(ret));
-
-	sockaddr_in addr;
-	if (result->ai_addr)
-		// pick first address
-		memcpy(&addr, result->ai_addr, result->ai_addrlen);
-	else {
-		freeaddrinfo(result);
-		throw socket_exception("addr info is null");
-	}
-	freeaddrinfo(result);
-
-	memset(&addr.sin_zero, 0, sizeof(addr.sin_zero));
-
-	return addr;
-}
-
-} // namespace
-
+/*
+ * Plain blocking socket syscalls, works for TCP and AF_UNIX addresses.
+ */
 class tcp_stream_client_socket: public stream_client_socket, public with_descriptor {
 public:
 	explicit tcp_stream_client_socket(int sockfd)
@@ -113,6 +37,11 @@ public:
 		if (!is_valid())
 			throw socket_exception("socket not connected");
 
+		if (m_limits.sendTimeout.count()) {
+			send_with_deadline(static_cast<uint8_t const *>(buf), size, m_deadlines.next(socket_direction::SEND, m_limits));
+			return;
+		}
+
 		ssize_t sendSize = ::send(m_descriptor, buf, size, MSG_NOSIGNAL);
 		if (sendSize < 0 || size_t(sendSize) != size)
 			throw_errno("failed to send " + std::to_string(size) + " bytes");
@@ -123,74 +52,222 @@ public:
 		if (!is_valid())
 			throw socket_exception("socket not connected");
 
-		ssize_t recvSize = ::recv(m_descriptor, buf, size, MSG_NOSIGNAL);
+		if (m_limits.recvTimeout.count()) {
+			recv_with_deadline(static_cast<uint8_t *>(buf), size, m_deadlines.next(socket_direction::RECV, m_limits));
+			return;
+		}
+
+		ssize_t recvSize = ::recv(m_descriptor, buf, size, MSG_NOSIGNAL | MSG_WAITALL);
 		if (recvSize < 0 || size_t(recvSize) != size)
 			throw_errno("failed to recv " + std::to_string(size) + " bytes");
 	}
 
-	void connect() override
+	void set_limits(socket_limits const & limits) override
 	{
 		if (is_valid())
-			throw socket_exception("socket already connected");
+			set_send_buffer_size(m_descriptor, limits.sendBufferSize);
+		m_limits = limits;
+	}
 
-		m_descriptor = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	void begin_message(socket_direction direction) override
+	{
+		m_deadlines.begin(direction, m_limits);
+	}
+
+	void end_message(socket_direction direction) override
+	{
+		m_deadlines.end(direction);
+	}
+
+	bool wait_readable(std::chrono::milliseconds timeout) override
+	{
 		if (!is_valid())
-			throw_errno("failed to create socket");
-		int option = 1;
-		if (setsockopt(m_descriptor, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) < 0) {
-			throw_errno("faild to set socket options");
-		}
+			throw socket_exception("socket not connected");
+		return wait_descriptor(m_descriptor, POLLIN, deadline_after(timeout));
+	}
 
-		sockaddr_in addr = create_addr(m_hostname, m_port, false);
-		if (::connect(m_descriptor, (sockaddr *) &addr, sizeof(addr)) < 0)
+	bool poll_readable() override
+	{
+		if (!is_valid())
+			throw socket_exception("socket not connected");
+		pollfd pfd { m_descriptor, POLLIN, 0 };
+		return poll(&pfd, 1, 0) > 0;
+	}
+
+	bool full_duplex() const override
+	{
+		return true;
+	}
+
+	void shutdown() override
+	{
+		shutdown_descriptor();
+	}
+
+	void connect() override
+	{
+		if (is_valid())
+			throw socket_exception("socket already connected");
+
+		socket_address addr = resolve_address(m_hostname, m_port, false);
+		m_descriptor = create_stream_socket(addr);
+		if (::connect(m_descriptor, addr.get(), addr.length) < 0)
 			throw_errno("failed to connect to host");
+		configure_stream_socket(m_descriptor, addr.family());
+		set_send_buffer_size(m_descriptor, m_limits.sendBufferSize);
 	}
 
 private:
+	/*
+	 * Non-blocking I/O polled until deadline, unlike SO_RCVTIMEO the
+	 * deadline holds for the whole call, not for every chunk.
+	 */
+	void send_with_deadline(uint8_t const * data, size_t size, socket_clock::time_point deadline)
+	{
+		while (size > 0) {
+			ssize_t sent = ::send(m_descriptor, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (sent > 0) {
+				data += sent;
+				size -= sent;
+			} else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				if (!wait_descriptor(m_descriptor, POLLOUT, deadline))
+					throw socket_timeout_exception("send timed out, " + std::to_string(size) + " bytes left");
+			} else if (sent < 0 && errno != EINTR) {
+				throw_errno("failed to send " + std::to_string(size) + " bytes");
+			}
+		}
+	}
+
+	void recv_with_deadline(uint8_t * data, size_t size, socket_clock::time_point deadline)
+	{
+		while (size > 0) {
+			ssize_t received = ::recv(m_descriptor, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (received > 0) {
+				data += received;
+				size -= received;
+			} else if (received == 0) {
+				throw socket_exception("failed to recv: connection closed by peer");
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!wait_descriptor(m_descriptor, POLLIN, deadline))
+					throw socket_timeout_exception("recv timed out, " + std::to_string(size) + " bytes left");
+			} else if (errno != EINTR) {
+				throw_errno("failed to recv " + std::to_string(size) + " bytes");
+			}
+		}
+	}
+
 	std::string m_hostname;
 	uint16_t m_port;
+	socket_limits m_limits;
+	call_deadlines m_deadlines;
 };
 
 class tcp_stream_server_socket: public stream_server_socket, public with_descriptor {
 public:
-	explicit tcp_stream_server_socket(std::string const & hostname, uint16_t port)
-		: with_descriptor(::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))
+	tcp_stream_server_socket(std::string const & hostname, uint16_t port, bool reusePort)
+		: with_descriptor(-1)
+		, m_address(resolve_address(hostname, port, true))
 	{
-		if (!is_valid())
-			throw_errno("failed to create socket");
+		m_descriptor = create_stream_socket(m_address);
+		set_listen_options(m_descriptor, reusePort);
+		bind_and_listen(m_descriptor, m_address, TCP_SERVER_SOCKET_BACKLOG_LENGTH);
+	}
 
-		sockaddr_in addr = create_addr(hostname, port, true);
-		if (::bind(m_descriptor, (sockaddr *) &addr, sizeof(addr)) < 0)
-			throw_errno("failed to bind socket");
+	explicit tcp_stream_server_socket(int descriptor)
+		: with_descriptor(descriptor)
+		, m_address(local_address(descriptor))
+	{}
 
-		if (::listen(m_descriptor, TCP_SERVER_SOCKET_BACKLOG_LENGTH) < 0)
-			throw_errno("failed to start listen");
+	~tcp_stream_server_socket()
+	{
+		if (!m_handedOver)
+			unlink_address(m_address);
 	}
 
 	socket_ptr accept_one_client() override
 	{
-		int client = ::accept(m_descriptor, nullptr, nullptr);
-		if (client < 0)
-			throw_errno("failed to accept client");
+		int client = m_stopper.accept(m_descriptor, 0);
+		configure_stream_socket(client, m_address.family());
 		return socket_ptr(new tcp_stream_client_socket(client));
 	}
+
+	int descriptor() const override
+	{
+		return m_descriptor;
+	}
+
+	void hand_over() override
+	{
+		m_handedOver = true;
+		m_stopper.stop();
+	}
+
+private:
+	socket_address m_address;
+	accept_stopper m_stopper;
+	bool m_handedOver = false;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+socket_backend parse_socket_backend(std::string const & name)
+{
+	if (name == "tcp")
+		return socket_backend::TCP;
+	if (name == "uring")
+		return socket_backend::URING;
+	if (name == "shm")
+		return socket_backend::SHM;
+	throw std::invalid_argument("unknown socket backend: " + name);
+}
+
 client_socket_ptr make_client_socket(
 	std::string const& hostname,
 	uint16_t port,
-	bool connect)
+	bool connect,
+	socket_backend backend)
 {
-	auto socket = client_socket_ptr(new tcp_stream_client_socket(hostname, port));
+	client_socket_ptr socket;
+	if (backend == socket_backend::URING)
+		socket = make_uring_client_socket(hostname, port);
+	else if (backend == socket_backend::SHM)
+		socket = make_shm_client_socket(hostname);
+	else
+		socket = client_socket_ptr(new tcp_stream_client_socket(hostname, port));
 	if (connect) {
 		socket->connect();
 	}
 	return socket;
 }
 
-server_socket_ptr make_server_socket(std::string const & hostname, uint16_t port)
+server_socket_ptr make_server_socket(
+	std::string const & hostname,
+	uint16_t port,
+	socket_backend backend,
+	bool reusePort)
+{
+	if (backend == socket_backend::URING)
+		return make_uring_server_socket(hostname, port, reusePort);
+	if (backend == socket_backend::SHM)
+		return make_shm_server_socket(hostname);
+	return server_socket_ptr(new tcp_stream_server_socket(hostname, port, reusePort));
+}
+
+server_socket_ptr adopt_server_socket(int descriptor, socket_backend backend)
+{
+	if (backend == socket_backend::URING)
+		return adopt_uring_server_socket(descriptor);
+	if (backend == socket_backend::SHM)
+		return adopt_shm_server_socket(descriptor);
+	return server_socket_ptr(new tcp_stream_server_socket(descriptor));
+}
+
+std::pair<socket_ptr, socket_ptr> make_socket_pair()
 {
-	return server_socket_ptr(new tcp_stream_server_socket(hostname, port));
+	int descriptors[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, descriptors) < 0)
+		throw_errno("failed to create socket pair");
+	socket_ptr first(new tcp_stream_client_socket(descriptors[0]));
+	socket_ptr second(new tcp_stream_client_socket(descriptors[1]));
+	return { first, second };
 }
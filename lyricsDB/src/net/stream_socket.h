@@ -1,8 +1,10 @@
 #pragma once
 
+#include <chrono>
 #include <cstddef>
 #include <memory>
 #include <string>
+#include <utility>
 #include <stdexcept>
 
 /*
@@ -15,6 +17,41 @@ struct socket_exception: public std::runtime_error {
 	{}
 };
 
+/*
+ * Thrown when send or recv didn't complete in time given by socket_limits.
+ * Socket can't be used after that.
+ */
+struct socket_timeout_exception: public socket_exception {
+	socket_timeout_exception(std::string const & what)
+		: socket_exception(what)
+	{}
+};
+
+/*
+ * Zero means no limit.
+ */
+struct socket_limits {
+	/*
+	 * Max duration of one whole recv() call, however data trickles in,
+	 * or of a whole message (see stream_socket::begin_message).
+	 */
+	std::chrono::milliseconds recvTimeout { 0 };
+	/*
+	 * Max duration of one whole send() or flush() call, or of a whole
+	 * message.
+	 */
+	std::chrono::milliseconds sendTimeout { 0 };
+	/*
+	 * Kernel send buffer size, bounds memory held for slow readers.
+	 */
+	size_t sendBufferSize = 0;
+};
+
+enum class socket_direction {
+	RECV,
+	SEND
+};
+
 struct stream_socket
 {
 	virtual ~stream_socket() = default;
@@ -38,6 +75,43 @@ struct stream_socket
 	 * - locking required;
 	 */
 	virtual void recv(void * buf, size_t size) = 0;
+	/*
+	 * Pushes out data that implementation may keep buffered after send.
+	 * Buffered data is also flushed before any blocking recv.
+	 */
+	virtual void flush() {}
+	/*
+	 * Implementations without timeouts may ignore limits.
+	 */
+	virtual void set_limits(socket_limits const &) {}
+	/*
+	 * Calls of the direction until end_message share one timeout of
+	 * socket_limits counted from here instead of getting it each, so a
+	 * peer trickling a message made of several calls can't stretch it.
+	 * Implementations without timeouts may ignore them.
+	 */
+	virtual void begin_message(socket_direction) {}
+	virtual void end_message(socket_direction) {}
+	/*
+	 * Waits until recv() can make progress without blocking (also on
+	 * EOF or error), returns false if timeout expired. Zero waits forever.
+	 */
+	virtual bool wait_readable(std::chrono::milliseconds) { return true; }
+	/*
+	 * Like wait_readable but never blocks.
+	 */
+	virtual bool poll_readable() { return wait_readable(std::chrono::milliseconds(1)); }
+	/*
+	 * True if one thread may send while another one recvs, each call
+	 * still needs its own locking.
+	 */
+	virtual bool full_duplex() const { return false; }
+	/*
+	 * Makes send/recv blocked in other threads and all further ones fail
+	 * as if peer closed the connection. May be called from any thread.
+	 * Implementations without a descriptor may ignore it.
+	 */
+	virtual void shutdown() {}
 };
 using socket_ptr = std::shared_ptr<stream_socket>;
 
@@ -59,14 +133,60 @@ struct stream_server_socket
 	 * throw them on all further accepts.
 	 */
 	virtual socket_ptr accept_one_client() = 0;
+	/*
+	 * Listening descriptor for passing it to another process, the socket
+	 * keeps owning it. -1 if there is none.
+	 */
+	virtual int descriptor() const { return -1; }
+	/*
+	 * Stops accepting so that another process can take the descriptor
+	 * over: accept_one_client blocked in another thread and all further
+	 * calls throw socket_exception, once connections accepted already
+	 * are returned. Connections queued in the socket are left to the new
+	 * owner and AF_UNIX socket file stays when this socket is destroyed.
+	 */
+	virtual void hand_over() {}
 };
 using server_socket_ptr = std::shared_ptr<stream_server_socket>;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+enum class socket_backend {
+	TCP,   // plain blocking ::send/::recv
+	URING, // io_uring: one send per flushed message, multishot recv/accept into registered buffer ring
+	SHM    // shared memory rings set up over unix socket, same host only
+};
+
+/*
+ * Accepts "tcp", "uring" or "shm", throws std::invalid_argument otherwise.
+ */
+socket_backend parse_socket_backend(std::string const & name);
+
 client_socket_ptr make_client_socket(
 	std::string const& hostname,
 	uint16_t port,
-	bool connect = false);
+	bool connect = false,
+	socket_backend backend = socket_backend::TCP);
+
+/*
+ * With reusePort several server sockets may listen on the same address
+ * (SO_REUSEPORT), kernel spreads incoming connections between them.
+ */
+server_socket_ptr make_server_socket(
+	std::string const & hostname,
+	uint16_t port,
+	socket_backend backend = socket_backend::TCP,
+	bool reusePort = false);
+
+/*
+ * Server socket over listening descriptor handed over by another process,
+ * takes ownership of it (closes it on failure too). SHM backend needs
+ * AF_UNIX socket.
+ */
+server_socket_ptr adopt_server_socket(int descriptor, socket_backend backend);
 
-server_socket_ptr make_server_socket(std::string const & hostname, uint16_t port);
+/*
+ * Connected pair of AF_UNIX stream sockets with plain blocking syscalls,
+ * for tests and benchmarks that need no listening address.
+ */
+std::pair<socket_ptr, socket_ptr> make_socket_pair();
@@ -0,0 +1,184 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+int sys_io_uring_setup(unsigned entries, io_uring_params * params)
+{
+	return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return int(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int sys_io_uring_enter_timeout(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+	__kernel_timespec * timeout)
+{
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uint64_t>(timeout);
+	return int(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+		flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void * arg, unsigned argCount)
+{
+	return int(syscall(__NR_io_uring_register, fd, opcode, arg, argCount));
+}
+
+template<typename T>
+T * at_offset(void * base, uint32_t offset)
+{
+	return reinterpret_cast<T *>(static_cast<uint8_t *>(base) + offset);
+}
+
+} // namespace
+
+uring::uring(unsigned entries)
+	: with_descriptor(-1)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	m_descriptor = sys_io_uring_setup(entries, &params);
+	if (!is_valid())
+		throw_errno("failed to setup io_uring");
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMmap)
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_descriptor, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		m_sqRing = nullptr;
+		throw_errno("failed to map io_uring submission ring");
+	}
+
+	if (singleMmap) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_descriptor, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			m_cqRing = nullptr;
+			munmap(m_sqRing, m_sqRingSize);
+			throw_errno("failed to map io_uring completion ring");
+		}
+	}
+
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void * sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_descriptor, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (m_cqRing != m_sqRing)
+			munmap(m_cqRing, m_cqRingSize);
+		munmap(m_sqRing, m_sqRingSize);
+		throw_errno("failed to map io_uring sqes");
+	}
+	m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+	m_sqHead = at_offset<unsigned>(m_sqRing, params.sq_off.head);
+	m_sqTail = at_offset<unsigned>(m_sqRing, params.sq_off.tail);
+	m_sqArray = at_offset<unsigned>(m_sqRing, params.sq_off.array);
+	m_sqMask = *at_offset<unsigned>(m_sqRing, params.sq_off.ring_mask);
+	m_sqEntries = *at_offset<unsigned>(m_sqRing, params.sq_off.ring_entries);
+	m_sqLocalTail = *m_sqTail;
+
+	m_cqHead = at_offset<unsigned>(m_cqRing, params.cq_off.head);
+	m_cqTail = at_offset<unsigned>(m_cqRing, params.cq_off.tail);
+	m_cqMask = *at_offset<unsigned>(m_cqRing, params.cq_off.ring_mask);
+	m_cqes = at_offset<io_uring_cqe>(m_cqRing, params.cq_off.cqes);
+}
+
+uring::~uring()
+{
+	munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	munmap(m_sqRing, m_sqRingSize);
+}
+
+io_uring_sqe * uring::get_sqe()
+{
+	if (m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries)
+		submit_and_wait(0);
+
+	unsigned index = m_sqLocalTail & m_sqMask;
+	io_uring_sqe * sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqArray[index] = index;
+	++m_sqLocalTail;
+
+	return sqe;
+}
+
+unsigned uring::pending_sqes() const
+{
+	return m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+}
+
+void uring::submit_and_wait(unsigned waitCount)
+{
+	__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+
+	unsigned flags = waitCount ? IORING_ENTER_GETEVENTS : 0;
+	while (true) {
+		int ret = sys_io_uring_enter(m_descriptor, pending_sqes(), waitCount, flags);
+		if (ret >= 0)
+			return;
+		if (errno != EINTR)
+			throw_errno("failed to enter io_uring");
+	}
+}
+
+bool uring::submit_and_wait(unsigned waitCount, std::chrono::nanoseconds timeout)
+{
+	__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+
+	__kernel_timespec ts;
+	ts.tv_sec = timeout.count() / 1000000000;
+	ts.tv_nsec = timeout.count() % 1000000000;
+	int ret = sys_io_uring_enter_timeout(m_descriptor, pending_sqes(), waitCount,
+		IORING_ENTER_GETEVENTS, &ts);
+	// on EINTR caller finds no completion and waits again for what is left
+	if (ret >= 0 || errno == EINTR)
+		return true;
+	if (errno == ETIME)
+		return false;
+	throw_errno("failed to enter io_uring");
+}
+
+io_uring_cqe * uring::peek_cqe()
+{
+	unsigned head = *m_cqHead;
+	if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+		return nullptr;
+	return &m_cqes[head & m_cqMask];
+}
+
+void uring::cqe_seen()
+{
+	__atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+void uring::register_buf_ring(void * ring, unsigned entries, uint16_t groupId)
+{
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+	reg.ring_entries = entries;
+	reg.bgid = groupId;
+
+	if (sys_io_uring_register(m_descriptor, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		throw_errno("failed to register io_uring buffer ring");
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "socket_common.h"
+
+#include <linux/io_uring.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Thin wrapper over raw io_uring syscalls (we don't depend on liburing).
+ * Ring is not thread-safe: it should be driven by one thread at a time.
+ */
+class uring: public with_descriptor {
+public:
+	explicit uring(unsigned entries);
+	~uring();
+
+	/*
+	 * Returns zeroed sqe to fill. If submission queue is full
+	 * then pending entries are submitted first.
+	 */
+	io_uring_sqe * get_sqe();
+
+	/*
+	 * Submits all prepared sqes in one io_uring_enter and waits
+	 * until at least waitCount completions are available.
+	 */
+	void submit_and_wait(unsigned waitCount);
+
+	/*
+	 * Same with positive timeout, returns false if it expired first.
+	 */
+	bool submit_and_wait(unsigned waitCount, std::chrono::nanoseconds timeout);
+
+	/*
+	 * Returns oldest unseen completion or nullptr, never blocks.
+	 */
+	io_uring_cqe * peek_cqe();
+	void cqe_seen();
+
+	/*
+	 * Ring memory must be page aligned and hold entries io_uring_buf's.
+	 */
+	void register_buf_ring(void * ring, unsigned entries, uint16_t groupId);
+
+private:
+	unsigned pending_sqes() const;
+
+	void * m_sqRing = nullptr;
+	void * m_cqRing = nullptr;
+	size_t m_sqRingSize = 0;
+	size_t m_cqRingSize = 0;
+	io_uring_sqe * m_sqes = nullptr;
+	size_t m_sqesSize = 0;
+
+	unsigned * m_sqHead;
+	unsigned * m_sqTail;
+	unsigned * m_sqArray;
+	unsigned m_sqMask;
+	unsigned m_sqEntries;
+	unsigned m_sqLocalTail;
+
+	unsigned * m_cqHead;
+	unsigned * m_cqTail;
+	unsigned m_cqMask;
+	io_uring_cqe * m_cqes;
+};
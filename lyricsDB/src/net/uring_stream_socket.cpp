@@ -0,0 +1,475 @@
+#include "uring_stream_socket.h"
+#include "socket_common.h"
+#include "uring.h"
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+constexpr unsigned URING_QUEUE_DEPTH = 16;
+constexpr unsigned URING_RECV_BUFFER_COUNT = 16; // must be power of 2
+constexpr size_t URING_RECV_BUFFER_SIZE = 16 * 1024;
+constexpr size_t URING_SEND_BUFFER_SIZE = 64 * 1024;
+constexpr uint16_t URING_RECV_BUFFER_GROUP = 0;
+constexpr auto URING_SERVER_SOCKET_BACKLOG_LENGTH = 128;
+
+namespace {
+
+enum completion_tag: uint64_t {
+	SEND_TAG = 1,
+	RECV_TAG = 2,
+	ACCEPT_TAG = 3,
+	STOP_TAG = 4,
+	CANCEL_TAG = 5
+};
+
+class uring_stream_client_socket: public stream_client_socket, public with_descriptor {
+public:
+	explicit uring_stream_client_socket(int sockfd)
+		: with_descriptor(sockfd)
+	{
+		if (!is_valid())
+			throw_errno("invalid socket descriptor");
+		setup_ring();
+	}
+
+	uring_stream_client_socket(std::string const & hostname, uint16_t port)
+		: with_descriptor(-1)
+		, m_hostname(hostname)
+		, m_port(port)
+	{}
+
+	~uring_stream_client_socket()
+	{
+		// ring must go first: kernel may still reference buffer ring memory
+		m_ring.reset();
+		if (m_bufRing)
+			munmap(m_bufRing, buf_ring_size());
+	}
+
+	void send(void const * buf, size_t size) override
+	{
+		check_usable();
+
+		if (m_sendSize + size > URING_SEND_BUFFER_SIZE)
+			flush();
+
+		if (size > URING_SEND_BUFFER_SIZE) {
+			send_all(static_cast<uint8_t const *>(buf), size);
+			return;
+		}
+
+		memcpy(m_sendBuffer.data() + m_sendSize, buf, size);
+		m_sendSize += size;
+	}
+
+	void recv(void * buf, size_t size) override
+	{
+		check_usable();
+
+		flush();
+
+		auto deadline = m_deadlines.next(socket_direction::RECV, m_limits);
+		uint8_t * data = static_cast<uint8_t *>(buf);
+		while (size > 0) {
+			if (m_chunks.empty()) {
+				if (!wait_recv(deadline))
+					timed_out("recv timed out, " + std::to_string(size) + " bytes left");
+				continue;
+			}
+
+			auto & chunk = m_chunks.front();
+			size_t portion = std::min<size_t>(size, chunk.length);
+			memcpy(data, m_recvBuffers.data() + chunk.bufferId * URING_RECV_BUFFER_SIZE + chunk.offset, portion);
+			data += portion;
+			size -= portion;
+			chunk.offset += portion;
+			chunk.length -= portion;
+
+			if (chunk.length == 0) {
+				recycle_buffer(chunk.bufferId);
+				m_chunks.pop_front();
+			}
+		}
+	}
+
+	void flush() override
+	{
+		if (!m_sendSize)
+			return;
+
+		size_t size = m_sendSize;
+		m_sendSize = 0;
+		send_all(m_sendBuffer.data(), size);
+	}
+
+	void set_limits(socket_limits const & limits) override
+	{
+		if (is_valid())
+			set_send_buffer_size(m_descriptor, limits.sendBufferSize);
+		m_limits = limits;
+	}
+
+	void begin_message(socket_direction direction) override
+	{
+		m_deadlines.begin(direction, m_limits);
+	}
+
+	void end_message(socket_direction direction) override
+	{
+		m_deadlines.end(direction);
+	}
+
+	bool wait_readable(std::chrono::milliseconds timeout) override
+	{
+		check_usable();
+		flush();
+
+		auto deadline = deadline_after(timeout);
+		while (m_chunks.empty() && !m_eof && !m_recvError)
+			if (!wait_recv(deadline))
+				return false;
+		return true;
+	}
+
+	bool poll_readable() override
+	{
+		check_usable();
+		flush();
+
+		if (m_chunks.empty() && !m_eof && !m_recvError) {
+			if (!m_recvArmed)
+				arm_recv();
+			m_ring->submit_and_wait(0);
+			reap_completions();
+		}
+		return !m_chunks.empty() || m_eof || m_recvError;
+	}
+
+	void shutdown() override
+	{
+		// pending recv completes with EOF, sends fail
+		shutdown_descriptor();
+	}
+
+	void connect() override
+	{
+		if (is_valid())
+			throw socket_exception("socket already connected");
+
+		socket_address addr = resolve_address(m_hostname, m_port, false);
+		m_descriptor = create_stream_socket(addr);
+		if (::connect(m_descriptor, addr.get(), addr.length) < 0)
+			throw_errno("failed to connect to host");
+		configure_stream_socket(m_descriptor, addr.family());
+		set_send_buffer_size(m_descriptor, m_limits.sendBufferSize);
+
+		setup_ring();
+	}
+
+private:
+	struct recv_chunk {
+		uint16_t bufferId;
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	static size_t buf_ring_size()
+	{
+		return URING_RECV_BUFFER_COUNT * sizeof(io_uring_buf);
+	}
+
+	void setup_ring()
+	{
+		m_ring.reset(new uring(URING_QUEUE_DEPTH));
+		m_sendBuffer.resize(URING_SEND_BUFFER_SIZE);
+		m_recvBuffers.resize(URING_RECV_BUFFER_COUNT * URING_RECV_BUFFER_SIZE);
+
+		// buffer ring has to be page aligned
+		void * mem = mmap(nullptr, buf_ring_size(), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			throw_errno("failed to allocate buffer ring");
+		try {
+			m_ring->register_buf_ring(mem, URING_RECV_BUFFER_COUNT, URING_RECV_BUFFER_GROUP);
+		} catch (...) {
+			munmap(mem, buf_ring_size());
+			throw;
+		}
+		m_bufRing = static_cast<io_uring_buf *>(mem);
+
+		for (uint16_t id = 0; id < URING_RECV_BUFFER_COUNT; ++id)
+			recycle_buffer(id);
+	}
+
+	void recycle_buffer(uint16_t bufferId)
+	{
+		auto & buf = m_bufRing[m_bufRingTail & (URING_RECV_BUFFER_COUNT - 1)];
+		buf.addr = reinterpret_cast<uint64_t>(m_recvBuffers.data() + bufferId * URING_RECV_BUFFER_SIZE);
+		buf.len = URING_RECV_BUFFER_SIZE;
+		buf.bid = bufferId;
+		++m_bufRingTail;
+		// ring tail overlays resv field of the first entry (see io_uring_buf_ring)
+		__atomic_store_n(&m_bufRing[0].resv, m_bufRingTail, __ATOMIC_RELEASE);
+	}
+
+	void arm_recv()
+	{
+		io_uring_sqe * sqe = m_ring->get_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = m_descriptor;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_RECV_BUFFER_GROUP;
+		sqe->user_data = RECV_TAG;
+		m_recvArmed = true;
+	}
+
+	void check_usable() const
+	{
+		if (!is_valid())
+			throw socket_exception("socket not connected");
+		if (m_timedOut)
+			throw socket_timeout_exception("socket timed out before");
+	}
+
+	[[noreturn]] void timed_out(std::string const & msg)
+	{
+		// operations may still be in flight, so the socket is done for
+		m_timedOut = true;
+		throw socket_timeout_exception(msg);
+	}
+
+	/*
+	 * Returns false if deadline passed before anything was received.
+	 */
+	bool wait_recv(socket_clock::time_point deadline)
+	{
+		if (m_recvError)
+			throw_errno("failed to recv", m_recvError);
+		if (m_eof)
+			throw socket_exception("failed to recv: connection closed by peer");
+
+		if (!m_recvArmed)
+			arm_recv();
+		if (!wait_completion(deadline))
+			return false;
+		reap_completions();
+		return true;
+	}
+
+	bool wait_completion(socket_clock::time_point deadline)
+	{
+		if (deadline == socket_clock::time_point::max()) {
+			m_ring->submit_and_wait(1);
+			return true;
+		}
+		auto left = deadline - socket_clock::now();
+		return left.count() > 0 && m_ring->submit_and_wait(1, left);
+	}
+
+	/*
+	 * One SQE at a time, each waited for: what saves syscalls is that
+	 * send() coalesced the message, not batching in the ring.
+	 */
+	void send_all(uint8_t const * data, size_t size)
+	{
+		auto deadline = m_deadlines.next(socket_direction::SEND, m_limits);
+		while (size > 0) {
+			io_uring_sqe * sqe = m_ring->get_sqe();
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = m_descriptor;
+			sqe->addr = reinterpret_cast<uint64_t>(data);
+			sqe->len = uint32_t(std::min<size_t>(size, UINT32_MAX));
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = SEND_TAG;
+
+			m_sendDone = false;
+			while (!m_sendDone) {
+				if (!wait_completion(deadline))
+					timed_out("send timed out, " + std::to_string(size) + " bytes left");
+				reap_completions();
+			}
+
+			if (m_sendResult <= 0)
+				throw_errno("failed to send " + std::to_string(size) + " bytes",
+					m_sendResult < 0 ? -m_sendResult : EPIPE);
+			data += m_sendResult;
+			size -= m_sendResult;
+		}
+	}
+
+	void reap_completions()
+	{
+		while (io_uring_cqe * cqe = m_ring->peek_cqe()) {
+			if (cqe->user_data == SEND_TAG) {
+				m_sendDone = true;
+				m_sendResult = cqe->res;
+			} else if (cqe->user_data == RECV_TAG) {
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					m_recvArmed = false;
+
+				if (cqe->res > 0)
+					m_chunks.push_back({ uint16_t(cqe->flags >> IORING_CQE_BUFFER_SHIFT), 0, uint32_t(cqe->res) });
+				else if (cqe->res == 0)
+					m_eof = true;
+				else if (cqe->res != -ENOBUFS)
+					// ENOBUFS: all buffers are held by m_chunks, rearm after they are consumed
+					m_recvError = -cqe->res;
+			}
+			m_ring->cqe_seen();
+		}
+	}
+
+	std::string m_hostname;
+	uint16_t m_port = 0;
+	socket_limits m_limits;
+	call_deadlines m_deadlines;
+	bool m_timedOut = false;
+
+	std::unique_ptr<uring> m_ring;
+
+	std::vector<uint8_t> m_sendBuffer;
+	size_t m_sendSize = 0;
+	bool m_sendDone = false;
+	int m_sendResult = 0;
+
+	// io_uring_buf_ring isn't usable from C++ (flex array gets wrong offset),
+	// so ring is addressed as a plain array of entries
+	io_uring_buf * m_bufRing = nullptr;
+	uint16_t m_bufRingTail = 0;
+	std::vector<uint8_t> m_recvBuffers;
+	std::deque<recv_chunk> m_chunks;
+	bool m_recvArmed = false;
+	bool m_eof = false;
+	int m_recvError = 0;
+};
+
+class uring_stream_server_socket: public stream_server_socket, public with_descriptor {
+public:
+	uring_stream_server_socket(std::string const & hostname, uint16_t port, bool reusePort)
+		: with_descriptor(-1)
+		, m_address(resolve_address(hostname, port, true))
+		, m_ring(URING_QUEUE_DEPTH)
+	{
+		m_descriptor = create_stream_socket(m_address);
+		set_listen_options(m_descriptor, reusePort);
+		bind_and_listen(m_descriptor, m_address, URING_SERVER_SOCKET_BACKLOG_LENGTH);
+	}
+
+	explicit uring_stream_server_socket(int descriptor)
+		: with_descriptor(descriptor)
+		, m_address(local_address(descriptor))
+		, m_ring(URING_QUEUE_DEPTH)
+	{}
+
+	~uring_stream_server_socket()
+	{
+		for (int client: m_accepted)
+			close(client);
+		if (!m_handedOver)
+			unlink_address(m_address);
+	}
+
+	socket_ptr accept_one_client() override
+	{
+		while (m_accepted.empty()) {
+			// once stopped, accept is done when its cancellation completes
+			if (m_stopped && !m_acceptArmed)
+				throw socket_exception("listening socket was handed over");
+			if (!m_acceptArmed) {
+				io_uring_sqe * sqe = m_ring.get_sqe();
+				sqe->opcode = IORING_OP_ACCEPT;
+				sqe->fd = m_descriptor;
+				sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+				sqe->user_data = ACCEPT_TAG;
+				m_acceptArmed = true;
+			}
+			if (!m_stopArmed) {
+				io_uring_sqe * sqe = m_ring.get_sqe();
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->fd = m_stopper.descriptor();
+				sqe->poll32_events = POLLIN;
+				sqe->user_data = STOP_TAG;
+				m_stopArmed = true;
+			}
+			m_ring.submit_and_wait(1);
+
+			while (io_uring_cqe * cqe = m_ring.peek_cqe()) {
+				uint64_t tag = cqe->user_data;
+				int res = cqe->res;
+				bool more = cqe->flags & IORING_CQE_F_MORE;
+				m_ring.cqe_seen();
+
+				if (tag == STOP_TAG) {
+					m_stopped = true;
+					io_uring_sqe * sqe = m_ring.get_sqe();
+					sqe->opcode = IORING_OP_ASYNC_CANCEL;
+					sqe->addr = ACCEPT_TAG;
+					sqe->user_data = CANCEL_TAG;
+					continue;
+				}
+				if (tag != ACCEPT_TAG)
+					continue;
+				if (!more)
+					m_acceptArmed = false;
+				if (res == -ECANCELED && m_stopped)
+					continue;
+				if (res < 0)
+					throw_errno("failed to accept client", -res);
+				configure_stream_socket(res, m_address.family());
+				m_accepted.push_back(res);
+			}
+		}
+
+		int client = m_accepted.front();
+		m_accepted.pop_front();
+		return socket_ptr(new uring_stream_client_socket(client));
+	}
+
+	int descriptor() const override
+	{
+		return m_descriptor;
+	}
+
+	void hand_over() override
+	{
+		m_handedOver = true;
+		m_stopper.stop();
+	}
+
+private:
+	socket_address m_address;
+	uring m_ring;
+	bool m_acceptArmed = false;
+	std::deque<int> m_accepted;
+	// eventfd polled in the ring along with accept
+	accept_stopper m_stopper;
+	bool m_stopArmed = false;
+	bool m_stopped = false;
+	bool m_handedOver = false;
+};
+
+} // namespace
+
+client_socket_ptr make_uring_client_socket(std::string const & hostname, uint16_t port)
+{
+	return client_socket_ptr(new uring_stream_client_socket(hostname, port));
+}
+
+server_socket_ptr make_uring_server_socket(std::string const & hostname, uint16_t port, bool reusePort)
+{
+	return server_socket_ptr(new uring_stream_server_socket(hostname, port, reusePort));
+}
+
+server_socket_ptr adopt_uring_server_socket(int descriptor)
+{
+	return server_socket_ptr(new uring_stream_server_socket(descriptor));
+}
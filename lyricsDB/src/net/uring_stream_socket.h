@@ -0,0 +1,24 @@
+#pragma once
+
+#include "stream_socket.h"
+
+/*
+ * io_uring backed sockets. Every socket owns a small ring:
+ *  - sends are coalesced in a staging buffer and go out as one send on
+ *    flush(), before blocking recv() or when the buffer is full. Rings
+ *    aren't shared and the send is waited for before anything else is
+ *    submitted, so one message costs one send, not a batch of them;
+ *  - recv is a multishot request into a registered buffer ring, so
+ *    data arrived in between is consumed without entering the kernel;
+ *  - server socket keeps one multishot accept armed.
+ * Use make_client_socket/make_server_socket with socket_backend::URING.
+ */
+
+client_socket_ptr make_uring_client_socket(std::string const & hostname, uint16_t port);
+
+server_socket_ptr make_uring_server_socket(std::string const & hostname, uint16_t port, bool reusePort);
+
+/*
+ * See adopt_server_socket.
+ */
+server_socket_ptr adopt_uring_server_socket(int descriptor);
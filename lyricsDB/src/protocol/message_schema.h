@@ -0,0 +1,590 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Wire formats of messages declared as field lists. A format knows
+ * the exact frame size of its values, encodes them with one allocation
+ * and decodes a frame checking every size against frame bounds. Frame
+ * layouts are:
+ *   string_list_format    [type][u64 count]{u64 size, bytes}...
+ *   single_string_format  [type][u64 size][bytes]
+ *   empty_format          [type]
+ * Every field takes one or more strings of the frame, numbers are 8-byte
+ * strings.
+ */
+
+namespace schema {
+
+///////////////////////////////////////////////////////////////////////////////
+// frame cursors
+
+class frame_writer {
+public:
+	explicit frame_writer(uint8_t * data)
+		: m_data(data)
+	{}
+
+	void number(uint64_t value)
+	{
+		memcpy(m_data, &value, sizeof(value));
+		m_data += sizeof(value);
+	}
+
+	void string(void const * data, uint64_t size)
+	{
+		number(size);
+		memcpy(m_data, data, size);
+		m_data += size;
+	}
+
+private:
+	uint8_t * m_data;
+};
+
+struct string_view {
+	char const * data;
+	uint64_t size;
+};
+
+/*
+ * Reads strings of string list frame, count is checked to fit into
+ * the frame before anything is read.
+ */
+class list_reader {
+public:
+	explicit list_reader(message_bytes const & bytes)
+		: m_data(bytes.data() + 1 + sizeof(uint64_t))
+		, m_end(bytes.data() + bytes.size())
+	{
+		if (bytes.size() < 1 + sizeof(uint64_t))
+			throw protocol_exception("message is too short");
+		memcpy(&m_count, bytes.data() + 1, sizeof(m_count));
+		// every string takes at least its size field
+		if (m_count > uint64_t(m_end - m_data) / sizeof(uint64_t))
+			throw protocol_exception("string count doesn't fit into message");
+	}
+
+	uint64_t count() const { return m_count; }
+	uint64_t remaining() const { return m_count - m_read; }
+
+	string_view string()
+	{
+		if (!remaining())
+			throw protocol_exception("unexpected number of strings in message");
+
+		uint64_t size = 0;
+		if (uint64_t(m_end - m_data) < sizeof(size))
+			throw protocol_exception("string header is out of message bounds");
+		memcpy(&size, m_data, sizeof(size));
+		m_data += sizeof(size);
+
+		if (size > uint64_t(m_end - m_data))
+			throw protocol_exception("string is out of message bounds");
+		string_view view { reinterpret_cast<char const *>(m_data), size };
+		m_data += size;
+		++m_read;
+		return view;
+	}
+
+	void finish() const
+	{
+		if (remaining())
+			throw protocol_exception("unexpected number of strings in message");
+		if (m_data != m_end)
+			throw protocol_exception("trailing bytes after last string");
+	}
+
+private:
+	uint8_t const * m_data;
+	uint8_t const * m_end;
+	uint64_t m_count = 0;
+	uint64_t m_read = 0;
+};
+
+/*
+ * Reads the only string of single string frame, its size must cover
+ * the rest of the frame exactly.
+ */
+class single_reader {
+public:
+	explicit single_reader(message_bytes const & bytes)
+		: m_bytes(bytes)
+	{
+		if (bytes.size() < 1 + sizeof(uint64_t))
+			throw protocol_exception("message is too short");
+	}
+
+	uint64_t remaining() const { return m_read ? 0 : 1; }
+
+	string_view string()
+	{
+		uint64_t size = 0;
+		memcpy(&size, m_bytes.data() + 1, sizeof(size));
+		if (size != m_bytes.size() - 1 - sizeof(size))
+			throw protocol_exception("string size doesn't match message size");
+		m_read = true;
+		return { reinterpret_cast<char const *>(m_bytes.data() + 1 + sizeof(size)), size };
+	}
+
+	void finish() const {}
+
+private:
+	message_bytes const & m_bytes;
+	bool m_read = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// fields
+//
+// Field type names value type, codec<Field> tells how many strings its
+// value takes, their size with headers and how to write and read them.
+// Fields of variable length take the rest of the frame, so they go last.
+
+struct string_field { using value_type = std::string; };
+struct number_field { using value_type = uint64_t; };
+struct digest_field { using value_type = text_digest; };
+struct duration_field { using value_type = std::chrono::microseconds; };
+// frame of another request, not of a deadline_request
+struct request_field { using value_type = message_ptr; };
+struct string_list_field { using value_type = std::vector<std::string>; };
+// u64 count, then count records
+template<typename Record> struct counted_records_field { using value_type = std::vector<Record>; };
+// records till the end of frame
+template<typename Record> struct records_field { using value_type = std::vector<Record>; };
+
+/*
+ * Fields of a plain struct used in record fields, specialized with
+ * fields list and tie() returning references to members in that order.
+ */
+template<typename Record>
+struct record_format;
+
+template<typename Field>
+struct codec;
+
+template<typename... Fields>
+struct field_list {};
+
+uint64_t constexpr sum(std::initializer_list<uint64_t> values)
+{
+	uint64_t result = 0;
+	for (uint64_t v: values)
+		result += v;
+	return result;
+}
+
+template<typename... Fields>
+uint64_t constexpr fixed_strings(field_list<Fields...>)
+{
+	return sum({ 0, codec<Fields>::strings... });
+}
+
+template<typename... Fields>
+bool constexpr is_fixed(field_list<Fields...>)
+{
+	return sum({ 0, uint64_t(codec<Fields>::variable)... }) == 0;
+}
+
+template<>
+struct codec<string_field> {
+	static uint64_t constexpr strings = 1;
+	static bool constexpr variable = false;
+
+	static uint64_t size(std::string const & value) { return sizeof(uint64_t) + value.size(); }
+	static uint64_t count(std::string const &) { return strings; }
+	static void write(frame_writer & w, std::string const & value) { w.string(value.data(), value.size()); }
+
+	template<typename Reader>
+	static void read(Reader & r, std::string & value)
+	{
+		string_view s = r.string();
+		value.assign(s.data, s.size);
+	}
+};
+
+template<>
+struct codec<number_field> {
+	static uint64_t constexpr strings = 1;
+	static bool constexpr variable = false;
+
+	static uint64_t size(uint64_t) { return 2 * sizeof(uint64_t); }
+	static uint64_t count(uint64_t) { return strings; }
+
+	static void write(frame_writer & w, uint64_t value)
+	{
+		w.number(sizeof(value));
+		w.number(value);
+	}
+
+	template<typename Reader>
+	static void read(Reader & r, uint64_t & value)
+	{
+		string_view s = r.string();
+		if (s.size != sizeof(value))
+			throw protocol_exception("invalid number size");
+		memcpy(&value, s.data, sizeof(value));
+	}
+};
+
+template<>
+struct codec<digest_field> {
+	static uint64_t constexpr strings = 1;
+	static bool constexpr variable = false;
+
+	static uint64_t size(text_digest const & value) { return sizeof(uint64_t) + value.bytes.size(); }
+	static uint64_t count(text_digest const &) { return strings; }
+	static void write(frame_writer & w, text_digest const & value) { w.string(value.bytes.data(), value.bytes.size()); }
+
+	template<typename Reader>
+	static void read(Reader & r, text_digest & value)
+	{
+		string_view s = r.string();
+		if (s.size != value.bytes.size())
+			throw protocol_exception("invalid digest size");
+		memcpy(value.bytes.data(), s.data, s.size);
+	}
+};
+
+template<>
+struct codec<duration_field> {
+	static uint64_t constexpr strings = 1;
+	static bool constexpr variable = false;
+
+	static uint64_t size(std::chrono::microseconds) { return 2 * sizeof(uint64_t); }
+	static uint64_t count(std::chrono::microseconds) { return strings; }
+	static void write(frame_writer & w, std::chrono::microseconds value) { codec<number_field>::write(w, value.count()); }
+
+	template<typename Reader>
+	static void read(Reader & r, std::chrono::microseconds & value)
+	{
+		uint64_t count;
+		codec<number_field>::read(r, count);
+		if (count > uint64_t(std::chrono::microseconds::max().count()))
+			throw protocol_exception("duration is too large");
+		value = std::chrono::microseconds(count);
+	}
+};
+
+template<>
+struct codec<request_field> {
+	static uint64_t constexpr strings = 1;
+	static bool constexpr variable = false;
+
+	// written from the serialized request, so it is serialized once
+	static uint64_t size(message_bytes const & value) { return sizeof(uint64_t) + value.size(); }
+	static uint64_t count(message_bytes const &) { return strings; }
+	static void write(frame_writer & w, message_bytes const & value) { w.string(value.data(), value.size()); }
+
+	template<typename Reader>
+	static void read(Reader & r, message_ptr & value)
+	{
+		string_view s = r.string();
+		if (!s.size || uint8_t(s.data[0]) == uint8_t(message_type::DEADLINE_REQUEST))
+			throw protocol_exception("deadline request must wrap another request");
+		value = parse_message(message_bytes(s.data, s.data + s.size));
+	}
+};
+
+template<>
+struct codec<string_list_field> {
+	static uint64_t constexpr strings = 0;
+	static bool constexpr variable = true;
+
+	static uint64_t size(std::vector<std::string> const & value)
+	{
+		uint64_t size = 0;
+		for (auto const & str: value)
+			size += codec<string_field>::size(str);
+		return size;
+	}
+
+	static uint64_t count(std::vector<std::string> const & value) { return value.size(); }
+
+	static void write(frame_writer & w, std::vector<std::string> const & value)
+	{
+		for (auto const & str: value)
+			codec<string_field>::write(w, str);
+	}
+
+	template<typename Reader>
+	static void read(Reader & r, std::vector<std::string> & value)
+	{
+		value.reserve(r.remaining());
+		while (r.remaining()) {
+			string_view s = r.string();
+			value.emplace_back(s.data, s.size);
+		}
+	}
+};
+
+/*
+ * Applies fn to every field codec and matching member of a record.
+ */
+template<typename Fn, typename Tuple, typename... Fields, size_t... I>
+void for_each_field(Fn && fn, Tuple && members, field_list<Fields...>, std::index_sequence<I...>)
+{
+	int expand[] = { 0, (fn(codec<Fields>(), std::get<I>(members)), 0)... };
+	(void) expand;
+}
+
+template<typename Record, typename Fn>
+void for_each_member(Record & record, Fn && fn)
+{
+	using format = record_format<typename std::remove_const<Record>::type>;
+	auto members = format::tie(record);
+	for_each_field(fn, members, typename format::fields(),
+		std::make_index_sequence<std::tuple_size<decltype(members)>::value>());
+}
+
+template<typename Record>
+struct codec<records_field<Record>> {
+	static uint64_t constexpr strings = 0;
+	static bool constexpr variable = true;
+	static uint64_t constexpr recordStrings = fixed_strings(typename record_format<Record>::fields());
+	static_assert(is_fixed(typename record_format<Record>::fields()), "record fields must have fixed size");
+
+	static uint64_t size(std::vector<Record> const & value)
+	{
+		uint64_t size = 0;
+		for (auto const & record: value) {
+			for_each_member(record, [&size] (auto c, auto const & member) {
+				size += decltype(c)::size(member);
+			});
+		}
+		return size;
+	}
+
+	static uint64_t count(std::vector<Record> const & value) { return recordStrings * value.size(); }
+
+	static void write(frame_writer & w, std::vector<Record> const & value)
+	{
+		for (auto const & record: value) {
+			for_each_member(record, [&w] (auto c, auto const & member) {
+				decltype(c)::write(w, member);
+			});
+		}
+	}
+
+	template<typename Reader>
+	static void read(Reader & r, std::vector<Record> & value)
+	{
+		if (r.remaining() % recordStrings)
+			throw protocol_exception("records don't fill message");
+		read_records(r, value, r.remaining() / recordStrings);
+	}
+
+	template<typename Reader>
+	static void read_records(Reader & r, std::vector<Record> & value, uint64_t count)
+	{
+		value.resize(count);
+		for (auto & record: value) {
+			for_each_member(record, [&r] (auto c, auto & member) {
+				decltype(c)::read(r, member);
+			});
+		}
+	}
+};
+
+template<typename Record>
+struct codec<counted_records_field<Record>> {
+	using records = codec<records_field<Record>>;
+	static uint64_t constexpr strings = 1;
+	static bool constexpr variable = true;
+
+	static uint64_t size(std::vector<Record> const & value)
+	{
+		return codec<number_field>::size(value.size()) + records::size(value);
+	}
+
+	static uint64_t count(std::vector<Record> const & value) { return 1 + records::count(value); }
+
+	static void write(frame_writer & w, std::vector<Record> const & value)
+	{
+		codec<number_field>::write(w, value.size());
+		records::write(w, value);
+	}
+
+	template<typename Reader>
+	static void read(Reader & r, std::vector<Record> & value)
+	{
+		uint64_t count;
+		codec<number_field>::read(r, count);
+		if (count > r.remaining() / records::recordStrings)
+			throw protocol_exception("record count doesn't fit into message");
+		records::read_records(r, value, count);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// formats
+
+/*
+ * Makes message from decoded values in wire order, specialized when
+ * constructor takes them in another order.
+ */
+template<typename Message>
+struct message_factory {
+	template<typename... Values>
+	static message_ptr make(Values &&... values)
+	{
+		return std::make_shared<Message>(std::forward<Values>(values)...);
+	}
+};
+
+template<typename Reader, typename Message, typename... Fields>
+struct fields_decoder {
+	using values = std::tuple<typename Fields::value_type...>;
+
+	static message_ptr decode(Reader & r)
+	{
+		return decode(r, std::index_sequence_for<Fields...>());
+	}
+
+	template<size_t... I>
+	static message_ptr decode(Reader & r, std::index_sequence<I...>)
+	{
+		values v;
+		// braced list is evaluated left to right, in wire order
+		int expand[] = { 0, (codec<Fields>::read(r, std::get<I>(v)), 0)... };
+		(void) expand;
+		r.finish();
+		return message_factory<Message>::make(std::move(std::get<I>(v))...);
+	}
+};
+
+template<message_type Type, typename Message, typename... Fields>
+struct string_list_format {
+	static message_type constexpr type = Type;
+	using message = Message;
+
+	/*
+	 * Values are field values or anything codecs write, e.g. serialized
+	 * request for request_field.
+	 */
+	template<typename... Values>
+	static message_bytes encode(Values const &... values)
+	{
+		static_assert(sizeof...(Values) == sizeof...(Fields), "value for every field is required");
+		uint64_t size = sum({ 1 + sizeof(uint64_t), codec<Fields>::size(values)... });
+		uint64_t count = sum({ 0, codec<Fields>::count(values)... });
+
+		message_bytes bytes(size);
+		bytes[0] = uint8_t(Type);
+		frame_writer w(bytes.data() + 1);
+		w.number(count);
+		int expand[] = { 0, (codec<Fields>::write(w, values), 0)... };
+		(void) expand;
+		return bytes;
+	}
+
+	static message_ptr decode(message_bytes const & bytes)
+	{
+		list_reader r(bytes);
+		// frames of fixed formats are checked before anything is allocated
+		if (is_fixed(field_list<Fields...>()) && r.count() != fixed_strings(field_list<Fields...>()))
+			throw protocol_exception("unexpected number of strings in message");
+		return fields_decoder<list_reader, Message, Fields...>::decode(r);
+	}
+};
+
+template<message_type Type, typename Message, typename Field>
+struct single_string_format {
+	static_assert(codec<Field>::strings == 1 && !codec<Field>::variable, "field must take one string");
+
+	static message_type constexpr type = Type;
+	using message = Message;
+
+	template<typename Value>
+	static message_bytes encode(Value const & value)
+	{
+		message_bytes bytes(1 + codec<Field>::size(value));
+		bytes[0] = uint8_t(Type);
+		frame_writer w(bytes.data() + 1);
+		codec<Field>::write(w, value);
+		return bytes;
+	}
+
+	static message_ptr decode(message_bytes const & bytes)
+	{
+		single_reader r(bytes);
+		return fields_decoder<single_reader, Message, Field>::decode(r);
+	}
+};
+
+template<message_type Type, typename Message>
+struct empty_format {
+	static message_type constexpr type = Type;
+	using message = Message;
+
+	static message_bytes encode()
+	{
+		return message_bytes(1, uint8_t(Type));
+	}
+
+	static message_ptr decode(message_bytes const & bytes)
+	{
+		if (bytes.size() != 1)
+			throw protocol_exception("trailing bytes after message type");
+		return message_factory<Message>::make();
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// registry
+
+template<typename... Formats>
+struct format_list {};
+
+/*
+ * Format of message type in the list, fails to compile if there's none.
+ */
+template<message_type Type, typename List>
+struct find_format;
+
+template<message_type Type, typename First, typename... Rest>
+struct find_format<Type, format_list<First, Rest...>> {
+	using type = typename std::conditional<First::type == Type,
+		First, typename find_format<Type, format_list<Rest...>>::type>::type;
+};
+
+template<message_type Type>
+struct find_format<Type, format_list<>> {
+	using type = void;
+};
+
+using parse_function = message_ptr (*)(message_bytes const &);
+
+struct dispatch_table {
+	parse_function parsers[256];
+	bool duplicate;
+};
+
+template<typename... Formats>
+dispatch_table constexpr make_dispatch_table(format_list<Formats...>)
+{
+	dispatch_table table {};
+	message_type const types[] = { Formats::type... };
+	parse_function const parsers[] = { &Formats::decode... };
+	for (size_t i = 0; i < sizeof...(Formats); ++i) {
+		if (table.parsers[uint8_t(types[i])])
+			table.duplicate = true;
+		table.parsers[uint8_t(types[i])] = parsers[i];
+	}
+	return table;
+}
+
+} // namespace schema
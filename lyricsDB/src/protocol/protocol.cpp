@@ -1,260 +1,456 @@
 #include "protocol.h"
+#include "message_schema.h"
 
-#include <algorithm>
-#include <cstring>
+#include <type_traits>
+#include <utility>
 
-namespace {
+namespace schema {
 
-void serialize_one_string(std::string const & str, message_bytes & bytes)
-{
-	uint8_t * data = bytes.data() + 1; // skip message type
-	uint64_t size = str.length();
+template<>
+struct record_format<song_popularity> {
+	using fields = field_list<string_field, string_field, number_field>;
 
-	// write size
-	memcpy(data, &size, sizeof(size));
-	data += sizeof(size);
+	template<typename Record>
+	static auto tie(Record & r) { return std::tie(r.author, r.song, r.requests); }
+};
 
-	// write author
-	memcpy(data, str.data(), size);
-}
+template<>
+struct record_format<author_popularity> {
+	using fields = field_list<string_field, number_field>;
 
-std::string deserialize_one_string(message_bytes const & bytes)
-{
-	uint8_t const * data = bytes.data() + 1; // skip message type
+	template<typename Record>
+	static auto tie(Record & r) { return std::tie(r.author, r.requests); }
+};
 
-	uint64_t size = 0;
-	memcpy(&size, data, sizeof(size));
-	data += sizeof(size);
+template<>
+struct record_format<scan_group> {
+	using fields = field_list<string_field, number_field>;
 
-	return std::string(data, data + size);
-}
+	template<typename Record>
+	static auto tie(Record & r) { return std::tie(r.author, r.value); }
+};
 
-void serialize_many_strings(std::vector<std::string> const & strings, message_bytes & bytes)
-{
-	uint64_t stringCount = strings.size();
-	uint8_t * data = bytes.data() + 1; // skip message type
-	memcpy(data, &stringCount, sizeof(stringCount));
-	data += sizeof(stringCount);
+template<>
+struct record_format<song_name> {
+	using fields = field_list<string_field, string_field>;
 
-	for (auto const & str: strings) {
-		uint64_t size = str.size();
-		memcpy(data, &size, sizeof(size));
-		data += sizeof(size);
+	template<typename Record>
+	static auto tie(Record & r) { return std::tie(r.author, r.song); }
+};
 
-		memcpy(data, str.data(), size);
-		data += size;
+// versioned list has version first, constructor takes it last
+template<>
+struct message_factory<get_song_list_response> {
+	static message_ptr make(std::vector<std::string> songs)
+	{
+		return std::make_shared<get_song_list_response>(std::move(songs));
 	}
-}
-
-std::vector<std::string> deserialize_many_strings(message_bytes const & bytes)
-{
-	uint8_t const * data = bytes.data() + 1; // skip message type
 
-	uint64_t stringCount = 0;
-	memcpy(&stringCount, data, sizeof(stringCount));
-	data += sizeof(stringCount);
+	static message_ptr make(uint64_t version, std::vector<std::string> songs)
+	{
+		return std::make_shared<get_song_list_response>(std::move(songs), version);
+	}
+};
+
+template<>
+struct message_factory<scan_request> {
+	static message_ptr make(std::string pattern, uint64_t minLines, uint64_t aggregate)
+	{
+		if (aggregate > uint64_t(scan_aggregate::OCCURRENCES_PER_AUTHOR))
+			throw protocol_exception("unknown scan aggregate");
+		scan_query query;
+		query.pattern = std::move(pattern);
+		query.minLines = minLines;
+		query.aggregate = scan_aggregate(aggregate);
+		return std::make_shared<scan_request>(std::move(query));
+	}
+};
+
+template<>
+struct message_factory<deadline_request> {
+	static message_ptr make(std::chrono::microseconds budget, message_ptr request)
+	{
+		if (budget > MAX_DEADLINE_BUDGET)
+			throw protocol_exception("deadline budget is too large");
+		return std::make_shared<deadline_request>(budget, std::move(request));
+	}
+};
+
+template<>
+struct message_factory<scan_response> {
+	static message_ptr make(uint64_t scannedSongs, uint64_t total, std::vector<scan_group> groups)
+	{
+		scan_result result;
+		result.scannedSongs = scannedSongs;
+		result.total = total;
+		result.groups = std::move(groups);
+		return std::make_shared<scan_response>(std::move(result));
+	}
+};
 
-	std::vector<std::string> strings;
-	for (uint64_t i = 0; i < stringCount; ++i) {
-		uint64_t size = 0;
-		memcpy(&size, data, sizeof(size));
-		data += sizeof(size);
+} // namespace schema
 
-		strings.emplace_back(data, data + size);
-		data += size;
-	}
+namespace {
 
-	return strings;
+using namespace schema;
+
+/*
+ * Wire format of every message type, declared once. Serialization and
+ * parsing are generated from it.
+ */
+using message_formats = format_list<
+	// requests
+	string_list_format<message_type::GET_SONG_REQUEST, get_song_request, string_field, string_field>,
+	single_string_format<message_type::GET_SONG_LIST_REQUEST, get_song_list_request, string_field>,
+	string_list_format<message_type::ADD_SONG_REQUEST, add_song_request, string_field, string_field, string_field>,
+	string_list_format<message_type::UPDATE_SONG_REQUEST, update_song_request,
+		string_field, string_field, digest_field, string_field>,
+	string_list_format<message_type::VERSIONED_GET_SONG_REQUEST, get_song_request,
+		string_field, string_field, number_field>,
+	string_list_format<message_type::VERSIONED_GET_SONG_LIST_REQUEST, get_song_list_request, string_field, number_field>,
+	empty_format<message_type::SUBSCRIBE_REQUEST, subscribe_request>,
+	string_list_format<message_type::TOP_SONGS_REQUEST, top_songs_request, number_field, number_field>,
+	string_list_format<message_type::DEADLINE_REQUEST, deadline_request, duration_field, request_field>,
+	string_list_format<message_type::SCAN_REQUEST, scan_request, string_field, number_field, number_field>,
+	string_list_format<message_type::FIND_SONG_REQUEST, find_song_request, string_field, string_field, number_field>,
+
+	// responses
+	single_string_format<message_type::GET_SONG_RESPONSE, get_song_response, string_field>,
+	string_list_format<message_type::GET_SONG_LIST_RESPONSE, get_song_list_response, string_list_field>,
+	single_string_format<message_type::ADD_SONG_RESPONSE, add_song_response, string_field>,
+	string_list_format<message_type::VERSIONED_GET_SONG_RESPONSE, get_song_response, string_field, number_field>,
+	string_list_format<message_type::VERSIONED_GET_SONG_LIST_RESPONSE, get_song_list_response,
+		number_field, string_list_field>,
+	single_string_format<message_type::NOT_MODIFIED_RESPONSE, not_modified_response, number_field>,
+	string_list_format<message_type::INVALIDATE_MESSAGE, invalidate_message, string_field, string_field>,
+	string_list_format<message_type::TOP_SONGS_RESPONSE, top_songs_response,
+		counted_records_field<song_popularity>, records_field<author_popularity>>,
+	single_string_format<message_type::OVERLOADED_RESPONSE, overloaded_response, string_field>,
+	string_list_format<message_type::SCAN_RESPONSE, scan_response,
+		number_field, number_field, records_field<scan_group>>,
+	string_list_format<message_type::GET_SONG_SUGGESTIONS_RESPONSE, get_song_response,
+		string_field, records_field<song_name>>
+>;
+
+template<message_type Type, typename... Values>
+message_bytes encode(Values const &... values)
+{
+	using format = typename find_format<Type, message_formats>::type;
+	static_assert(!std::is_void<format>::value, "message type has no format");
+	return format::encode(values...);
 }
 
+dispatch_table constexpr parsers = make_dispatch_table(message_formats());
+static_assert(!parsers.duplicate, "message type has two formats");
+
 } // namespace
 
 
-get_song_list_request::get_song_list_request(std::string const & author)
-	: m_author(author)
+get_song_list_request::get_song_list_request(std::string author)
+	: m_author(std::move(author))
+{}
+
+get_song_list_request::get_song_list_request(std::string author, uint64_t knownVersion)
+	: m_author(std::move(author))
+	, m_versioned(true)
+	, m_knownVersion(knownVersion)
 {}
 
 message_bytes get_song_list_request::serialize() const
 {
-	message_bytes bytes(1 + 8 + m_author.length());
+	return m_versioned
+		? encode<message_type::VERSIONED_GET_SONG_LIST_REQUEST>(m_author, m_knownVersion)
+		: encode<message_type::GET_SONG_LIST_REQUEST>(m_author);
+}
+
+void get_song_list_request::accept(request_visitor & v)
+{
+	v.visit(*this);
+}
+
+
+get_song_list_response::get_song_list_response(std::vector<std::string> songs)
+	: m_songs(std::move(songs))
+{}
 
-	bytes[0] = uint8_t(message_type::GET_SONG_LIST_REQUEST);
-	serialize_one_string(m_author, bytes);
+get_song_list_response::get_song_list_response(std::vector<std::string> songs, uint64_t version)
+	: m_songs(std::move(songs))
+	, m_versioned(true)
+	, m_version(version)
+{}
 
-	return bytes;
+message_bytes get_song_list_response::serialize() const
+{
+	return m_versioned
+		? encode<message_type::VERSIONED_GET_SONG_LIST_RESPONSE>(m_version, m_songs)
+		: encode<message_type::GET_SONG_LIST_RESPONSE>(m_songs);
 }
 
-message_ptr get_song_list_request::deserialize(message_bytes const & bytes)
+void get_song_list_response::accept(response_visitor & v)
 {
-	if (message_type(bytes[0]) != message_type::GET_SONG_LIST_REQUEST)
-		throw std::runtime_error("invalid message type");
+	v.visit(*this);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+get_song_request::get_song_request(std::string author, std::string song)
+	: m_author(std::move(author))
+	, m_song(std::move(song))
+{}
+
+get_song_request::get_song_request(std::string author, std::string song, uint64_t knownVersion)
+	: m_author(std::move(author))
+	, m_song(std::move(song))
+	, m_versioned(true)
+	, m_knownVersion(knownVersion)
+{}
 
-	return message_ptr(new get_song_list_request(deserialize_one_string(bytes)));
+message_bytes get_song_request::serialize() const
+{
+	return m_versioned
+		? encode<message_type::VERSIONED_GET_SONG_REQUEST>(m_author, m_song, m_knownVersion)
+		: encode<message_type::GET_SONG_REQUEST>(m_author, m_song);
 }
 
-void get_song_list_request::accept(request_visitor & v)
+void get_song_request::accept(request_visitor & v)
 {
 	v.visit(*this);
 }
 
 
-get_song_list_response::get_song_list_response(std::vector<std::string> const & songs)
-	: m_songs(songs)
+find_song_request::find_song_request(std::string author, std::string song, uint64_t suggestions)
+	: m_author(std::move(author))
+	, m_song(std::move(song))
+	, m_suggestions(suggestions)
 {}
 
-message_bytes get_song_list_response::serialize() const
+message_bytes find_song_request::serialize() const
 {
-	uint64_t commonSize = 0;
-	for (auto const & song: m_songs)
-		commonSize += song.size();
+	return encode<message_type::FIND_SONG_REQUEST>(m_author, m_song, m_suggestions);
+}
 
-	uint64_t songCount = m_songs.size();
-	message_bytes bytes(1 + 8 + 8 * songCount + commonSize);
-	bytes[0] = uint8_t(message_type::GET_SONG_LIST_RESPONSE);
+void find_song_request::accept(request_visitor & v)
+{
+	v.visit(*this);
+}
+
+
+get_song_response::get_song_response(std::string text)
+	: m_text(std::move(text))
+{}
+
+get_song_response::get_song_response(std::string text, uint64_t version)
+	: m_text(std::move(text))
+	, m_versioned(true)
+	, m_version(version)
+{}
 
-	serialize_many_strings(m_songs, bytes);
+get_song_response::get_song_response(std::string text, std::vector<song_name> suggestions)
+	: m_text(std::move(text))
+	, m_suggesting(true)
+	, m_suggestions(std::move(suggestions))
+{}
 
-	return bytes;
+message_bytes get_song_response::serialize() const
+{
+	if (m_suggesting)
+		return encode<message_type::GET_SONG_SUGGESTIONS_RESPONSE>(m_text, m_suggestions);
+	return m_versioned
+		? encode<message_type::VERSIONED_GET_SONG_RESPONSE>(m_text, m_version)
+		: encode<message_type::GET_SONG_RESPONSE>(m_text);
 }
 
-message_ptr get_song_list_response::deserialize(message_bytes const & bytes)
+void get_song_response::accept(response_visitor & v)
 {
-	if (bytes[0] != uint8_t(message_type::GET_SONG_LIST_RESPONSE))
-		throw std::runtime_error("invalid message type");
+	v.visit(*this);
+}
+
 
-	return message_ptr(new get_song_list_response(deserialize_many_strings(bytes)));
+not_modified_response::not_modified_response(uint64_t version)
+	: m_version(version)
+{}
+
+message_bytes not_modified_response::serialize() const
+{
+	return encode<message_type::NOT_MODIFIED_RESPONSE>(m_version);
 }
 
-void get_song_list_response::accept(response_visitor & v)
+void not_modified_response::accept(response_visitor & v)
 {
 	v.visit(*this);
 }
 
-
 ///////////////////////////////////////////////////////////////////////////////
 
-get_song_request::get_song_request(std::string const & author, std::string const & song)
-	: m_author(author)
-	, m_song(song)
+add_song_request::add_song_request(
+		std::string author,
+		std::string song,
+		std::string text)
+	: m_author(std::move(author))
+	, m_song(std::move(song))
+	, m_text(std::move(text))
 {}
 
-message_bytes get_song_request::serialize() const
+message_bytes add_song_request::serialize() const
+{
+	return encode<message_type::ADD_SONG_REQUEST>(m_author, m_song, m_text);
+}
+
+void add_song_request::accept(request_visitor & v)
 {
-	message_bytes bytes(1 + 8 + 8 + m_author.length() + 8 + m_song.length());
+	v.visit(*this);
+}
+
 
-	bytes[0] = uint8_t(message_type::GET_SONG_REQUEST);
-	serialize_many_strings({ m_author, m_song }, bytes);
+update_song_request::update_song_request(
+		std::string author,
+		std::string song,
+		text_digest baseDigest,
+		std::string delta)
+	: m_author(std::move(author))
+	, m_song(std::move(song))
+	, m_baseDigest(baseDigest)
+	, m_delta(std::move(delta))
+{}
 
-	return bytes;
+message_bytes update_song_request::serialize() const
+{
+	return encode<message_type::UPDATE_SONG_REQUEST>(m_author, m_song, m_baseDigest, m_delta);
 }
 
-message_ptr get_song_request::deserialize(message_bytes const & bytes)
+void update_song_request::accept(request_visitor & v)
 {
-	if (bytes[0] != uint8_t(message_type::GET_SONG_REQUEST))
-		throw std::runtime_error("invalid message type");;
+	v.visit(*this);
+}
 
-	auto strings = deserialize_many_strings(bytes);
-	if (strings.size() != 2)
-		throw std::runtime_error("not enough values to unpack");
 
-	return message_ptr(new get_song_request(strings[0], strings[1]));
+message_bytes subscribe_request::serialize() const
+{
+	return encode<message_type::SUBSCRIBE_REQUEST>();
 }
 
-void get_song_request::accept(request_visitor & v)
+void subscribe_request::accept(request_visitor & v)
 {
 	v.visit(*this);
 }
 
 
-get_song_response::get_song_response(std::string const & text)
-	: m_text(text)
+top_songs_request::top_songs_request(uint64_t count, uint64_t windows)
+	: m_count(count)
+	, m_windows(windows)
 {}
 
-message_bytes get_song_response::serialize() const
+message_bytes top_songs_request::serialize() const
 {
-	message_bytes bytes(1 + 8 + m_text.length());
-
-	bytes[0] = uint8_t(message_type::GET_SONG_RESPONSE);
-	serialize_one_string(m_text, bytes);
-
-	return bytes;
+	return encode<message_type::TOP_SONGS_REQUEST>(m_count, m_windows);
 }
 
-message_ptr get_song_response::deserialize(message_bytes const & bytes)
+void top_songs_request::accept(request_visitor & v)
 {
-	if (bytes[0] != uint8_t(message_type::GET_SONG_RESPONSE))
-		throw std::runtime_error("invalid message type");;
+	v.visit(*this);
+}
+
+
+top_songs_response::top_songs_response(std::vector<song_popularity> songs, std::vector<author_popularity> authors)
+	: m_songs(std::move(songs))
+	, m_authors(std::move(authors))
+{}
 
-	return message_ptr(new get_song_response(deserialize_one_string(bytes)));
+message_bytes top_songs_response::serialize() const
+{
+	return encode<message_type::TOP_SONGS_RESPONSE>(m_songs, m_authors);
 }
 
-void get_song_response::accept(response_visitor & v)
+void top_songs_response::accept(response_visitor & v)
 {
 	v.visit(*this);
 }
 
-///////////////////////////////////////////////////////////////////////////////
 
-add_song_request::add_song_request(
-		std::string const & author,
-		std::string const & song,
-		std::string const & text)
-	: m_author(author)
-	, m_song(song)
-	, m_text(text)
+deadline_request::deadline_request(std::chrono::microseconds budget, message_ptr request)
+	: m_budget(budget)
+	, m_request(std::move(request))
 {}
 
-message_bytes add_song_request::serialize() const
+message_bytes deadline_request::serialize() const
+{
+	return encode<message_type::DEADLINE_REQUEST>(m_budget, m_request->serialize());
+}
+
+void deadline_request::accept(request_visitor & v)
 {
-	message_bytes bytes(1 + 8 +
-						8 + m_author.length() +
-						8 + m_song.length() +
-						8 + m_text.length());
+	m_request->accept(v);
+}
 
-	bytes[0] = uint8_t(message_type::ADD_SONG_REQUEST);
-	serialize_many_strings({ m_author, m_song, m_text }, bytes);
 
-	return bytes;
+overloaded_response::overloaded_response(std::string reason)
+	: m_reason(std::move(reason))
+{}
+
+message_bytes overloaded_response::serialize() const
+{
+	return encode<message_type::OVERLOADED_RESPONSE>(m_reason);
 }
 
-message_ptr add_song_request::deserialize(message_bytes const & bytes)
+void overloaded_response::accept(response_visitor & v)
 {
-	if (bytes[0] != uint8_t(message_type::ADD_SONG_REQUEST))
-		throw std::runtime_error("invalid message type");;
+	v.visit(*this);
+}
+
 
-	auto strings = deserialize_many_strings(bytes);
-	if (strings.size() != 3)
-		throw std::runtime_error("not enough values to unpack");
+invalidate_message::invalidate_message(std::string author, std::string song)
+	: m_author(std::move(author))
+	, m_song(std::move(song))
+{}
 
-	return message_ptr(new add_song_request(strings[0], strings[1], strings[2]));
+message_bytes invalidate_message::serialize() const
+{
+	return encode<message_type::INVALIDATE_MESSAGE>(m_author, m_song);
 }
 
-void add_song_request::accept(request_visitor & v)
+void invalidate_message::accept(response_visitor & v)
 {
 	v.visit(*this);
 }
 
 
-add_song_response::add_song_response(std::string const & result)
-	: m_result(result)
+scan_request::scan_request(scan_query query)
+	: m_query(std::move(query))
 {}
 
-message_bytes add_song_response::serialize() const
+message_bytes scan_request::serialize() const
 {
-	message_bytes bytes(1 + 8 + m_result.length());
+	return encode<message_type::SCAN_REQUEST>(m_query.pattern, m_query.minLines, uint64_t(m_query.aggregate));
+}
+
+void scan_request::accept(request_visitor & v)
+{
+	v.visit(*this);
+}
+
 
-	bytes[0] = uint8_t(message_type::ADD_SONG_RESPONSE);
-	serialize_one_string(m_result, bytes);
+scan_response::scan_response(scan_result result)
+	: m_result(std::move(result))
+{}
 
-	return bytes;
+message_bytes scan_response::serialize() const
+{
+	return encode<message_type::SCAN_RESPONSE>(m_result.scannedSongs, m_result.total, m_result.groups);
 }
 
-message_ptr add_song_response::deserialize(message_bytes const & bytes)
+void scan_response::accept(response_visitor & v)
 {
-	if (message_type(bytes[0]) != message_type::ADD_SONG_RESPONSE)
-		throw std::runtime_error("invalid message type");
+	v.visit(*this);
+}
+
+add_song_response::add_song_response(std::string result)
+	: m_result(std::move(result))
+{}
 
-	return message_ptr(new add_song_response(deserialize_one_string(bytes)));
+message_bytes add_song_response::serialize() const
+{
+	return encode<message_type::ADD_SONG_RESPONSE>(m_result);
 }
 
 void add_song_response::accept(response_visitor & v)
@@ -269,21 +465,8 @@ message_ptr parse_message(message_bytes const & bytes)
 	if (bytes.empty())
 		return nullptr;
 
-	message_type type = message_type(bytes[0]);
-	switch (type) {
-		case message_type::GET_SONG_LIST_REQUEST:
-			return get_song_list_request::deserialize(bytes);
-		case message_type::GET_SONG_REQUEST:
-			return get_song_request::deserialize(bytes);
-		case message_type::ADD_SONG_REQUEST:
-			return add_song_request::deserialize(bytes);
-		case message_type::GET_SONG_LIST_RESPONSE:
-			return get_song_list_response::deserialize(bytes);
-		case message_type::GET_SONG_RESPONSE:
-			return get_song_response::deserialize(bytes);
-		case message_type::ADD_SONG_RESPONSE:
-			return add_song_response::deserialize(bytes);
-		default:
-			throw std::runtime_error("unknown message type");
-	}
+	parse_function parse = parsers.parsers[bytes[0]];
+	if (!parse)
+		throw protocol_exception("unknown message type");
+	return parse(bytes);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "text_digest.h"
+
+#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -11,15 +14,49 @@ enum class message_type: uint8_t {
 	GET_SONG_REQUEST = 0,
 	GET_SONG_LIST_REQUEST = 1,
 	ADD_SONG_REQUEST = 2,
+	UPDATE_SONG_REQUEST = 3,
+	VERSIONED_GET_SONG_REQUEST = 4,
+	VERSIONED_GET_SONG_LIST_REQUEST = 5,
+	SUBSCRIBE_REQUEST = 6,
+	TOP_SONGS_REQUEST = 7,
+	DEADLINE_REQUEST = 8,
+	SCAN_REQUEST = 9,
+	FIND_SONG_REQUEST = 10,
 
 	// server messages
 	GET_SONG_RESPONSE = 64,
 	GET_SONG_LIST_RESPONSE = 65,
-	ADD_SONG_RESPONSE = 66
+	ADD_SONG_RESPONSE = 66,
+	VERSIONED_GET_SONG_RESPONSE = 67,
+	VERSIONED_GET_SONG_LIST_RESPONSE = 68,
+	NOT_MODIFIED_RESPONSE = 69,
+	INVALIDATE_MESSAGE = 70,
+	TOP_SONGS_RESPONSE = 71,
+	OVERLOADED_RESPONSE = 72,
+	SCAN_RESPONSE = 73,
+	GET_SONG_SUGGESTIONS_RESPONSE = 74
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Thrown when bytes don't form a valid message.
+ */
+struct protocol_exception: public std::runtime_error {
+	protocol_exception(std::string const & what)
+		: std::runtime_error(what)
+	{}
+};
+
+/*
+ * Server refused the request with overloaded_response.
+ */
+struct overloaded_exception: public std::runtime_error {
+	overloaded_exception(std::string const & what)
+		: std::runtime_error(what)
+	{}
+};
+
 struct request_visitor;
 struct response_visitor;
 
@@ -31,80 +68,153 @@ struct message {
 
 	virtual void accept(request_visitor &)
 	{
-		throw std::runtime_error("message type don't support request visitor");
+		throw protocol_exception("message type don't support request visitor");
 	}
 
 	virtual void accept(response_visitor &)
 	{
-		throw std::runtime_error("message type don't support response visitor");
+		throw protocol_exception("message type don't support response visitor");
 	}
 };
 using message_ptr = std::shared_ptr<message>;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Songs and song lists have versions that grow with every change. Get
+ * requests made with known version are versioned: they are answered with
+ * versioned response or with not_modified_response if the version is still
+ * current. Zero known version means client has nothing yet.
+ */
+
 class get_song_list_request: public message {
 public:
-	get_song_list_request(std::string const & author);
+	get_song_list_request(std::string author);
+	get_song_list_request(std::string author, uint64_t knownVersion);
 
 	message_bytes serialize() const override;
-	static message_ptr deserialize(message_bytes const & bytes);
 
 	void accept(request_visitor & v) override;
 
 	std::string const & get_author() const { return m_author; }
+	bool is_versioned() const { return m_versioned; }
+	uint64_t get_known_version() const { return m_knownVersion; }
 
 private:
 	std::string m_author;
+	bool m_versioned = false;
+	uint64_t m_knownVersion = 0;
 };
 
 class get_song_list_response: public message {
 public:
-	explicit get_song_list_response(std::vector<std::string> const & songs);
+	explicit get_song_list_response(std::vector<std::string> songs);
+	get_song_list_response(std::vector<std::string> songs, uint64_t version);
 
 	message_bytes serialize() const override;
-	static message_ptr deserialize(message_bytes const & bytes);
 
 	void accept(response_visitor & v) override;
 
 	std::vector<std::string> const & get_songs() { return m_songs; }
+	bool is_versioned() const { return m_versioned; }
+	uint64_t get_version() const { return m_version; }
 
 private:
 	std::vector<std::string> m_songs;
+	bool m_versioned = false;
+	uint64_t m_version = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
 class get_song_request: public message {
 public:
-	get_song_request(std::string const & author, std::string const & song);
+	get_song_request(std::string author, std::string song);
+	get_song_request(std::string author, std::string song, uint64_t knownVersion);
+
+	message_bytes serialize() const override;
+
+	void accept(request_visitor & v) override;
+
+	std::string const & get_author() const { return m_author; }
+	std::string const & get_song() const { return m_song; }
+	bool is_versioned() const { return m_versioned; }
+	uint64_t get_known_version() const { return m_knownVersion; }
+
+private:
+	std::string m_author;
+	std::string m_song;
+	bool m_versioned = false;
+	uint64_t m_knownVersion = 0;
+};
+
+struct song_name {
+	std::string author;
+	std::string song;
+};
+
+/*
+ * Like get_song_request, but a miss is answered with suggestions: at most
+ * suggestions songs with names close to the requested ones.
+ */
+class find_song_request: public message {
+public:
+	find_song_request(std::string author, std::string song, uint64_t suggestions);
 
 	message_bytes serialize() const override;
-	static message_ptr deserialize(message_bytes const & bytes);
 
 	void accept(request_visitor & v) override;
 
 	std::string const & get_author() const { return m_author; }
 	std::string const & get_song() const { return m_song; }
+	uint64_t get_suggestions() const { return m_suggestions; }
 
 private:
 	std::string m_author;
 	std::string m_song;
+	uint64_t m_suggestions;
 };
 
 class get_song_response: public message {
 public:
-	get_song_response(std::string const & text);
+	get_song_response(std::string text);
+	get_song_response(std::string text, uint64_t version);
+	// answer to find_song_request, suggestions are given on miss only
+	get_song_response(std::string text, std::vector<song_name> suggestions);
 
 	message_bytes serialize() const override;
-	static message_ptr deserialize(message_bytes const & bytes);
 
 	void accept(response_visitor & v) override;
 
 	std::string const & get_text() const { return m_text; }
+	bool is_versioned() const { return m_versioned; }
+	uint64_t get_version() const { return m_version; }
+	bool has_suggestions() const { return m_suggesting; }
+	std::vector<song_name> const & get_suggestions() const { return m_suggestions; }
 
 private:
 	std::string m_text;
+	bool m_versioned = false;
+	uint64_t m_version = 0;
+	bool m_suggesting = false;
+	std::vector<song_name> m_suggestions;
+};
+
+/*
+ * Answer to versioned get request when client's version is current.
+ */
+class not_modified_response: public message {
+public:
+	explicit not_modified_response(uint64_t version);
+
+	message_bytes serialize() const override;
+
+	void accept(response_visitor & v) override;
+
+	uint64_t get_version() const { return m_version; }
+
+private:
+	uint64_t m_version;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -112,12 +222,11 @@ private:
 class add_song_request: public message {
 public:
 	add_song_request(
-		std::string const & author,
-		std::string const & song,
-		std::string const & text);
+		std::string author,
+		std::string song,
+		std::string text);
 
 	message_bytes serialize() const override;
-	static message_ptr deserialize(message_bytes const & bytes);
 
 	void accept(request_visitor & v) override;
 
@@ -131,12 +240,177 @@ private:
 	std::string m_text;
 };
 
+/*
+ * Replaces song text with text_delta applied to the stored version, but
+ * only if the stored version has baseDigest. Answered with add_song_response,
+ * UPDATE_BASE_MISMATCH tells the client to fall back to add_song_request.
+ */
+class update_song_request: public message {
+public:
+	update_song_request(
+		std::string author,
+		std::string song,
+		text_digest baseDigest,
+		std::string delta);
+
+	message_bytes serialize() const override;
+
+	void accept(request_visitor & v) override;
+
+	std::string const & get_author() const { return m_author; }
+	std::string const & get_song() const { return m_song; }
+	text_digest const & get_base_digest() const { return m_baseDigest; }
+	std::string const & get_delta() const { return m_delta; }
+
+private:
+	std::string m_author;
+	std::string m_song;
+	text_digest m_baseDigest;
+	std::string m_delta;
+};
+
+char constexpr UPDATE_BASE_MISMATCH[] = "BASE_MISMATCH";
+
+/*
+ * Asks server to push invalidate_message for every song (and song list)
+ * this connection reads after that, once the song is changed by someone
+ * else. Every read arms one push. Answered with add_song_response,
+ * SUBSCRIBE_UNSUPPORTED if server can't push over this connection.
+ */
+class subscribe_request: public message {
+public:
+	message_bytes serialize() const override;
+
+	void accept(request_visitor & v) override;
+};
+
+char constexpr SUBSCRIBE_UNSUPPORTED[] = "UNSUPPORTED";
+
+/*
+ * Pushed by server, not an answer to any request: song and song list
+ * of author may have changed.
+ */
+class invalidate_message: public message {
+public:
+	invalidate_message(std::string author, std::string song);
+
+	message_bytes serialize() const override;
+
+	void accept(response_visitor & v) override;
+
+	std::string const & get_author() const { return m_author; }
+	std::string const & get_song() const { return m_song; }
+
+private:
+	std::string m_author;
+	std::string m_song;
+};
+
+/*
+ * Asks for count most requested songs and authors over the last windows
+ * time windows of server's request statistics, the current one included.
+ */
+class top_songs_request: public message {
+public:
+	top_songs_request(uint64_t count, uint64_t windows);
+
+	message_bytes serialize() const override;
+
+	void accept(request_visitor & v) override;
+
+	uint64_t get_count() const { return m_count; }
+	uint64_t get_windows() const { return m_windows; }
+
+private:
+	uint64_t m_count;
+	uint64_t m_windows;
+};
+
+struct song_popularity {
+	std::string author;
+	std::string song;
+	uint64_t requests;
+};
+
+struct author_popularity {
+	std::string author;
+	uint64_t requests;
+};
+
+/*
+ * Most requested first. Request counts are estimates, they may be
+ * a bit higher than the real ones but never lower.
+ */
+class top_songs_response: public message {
+public:
+	top_songs_response(std::vector<song_popularity> songs, std::vector<author_popularity> authors);
+
+	message_bytes serialize() const override;
+
+	void accept(response_visitor & v) override;
+
+	std::vector<song_popularity> const & get_songs() const { return m_songs; }
+	std::vector<author_popularity> const & get_authors() const { return m_authors; }
+
+private:
+	std::vector<song_popularity> m_songs;
+	std::vector<author_popularity> m_authors;
+};
+
+/*
+ * Request the client waits for at most budget, counted from the moment
+ * server receives it. Server doesn't start work on it after that and
+ * answers with overloaded_response instead of a stale read. Visitors
+ * see the wrapped request.
+ */
+class deadline_request: public message {
+public:
+	deadline_request(std::chrono::microseconds budget, message_ptr request);
+
+	message_bytes serialize() const override;
+
+	void accept(request_visitor & v) override;
+
+	std::chrono::microseconds get_budget() const { return m_budget; }
+	message_ptr const & get_request() const { return m_request; }
+
+private:
+	std::chrono::microseconds m_budget;
+	message_ptr m_request;
+};
+
+// longest budget a parsed deadline_request may have, so that adding it
+// to a clock reading can't overflow
+auto constexpr MAX_DEADLINE_BUDGET = std::chrono::hours(24);
+
+/*
+ * Cheap answer to any request server didn't process, reason is one
+ * of the OVERLOADED_* constants.
+ */
+class overloaded_response: public message {
+public:
+	explicit overloaded_response(std::string reason);
+
+	message_bytes serialize() const override;
+
+	void accept(response_visitor & v) override;
+
+	std::string const & get_reason() const { return m_reason; }
+
+private:
+	std::string m_reason;
+};
+
+// request spent its budget before being processed
+char constexpr OVERLOADED_DEADLINE_EXPIRED[] = "DEADLINE_EXPIRED";
+// server queue is too long, request was shed right away
+char constexpr OVERLOADED_QUEUE_FULL[] = "QUEUE_FULL";
+
 class add_song_response: public message {
 public:
-	add_song_response(const std::__cxx11::string &result);
+	add_song_response(std::string result);
 
 	message_bytes serialize() const override;
-	static message_ptr deserialize(message_bytes const & bytes);
 
 	void accept(response_visitor & v) override;
 
@@ -146,6 +420,70 @@ private:
 	std::string m_result;
 };
 
+enum class scan_aggregate: uint8_t {
+	// number of matching songs
+	SONGS = 0,
+	// matching songs of every author
+	SONGS_PER_AUTHOR = 1,
+	// occurrences of pattern in matching songs of every author,
+	// lines if pattern is empty
+	OCCURRENCES_PER_AUTHOR = 2
+};
+
+struct scan_query {
+	// song matches if its text contains pattern, empty matches any text,
+	std::string pattern;
+	// and has at least minLines lines
+	uint64_t minLines = 0;
+	scan_aggregate aggregate = scan_aggregate::SONGS;
+};
+
+struct scan_group {
+	std::string author;
+	uint64_t value;
+};
+
+struct scan_result {
+	// songs in the scanned snapshot
+	uint64_t scannedSongs = 0;
+	// matching songs, or sum of group values
+	uint64_t total = 0;
+	// authors with non-zero value, largest first, empty for SONGS
+	std::vector<scan_group> groups;
+};
+
+/*
+ * Runs query over all songs of the catalog on server, only aggregated
+ * result comes back in scan_response.
+ */
+class scan_request: public message {
+public:
+	explicit scan_request(scan_query query);
+
+	message_bytes serialize() const override;
+
+	void accept(request_visitor & v) override;
+
+	scan_query const & get_query() const { return m_query; }
+
+private:
+	scan_query m_query;
+};
+
+class scan_response: public message {
+public:
+	explicit scan_response(scan_result result);
+
+	message_bytes serialize() const override;
+
+	void accept(response_visitor & v) override;
+
+	scan_result const & get_result() const { return m_result; }
+
+private:
+	scan_result m_result;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 struct request_visitor {
@@ -153,6 +491,11 @@ struct request_visitor {
 	virtual void visit(get_song_list_request & request) = 0;
 	virtual void visit(get_song_request & request) = 0;
 	virtual void visit(add_song_request & request) = 0;
+	virtual void visit(update_song_request & request) = 0;
+	virtual void visit(subscribe_request & request) = 0;
+	virtual void visit(top_songs_request & request) = 0;
+	virtual void visit(scan_request & request) = 0;
+	virtual void visit(find_song_request & request) = 0;
 };
 
 struct response_visitor {
@@ -160,8 +503,22 @@ struct response_visitor {
 	virtual void visit(get_song_list_response & request) = 0;
 	virtual void visit(get_song_response & request) = 0;
 	virtual void visit(add_song_response & request) = 0;
+	virtual void visit(not_modified_response & request) = 0;
+	virtual void visit(invalidate_message & request) = 0;
+	virtual void visit(top_songs_response & request) = 0;
+	virtual void visit(overloaded_response & request) = 0;
+	virtual void visit(scan_response & request) = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Upper bound for a single frame, recv_message refuses to allocate more.
+ */
+uint64_t constexpr MAX_MESSAGE_SIZE = 256 * 1024 * 1024;
+
+/*
+ * Returns nullptr for empty bytes, throws protocol_exception
+ * if bytes are malformed. Never reads outside of bytes.
+ */
 message_ptr parse_message(message_bytes const & bytes);
@@ -0,0 +1,199 @@
+#include "text_delta.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+uint8_t constexpr DELTA_COPY = 0;
+uint8_t constexpr DELTA_INSERT = 1;
+
+size_t constexpr MIN_BLOCK_SIZE = 16;
+size_t constexpr MAX_BLOCK_SIZE = 1024;
+// candidates checked per checksum hit, guards against repetitive texts
+size_t constexpr MAX_BLOCK_CANDIDATES = 8;
+
+/*
+ * Adler-like checksum of a window, can be moved by one byte in O(1).
+ */
+class rolling_checksum {
+public:
+	rolling_checksum(uint8_t const * data, size_t size)
+		: m_size(size)
+	{
+		for (size_t i = 0; i < size; ++i) {
+			m_a += data[i];
+			m_b += uint32_t(size - i) * data[i];
+		}
+	}
+
+	void roll(uint8_t out, uint8_t in)
+	{
+		m_a += in - out;
+		m_b += m_a - uint32_t(m_size) * out;
+	}
+
+	uint32_t value() const { return (m_b << 16) ^ (m_a & 0xffff); }
+
+private:
+	size_t m_size;
+	uint32_t m_a = 0;
+	uint32_t m_b = 0;
+};
+
+class delta_writer {
+public:
+	explicit delta_writer(uint8_t const * target)
+		: m_target(target)
+	{}
+
+	void copy(uint64_t offset, uint64_t size)
+	{
+		// adjacent copies are merged into one op
+		if (m_lastCopy != std::string::npos) {
+			uint64_t lastOffset, lastSize;
+			memcpy(&lastOffset, &m_delta[m_lastCopy + 1], sizeof(lastOffset));
+			memcpy(&lastSize, &m_delta[m_lastCopy + 1 + 8], sizeof(lastSize));
+			if (lastOffset + lastSize == offset) {
+				lastSize += size;
+				memcpy(&m_delta[m_lastCopy + 1 + 8], &lastSize, sizeof(lastSize));
+				return;
+			}
+		}
+		m_lastCopy = m_delta.size();
+		m_delta.push_back(char(DELTA_COPY));
+		append(offset);
+		append(size);
+	}
+
+	void insert(size_t begin, size_t end)
+	{
+		if (begin == end)
+			return;
+		m_lastCopy = std::string::npos;
+		m_delta.push_back(char(DELTA_INSERT));
+		append(end - begin);
+		m_delta.append(reinterpret_cast<char const *>(m_target + begin), end - begin);
+	}
+
+	std::string release() { return std::move(m_delta); }
+
+private:
+	void append(uint64_t value)
+	{
+		m_delta.append(reinterpret_cast<char const *>(&value), sizeof(value));
+	}
+
+	uint8_t const * m_target;
+	std::string m_delta;
+	size_t m_lastCopy = std::string::npos;
+};
+
+uint64_t read_u64(char const * & data, char const * end)
+{
+	uint64_t value;
+	if (uint64_t(end - data) < sizeof(value))
+		throw protocol_exception("delta op is out of bounds");
+	memcpy(&value, data, sizeof(value));
+	data += sizeof(value);
+	return value;
+}
+
+} // namespace
+
+std::string make_text_delta(std::string const & base, std::string const & target)
+{
+	auto const * from = reinterpret_cast<uint8_t const *>(base.data());
+	auto const * to = reinterpret_cast<uint8_t const *>(target.data());
+	delta_writer delta(to);
+
+	// about sqrt(size) blocks of about sqrt(size) bytes, as rsync does
+	size_t blockSize = std::min(MAX_BLOCK_SIZE,
+		std::max(MIN_BLOCK_SIZE, size_t(std::sqrt(double(base.size())))));
+	if (base.size() < blockSize || target.size() < blockSize) {
+		delta.insert(0, target.size());
+		return delta.release();
+	}
+
+	std::unordered_multimap<uint32_t, size_t> blocks;
+	blocks.reserve(base.size() / blockSize);
+	for (size_t offset = 0; offset + blockSize <= base.size(); offset += blockSize)
+		blocks.emplace(rolling_checksum(from + offset, blockSize).value(), offset);
+
+	size_t pending = 0; // start of bytes not covered by ops yet
+	size_t position = 0;
+	rolling_checksum checksum(to, blockSize);
+	while (position + blockSize <= target.size()) {
+		size_t matchOffset = 0;
+		size_t matchSize = 0;
+		auto range = blocks.equal_range(checksum.value());
+		size_t checked = 0;
+		for (auto it = range.first; it != range.second && checked < MAX_BLOCK_CANDIDATES; ++it, ++checked)
+			if (!memcmp(from + it->second, to + position, blockSize)) {
+				matchOffset = it->second;
+				matchSize = blockSize;
+				break;
+			}
+
+		if (!matchSize) {
+			if (position + blockSize < target.size())
+				checksum.roll(to[position], to[position + blockSize]);
+			++position;
+			continue;
+		}
+
+		// grow the match, forward and back into pending bytes
+		while (matchOffset + matchSize < base.size() && position + matchSize < target.size()
+				&& from[matchOffset + matchSize] == to[position + matchSize])
+			++matchSize;
+		while (position > pending && matchOffset > 0 && from[matchOffset - 1] == to[position - 1]) {
+			--position;
+			--matchOffset;
+			++matchSize;
+		}
+
+		delta.insert(pending, position);
+		delta.copy(matchOffset, matchSize);
+		position += matchSize;
+		pending = position;
+		if (position + blockSize <= target.size())
+			checksum = rolling_checksum(to + position, blockSize);
+	}
+	delta.insert(pending, target.size());
+
+	return delta.release();
+}
+
+std::string apply_text_delta(std::string const & base, std::string const & delta)
+{
+	std::string text;
+	char const * data = delta.data();
+	char const * end = data + delta.size();
+	while (data != end) {
+		uint8_t op = uint8_t(*data++);
+		uint64_t offset = 0;
+		if (op == DELTA_COPY)
+			offset = read_u64(data, end);
+		else if (op != DELTA_INSERT)
+			throw protocol_exception("unknown delta op");
+		uint64_t size = read_u64(data, end);
+
+		if (size > MAX_MESSAGE_SIZE - text.size())
+			throw protocol_exception("delta result exceeds size limit");
+		if (op == DELTA_COPY) {
+			if (offset > base.size() || size > base.size() - offset)
+				throw protocol_exception("delta copies outside of base");
+			text.append(base, offset, size);
+		} else {
+			if (size > uint64_t(end - data))
+				throw protocol_exception("delta insert is out of bounds");
+			text.append(data, size);
+			data += size;
+		}
+	}
+	return text;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+/*
+ * Binary delta between two versions of a text, list of ops:
+ *   [0][u64 offset][u64 size]  copy size bytes of base starting at offset
+ *   [1][u64 size][size bytes]  insert the bytes
+ * make_text_delta finds copies rsync-style: base is cut into blocks indexed
+ * by rolling checksum, target is scanned byte by byte and every block match
+ * is grown in both directions, so a typo costs about one block of inserts.
+ */
+std::string make_text_delta(std::string const & base, std::string const & target);
+
+/*
+ * Throws protocol_exception if delta is malformed, refers outside of base
+ * or its result exceeds MAX_MESSAGE_SIZE.
+ */
+std::string apply_text_delta(std::string const & base, std::string const & delta);
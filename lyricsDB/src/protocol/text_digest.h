@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+ * SHA-256 of song text, key of content-addressed text store in db and
+ * name of the version a delta update is made against. It is strong
+ * enough that equal digests are taken for equal texts without comparing
+ * them, which is the only way to dedup texts already spilled to disk.
+ */
+struct text_digest {
+	std::array<uint8_t, 32> bytes;
+
+	bool operator==(text_digest const & other) const { return bytes == other.bytes; }
+	bool operator!=(text_digest const & other) const { return bytes != other.bytes; }
+
+	std::string to_hex() const;
+};
+
+text_digest digest_text(std::string const & text);
+
+struct text_digest_hash {
+	size_t operator()(text_digest const & digest) const
+	{
+		// digest bytes are uniformly distributed already
+		size_t hash;
+		memcpy(&hash, digest.bytes.data(), sizeof(hash));
+		return hash;
+	}
+};
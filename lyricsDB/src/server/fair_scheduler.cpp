@@ -0,0 +1,123 @@
+#include "fair_scheduler.h"
+
+#include <algorithm>
+
+drr_queue::drr_queue(std::chrono::microseconds quantum)
+	: m_quantum(std::max(quantum, std::chrono::microseconds(1)))
+{}
+
+void drr_queue::push(member & m)
+{
+	m_waiting.push_back(&m);
+}
+
+/*
+ * Member at the head gets a quantum, it is served if that pays its debt,
+ * otherwise it goes to the back.
+ */
+drr_queue::member * drr_queue::pop()
+{
+	size_t skipped = 0;
+	while (!m_waiting.empty()) {
+		if (skipped == m_waiting.size()) {
+			// nobody can be served yet: fast-forward the rounds
+			// instead of spinning over deep debts one quantum at a time
+			auto richest = m_waiting.front()->deficit;
+			for (member * m: m_waiting)
+				richest = std::max(richest, m->deficit);
+			auto rounds = (-richest.count() - 1) / m_quantum.count();
+			for (member * m: m_waiting)
+				m->deficit += rounds * m_quantum;
+			skipped = 0;
+		}
+
+		member * m = m_waiting.front();
+		m_waiting.pop_front();
+		// credit isn't saved up beyond one quantum
+		m->deficit = std::min(m->deficit + m_quantum, m_quantum);
+		if (m->deficit < std::chrono::microseconds(0)) {
+			m_waiting.push_back(m);
+			++skipped;
+			continue;
+		}
+		return m;
+	}
+	return nullptr;
+}
+
+void drr_queue::charge(member & m, std::chrono::microseconds cost)
+{
+	// debt only matters while others compete for slots
+	if (m_waiting.empty())
+		m.deficit = std::chrono::microseconds(0);
+	else
+		m.deficit -= cost;
+}
+
+std::chrono::steady_clock::time_point drr_queue::oldest() const
+{
+	// DRR reorders the queue, so the oldest one may be anywhere
+	auto oldest = m_waiting.front()->enqueued;
+	for (member * m: m_waiting)
+		oldest = std::min(oldest, m->enqueued);
+	return oldest;
+}
+
+fair_scheduler::fair_scheduler(size_t slots, std::chrono::microseconds quantum)
+	: m_slots(slots)
+	, m_free(slots)
+	, m_queue(quantum)
+{}
+
+fair_scheduler::flow_ptr fair_scheduler::open_flow()
+{
+	return std::make_shared<flow>();
+}
+
+bool fair_scheduler::acquire(flow & f)
+{
+	std::unique_lock<std::mutex> g(m_guard);
+	if (m_free && m_queue.empty()) {
+		--m_free;
+		return false;
+	}
+
+	f.granted = false;
+	f.enqueued = std::chrono::steady_clock::now();
+	m_queue.push(f);
+	dispatch();
+	f.wakeup.wait(g, [&f] () { return f.granted; });
+	return true;
+}
+
+void fair_scheduler::release(flow & f, std::chrono::microseconds cost)
+{
+	std::lock_guard<std::mutex> g(m_guard);
+	++m_free;
+	m_queue.charge(f, cost);
+	dispatch();
+}
+
+std::chrono::microseconds fair_scheduler::queue_delay()
+{
+	std::lock_guard<std::mutex> g(m_guard);
+	if (m_queue.empty())
+		return std::chrono::microseconds(0);
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_queue.oldest());
+}
+
+/*
+ * Grants free slots to waiting flows in DRR order.
+ * Called with m_guard held.
+ */
+void fair_scheduler::dispatch()
+{
+	while (m_free) {
+		flow * f = static_cast<flow *>(m_queue.pop());
+		if (!f)
+			return;
+		--m_free;
+		f->granted = true;
+		f->wakeup.notify_one();
+	}
+}
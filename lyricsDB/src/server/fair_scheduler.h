@@ -0,0 +1,122 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+/*
+ * Deficit round robin order of flows waiting for a slot, the part of
+ * fair_scheduler that doesn't block. Not thread-safe.
+ */
+class drr_queue {
+public:
+	struct member {
+		std::chrono::steady_clock::time_point enqueued;
+		// negative deficit is debt left by previous expensive requests
+		std::chrono::microseconds deficit { 0 };
+	};
+
+	explicit drr_queue(std::chrono::microseconds quantum);
+
+	void push(member & m);
+
+	/*
+	 * Takes out the member served next, null if nobody waits.
+	 */
+	member * pop();
+
+	/*
+	 * Charges the cost of a finished turn of m.
+	 */
+	void charge(member & m, std::chrono::microseconds cost);
+
+	bool empty() const { return m_waiting.empty(); }
+
+	/*
+	 * Earliest enqueued time of waiting members, queue must not be empty.
+	 */
+	std::chrono::steady_clock::time_point oldest() const;
+
+private:
+	std::chrono::microseconds const m_quantum;
+	std::deque<member *> m_waiting;
+};
+
+/*
+ * Deficit round robin over connections for a limited number of
+ * concurrently processed requests. Cost of a request is its measured
+ * processing time, so a client sending expensive requests gets
+ * proportionally fewer turns while others are waiting.
+ */
+class fair_scheduler {
+public:
+	class flow;
+	using flow_ptr = std::shared_ptr<flow>;
+
+	/*
+	 * Zero slots disables scheduling: run() just calls the function.
+	 */
+	fair_scheduler(size_t slots, std::chrono::microseconds quantum);
+
+	fair_scheduler(fair_scheduler const &) = delete;
+	fair_scheduler & operator=(fair_scheduler const &) = delete;
+
+	/*
+	 * One flow per connection, connection has at most one request in flight.
+	 */
+	flow_ptr open_flow();
+
+	/*
+	 * Waits for the turn of f and runs fn in the calling thread.
+	 * Returns true if call had to wait.
+	 */
+	template<typename F>
+	bool run(flow & f, F && fn);
+
+	/*
+	 * How long the longest waiting request has been waiting,
+	 * zero if nothing waits.
+	 */
+	std::chrono::microseconds queue_delay();
+
+private:
+	bool acquire(flow & f);
+	void release(flow & f, std::chrono::microseconds cost);
+	void dispatch();
+
+	size_t const m_slots;
+
+	std::mutex m_guard;
+	size_t m_free;
+	drr_queue m_queue;
+};
+
+class fair_scheduler::flow: private drr_queue::member {
+	friend class fair_scheduler;
+
+	std::condition_variable wakeup;
+	bool granted = false;
+};
+
+template<typename F>
+bool fair_scheduler::run(flow & f, F && fn)
+{
+	if (!m_slots) {
+		fn();
+		return false;
+	}
+
+	bool waited = acquire(f);
+	auto start = std::chrono::steady_clock::now();
+	try {
+		fn();
+	} catch (...) {
+		release(f, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+		throw;
+	}
+	release(f, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+	return waited;
+}
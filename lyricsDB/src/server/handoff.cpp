@@ -0,0 +1,316 @@
+#include "handoff.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+
+namespace {
+
+uint32_t constexpr HANDOFF_REQUEST = 0x7172796c; // "lyrq"
+uint32_t constexpr HANDOFF_PACKAGE = 0x7072796c; // "lyrp"
+uint32_t constexpr HANDOFF_READY = 0x7272796c;   // "lyrr"
+// SCM_MAX_FD of the kernel
+size_t constexpr MAX_HANDOFF_DESCRIPTORS = 253;
+// catalog and handoff listener come before listening sockets
+size_t constexpr FIXED_HANDOFF_DESCRIPTORS = 2;
+int constexpr HANDOFF_BACKLOG = 4;
+auto constexpr DRAIN_CHECK_PERIOD = std::chrono::milliseconds(10);
+// how often idle connections check whether server drains
+auto constexpr IDLE_DRAIN_CHECK_PERIOD = std::chrono::milliseconds(50);
+
+struct package_header {
+	uint32_t magic;
+	uint32_t listeners;
+};
+
+[[noreturn]] void throw_errno(std::string const & msg)
+{
+	throw socket_exception(msg + ": " + strerror(errno));
+}
+
+sockaddr_un make_address(std::string const & path, socklen_t & length)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	if (path.empty() || path.size() >= sizeof(address.sun_path))
+		throw socket_exception("invalid handoff socket path: " + path);
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.data(), path.size());
+	if (path[0] == '@')
+		address.sun_path[0] = '\0';
+	length = socklen_t(offsetof(sockaddr_un, sun_path) + path.size() + (path[0] == '@' ? 0 : 1));
+	return address;
+}
+
+/*
+ * Listening sockets and all songs go only to the same user, abstract
+ * names have no file permissions to rely on.
+ */
+bool peer_is_same_user(int descriptor)
+{
+	ucred credentials;
+	socklen_t length = sizeof(credentials);
+	return getsockopt(descriptor, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0
+		&& credentials.uid == geteuid();
+}
+
+/*
+ * Socket file left by a server that is gone, like remove_stale_socket
+ * of net does for listeners. Anything else stays for bind to fail on.
+ */
+void remove_stale_socket(sockaddr_un const & address, socklen_t length)
+{
+	struct stat info;
+	if (!address.sun_path[0] || lstat(address.sun_path, &info) < 0 || !S_ISSOCK(info.st_mode))
+		return;
+	int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (probe < 0)
+		return;
+	bool stale = connect(probe, reinterpret_cast<sockaddr const *>(&address), length) < 0 && errno == ECONNREFUSED;
+	close(probe);
+	if (stale)
+		unlink(address.sun_path);
+}
+
+// seqpacket keeps the package with its descriptors in one message
+int make_handoff_socket()
+{
+	int descriptor = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (descriptor < 0)
+		throw_errno("failed to create handoff socket");
+	return descriptor;
+}
+
+void send_magic(int descriptor, uint32_t magic)
+{
+	if (send(descriptor, &magic, sizeof(magic), MSG_NOSIGNAL) != ssize_t(sizeof(magic)))
+		throw_errno("failed to send to handoff peer");
+}
+
+/*
+ * False if peer closed the connection or sent something else.
+ */
+bool recv_magic(int descriptor, uint32_t magic)
+{
+	uint32_t received = 0;
+	ssize_t size;
+	do {
+		size = recv(descriptor, &received, sizeof(received), 0);
+	} while (size < 0 && errno == EINTR);
+	return size == ssize_t(sizeof(received)) && received == magic;
+}
+
+} // namespace
+
+handoff_listener::handoff_listener(std::string const & path)
+	: m_descriptor(make_handoff_socket())
+{
+	socklen_t length;
+	sockaddr_un address = make_address(path, length);
+	remove_stale_socket(address, length);
+	if (bind(m_descriptor, reinterpret_cast<sockaddr const *>(&address), length) < 0
+		|| listen(m_descriptor, HANDOFF_BACKLOG) < 0) {
+		int error = errno;
+		close(m_descriptor);
+		throw socket_exception("failed to listen for handoff at " + path + ": " + strerror(error));
+	}
+}
+
+handoff_listener::handoff_listener(int descriptor)
+	: m_descriptor(descriptor)
+{}
+
+handoff_listener::~handoff_listener()
+{
+	close(m_descriptor);
+}
+
+int handoff_listener::accept_successor()
+{
+	while (true) {
+		int successor = accept4(m_descriptor, nullptr, nullptr, SOCK_CLOEXEC);
+		if (successor < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			throw_errno("failed to accept handoff connection");
+		}
+		if (!peer_is_same_user(successor)) {
+			close(successor);
+			continue;
+		}
+		if (recv_magic(successor, HANDOFF_REQUEST))
+			return successor;
+		close(successor);
+	}
+}
+
+bool send_handoff(int successor, handoff_package const & package)
+{
+	std::vector<int> descriptors = { package.catalog, package.handoffListener };
+	std::vector<uint8_t> unixSockets;
+	for (auto const & l: package.listeners) {
+		descriptors.push_back(l.descriptor);
+		unixSockets.push_back(l.unixSocket);
+	}
+	if (descriptors.size() > MAX_HANDOFF_DESCRIPTORS)
+		throw socket_exception("too many listening sockets to hand over");
+
+	package_header header { HANDOFF_PACKAGE, uint32_t(package.listeners.size()) };
+	iovec iov[2] = { { &header, sizeof(header) }, { unixSockets.data(), unixSockets.size() } };
+	std::vector<char> control(CMSG_SPACE(descriptors.size() * sizeof(int)));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(descriptors.size() * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), descriptors.data(), descriptors.size() * sizeof(int));
+
+	if (sendmsg(successor, &msg, MSG_NOSIGNAL) != ssize_t(sizeof(header) + unixSockets.size()))
+		return false;
+	return recv_magic(successor, HANDOFF_READY);
+}
+
+bool request_handoff(std::string const & path, handoff_package & package, int & predecessor)
+{
+	socklen_t length;
+	sockaddr_un address = make_address(path, length);
+	int descriptor = make_handoff_socket();
+	if (connect(descriptor, reinterpret_cast<sockaddr const *>(&address), length) < 0) {
+		int error = errno;
+		close(descriptor);
+		if (error == ENOENT || error == ECONNREFUSED)
+			return false;
+		throw socket_exception("failed to connect to handoff socket " + path + ": " + strerror(error));
+	}
+
+	try {
+		if (!peer_is_same_user(descriptor))
+			throw socket_exception("server at handoff socket " + path + " runs as another user");
+		send_magic(descriptor, HANDOFF_REQUEST);
+
+		package_header header;
+		uint8_t unixSockets[MAX_HANDOFF_DESCRIPTORS];
+		iovec iov[2] = { { &header, sizeof(header) }, { unixSockets, sizeof(unixSockets) } };
+		std::vector<char> control(CMSG_SPACE(MAX_HANDOFF_DESCRIPTORS * sizeof(int)));
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+
+		// old server drains meanwhile
+		ssize_t received;
+		do {
+			received = recvmsg(descriptor, &msg, MSG_CMSG_CLOEXEC);
+		} while (received < 0 && errno == EINTR);
+		if (received < 0)
+			throw_errno("failed to receive handoff");
+		if (received == 0)
+			throw socket_exception("old server closed handoff connection");
+
+		std::vector<int> descriptors;
+		cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			descriptors.resize((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+			memcpy(descriptors.data(), CMSG_DATA(cmsg), descriptors.size() * sizeof(int));
+		}
+
+		bool valid = size_t(received) >= sizeof(header) && header.magic == HANDOFF_PACKAGE
+			&& size_t(received) == sizeof(header) + header.listeners
+			&& descriptors.size() == FIXED_HANDOFF_DESCRIPTORS + header.listeners
+			&& !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+		if (!valid) {
+			for (int d: descriptors)
+				close(d);
+			throw socket_exception("malformed handoff package");
+		}
+
+		package.catalog = descriptors[0];
+		package.handoffListener = descriptors[1];
+		package.listeners.clear();
+		for (size_t i = 0; i < header.listeners; ++i)
+			package.listeners.push_back({ descriptors[FIXED_HANDOFF_DESCRIPTORS + i], unixSockets[i] != 0 });
+	} catch (...) {
+		close(descriptor);
+		throw;
+	}
+	predecessor = descriptor;
+	return true;
+}
+
+void confirm_handoff(int predecessor)
+{
+	try {
+		send_magic(predecessor, HANDOFF_READY);
+	} catch (...) {
+		close(predecessor);
+		throw;
+	}
+	close(predecessor);
+}
+
+bool drain_control::enter()
+{
+	// counted before the check, so close() either sees it or it sees close()
+	++m_inFlight;
+	if (m_phase == CLOSED) {
+		--m_inFlight;
+		return false;
+	}
+	return true;
+}
+
+bool drain_control::close(std::chrono::milliseconds timeout)
+{
+	m_phase = CLOSED;
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	while (m_inFlight) {
+		if (std::chrono::steady_clock::now() >= deadline)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+size_t wait_drained(listener_group const & listeners, std::chrono::milliseconds timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	while (listeners.connections() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(DRAIN_CHECK_PERIOD);
+	return listeners.connections();
+}
+
+idle_wait wait_for_request(stream_socket & client, std::chrono::seconds idleTimeout, drain_control const * drain)
+{
+	if (!drain)
+		return client.wait_readable(idleTimeout) ? idle_wait::REQUEST : idle_wait::TIMED_OUT;
+
+	auto deadline = idleTimeout.count() > 0 ? std::chrono::steady_clock::now() + idleTimeout
+		: std::chrono::steady_clock::time_point::max();
+	while (true) {
+		if (drain->draining())
+			return client.poll_readable() ? idle_wait::REQUEST : idle_wait::DRAINED;
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline)
+			return idle_wait::TIMED_OUT;
+		auto slice = std::min<std::chrono::steady_clock::duration>(IDLE_DRAIN_CHECK_PERIOD, deadline - now);
+		auto wait = std::max(std::chrono::milliseconds(1), std::chrono::duration_cast<std::chrono::milliseconds>(slice));
+		if (client.wait_readable(wait))
+			return idle_wait::REQUEST;
+	}
+}
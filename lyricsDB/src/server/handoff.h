@@ -0,0 +1,189 @@
+#pragma once
+
+#include "listeners.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/*
+ * Zero-downtime restart. Server started with --handoff=PATH listens on
+ * unix socket PATH for its successor. New server started with the same
+ * PATH connects there first, and the old one:
+ *   1. stops accepting, clients connecting meanwhile wait in the queues
+ *      of listening sockets;
+ *   2. drains: idle connections are closed, busy ones once their request
+ *      is answered, the rest is cut after drain timeout and requests
+ *      being processed get one more drain timeout to finish;
+ *   3. exports its catalog into a memfd (see database::export_catalog);
+ *   4. passes the catalog, the listening sockets and the handoff socket
+ *      to the new server over PATH with SCM_RIGHTS;
+ *   5. exits once the new server has loaded the catalog and took the
+ *      sockets over, or resumes serving if it went away before that.
+ * So no connection is refused and the new server starts with all songs.
+ * Functions throw socket_exception on errors.
+ */
+
+/*
+ * Descriptors the old server passes to the new one.
+ */
+struct handoff_package {
+	int catalog = -1;
+	std::vector<inherited_listener> listeners;
+	int handoffListener = -1;
+};
+
+/*
+ * Unix socket successors connect to, "@NAME" is in abstract namespace.
+ */
+class handoff_listener {
+public:
+	/*
+	 * Listens at path, socket file left there by a server that is gone
+	 * is replaced. Throws if a server listens there or it is not a
+	 * socket.
+	 */
+	explicit handoff_listener(std::string const & path);
+
+	/*
+	 * Takes over descriptor from handoff_package.
+	 */
+	explicit handoff_listener(int descriptor);
+
+	/*
+	 * Socket file is left for the successor, it owns the socket now.
+	 */
+	~handoff_listener();
+
+	handoff_listener(handoff_listener const &) = delete;
+	handoff_listener & operator=(handoff_listener const &) = delete;
+
+	/*
+	 * Blocks until a new server asks to take over, returns connection
+	 * to it owned by caller. Connections of other users are dropped.
+	 */
+	int accept_successor();
+
+	int descriptor() const { return m_descriptor; }
+
+private:
+	int m_descriptor;
+};
+
+/*
+ * Old server side: passes package and waits until the new server
+ * confirms, returns false if it went away before that. Descriptors
+ * stay owned by caller.
+ */
+bool send_handoff(int successor, handoff_package const & package);
+
+/*
+ * New server side: asks server at path to hand over and waits for the
+ * package while it drains. Returns false right away if no server listens
+ * there. Otherwise predecessor is the connection to confirm_handoff on,
+ * descriptors of package are owned by caller.
+ */
+bool request_handoff(std::string const & path, handoff_package & package, int & predecessor);
+
+/*
+ * Tells the old server that the new one serves now and closes predecessor.
+ */
+void confirm_handoff(int predecessor);
+
+/*
+ * Connections of the old server ask it whether to go on, so that no
+ * request is applied after the catalog was exported.
+ */
+class drain_control {
+public:
+	/*
+	 * Idle connections should close rather than wait for next request.
+	 */
+	bool draining() const { return m_phase != SERVING; }
+
+	/*
+	 * Called before processing a request, false means connection is to
+	 * be closed without processing it. Every true needs leave(), which
+	 * comes before the response is sent, so that a client that doesn't
+	 * read can't hold close() up.
+	 */
+	bool enter();
+	void leave() { --m_inFlight; }
+
+	void start_draining() { m_phase = DRAINING; }
+
+	/*
+	 * Refuses requests from now on and waits for ones being processed,
+	 * returns false if some still are after timeout.
+	 */
+	bool close(std::chrono::milliseconds timeout);
+
+	void resume() { m_phase = SERVING; }
+
+private:
+	enum phase {
+		SERVING,
+		DRAINING,
+		CLOSED
+	};
+
+	std::atomic<phase> m_phase { SERVING };
+	std::atomic<size_t> m_inFlight { 0 };
+};
+
+/*
+ * Request admitted by drain_control while it lives, null control admits
+ * everything.
+ */
+class drain_guard {
+public:
+	explicit drain_guard(drain_control * drain)
+		: m_drain(drain && drain->enter() ? drain : nullptr)
+		, m_admitted(!drain || m_drain)
+	{}
+
+	~drain_guard()
+	{
+		release();
+	}
+
+	drain_guard(drain_guard const &) = delete;
+	drain_guard & operator=(drain_guard const &) = delete;
+
+	bool admitted() const { return m_admitted; }
+
+	/*
+	 * Request is processed, only its response is left.
+	 */
+	void release()
+	{
+		if (m_drain)
+			m_drain->leave();
+		m_drain = nullptr;
+	}
+
+private:
+	drain_control * m_drain;
+	bool m_admitted;
+};
+
+/*
+ * Waits until listeners have no connections or timeout expires, returns
+ * number of connections left.
+ */
+size_t wait_drained(listener_group const & listeners, std::chrono::milliseconds timeout);
+
+enum class idle_wait {
+	REQUEST,
+	TIMED_OUT,
+	DRAINED
+};
+
+/*
+ * Waits for the next request of idle connection, zero idle timeout waits
+ * forever. It is waited for before recv, so read timeouts count from its
+ * first byte, not from the end of the previous request. While draining
+ * only a request already arriving is served.
+ */
+idle_wait wait_for_request(stream_socket & client, std::chrono::seconds idleTimeout, drain_control const * drain);
@@ -0,0 +1,109 @@
+#include "invalidation_hub.h"
+
+#include <common/message_io.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// length prefix keeps keys of different authors and songs apart
+std::string song_key(std::string const & author, std::string const & song)
+{
+	return "s" + std::to_string(author.size()) + ":" + author + song;
+}
+
+std::string song_list_key(std::string const & author)
+{
+	return "l" + author;
+}
+
+} // namespace
+
+push_channel_ptr invalidation_hub::subscribe(socket_ptr socket)
+{
+	auto channel = std::make_shared<push_channel>(std::move(socket));
+	std::lock_guard<std::mutex> g(m_guard);
+	m_subscribers[channel.get()].channel = channel;
+	return channel;
+}
+
+void invalidation_hub::unsubscribe(push_channel_ptr const & channel)
+{
+	std::lock_guard<std::mutex> g(m_guard);
+	auto it = m_subscribers.find(channel.get());
+	if (it == m_subscribers.end())
+		return;
+	for (auto const & key: it->second.keys)
+		unwatch(channel.get(), key);
+	m_subscribers.erase(it);
+}
+
+void invalidation_hub::watch_song(push_channel_ptr const & channel, std::string const & author, std::string const & song)
+{
+	watch(channel, song_key(author, song));
+}
+
+void invalidation_hub::watch_song_list(push_channel_ptr const & channel, std::string const & author)
+{
+	watch(channel, song_list_key(author));
+}
+
+void invalidation_hub::invalidate(std::string const & author, std::string const & song, push_channel const * writer)
+{
+	std::vector<push_channel_ptr> targets;
+	{
+		std::lock_guard<std::mutex> g(m_guard);
+		for (auto const & key: { song_key(author, song), song_list_key(author) }) {
+			auto it = m_watchers.find(key);
+			if (it == m_watchers.end())
+				continue;
+			for (push_channel * channel: it->second) {
+				m_subscribers[channel].keys.erase(key);
+				if (channel != writer)
+					targets.push_back(m_subscribers[channel].channel);
+			}
+			m_watchers.erase(it);
+		}
+	}
+
+	// a channel watching both keys gets one push
+	std::sort(targets.begin(), targets.end());
+	targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+	invalidate_message message(author, song);
+	for (auto const & channel: targets) {
+		try {
+			std::lock_guard<std::mutex> g(channel->sendGuard);
+			send_message(*channel->socket, message);
+		} catch (socket_exception const & e) {
+			// connection's own thread fails on the broken socket and unsubscribes
+			std::cerr << "failed to push invalidation: " << e.what() << std::endl;
+			unsubscribe(channel);
+		}
+	}
+}
+
+void invalidation_hub::watch(push_channel_ptr const & channel, std::string key)
+{
+	std::lock_guard<std::mutex> g(m_guard);
+	auto it = m_subscribers.find(channel.get());
+	if (it == m_subscribers.end())
+		return;
+	m_watchers[key].insert(channel.get());
+	it->second.keys.insert(std::move(key));
+}
+
+/*
+ * Caller holds m_guard.
+ */
+void invalidation_hub::unwatch(push_channel * channel, std::string const & key)
+{
+	auto it = m_watchers.find(key);
+	if (it == m_watchers.end())
+		return;
+	it->second.erase(channel);
+	if (it->second.empty())
+		m_watchers.erase(it);
+}
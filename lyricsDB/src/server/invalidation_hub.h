@@ -0,0 +1,65 @@
+#pragma once
+
+#include <net/stream_socket.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/*
+ * Connection that subscribed to invalidations. Its sends are serialized
+ * by sendGuard since pushes come from threads of other connections.
+ */
+struct push_channel {
+	explicit push_channel(socket_ptr s)
+		: socket(std::move(s))
+	{}
+
+	socket_ptr socket;
+	std::mutex sendGuard;
+};
+using push_channel_ptr = std::shared_ptr<push_channel>;
+
+/*
+ * Callback-breaking invalidation: reading a song or song list arms one
+ * push for the reader, the first write after that sends invalidate_message
+ * and disarms it. So every write costs pushes only to readers that
+ * may cache the old value, and no state is kept for songs nobody reads.
+ * Thread-safe.
+ */
+class invalidation_hub {
+public:
+	push_channel_ptr subscribe(socket_ptr socket);
+	void unsubscribe(push_channel_ptr const & channel);
+
+	/*
+	 * Must be called before the read, so that a write racing
+	 * with it is pushed.
+	 */
+	void watch_song(push_channel_ptr const & channel, std::string const & author, std::string const & song);
+	void watch_song_list(push_channel_ptr const & channel, std::string const & author);
+
+	/*
+	 * Pushes to everyone watching the song or author's song list except
+	 * the writer itself. Slow subscriber blocks it for at most its send
+	 * timeout and is dropped on error.
+	 */
+	void invalidate(std::string const & author, std::string const & song, push_channel const * writer);
+
+private:
+	struct subscriber {
+		push_channel_ptr channel;
+		// watched keys, to clean up on unsubscribe
+		std::unordered_set<std::string> keys;
+	};
+
+	void watch(push_channel_ptr const & channel, std::string key);
+	void unwatch(push_channel * channel, std::string const & key);
+
+	std::mutex m_guard;
+	std::unordered_map<std::string, std::unordered_set<push_channel *>> m_watchers;
+	std::unordered_map<push_channel *, subscriber> m_subscribers;
+};
@@ -0,0 +1,269 @@
+#include "listeners.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+// pause after a failed accept, out of descriptors or memory it fails again at once
+auto constexpr ACCEPT_RETRY_DELAY = std::chrono::milliseconds(100);
+
+namespace {
+
+std::vector<int> allowed_cpus()
+{
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+	if (cpus.empty())
+		cpus.push_back(0);
+	return cpus;
+}
+
+void pin_current_thread(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		std::cerr << "failed to pin listener to cpu " << cpu << std::endl;
+}
+
+using stats_ptr = std::shared_ptr<listener_stats>;
+using handler_ptr = std::shared_ptr<connection_handler const>;
+using counter_ptr = std::shared_ptr<std::atomic<size_t>>;
+using connection_set_ptr = std::shared_ptr<connection_set>;
+
+void accept_loop(server_socket_ptr socket, stats_ptr stats, handler_ptr handler,
+	counter_ptr connections, connection_set_ptr open, size_t maxConnections,
+	std::atomic<bool> const & handedOver)
+{
+	if (stats->cpu >= 0)
+		pin_current_thread(stats->cpu);
+
+	while (true) {
+		socket_ptr client;
+		try {
+			client = socket->accept_one_client();
+		} catch (socket_exception const & e) {
+			if (handedOver)
+				return;
+			// EMFILE and the like pass once connections close
+			std::cerr << "failed to accept connection: " << e.what() << std::endl;
+			std::this_thread::sleep_for(ACCEPT_RETRY_DELAY);
+			continue;
+		}
+		++stats->accepted;
+		if (++*connections > maxConnections && maxConnections) {
+			// closed as client goes out of scope
+			--*connections;
+			++stats->rejected;
+			continue;
+		}
+		std::cerr << "accepted connection, start handling it" << std::endl;
+		// new thread inherits affinity of the accepting one
+		{
+			std::lock_guard<std::mutex> g(open->guard);
+			open->sockets.insert(client);
+		}
+		std::thread t([client, stats, handler, connections, open] () {
+			++stats->active;
+			(*handler)(client, *stats);
+			--stats->active;
+			{
+				std::lock_guard<std::mutex> g(open->guard);
+				open->sockets.erase(client);
+			}
+			--*connections;
+		});
+		t.detach();
+	}
+}
+
+void report_loop(std::vector<stats_ptr> const & stats, std::chrono::seconds interval)
+{
+	std::vector<uint64_t> lastAccepted(stats.size());
+	std::vector<uint64_t> lastRequests(stats.size());
+	std::vector<uint64_t> lastThrottled(stats.size());
+	std::vector<uint64_t> lastQueued(stats.size());
+	std::vector<uint64_t> lastShed(stats.size());
+	std::vector<uint64_t> lastExpired(stats.size());
+	std::vector<uint64_t> lastRejected(stats.size());
+	std::vector<uint64_t> lastIdleClosed(stats.size());
+	std::vector<uint64_t> lastTimedOut(stats.size());
+	while (true) {
+		std::this_thread::sleep_for(interval);
+
+		uint64_t totalRequests = 0;
+		std::vector<uint64_t> requests(stats.size());
+		for (size_t i = 0; i < stats.size(); ++i) {
+			requests[i] = stats[i]->requests - lastRequests[i];
+			totalRequests += requests[i];
+		}
+
+		double seconds = interval.count();
+		std::cerr << "listener stats for last " << interval.count() << "s:" << std::endl;
+		for (size_t i = 0; i < stats.size(); ++i) {
+			uint64_t accepted = stats[i]->accepted;
+			uint64_t throttled = stats[i]->throttled;
+			uint64_t queued = stats[i]->queued;
+			uint64_t shed = stats[i]->shed;
+			uint64_t expired = stats[i]->expired;
+			uint64_t rejected = stats[i]->rejected;
+			uint64_t idleClosed = stats[i]->idleClosed;
+			uint64_t timedOut = stats[i]->timedOut;
+			auto const & states = stats[i]->states;
+			std::cerr << "  listener " << i << " cpu " << stats[i]->cpu
+				<< std::fixed << std::setprecision(1)
+				<< ": accepts/s " << (accepted - lastAccepted[i]) / seconds
+				<< ", active " << stats[i]->active
+				<< ", requests/s " << requests[i] / seconds
+				<< " (" << (totalRequests ? 100.0 * requests[i] / totalRequests : 0.0) << "% of load)"
+				<< ", throttled/s " << (throttled - lastThrottled[i]) / seconds
+				<< ", queued/s " << (queued - lastQueued[i]) / seconds
+				<< ", shed/s " << (shed - lastShed[i]) / seconds
+				<< ", expired/s " << (expired - lastExpired[i]) / seconds
+				<< std::endl
+				<< "    connections idle " << states[size_t(connection_state::IDLE)]
+				<< ", reading " << states[size_t(connection_state::READING)]
+				<< ", processing " << states[size_t(connection_state::PROCESSING)]
+				<< ", writing " << states[size_t(connection_state::WRITING)]
+				<< "; rejected/s " << (rejected - lastRejected[i]) / seconds
+				<< ", idle closed/s " << (idleClosed - lastIdleClosed[i]) / seconds
+				<< ", timed out/s " << (timedOut - lastTimedOut[i]) / seconds
+				<< std::endl;
+			lastAccepted[i] = accepted;
+			lastThrottled[i] = throttled;
+			lastQueued[i] = queued;
+			lastShed[i] = shed;
+			lastExpired[i] = expired;
+			lastRejected[i] = rejected;
+			lastIdleClosed[i] = idleClosed;
+			lastTimedOut[i] = timedOut;
+			lastRequests[i] += requests[i];
+		}
+	}
+}
+
+} // namespace
+
+size_t available_cpu_count()
+{
+	return allowed_cpus().size();
+}
+
+listener_group::listener_group(listener_options const & options)
+	: m_options(options)
+	, m_connections(std::make_shared<std::atomic<size_t>>(0))
+	, m_open(std::make_shared<connection_set>())
+{
+	size_t count = std::max<size_t>(1, options.count);
+	bool pinned = count > 1;
+	auto cpus = allowed_cpus();
+
+	for (size_t i = 0; i < count; ++i) {
+		add(make_server_socket(options.hostname, options.port, options.backend, pinned),
+			options.backend, false, pinned ? cpus[i % cpus.size()] : -1);
+	}
+	if (!options.unixPath.empty())
+		add(make_server_socket("unix:" + options.unixPath, 0, options.unixBackend), options.unixBackend, true, -1);
+}
+
+listener_group::listener_group(listener_options const & options, std::vector<inherited_listener> const & inherited)
+	: m_options(options)
+	, m_connections(std::make_shared<std::atomic<size_t>>(0))
+	, m_open(std::make_shared<connection_set>())
+{
+	size_t count = std::count_if(inherited.begin(), inherited.end(), [] (inherited_listener const & l) {
+		return !l.unixSocket;
+	});
+	bool pinned = count > 1;
+	auto cpus = allowed_cpus();
+
+	size_t index = 0;
+	for (auto const & l: inherited) {
+		socket_backend backend = l.unixSocket ? options.unixBackend : options.backend;
+		int cpu = pinned && !l.unixSocket ? cpus[index++ % cpus.size()] : -1;
+		add(adopt_server_socket(l.descriptor, backend), backend, l.unixSocket, cpu);
+	}
+}
+
+void listener_group::add(server_socket_ptr socket, socket_backend backend, bool unixSocket, int cpu)
+{
+	auto stats = std::make_shared<listener_stats>();
+	stats->cpu = cpu;
+	m_listeners.push_back({ socket, backend, unixSocket, stats });
+}
+
+void listener_group::run(connection_handler handler)
+{
+	if (m_options.statsInterval.count() > 0 && !m_reporting) {
+		std::vector<stats_ptr> stats;
+		for (auto const & l: m_listeners)
+			stats.push_back(l.stats);
+		auto interval = m_options.statsInterval;
+		std::thread reporter([stats, interval] () { report_loop(stats, interval); });
+		reporter.detach();
+		m_reporting = true;
+	}
+
+	auto sharedHandler = std::make_shared<connection_handler const>(std::move(handler));
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i + 1 < m_listeners.size(); ++i) {
+		listener const & l = m_listeners[i];
+		threads.emplace_back(accept_loop, l.socket, l.stats, sharedHandler, m_connections, m_open,
+			m_options.maxConnections, std::cref(m_handedOver));
+	}
+	// the last listener runs in the calling thread
+	listener const & last = m_listeners.back();
+	accept_loop(last.socket, last.stats, sharedHandler, m_connections, m_open,
+		m_options.maxConnections, m_handedOver);
+	for (auto & t: threads)
+		t.join();
+}
+
+std::vector<inherited_listener> listener_group::hand_over()
+{
+	for (auto const & l: m_listeners) {
+		if (l.socket->descriptor() < 0)
+			throw socket_exception("listening socket can't be handed over");
+	}
+
+	// accept loops check it once their sockets throw
+	m_handedOver = true;
+	std::vector<inherited_listener> descriptors;
+	for (auto const & l: m_listeners) {
+		l.socket->hand_over();
+		descriptors.push_back({ l.socket->descriptor(), l.unixSocket });
+	}
+	return descriptors;
+}
+
+void listener_group::cut_connections()
+{
+	std::lock_guard<std::mutex> g(m_open->guard);
+	for (auto const & socket: m_open->sockets)
+		socket->shutdown();
+}
+
+void listener_group::resume()
+{
+	// sockets stopped accepting for good, new ones are made over the same listening sockets
+	for (auto & l: m_listeners) {
+		int descriptor = fcntl(l.socket->descriptor(), F_DUPFD_CLOEXEC, 0);
+		if (descriptor < 0)
+			throw socket_exception(std::string("failed to take listening socket back: ") + strerror(errno));
+		l.socket = adopt_server_socket(descriptor, l.backend);
+	}
+	m_handedOver = false;
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <net/stream_socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct listener_options {
+	std::string hostname;
+	uint16_t port;
+	socket_backend backend = socket_backend::TCP;
+	/*
+	 * With one listener server accepts in one unpinned thread, as before.
+	 * With more every listener gets its own SO_REUSEPORT socket and
+	 * accept thread pinned to cpu (index % cpu count).
+	 */
+	size_t count = 1;
+	/*
+	 * How often accept/load statistics are printed, zero disables it.
+	 */
+	std::chrono::seconds statsInterval { 0 };
+	/*
+	 * Connections over this number (over all listeners) are closed
+	 * right after accept, zero means no limit.
+	 */
+	size_t maxConnections = 0;
+	/*
+	 * If not empty, server also accepts AF_UNIX connections at this
+	 * path in one more (unpinned) listener.
+	 */
+	std::string unixPath;
+	socket_backend unixBackend = socket_backend::TCP;
+};
+
+enum class connection_state {
+	IDLE,       // waiting for the next request
+	READING,    // request started arriving
+	PROCESSING,
+	WRITING,
+	COUNT
+};
+
+struct listener_stats {
+	int cpu = -1;
+	std::atomic<uint64_t> accepted { 0 };
+	std::atomic<uint64_t> active { 0 };
+	std::atomic<uint64_t> requests { 0 };
+	// requests delayed by per-connection rate limit
+	std::atomic<uint64_t> throttled { 0 };
+	// requests which waited for their turn in fair scheduler
+	std::atomic<uint64_t> queued { 0 };
+	// requests answered overloaded because of long scheduler queue
+	std::atomic<uint64_t> shed { 0 };
+	// requests whose deadline passed before they were processed or answered
+	std::atomic<uint64_t> expired { 0 };
+	// connections closed over max connection count
+	std::atomic<uint64_t> rejected { 0 };
+	// connections closed by idle timeout
+	std::atomic<uint64_t> idleClosed { 0 };
+	// connections closed by read or write timeout
+	std::atomic<uint64_t> timedOut { 0 };
+	// number of active connections in every state
+	std::atomic<uint64_t> states[size_t(connection_state::COUNT)] {};
+};
+
+/*
+ * Keeps connection counted in exactly one state gauge of listener_stats.
+ */
+class connection_state_tracker {
+public:
+	explicit connection_state_tracker(listener_stats & stats)
+		: m_stats(stats)
+	{
+		++m_stats.states[size_t(m_state)];
+	}
+
+	~connection_state_tracker()
+	{
+		--m_stats.states[size_t(m_state)];
+	}
+
+	connection_state_tracker(connection_state_tracker const &) = delete;
+	connection_state_tracker & operator=(connection_state_tracker const &) = delete;
+
+	void set(connection_state state)
+	{
+		++m_stats.states[size_t(state)];
+		--m_stats.states[size_t(m_state)];
+		m_state = state;
+	}
+
+private:
+	listener_stats & m_stats;
+	connection_state m_state = connection_state::IDLE;
+};
+
+/*
+ * Called in a new thread for every accepted client. Thread runs on the
+ * cpu of listener which accepted the client, so connection is served
+ * end to end where it was accepted.
+ */
+using connection_handler = std::function<void(socket_ptr, listener_stats &)>;
+
+/*
+ * Number of cpus this process may run on.
+ */
+size_t available_cpu_count();
+
+/*
+ * Sockets of connections being handled, so that the ones left after
+ * drain can be cut.
+ */
+struct connection_set {
+	std::mutex guard;
+	std::unordered_set<socket_ptr> sockets;
+};
+
+/*
+ * Listening socket handed over by another server process.
+ */
+struct inherited_listener {
+	int descriptor;
+	// the --unix one, gets unixBackend
+	bool unixSocket;
+};
+
+/*
+ * Listening sockets of the server, every one with its accept thread.
+ */
+class listener_group {
+public:
+	/*
+	 * Opens sockets as options say, throws socket_exception if they
+	 * can't be created.
+	 */
+	explicit listener_group(listener_options const & options);
+
+	/*
+	 * Takes over sockets of another server, which keep their addresses.
+	 * Backends and the rest still come from options.
+	 */
+	listener_group(listener_options const & options, std::vector<inherited_listener> const & inherited);
+
+	/*
+	 * Runs accept loops until hand_over(), then returns once all of them
+	 * are done. Accepted connections stay with their handler threads.
+	 */
+	void run(connection_handler handler);
+
+	/*
+	 * Stops accepting for another server to take the sockets over and
+	 * returns their descriptors, which the group still owns. Clients
+	 * connecting meanwhile wait in the sockets' queues.
+	 */
+	std::vector<inherited_listener> hand_over();
+
+	/*
+	 * Takes sockets back after the other server failed to start, run()
+	 * may accept on them again once it returned.
+	 */
+	void resume();
+
+	/*
+	 * Connections being handled now, over all listeners.
+	 */
+	size_t connections() const { return *m_connections; }
+
+	/*
+	 * Shuts down connections still open (see stream_socket::shutdown),
+	 * their handlers fail on the next send or recv.
+	 */
+	void cut_connections();
+
+private:
+	struct listener {
+		server_socket_ptr socket;
+		socket_backend backend;
+		bool unixSocket;
+		std::shared_ptr<listener_stats> stats;
+	};
+
+	void add(server_socket_ptr socket, socket_backend backend, bool unixSocket, int cpu);
+
+	listener_options m_options;
+	std::vector<listener> m_listeners;
+	std::shared_ptr<std::atomic<size_t>> m_connections;
+	std::shared_ptr<connection_set> m_open;
+	std::atomic<bool> m_handedOver { false };
+	bool m_reporting = false;
+};
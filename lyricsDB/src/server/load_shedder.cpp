@@ -0,0 +1,42 @@
+#include "load_shedder.h"
+
+#include <common/trace.h>
+
+load_shedder::load_shedder(fair_scheduler & scheduler, std::chrono::milliseconds shedDelay)
+	: m_scheduler(scheduler)
+	, m_shedDelay(shedDelay)
+{}
+
+shed_outcome load_shedder::serve(fair_scheduler::flow & f, message const & request,
+	request_processor const & process, clock::time_point received)
+{
+	shed_outcome outcome;
+	if (m_shedDelay.count() > 0 && m_scheduler.queue_delay() > m_shedDelay) {
+		// queue this long won't drain soon, waiting in it only makes it longer
+		outcome.shed = true;
+		outcome.response = std::make_shared<overloaded_response>(OVERLOADED_QUEUE_FULL);
+		return outcome;
+	}
+
+	// parsed budgets are capped, so this can't overflow
+	auto timed = dynamic_cast<deadline_request const *>(&request);
+	auto deadline = timed ? received + timed->get_budget() : clock::time_point::max();
+	auto expired = [&deadline] () { return clock::now() > deadline; };
+
+	processed_request processed;
+	trace_span span("schedule");
+	outcome.queued = m_scheduler.run(f, [&] () {
+		if (expired())
+			return;
+		trace_span span("process");
+		processed = process();
+	});
+
+	if (!processed.response || (processed.read && expired())) {
+		outcome.expired = true;
+		outcome.response = std::make_shared<overloaded_response>(OVERLOADED_DEADLINE_EXPIRED);
+	} else {
+		outcome.response = std::move(processed.response);
+	}
+	return outcome;
+}
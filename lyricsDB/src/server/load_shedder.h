@@ -0,0 +1,59 @@
+#pragma once
+
+#include "fair_scheduler.h"
+
+#include <protocol/protocol.h>
+
+#include <chrono>
+#include <functional>
+
+/*
+ * What processing of a request produced. Reads answered after the
+ * deadline are dropped, writes are applied already and answered anyway.
+ */
+struct processed_request {
+	message_ptr response;
+	bool read = false;
+};
+
+using request_processor = std::function<processed_request()>;
+
+/*
+ * How a request went through load_shedder, response is always set.
+ */
+struct shed_outcome {
+	message_ptr response;
+	// waited for its turn in scheduler
+	bool queued = false;
+	// answered OVERLOADED_QUEUE_FULL without waiting
+	bool shed = false;
+	// answered OVERLOADED_DEADLINE_EXPIRED, processed or not
+	bool expired = false;
+};
+
+/*
+ * Runs requests of connections in fair_scheduler turns, answering
+ * overloaded_response instead when the queue is too long or the budget
+ * of a deadline_request is spent.
+ */
+class load_shedder {
+public:
+	using clock = std::chrono::steady_clock;
+
+	/*
+	 * Requests are shed while the longest waiting one waits over
+	 * shedDelay, zero never sheds.
+	 */
+	load_shedder(fair_scheduler & scheduler, std::chrono::milliseconds shedDelay);
+
+	/*
+	 * Calls process in the turn of f unless request is shed or its
+	 * deadline, counted from received, passes before the turn.
+	 */
+	shed_outcome serve(fair_scheduler::flow & f, message const & request,
+		request_processor const & process, clock::time_point received);
+
+private:
+	fair_scheduler & m_scheduler;
+	std::chrono::milliseconds const m_shedDelay;
+};
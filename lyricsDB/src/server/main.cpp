@@ -1,9 +1,32 @@
 #include <net/stream_socket.h>
 #include <common/message_io.h>
+#include <common/trace.h>
+#include <db/database.h>
+#include <db/popularity.h>
+#include <protocol/text_delta.h>
 
+#include "fair_scheduler.h"
+#include "handoff.h"
+#include "invalidation_hub.h"
+#include "listeners.h"
+#include "load_shedder.h"
+#include "token_bucket.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <future>
+#include <iomanip>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
 #include <unordered_map>
 #include <iostream>
 #include <string>
@@ -12,128 +35,598 @@
 
 void usage(std::string const & name)
 {
-	std::cerr << "Usage: " << name << " [SERVER_ADDR] [SERVER_PORT]" << std::endl << std::endl;
+	std::cerr << "Usage: " << name << " [OPTIONS] [SERVER_ADDR] [SERVER_PORT]" << std::endl << std::endl;
 	std::cerr << "Options:" << std::endl;
 	std::cerr << "  SERVER_ADDR [default = 127.0.0.1]  ip4-address of server with db" << std::endl;
 	std::cerr << "  SERVER_PORT [default = 40001]      port of server with db" << std::endl;
+	std::cerr << "  --backend=NAME [default = tcp]     socket backend: tcp or uring" << std::endl;
+	std::cerr << "  --unix=PATH                        also listen on unix socket PATH (@NAME is abstract)" << std::endl;
+	std::cerr << "  --unix-backend=NAME [default = tcp] backend of unix listener: tcp, uring or shm" << std::endl;
+	std::cerr << "  --write-batch=N [default = 64]     max writes applied under one lock" << std::endl;
+	std::cerr << "  --write-delay-us=N [default = 0]   how long writes may wait for batch to fill" << std::endl;
+	std::cerr << "  --listeners=N|cores [default = 1]  SO_REUSEPORT listeners, each pinned to own cpu" << std::endl;
+	std::cerr << "  --stats-interval=S [default = 0]   print per-listener accept/load stats every S seconds" << std::endl;
+	std::cerr << "  --rate-limit=N [default = 0]       max requests per second of one connection, 0 is unlimited" << std::endl;
+	std::cerr << "  --rate-burst=N [default = rate]    requests connection may send at once after being idle" << std::endl;
+	std::cerr << "  --workers=N [default = 0]          requests processed at once, shared fairly between" << std::endl;
+	std::cerr << "                                     connections; 0 disables fair scheduling" << std::endl;
+	std::cerr << "  --drr-quantum-us=N [default = 100] processing time connection gets per scheduling round" << std::endl;
+	std::cerr << "  --shed-delay-ms=N [default = 0]    answer overloaded right away while a request waits for" << std::endl;
+	std::cerr << "                                     workers longer than N ms, 0 never sheds; needs --workers" << std::endl;
+	std::cerr << "  --idle-timeout=S [default = 0]     close connection idle for S seconds, 0 never closes" << std::endl;
+	std::cerr << "  --read-timeout-ms=N [default = 0]  max time to receive a request once it started" << std::endl;
+	std::cerr << "  --write-timeout-ms=N [default = 0] max time to send a response to slow reader" << std::endl;
+	std::cerr << "  --max-connections=N [default = 0]  close connections over N right away, 0 is unlimited" << std::endl;
+	std::cerr << "  --max-output-kb=N [default = 0]    kernel send buffer per connection, 0 is system default" << std::endl;
+	std::cerr << "  --memory-budget-mb=N [default = 0] keep at most N MB of texts in memory, 0 is unlimited" << std::endl;
+	std::cerr << "  --spill-file=PATH                  blob file for evicted texts [default = temporary]" << std::endl;
+	std::cerr << "  --scan-threads=N [default = cores] threads shared by concurrent catalog scans" << std::endl;
+	std::cerr << "  --top-window-s=N [default = 10]    length of time windows of song popularity" << std::endl;
+	std::cerr << "  --top-windows=N [default = 6]      completed popularity windows kept" << std::endl;
+	std::cerr << "  --trace-sample=N [default = 0]     trace every N-th request, 0 disables tracing" << std::endl;
+	std::cerr << "  --trace-ring=N [default = 4096]    spans kept per thread" << std::endl;
+	std::cerr << "  --trace-file=PATH [default = lyricsdb-trace.json]" << std::endl;
+	std::cerr << "                                     where SIGUSR1 dumps traced spans in Chrome trace format" << std::endl;
+	std::cerr << "  --handoff=PATH                     unix socket for zero-downtime restart: server started with" << std::endl;
+	std::cerr << "                                     the same PATH takes listening sockets and songs over" << std::endl;
+	std::cerr << "  --drain-timeout-ms=N [default = 5000]" << std::endl;
+	std::cerr << "                                     how long connections may finish before handing over" << std::endl;
 }
 
-class database {
-public:
-	void add_song(
-		std::string const & author,
-		std::string const & song,
-		std::string const & text)
-	{
-		std::lock_guard<std::mutex> g(m_guard);
-		m_authors[author][song] = text;
-	}
-
-	std::string get_song(std::string const & author, std::string const & song)
-	{
-		std::lock_guard<std::mutex> g(m_guard);
-
-		auto authorIt = m_authors.find(author);
-		if (authorIt == m_authors.end())
-			return "";
+struct server_options {
+	std::string hostname = "127.0.0.1";
+	uint16_t port = 40001;
+	socket_backend backend = socket_backend::TCP;
+	database_options db;
+	listener_options listeners;
+	double rateLimit = 0;
+	double rateBurst = 0;
+	size_t workers = 0;
+	std::chrono::microseconds drrQuantum { 100 };
+	std::chrono::milliseconds shedDelay { 0 };
+	std::chrono::seconds idleTimeout { 0 };
+	socket_limits limits;
+	popularity_options popularity;
+	trace_options trace;
+	std::string traceFile = "lyricsdb-trace.json";
+	std::string handoffPath;
+	std::chrono::milliseconds drainTimeout { 5000 };
+};
 
-		auto songIt = authorIt->second.find(song);
-		if (songIt == authorIt->second.end())
-			return "";
+/*
+ * Returns false if arguments are malformed.
+ */
+bool parse_options(int argc, char * argv[], server_options & options)
+{
+	std::vector<std::string> positional;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--")) {
+			positional.push_back(arg);
+			continue;
+		}
 
-		return songIt->second;
+		auto eq = arg.find('=');
+		if (eq == std::string::npos) {
+			std::cerr << "option " << arg << " requires value" << std::endl;
+			return false;
+		}
+		std::string key = arg.substr(2, eq - 2);
+		std::string value = arg.substr(eq + 1);
+		try {
+			if (key == "backend")
+				options.backend = parse_socket_backend(value);
+			else if (key == "unix")
+				options.listeners.unixPath = value;
+			else if (key == "unix-backend")
+				options.listeners.unixBackend = parse_socket_backend(value);
+			else if (key == "write-batch")
+				options.db.writeBatchSize = std::stoul(value);
+			else if (key == "write-delay-us")
+				options.db.writeBatchDelay = std::chrono::microseconds(std::stoul(value));
+			else if (key == "listeners")
+				options.listeners.count = value == "cores" ? available_cpu_count() : std::stoul(value);
+			else if (key == "stats-interval")
+				options.listeners.statsInterval = std::chrono::seconds(std::stoul(value));
+			else if (key == "rate-limit")
+				options.rateLimit = std::stod(value);
+			else if (key == "rate-burst")
+				options.rateBurst = std::stod(value);
+			else if (key == "workers")
+				options.workers = std::stoul(value);
+			else if (key == "drr-quantum-us")
+				options.drrQuantum = std::chrono::microseconds(std::stoul(value));
+			else if (key == "shed-delay-ms")
+				options.shedDelay = std::chrono::milliseconds(std::stoul(value));
+			else if (key == "idle-timeout")
+				options.idleTimeout = std::chrono::seconds(std::stoul(value));
+			else if (key == "read-timeout-ms")
+				options.limits.recvTimeout = std::chrono::milliseconds(std::stoul(value));
+			else if (key == "write-timeout-ms")
+				options.limits.sendTimeout = std::chrono::milliseconds(std::stoul(value));
+			else if (key == "max-connections")
+				options.listeners.maxConnections = std::stoul(value);
+			else if (key == "max-output-kb")
+				options.limits.sendBufferSize = std::stoul(value) * 1024;
+			else if (key == "memory-budget-mb")
+				options.db.memoryBudget = std::stoul(value) * 1024 * 1024;
+			else if (key == "spill-file")
+				options.db.spillPath = value;
+			else if (key == "scan-threads")
+				options.db.scanThreads = std::stoul(value);
+			else if (key == "top-window-s")
+				options.popularity.window = std::chrono::seconds(std::stoul(value));
+			else if (key == "top-windows")
+				options.popularity.windows = std::stoul(value);
+			else if (key == "trace-sample")
+				options.trace.sampleEvery = std::stoul(value);
+			else if (key == "trace-ring")
+				options.trace.ringCapacity = std::stoul(value);
+			else if (key == "trace-file")
+				options.traceFile = value;
+			else if (key == "handoff")
+				options.handoffPath = value;
+			else if (key == "drain-timeout-ms")
+				options.drainTimeout = std::chrono::milliseconds(std::stoul(value));
+			else {
+				std::cerr << "unknown option: " << arg << std::endl;
+				return false;
+			}
+		} catch (std::exception const & e) {
+			std::cerr << "invalid value of " << key << ": " << e.what() << std::endl;
+			return false;
+		}
 	}
 
-	std::vector<std::string> get_song_list(std::string const & author)
-	{
-		std::vector<std::string> songs;
+	if (positional.size() > 2)
+		return false;
 
-		std::lock_guard<std::mutex> g(m_guard);
-		auto authorIt = m_authors.find(author);
-		if (authorIt != m_authors.end())
-			for (auto const & it: authorIt->second)
-				songs.push_back(it.first);
+	if (positional.size() >= 1) {
+		options.hostname = positional[0];
+	}
 
-		return songs;
+	if (positional.size() >= 2) {
+		uint64_t p = std::stoul(positional[1]);
+		uint16_t maxPort = std::numeric_limits<uint16_t>::max();
+		if (p > maxPort) {
+			std::cerr << "invalid port: should be in interval [0, " << maxPort << "]" << std::endl;
+			return false;
+		}
+		options.port = p;
 	}
 
-private:
-	std::mutex m_guard;
-	std::unordered_map<std::string, std::unordered_map<std::string, std::string>> m_authors;
-};
+	return true;
+}
+
+// suggestions given for one missed lookup
+size_t constexpr MAX_SUGGESTIONS = 16;
 
 struct client_request_visitor: public request_visitor {
-	explicit client_request_visitor(database & d)
+	client_request_visitor(database & d, invalidation_hub & h, popularity_tracker & t,
+			socket_ptr const & c, push_channel_ptr & p)
 		: db(d)
+		, hub(h)
+		, popularity(t)
+		, client(c)
+		, channel(p)
 	{}
 
 	void visit(get_song_list_request & request) override
 	{
-		msg = std::make_shared<get_song_list_response>(db.get_song_list(request.get_author()));
+		read = true;
+		if (channel)
+			hub.watch_song_list(channel, request.get_author());
+		if (!request.is_versioned()) {
+			msg = std::make_shared<get_song_list_response>(db.get_song_list(request.get_author()));
+			return;
+		}
+
+		std::vector<std::string> songs;
+		uint64_t version;
+		if (db.get_song_list_if_modified(request.get_author(), request.get_known_version(), songs, version))
+			msg = std::make_shared<get_song_list_response>(std::move(songs), version);
+		else
+			msg = std::make_shared<not_modified_response>(version);
 	}
 
 	void visit(get_song_request & request) override
 	{
-		msg = std::make_shared<get_song_response>(
-			db.get_song(request.get_author(), request.get_song()));
+		read = true;
+		popularity.record(request.get_author(), request.get_song());
+		if (channel)
+			hub.watch_song(channel, request.get_author(), request.get_song());
+		if (!request.is_versioned()) {
+			msg = std::make_shared<get_song_response>(
+				db.get_song(request.get_author(), request.get_song()));
+			return;
+		}
+
+		std::string text;
+		uint64_t version;
+		if (db.get_song_if_modified(request.get_author(), request.get_song(), request.get_known_version(), text, version))
+			msg = std::make_shared<get_song_response>(std::move(text), version);
+		else
+			msg = std::make_shared<not_modified_response>(version);
+	}
+
+	void visit(find_song_request & request) override
+	{
+		read = true;
+		popularity.record(request.get_author(), request.get_song());
+		if (channel)
+			hub.watch_song(channel, request.get_author(), request.get_song());
+
+		std::string text;
+		text_digest digest;
+		if (db.find_song(request.get_author(), request.get_song(), text, digest)) {
+			msg = std::make_shared<get_song_response>(std::move(text), std::vector<song_name>());
+			return;
+		}
+		size_t limit = std::min<uint64_t>(request.get_suggestions(), MAX_SUGGESTIONS);
+		msg = std::make_shared<get_song_response>(std::string(),
+			db.suggest_songs(request.get_author(), request.get_song(), limit));
 	}
 
 	void visit(add_song_request & request) override
 	{
 		db.add_song(request.get_author(), request.get_song(), request.get_text());
+		hub.invalidate(request.get_author(), request.get_song(), channel.get());
+		msg = std::make_shared<add_song_response>("OK");
+	}
+
+	void visit(update_song_request & request) override
+	{
+		std::string base;
+		text_digest digest;
+		bool applied = db.find_song(request.get_author(), request.get_song(), base, digest)
+			&& digest == request.get_base_digest()
+			// song may change between find and replace, replace checks it again
+			&& db.replace_song(request.get_author(), request.get_song(), digest,
+				apply_text_delta(base, request.get_delta()));
+		if (applied)
+			hub.invalidate(request.get_author(), request.get_song(), channel.get());
+		msg = std::make_shared<add_song_response>(applied ? "OK" : UPDATE_BASE_MISMATCH);
+	}
+
+	void visit(subscribe_request &) override
+	{
+		if (!client->full_duplex()) {
+			msg = std::make_shared<add_song_response>(SUBSCRIBE_UNSUPPORTED);
+			return;
+		}
+		if (!channel)
+			channel = hub.subscribe(client);
 		msg = std::make_shared<add_song_response>("OK");
 	}
 
+	void visit(top_songs_request & request) override
+	{
+		std::vector<song_popularity> songs;
+		std::vector<author_popularity> authors;
+		read = true;
+		popularity.top(request.get_count(), request.get_windows(), songs, authors);
+		msg = std::make_shared<top_songs_response>(std::move(songs), std::move(authors));
+	}
+
+	void visit(scan_request & request) override
+	{
+		read = true;
+		msg = std::make_shared<scan_response>(db.scan(request.get_query()));
+	}
+
 	message_ptr msg;
+	// answer can be dropped without losing any change
+	bool read = false;
 	database & db;
+	invalidation_hub & hub;
+	popularity_tracker & popularity;
+	socket_ptr const & client;
+	push_channel_ptr & channel;
 };
 
+void report_database_stats(database const & db, std::chrono::seconds interval)
+{
+	database_stats last = db.stats();
+	while (true) {
+		std::this_thread::sleep_for(interval);
+		database_stats now = db.stats();
+		uint64_t diskReads = now.diskReads - last.diskReads;
+		auto diskTime = now.diskReadTime - last.diskReadTime;
+		std::cerr << std::fixed << std::setprecision(1)
+			<< "database: " << now.uniqueTexts << " unique texts"
+			<< ", dedup ratio " << now.dedup_ratio()
+			<< " (" << (now.logicalBytes - now.storedBytes) / 1e6 << " MB saved)"
+			<< ", hit ratio " << 100.0 * now.hit_ratio() << "%"
+			<< ", resident " << now.residentBytes / 1e6 << " MB"
+			<< ", spilled " << now.spilledBytes / 1e6 << " MB"
+			<< ", evictions/s " << (now.evictions - last.evictions) / double(interval.count())
+			<< ", disk reads/s " << diskReads / double(interval.count())
+			<< ", avg disk read " << (diskReads ? diskTime.count() / 1e3 / diskReads : 0.0) << "us"
+			<< ", max " << now.maxDiskReadTime.count() / 1e3 << "us"
+			<< std::endl;
+		last = now;
+	}
+}
+
+/*
+ * Outcome of a handoff round, passed from the handoff thread to the main
+ * thread, which runs listeners.
+ */
+struct handoff_round {
+	std::mutex guard;
+	std::condition_variable changed;
+	bool decided = false;
+	bool handedOver = false;
+};
+
+/*
+ * Old server side of handoff.h: drains, exports the catalog and passes
+ * it with the sockets to successor. False if successor went away.
+ */
+bool hand_over_to(int successor, server_options const & options, listener_group & listeners,
+		handoff_listener const & handoff, drain_control & drain, database const & db)
+{
+	drain.start_draining();
+	std::vector<inherited_listener> sockets;
+	try {
+		sockets = listeners.hand_over();
+	} catch (socket_exception const & e) {
+		std::cerr << "failed to hand over: " << e.what() << std::endl;
+		drain.resume();
+		return false;
+	}
+	std::cerr << "handing over to new server, draining connections" << std::endl;
+	size_t left = wait_drained(listeners, options.drainTimeout);
+	if (left) {
+		std::cerr << "drain timeout expired, cutting " << left << " connections" << std::endl;
+		listeners.cut_connections();
+	}
+	if (!drain.close(options.drainTimeout)) {
+		// a write may still be applied, catalog exported now could miss it
+		std::cerr << "requests still processed after drain timeout, serving again" << std::endl;
+		drain.resume();
+		return false;
+	}
+
+	bool taken = false;
+	try {
+		int catalog = db.export_catalog();
+		try {
+			taken = send_handoff(successor, { catalog, sockets, handoff.descriptor() });
+		} catch (socket_exception const & e) {
+			std::cerr << "failed to hand over: " << e.what() << std::endl;
+		}
+		close(catalog);
+	} catch (std::runtime_error const & e) {
+		std::cerr << "failed to export catalog: " << e.what() << std::endl;
+	}
+	if (!taken) {
+		std::cerr << "new server went away, serving again" << std::endl;
+		drain.resume();
+	}
+	return taken;
+}
+
+/*
+ * Dumps traced spans on every SIGUSR1. Signal must be blocked in all
+ * threads, so this is called before any of them starts.
+ */
+void start_trace_dumper(std::string const & path)
+{
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	std::thread dumper([signals, path] () {
+		while (true) {
+			int signal;
+			if (sigwait(&signals, &signal))
+				continue;
+
+			std::ofstream out(path, std::ios::trunc);
+			write_chrome_trace(out);
+			out.close();
+			trace_stats stats = tracing_stats();
+			std::cerr << "trace: " << (out ? "written to " : "failed to write ") << path
+				<< ", " << stats.sampledRequests << " sampled requests"
+				<< ", " << stats.spans << " spans"
+				<< ", " << stats.droppedSpans << " overwritten" << std::endl;
+		}
+	});
+	dumper.detach();
+}
+
 int main(int argc, char * argv[])
 {
-	if (argc > 3 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))) {
+	if (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
 		usage(argv[0]);
-		return (argc == 2 ? 0 : 1);
+		return 0;
 	}
 
-	std::string hostname = "127.0.0.1";
-	uint16_t port = 40001;
-	(void) port;
-
-	if (argc >= 2) {
-		hostname = argv[1];
+	server_options options;
+	if (!parse_options(argc, argv, options)) {
+		usage(argv[0]);
+		return 1;
 	}
+	options.listeners.hostname = options.hostname;
+	options.listeners.port = options.port;
+	options.listeners.backend = options.backend;
 
-	if (argc >= 3) {
-		uint64_t p = std::stoul(argv[2]);
-		uint16_t maxPort = std::numeric_limits<uint16_t>::max();
-		if (p > maxPort) {
-			std::cerr << "invalid port: should be in interval [0, " << maxPort << "]" << std::endl;
+	configure_tracing(options.trace);
+	if (options.trace.sampleEvery)
+		start_trace_dumper(options.traceFile);
+
+	handoff_package inherited;
+	int predecessor = -1;
+	bool takingOver = false;
+	if (!options.handoffPath.empty()) {
+		try {
+			takingOver = request_handoff(options.handoffPath, inherited, predecessor);
+		} catch (socket_exception const & e) {
+			std::cerr << "failed to take over running server: " << e.what() << std::endl;
 			return 1;
 		}
-		port = p;
 	}
 
-	auto ssocket = make_server_socket(hostname, port);
+	std::unique_ptr<database> dbHolder;
+	try {
+		dbHolder.reset(new database(options.db));
+		if (takingOver) {
+			auto start = std::chrono::steady_clock::now();
+			dbHolder->import_catalog(inherited.catalog);
+			close(inherited.catalog);
+			std::cerr << "loaded catalog of previous server in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+		}
+	} catch (std::runtime_error const & e) {
+		// previous server resumes once this one exits without confirming
+		std::cerr << "failed to open database: " << e.what() << std::endl;
+		return 1;
+	}
+	database & db = *dbHolder;
 
-	database db;
-	std::cerr << "server started on port " << port << std::endl;
-	while (true) {
-		auto client = ssocket->accept_one_client();
-		std::cerr << "accepted connection, start handling it" << std::endl;
-		std::thread t([client, &db] () {
-			try {
-				while (true) {
-					auto request = recv_message(*client);
-					client_request_visitor v(db);
-					request->accept(v);
-					send_message(*client, *v.msg);
+	if (options.listeners.statsInterval.count() > 0) {
+		std::thread reporter([&db, interval = options.listeners.statsInterval] () {
+			report_database_stats(db, interval);
+		});
+		reporter.detach();
+	}
+
+	fair_scheduler scheduler(options.workers, options.drrQuantum);
+	load_shedder shedder(scheduler, options.shedDelay);
+	invalidation_hub hub;
+	popularity_tracker popularity(options.popularity);
+	double rateBurst = options.rateBurst > 0 ? options.rateBurst : options.rateLimit;
+	drain_control drain;
+	drain_control * drainControl = options.handoffPath.empty() ? nullptr : &drain;
+
+	std::unique_ptr<listener_group> listeners;
+	std::unique_ptr<handoff_listener> handoff;
+	try {
+		if (takingOver) {
+			listeners.reset(new listener_group(options.listeners, inherited.listeners));
+			handoff.reset(new handoff_listener(inherited.handoffListener));
+			confirm_handoff(predecessor);
+			std::cerr << "took over " << inherited.listeners.size() << " listening sockets" << std::endl;
+		} else {
+			listeners.reset(new listener_group(options.listeners));
+			if (drainControl)
+				handoff.reset(new handoff_listener(options.handoffPath));
+		}
+	} catch (socket_exception const & e) {
+		std::cerr << "failed to listen: " << e.what() << std::endl;
+		return 1;
+	}
+
+	handoff_round round;
+	if (handoff) {
+		std::thread successors([&] () {
+			while (true) {
+				int successor;
+				try {
+					successor = handoff->accept_successor();
+				} catch (socket_exception const & e) {
+					std::cerr << e.what() << std::endl;
+					return;
 				}
-			} catch (socket_exception const & e) {
-				std::cerr << "error interact client: " << std::endl;
+				bool taken = hand_over_to(successor, options, *listeners, *handoff, drain, db);
+				close(successor);
+
+				std::unique_lock<std::mutex> lock(round.guard);
+				round.decided = true;
+				round.handedOver = taken;
+				round.changed.notify_all();
+				if (taken)
+					return;
+				// listeners are resumed before the next successor may stop them
+				round.changed.wait(lock, [&round] () { return !round.decided; });
 			}
 		});
-		t.detach();
+		successors.detach();
+	}
+
+	std::cerr << "server started on port " << options.port << std::endl;
+	auto handler = [&] (socket_ptr client, listener_stats & stats) {
+		token_bucket limiter(options.rateLimit, rateBurst);
+		auto flow = scheduler.open_flow();
+		connection_state_tracker state(stats);
+		push_channel_ptr channel;
+		try {
+			client->set_limits(options.limits);
+			while (true) {
+				state.set(connection_state::IDLE);
+				idle_wait waited = wait_for_request(*client, options.idleTimeout, drainControl);
+				if (waited == idle_wait::TIMED_OUT) {
+					++stats.idleClosed;
+					std::cerr << "closing idle connection" << std::endl;
+					break;
+				}
+				if (waited == idle_wait::DRAINED)
+					break;
+				state.set(connection_state::READING);
+				trace_request traced;
+				auto request = recv_message(*client);
+				if (!request)
+					throw protocol_exception("empty message");
+				// catalog may be exported already, the next server answers after reconnect
+				drain_guard admitted(drainControl);
+				if (!admitted.admitted())
+					break;
+				// budget is spent by throttling too
+				auto received = load_shedder::clock::now();
+				if (limiter.take())
+					++stats.throttled;
+
+				state.set(connection_state::PROCESSING);
+				client_request_visitor v(db, hub, popularity, client, channel);
+				auto outcome = shedder.serve(*flow, *request, [&] () {
+					request->accept(v);
+					return processed_request{ v.msg, v.read };
+				}, received);
+				stats.queued += outcome.queued;
+				stats.shed += outcome.shed;
+				stats.expired += outcome.expired;
+
+				// applied already, a client that doesn't read must not hold the drain up
+				admitted.release();
+				state.set(connection_state::WRITING);
+				if (channel) {
+					// pushes to this connection come from other threads
+					std::lock_guard<std::mutex> g(channel->sendGuard);
+					send_message(*client, *outcome.response);
+				} else {
+					send_message(*client, *outcome.response);
+				}
+				++stats.requests;
+			}
+		} catch (socket_timeout_exception const & e) {
+			++stats.timedOut;
+			std::cerr << "closing slow connection: " << e.what() << std::endl;
+		} catch (socket_exception const & e) {
+			std::cerr << "error interact client: " << e.what() << std::endl;
+		} catch (protocol_exception const & e) {
+			std::cerr << "malformed message from client: " << e.what() << std::endl;
+		} catch (std::runtime_error const & e) {
+			std::cerr << "database error: " << e.what() << std::endl;
+		}
+		if (channel)
+			hub.unsubscribe(channel);
+	};
+
+	while (true) {
+		listeners->run(handler);
+		// run() returns only once the sockets were handed over
+		std::unique_lock<std::mutex> lock(round.guard);
+		round.changed.wait(lock, [&round] () { return round.decided; });
+		if (round.handedOver)
+			break;
+		listeners->resume();
+		round.decided = false;
+		round.changed.notify_all();
 	}
 
-	return 0;
+	std::cerr << "handed over to new server, exiting" << std::endl;
+	// handler threads left after drain timeout still use the database
+	std::_Exit(0);
 }
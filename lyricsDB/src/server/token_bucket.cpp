@@ -0,0 +1,41 @@
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <thread>
+
+token_bucket::token_bucket(double rate, double burst)
+	: m_rate(rate)
+	, m_burst(std::max(1.0, burst))
+	, m_tokens(m_burst)
+	, m_last(clock::now())
+{}
+
+bool token_bucket::take()
+{
+	auto wait = reserve(clock::now());
+	if (wait == clock::duration::zero())
+		return false;
+
+	// sleeping stops reading the socket, so TCP pushes back on the client
+	std::this_thread::sleep_for(wait);
+	return true;
+}
+
+token_bucket::clock::duration token_bucket::reserve(clock::time_point now)
+{
+	if (m_rate <= 0)
+		return clock::duration::zero();
+
+	m_tokens = std::min(m_burst, m_tokens + m_rate * std::chrono::duration<double>(now - m_last).count());
+	m_last = now;
+	if (m_tokens >= 1) {
+		m_tokens -= 1;
+		return clock::duration::zero();
+	}
+
+	// the token is taken once it is there, refill goes on from that moment
+	auto wait = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1 - m_tokens) / m_rate));
+	m_tokens = 0;
+	m_last = now + wait;
+	return wait;
+}
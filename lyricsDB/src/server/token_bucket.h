@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+
+/*
+ * Classic token bucket, not thread-safe: every connection owns one.
+ */
+class token_bucket {
+public:
+	using clock = std::chrono::steady_clock;
+
+	/*
+	 * rate tokens per second, at most burst of them saved up.
+	 * Zero rate means no limit.
+	 */
+	token_bucket(double rate, double burst);
+
+	/*
+	 * Takes one token, sleeping until it is available.
+	 * Returns false if call wasn't throttled.
+	 */
+	bool take();
+
+	/*
+	 * Takes one token at now and returns how long the caller has to wait
+	 * for it, zero if it was there. Time is the caller's, so the tokens
+	 * after any sequence of calls are known exactly.
+	 */
+	clock::duration reserve(clock::time_point now);
+
+private:
+	double m_rate;
+	double m_burst;
+	double m_tokens;
+	clock::time_point m_last;
+};
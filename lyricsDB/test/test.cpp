@@ -1,21 +1,58 @@
 //#include "tcp_socket.h"
 //#include "au_stream_socket.h"
 
+#include <async/async_client.h>
+#include <client/requester.h>
+#include <common/message_io.h>
+#include <common/trace.h>
+#include <db/catalog_image.h>
+#include <db/database.h>
+#include <db/popularity.h>
+#include <importer/corpus.h>
+#include <net/impaired_link.h>
 #include <net/stream_socket.h>
+#include <protocol/text_delta.h>
+#include <server/handoff.h>
+#include <server/invalidation_hub.h>
+#include <server/listeners.h>
+#include <server/load_shedder.h>
+#include <server/token_bucket.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
 #include <cstdint>
 #include <cstddef>
 #include <cassert>
 #include <memory>
+#include <mutex>
 #include <cstring>
 #include <pthread.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #define TEST_TCP_STREAM_SOCKET
+#define TEST_URING_STREAM_SOCKET
+#define TEST_UNIX_STREAM_SOCKET
 //#define TEST_AU_STREAM_SOCKET
 
 const char *TEST_ADDR = "localhost";
+const char *UNIX_TEST_PATH = "unix:/tmp/lyricsdb-test.sock";
+const char *UNIX_ABSTRACT_TEST_PATH = "unix:@lyricsdb-test";
 const uint16_t TCP_TEST_PORT = 40002;
+const uint16_t URING_TEST_PORT = 40003;
+const uint16_t ASYNC_TEST_PORT = 40004;
+const uint16_t TIMEOUT_TEST_PORT = 40005;
+const uint16_t HANDOVER_TEST_PORT = 40006;
+const uint16_t CACHE_TEST_PORT = 40007;
+const uint16_t ACCEPT_TEST_PORT = 40008;
 //const au_stream_port AU_TEST_CLIENT_PORT = 40001;
 //const au_stream_port AU_TEST_SERVER_PORT = 301;
 
@@ -61,6 +98,7 @@ static void test_stream_sockets_datapipe()
 			buf[buf_ix] = i;
 		server_client->send(buf, sizeof(buf));
 	}
+	server_client->flush();
 
 	pthread_join(th, NULL);
 }
@@ -75,7 +113,8 @@ static void* test_stream_sockets_partial_data_sent_thread_func(void *)
 	buf[2] = 'l';
 	buf[3] = 'l';
 	client->send(buf, 2);
-//	client.reset();
+	client->flush();
+	client.reset();
 
 	return NULL;
 }
@@ -110,6 +149,118 @@ static void test_tcp_stream_sockets()
 #endif
 }
 
+static void test_uring_stream_sockets()
+{
+#ifdef TEST_URING_STREAM_SOCKET
+	server = make_server_socket(TEST_ADDR, URING_TEST_PORT, socket_backend::URING);
+	client = make_client_socket(TEST_ADDR, URING_TEST_PORT, false, socket_backend::URING);
+
+	test_stream_sockets_datapipe();
+	test_stream_sockets_partial_data_sent();
+#endif
+}
+
+static void test_unix_stream_sockets()
+{
+#ifdef TEST_UNIX_STREAM_SOCKET
+	server = make_server_socket(UNIX_TEST_PATH, 0);
+	client = make_client_socket(UNIX_TEST_PATH, 0);
+
+	test_stream_sockets_datapipe();
+	test_stream_sockets_partial_data_sent();
+
+	server = make_server_socket(UNIX_ABSTRACT_TEST_PATH, 0, socket_backend::URING);
+	client = make_client_socket(UNIX_ABSTRACT_TEST_PATH, 0, false, socket_backend::URING);
+
+	test_stream_sockets_datapipe();
+	test_stream_sockets_partial_data_sent();
+
+	// abstract address is free only once the previous server is gone
+	server.reset();
+	server = make_server_socket(UNIX_ABSTRACT_TEST_PATH, 0, socket_backend::SHM);
+	client = make_client_socket(UNIX_ABSTRACT_TEST_PATH, 0, false, socket_backend::SHM);
+
+	test_stream_sockets_datapipe();
+	test_stream_sockets_partial_data_sent();
+	server.reset();
+#endif
+}
+
+/*
+ * Segment is sent on first use, a client gone before that fails only
+ * its own connection and the server keeps accepting.
+ */
+static void test_shm_client_gone_before_accept()
+{
+#ifdef TEST_UNIX_STREAM_SOCKET
+	server = make_server_socket(UNIX_ABSTRACT_TEST_PATH, 0, socket_backend::SHM);
+	auto gone = make_client_socket(UNIX_ABSTRACT_TEST_PATH, 0);
+	gone->connect();
+	gone.reset();
+
+	server_client = server->accept_one_client();
+	bool thrown = false;
+	try {
+		char byte = 0;
+		server_client->send(&byte, 1);
+	} catch (socket_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	server_client.reset();
+
+	client = make_client_socket(UNIX_ABSTRACT_TEST_PATH, 0, false, socket_backend::SHM);
+	test_stream_sockets_datapipe();
+	server_client.reset();
+	client.reset();
+	server.reset();
+#endif
+}
+
+/*
+ * Only socket file of a server that is gone is replaced on bind.
+ */
+static void test_unix_socket_path_reuse()
+{
+	std::string path = "/tmp/lyricsdb-reuse-test.sock";
+	std::string address = "unix:" + path;
+	unlink(path.c_str());
+
+	// mistyped path of a regular file
+	std::ofstream(path) << "data";
+	bool thrown = false;
+	try {
+		make_server_socket(address, 0);
+	} catch (socket_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	std::string content;
+	std::ifstream(path) >> content;
+	assert(content == "data");
+	unlink(path.c_str());
+
+	// second server doesn't steal the socket of a running one
+	auto live = make_server_socket(address, 0);
+	thrown = false;
+	try {
+		make_server_socket(address, 0);
+	} catch (socket_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	auto peer = make_client_socket(address, 0, true);
+	live->accept_one_client();
+
+	// handed over socket keeps its file, nobody listens there once it is closed
+	live->hand_over();
+	live.reset();
+	assert(access(path.c_str(), F_OK) == 0);
+	auto replaced = make_server_socket(address, 0);
+	peer = make_client_socket(address, 0, true);
+	replaced->accept_one_client();
+}
+
 static void test_au_stream_sockets()
 {
 #ifdef TEST_AU_STREAM_SOCKET
@@ -121,10 +272,1637 @@ static void test_au_stream_sockets()
 #endif
 }
 
+static void test_database_concurrent_writes()
+{
+	database_options options;
+	options.writeBatchSize = 16;
+	options.writeBatchDelay = std::chrono::microseconds(100);
+	database db(options);
+
+	const int writers = 8;
+	const int songs = 200;
+	std::vector<std::thread> threads;
+	for (int w = 0; w < writers; ++w)
+		threads.emplace_back([&db, w] () {
+			std::string author = "author" + std::to_string(w % 3);
+			for (int i = 0; i < songs; ++i) {
+				std::string song = std::to_string(w) + "-" + std::to_string(i % 50);
+				db.add_song(author, song, std::to_string(i));
+				// write is visible as soon as add_song returned
+				assert(db.get_song(author, song) == std::to_string(i));
+			}
+		});
+	for (auto & t: threads)
+		t.join();
+
+	size_t total = 0;
+	for (int a = 0; a < 3; ++a)
+		total += db.get_song_list("author" + std::to_string(a)).size();
+	assert(total == size_t(writers * 50));
+	// last write of every song wins
+	assert(db.get_song("author1", "1-49") == std::to_string(songs - 1));
+}
+
+static void test_database_memory_budget()
+{
+	database_options options;
+	options.memoryBudget = 4 * 1024;
+	database db(options);
+
+	const int songs = 100;
+	// texts are distinct, equal ones would be stored once
+	auto text = [] (int i) { return std::string(100, 'a' + i % 26) + std::to_string(i); };
+	for (int i = 0; i < songs; ++i)
+		db.add_song("author", "song" + std::to_string(i), text(i));
+
+	auto stats = db.stats();
+	assert(stats.residentBytes <= options.memoryBudget);
+	assert(stats.evictions > 0);
+	assert(stats.spilledBytes > 0);
+
+	// evicted texts are read back from disk intact
+	for (int i = 0; i < songs; ++i)
+		assert(db.get_song("author", "song" + std::to_string(i)) == text(i));
+	assert(db.stats().diskReads > 0);
+
+	// recently read song stays in memory
+	db.get_song("author", "song7");
+	uint64_t hits = db.stats().memoryHits;
+	db.get_song("author", "song7");
+	assert(db.stats().memoryHits == hits + 1);
+
+	// overwrite of evicted song wins over its blob copy
+	db.add_song("author", "song0", "new text");
+	assert(db.get_song("author", "song0") == "new text");
+
+	uint64_t diskReads = db.stats().diskReads;
+	assert(db.get_song("author", "nothing").empty());
+	assert(db.get_song("nobody", "song1").empty());
+	assert(db.stats().misses == 2);
+	assert(db.stats().diskReads == diskReads);
+	assert(db.get_song_list("author").size() == size_t(songs));
+	assert(db.stats().residentBytes <= options.memoryBudget);
+}
+
+static void test_database_dedup()
+{
+	assert(digest_text("").to_hex() == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+	assert(digest_text("abc").to_hex() == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	assert(digest_text(std::string(1000000, 'a')).to_hex()
+		== "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+	database_options options;
+	options.memoryBudget = 1024;
+	database db(options);
+
+	std::string chorus(300, 'x');
+	for (int i = 0; i < 10; ++i)
+		db.add_song("cover" + std::to_string(i), "song", chorus);
+	db.add_song("original", "song", "other");
+
+	auto stats = db.stats();
+	assert(stats.uniqueTexts == 2);
+	assert(stats.logicalBytes == 10 * chorus.size() + 5);
+	assert(stats.storedBytes == chorus.size() + 5);
+	assert(stats.dedup_ratio() > 9);
+	assert(stats.residentBytes == stats.storedBytes);
+
+	// overwrite drops the reference, last one removes the text
+	db.add_song("cover0", "song", "other");
+	assert(db.stats().uniqueTexts == 2);
+	for (int i = 1; i < 10; ++i)
+		db.add_song("cover" + std::to_string(i), "song", "other");
+	stats = db.stats();
+	assert(stats.uniqueTexts == 1);
+	assert(stats.storedBytes == 5);
+	assert(stats.residentBytes == 5);
+	assert(db.get_song("cover3", "song") == "other");
+
+	// shared text evicted to disk is read back for every song
+	for (int i = 0; i < 20; ++i)
+		db.add_song("filler", std::to_string(i), std::string(100, 'a' + i));
+	assert(db.stats().evictions > 0);
+	for (int i = 0; i < 10; ++i)
+		assert(db.get_song("cover" + std::to_string(i), "song") == "other");
+	for (int i = 0; i < 20; ++i)
+		assert(db.get_song("filler", std::to_string(i)) == std::string(100, 'a' + i));
+}
+
+static void test_text_delta()
+{
+	std::string base;
+	for (int i = 0; i < 2000; ++i)
+		base += "line " + std::to_string(i) + " of a long song\n";
+
+	// typo in the middle costs about one block, not the whole text
+	std::string typo = base;
+	typo[typo.size() / 2] = '!';
+	std::string delta = make_text_delta(base, typo);
+	assert(apply_text_delta(base, delta) == typo);
+	assert(delta.size() < 1024);
+
+	std::string edited = "new first line\n" + base.substr(100, 30000) + "inserted\n" + base.substr(31000);
+	delta = make_text_delta(base, edited);
+	assert(apply_text_delta(base, delta) == edited);
+	assert(delta.size() < 1024);
+
+	for (auto const & target: { std::string(), std::string("short"), base + base, std::string(5000, 'a') })
+		assert(apply_text_delta(base, make_text_delta(base, target)) == target);
+	assert(apply_text_delta("", make_text_delta("", "text")) == "text");
+
+	// copy outside of base
+	std::string bad(1, '\0');
+	uint64_t fields[2] = { base.size(), 1 };
+	bad.append(reinterpret_cast<char const *>(fields), sizeof(fields));
+	bool thrown = false;
+	try {
+		apply_text_delta(base, bad);
+	} catch (protocol_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+
+	database db;
+	db.add_song("author", "song", base);
+	assert(db.replace_song("author", "song", digest_text(base), typo));
+	assert(db.get_song("author", "song") == typo);
+	// stale base and missing song are refused
+	assert(!db.replace_song("author", "song", digest_text(base), edited));
+	assert(!db.replace_song("author", "nothing", digest_text(""), edited));
+	assert(db.get_song("author", "song") == typo);
+	assert(db.get_song("author", "nothing").empty());
+
+	// refused replace of a missing author doesn't leave it listed empty
+	database empty, refused;
+	assert(!refused.replace_song("ghost", "song", digest_text(base), edited));
+	int emptyImage = empty.export_catalog();
+	int refusedImage = refused.export_catalog();
+	assert(lseek(refusedImage, 0, SEEK_END) == lseek(emptyImage, 0, SEEK_END));
+	close(emptyImage);
+	close(refusedImage);
+}
+
+static void test_message_schema()
+{
+	text_digest digest = digest_text("base");
+	std::vector<message_ptr> messages {
+		std::make_shared<get_song_request>("author", "song"),
+		std::make_shared<get_song_request>("author", "song", 7),
+		std::make_shared<get_song_list_request>("author"),
+		std::make_shared<get_song_list_request>("author", 7),
+		std::make_shared<add_song_request>("author", "song", "text"),
+		std::make_shared<update_song_request>("author", "song", digest, "delta"),
+		std::make_shared<subscribe_request>(),
+		std::make_shared<top_songs_request>(10, 3),
+		std::make_shared<deadline_request>(std::chrono::microseconds(500),
+			std::make_shared<get_song_request>("author", "song")),
+		std::make_shared<get_song_response>("text"),
+		std::make_shared<get_song_response>("", 7),
+		std::make_shared<get_song_list_response>(std::vector<std::string> { "a", "", "c" }),
+		std::make_shared<get_song_list_response>(std::vector<std::string>(), 7),
+		std::make_shared<add_song_response>("OK"),
+		std::make_shared<not_modified_response>(7),
+		std::make_shared<invalidate_message>("author", "song"),
+		std::make_shared<top_songs_response>(
+			std::vector<song_popularity> { { "a", "s", 5 }, { "b", "t", 2 } },
+			std::vector<author_popularity> { { "a", 5 } }),
+		std::make_shared<overloaded_response>(OVERLOADED_QUEUE_FULL),
+		std::make_shared<scan_request>(scan_query { "love", 3, scan_aggregate::OCCURRENCES_PER_AUTHOR }),
+		std::make_shared<scan_response>(scan_result { 10, 5, { { "a", 3 }, { "b", 2 } } }),
+		std::make_shared<find_song_request>("author", "song", 5),
+		std::make_shared<get_song_response>("", std::vector<song_name> { { "author", "song" } }),
+		std::make_shared<get_song_response>("text", std::vector<song_name>()),
+	};
+
+	for (auto const & m: messages) {
+		message_bytes bytes = m->serialize();
+		assert(parse_message(bytes)->serialize() == bytes);
+
+		// every truncated or extended frame is rejected
+		for (size_t size = 1; size < bytes.size(); ++size) {
+			bool thrown = false;
+			try {
+				parse_message(message_bytes(bytes.begin(), bytes.begin() + size));
+			} catch (protocol_exception const &) {
+				thrown = true;
+			}
+			assert(thrown);
+		}
+		message_bytes extended = bytes;
+		extended.push_back(0);
+		bool thrown = false;
+		try {
+			parse_message(extended);
+		} catch (protocol_exception const &) {
+			thrown = true;
+		}
+		assert(thrown);
+	}
+
+	// exact sizes, layouts are unchanged
+	assert(get_song_request("ab", "c").serialize().size() == 1 + 8 + 8 + 2 + 8 + 1);
+	assert(get_song_list_request("ab").serialize().size() == 1 + 8 + 2);
+	assert(not_modified_response(9).serialize().size() == 17);
+
+	auto top = std::dynamic_pointer_cast<top_songs_response>(parse_message(messages[16]->serialize()));
+	assert(top && top->get_songs().size() == 2 && top->get_authors().size() == 1);
+	assert(top->get_songs()[1].song == "t" && top->get_songs()[1].requests == 2);
+	auto list = std::dynamic_pointer_cast<get_song_list_response>(parse_message(messages[11]->serialize()));
+	assert(list && !list->is_versioned() && list->get_songs().size() == 3);
+	list = std::dynamic_pointer_cast<get_song_list_response>(parse_message(messages[12]->serialize()));
+	assert(list && list->is_versioned() && list->get_version() == 7 && list->get_songs().empty());
+
+	// unknown type and deadline wrapping deadline
+	bool thrown = false;
+	try {
+		parse_message(message_bytes(1, 200));
+	} catch (protocol_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	thrown = false;
+	try {
+		parse_message(deadline_request(std::chrono::microseconds(1), messages[8]).serialize());
+	} catch (protocol_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+}
+
+static void test_database_versions()
+{
+	database db;
+	std::string text;
+	std::vector<std::string> songs;
+	uint64_t version;
+	assert(!db.get_song_if_modified("author", "song", 0, text, version));
+	assert(version == 0);
+	assert(!db.get_song_list_if_modified("author", 0, songs, version));
+	songs.push_back("stale");
+	assert(db.get_song_list_if_modified("author", 5, songs, version));
+	assert(songs.empty() && version == 0);
+
+	db.add_song("author", "song", "text");
+	assert(db.get_song_if_modified("author", "song", 0, text, version));
+	assert(text == "text" && version > 0);
+	uint64_t songVersion = version;
+	assert(db.get_song_list_if_modified("author", 0, songs, version));
+	assert(songs.size() == 1);
+	uint64_t listVersion = version;
+
+	text.clear();
+	assert(!db.get_song_if_modified("author", "song", songVersion, text, version));
+	assert(text.empty() && version == songVersion);
+
+	// same text again changes nothing, new text bumps the song only
+	db.add_song("author", "song", "text");
+	assert(!db.get_song_if_modified("author", "song", songVersion, text, version));
+	db.add_song("author", "song", "new text");
+	assert(db.get_song_if_modified("author", "song", songVersion, text, version));
+	assert(text == "new text" && version > songVersion);
+	assert(!db.get_song_list_if_modified("author", listVersion, songs, version));
+
+	db.add_song("author", "other", "text");
+	assert(db.get_song_list_if_modified("author", listVersion, songs, version));
+	assert(songs.size() == 2 && version > listVersion);
+
+	auto roundtrip = [] (message const & m) { return parse_message(m.serialize()); };
+	auto request = std::dynamic_pointer_cast<get_song_request>(roundtrip(get_song_request("a", "s", 7)));
+	assert(request && request->is_versioned() && request->get_known_version() == 7 && request->get_song() == "s");
+	assert(!std::dynamic_pointer_cast<get_song_request>(roundtrip(get_song_request("a", "s")))->is_versioned());
+	auto listRequest = std::dynamic_pointer_cast<get_song_list_request>(roundtrip(get_song_list_request("a", 0)));
+	assert(listRequest && listRequest->is_versioned() && listRequest->get_known_version() == 0);
+	auto list = std::dynamic_pointer_cast<get_song_list_response>(
+		roundtrip(get_song_list_response({ "x", "y" }, 5)));
+	assert(list && list->get_version() == 5 && list->get_songs().size() == 2);
+	auto notModified = std::dynamic_pointer_cast<not_modified_response>(roundtrip(not_modified_response(9)));
+	assert(notModified && notModified->get_version() == 9);
+
+	assert(not_modified_response(9).serialize().size() == 17);
+}
+
+static void test_deadline_messages()
+{
+	auto roundtrip = [] (message const & m) { return parse_message(m.serialize()); };
+	auto timed = std::dynamic_pointer_cast<deadline_request>(roundtrip(deadline_request(
+		std::chrono::milliseconds(250), std::make_shared<get_song_request>("a", "s", 7))));
+	assert(timed && timed->get_budget() == std::chrono::milliseconds(250));
+	auto inner = std::dynamic_pointer_cast<get_song_request>(timed->get_request());
+	assert(inner && inner->get_song() == "s" && inner->get_known_version() == 7);
+	auto overloaded = std::dynamic_pointer_cast<overloaded_response>(roundtrip(overloaded_response(OVERLOADED_QUEUE_FULL)));
+	assert(overloaded && overloaded->get_reason() == OVERLOADED_QUEUE_FULL);
+	bool thrown = false;
+	try {
+		deadline_request nested(std::chrono::seconds(1), std::make_shared<deadline_request>(
+			std::chrono::seconds(1), std::make_shared<subscribe_request>()));
+		parse_message(nested.serialize());
+	} catch (protocol_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+
+	// server adds budget to its clock, anything this long is an error
+	auto limit = std::dynamic_pointer_cast<deadline_request>(roundtrip(deadline_request(
+		MAX_DEADLINE_BUDGET, std::make_shared<subscribe_request>())));
+	assert(limit && limit->get_budget() == MAX_DEADLINE_BUDGET);
+	for (auto budget : { MAX_DEADLINE_BUDGET + std::chrono::microseconds(1), std::chrono::microseconds::max() }) {
+		thrown = false;
+		try {
+			parse_message(deadline_request(budget, std::make_shared<subscribe_request>()).serialize());
+		} catch (protocol_exception const &) {
+			thrown = true;
+		}
+		assert(thrown);
+	}
+}
+
+static void test_drr_queue()
+{
+	using std::chrono::microseconds;
+	drr_queue queue(microseconds(100));
+	assert(queue.empty() && !queue.pop());
+
+	// both flows always wait, one costs three times more per turn
+	drr_queue::member cheap, expensive;
+	queue.push(cheap);
+	queue.push(expensive);
+	std::map<drr_queue::member *, int> turns;
+	std::map<drr_queue::member *, microseconds> spent;
+	std::map<drr_queue::member *, microseconds> cost = { { &cheap, microseconds(100) }, { &expensive, microseconds(300) } };
+	for (int i = 0; i < 400; ++i) {
+		auto served = queue.pop();
+		assert(served);
+		++turns[served];
+		spent[served] += cost[served];
+		queue.charge(*served, cost[served]);
+		queue.push(*served);
+	}
+	// equal processing time, so three cheap turns for every expensive one
+	assert(turns[&cheap] == 300 && turns[&expensive] == 100);
+	assert(spent[&cheap] == spent[&expensive]);
+
+	// a debt of many quanta is fast-forwarded, not paid off one pop at a time
+	while (!queue.empty())
+		queue.pop();
+	drr_queue::member indebted;
+	queue.push(cheap);
+	queue.charge(indebted, microseconds(1000000));
+	queue.pop();
+	queue.push(indebted);
+	assert(queue.pop() == &indebted);
+
+	// debt makes the flow skip its turn while others wait
+	queue.push(cheap);
+	queue.charge(indebted, microseconds(1000));
+	assert(queue.pop() == &cheap);
+	queue.push(indebted);
+	queue.push(cheap);
+	assert(queue.pop() == &cheap);
+	assert(queue.pop() == &indebted);
+	// but is forgiven when nobody else waits
+	queue.charge(indebted, microseconds(1000));
+	queue.push(indebted);
+	queue.push(cheap);
+	assert(queue.pop() == &indebted);
+	queue.pop();
+
+	drr_queue::member early, late;
+	early.enqueued = std::chrono::steady_clock::now();
+	late.enqueued = early.enqueued + std::chrono::seconds(1);
+	queue.push(late);
+	queue.push(early);
+	assert(queue.oldest() == early.enqueued);
+}
+
+static void test_token_bucket()
+{
+	using std::chrono::milliseconds;
+	token_bucket bucket(10, 3);
+	auto now = token_bucket::clock::now() + std::chrono::seconds(1);
+	// starts full, burst goes through
+	for (int i = 0; i < 3; ++i)
+		assert(bucket.reserve(now) == milliseconds(0));
+	// then one token every 100ms
+	assert(bucket.reserve(now) == milliseconds(100));
+	// that token is the one refilled by now + 100ms, the next one comes 100ms later
+	assert(bucket.reserve(now + milliseconds(100)) == milliseconds(100));
+	assert(bucket.reserve(now + milliseconds(250)) == milliseconds(50));
+	// refill after a pause is capped by burst
+	now += std::chrono::seconds(10);
+	for (int i = 0; i < 3; ++i)
+		assert(bucket.reserve(now) == milliseconds(0));
+	assert(bucket.reserve(now) == milliseconds(100));
+	// partial refill
+	now += milliseconds(350);
+	assert(bucket.reserve(now) == milliseconds(0));
+	assert(bucket.reserve(now) == milliseconds(0));
+	assert(bucket.reserve(now) == milliseconds(50));
+
+	token_bucket unlimited(0, 0);
+	for (int i = 0; i < 100; ++i)
+		assert(unlimited.reserve(now) == milliseconds(0) && !unlimited.take());
+}
+
+static void test_load_shedder()
+{
+	using clock = load_shedder::clock;
+	fair_scheduler scheduler(1, std::chrono::microseconds(100));
+	load_shedder shedder(scheduler, std::chrono::milliseconds(20));
+	auto flow = scheduler.open_flow();
+	get_song_request plain("a", "s");
+	deadline_request timed(std::chrono::milliseconds(50), std::make_shared<get_song_request>("a", "s"));
+	auto reason = [] (shed_outcome const & outcome) {
+		auto overloaded = std::dynamic_pointer_cast<overloaded_response>(outcome.response);
+		return overloaded ? overloaded->get_reason() : std::string();
+	};
+
+	int calls = 0;
+	auto read = [&calls] () {
+		++calls;
+		return processed_request{ std::make_shared<get_song_response>("text"), true };
+	};
+	auto outcome = shedder.serve(*flow, timed, read, clock::now());
+	assert(calls == 1 && !outcome.queued && !outcome.shed && !outcome.expired);
+	assert(std::dynamic_pointer_cast<get_song_response>(outcome.response));
+
+	// budget spent before the turn, request isn't processed
+	outcome = shedder.serve(*flow, timed, read, clock::now() - std::chrono::seconds(1));
+	assert(calls == 1 && outcome.expired && reason(outcome) == OVERLOADED_DEADLINE_EXPIRED);
+	// no budget, no deadline
+	outcome = shedder.serve(*flow, plain, read, clock::now() - std::chrono::hours(48));
+	assert(calls == 2 && !outcome.expired);
+
+	// budget spent while processing: late read is dropped, write is applied already
+	auto slow = [&calls] (bool isRead) {
+		return [&calls, isRead] () {
+			++calls;
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			return processed_request{ std::make_shared<add_song_response>("OK"), isRead };
+		};
+	};
+	outcome = shedder.serve(*flow, timed, slow(true), clock::now());
+	assert(calls == 3 && outcome.expired && reason(outcome) == OVERLOADED_DEADLINE_EXPIRED);
+	outcome = shedder.serve(*flow, timed, slow(false), clock::now());
+	assert(calls == 4 && !outcome.expired && std::dynamic_pointer_cast<add_song_response>(outcome.response));
+
+	// one request holds the only slot, another waits for it past shed delay
+	std::promise<void> started, unblock;
+	auto blocked = unblock.get_future().share();
+	auto busy = std::async(std::launch::async, [&] () {
+		return shedder.serve(*scheduler.open_flow(), plain, [&started, blocked] () {
+			started.set_value();
+			blocked.wait();
+			return processed_request{ std::make_shared<add_song_response>("OK"), false };
+		}, clock::now());
+	});
+	started.get_future().wait();
+	auto queued = std::async(std::launch::async, [&] () {
+		return shedder.serve(*scheduler.open_flow(), plain, read, clock::now());
+	});
+	while (scheduler.queue_delay() <= std::chrono::milliseconds(20))
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	outcome = shedder.serve(*flow, timed, read, clock::now());
+	assert(outcome.shed && !outcome.expired && reason(outcome) == OVERLOADED_QUEUE_FULL);
+	// zero delay never sheds, this one waits in the queue too
+	load_shedder patient(scheduler, std::chrono::milliseconds(0));
+	auto waited = std::async(std::launch::async, [&] () {
+		return patient.serve(*scheduler.open_flow(), plain, read, clock::now());
+	});
+
+	unblock.set_value();
+	assert(!busy.get().queued);
+	auto late = queued.get();
+	assert(late.queued && !late.shed && std::dynamic_pointer_cast<get_song_response>(late.response));
+	assert(!waited.get().shed);
+	assert(calls == 6);
+}
+
+static std::string next_invalidation(stream_socket & peer)
+{
+	auto invalidation = std::dynamic_pointer_cast<invalidate_message>(recv_message(peer));
+	assert(invalidation);
+	return invalidation->get_author() + "/" + invalidation->get_song();
+}
+
+static void test_invalidation_hub()
+{
+	auto roundtrip = [] (message const & m) { return parse_message(m.serialize()); };
+	assert(std::dynamic_pointer_cast<subscribe_request>(roundtrip(subscribe_request())));
+	auto invalidation = std::dynamic_pointer_cast<invalidate_message>(roundtrip(invalidate_message("a", "s")));
+	assert(invalidation && invalidation->get_author() == "a" && invalidation->get_song() == "s");
+
+	invalidation_hub hub;
+	auto readerLink = make_impaired_socket_pair(link_options());
+	auto writerLink = make_impaired_socket_pair(link_options());
+	auto reader = hub.subscribe(readerLink.first);
+	auto writer = hub.subscribe(writerLink.first);
+	// nothing else is pushed before the marker, pushes to one channel keep their order
+	auto marker = [&hub] (push_channel_ptr const & channel) {
+		hub.watch_song(channel, "marker", "m");
+		hub.invalidate("marker", "m", nullptr);
+	};
+
+	// a read arms one push, the write after it breaks the callback
+	hub.watch_song(reader, "a", "s");
+	hub.invalidate("a", "s", writer.get());
+	assert(next_invalidation(*readerLink.second) == "a/s");
+	hub.invalidate("a", "s", writer.get());
+	marker(reader);
+	assert(next_invalidation(*readerLink.second) == "marker/m");
+
+	// list readers hear of every song of the author, one push for both keys
+	hub.watch_song_list(reader, "a");
+	hub.watch_song(reader, "a", "s");
+	hub.invalidate("a", "s", nullptr);
+	hub.invalidate("a", "other", nullptr);
+	marker(reader);
+	assert(next_invalidation(*readerLink.second) == "a/s");
+	assert(next_invalidation(*readerLink.second) == "marker/m");
+	hub.watch_song_list(reader, "a");
+	hub.invalidate("a", "other", nullptr);
+	assert(next_invalidation(*readerLink.second) == "a/other");
+
+	// keys of different authors don't collide
+	hub.watch_song(reader, "a", "bs");
+	hub.watch_song_list(reader, "ab");
+	hub.invalidate("ab", "s", nullptr);
+	hub.invalidate("a", "bs", nullptr);
+	assert(next_invalidation(*readerLink.second) == "ab/s");
+	assert(next_invalidation(*readerLink.second) == "a/bs");
+
+	// writer isn't pushed its own write, but its read is disarmed by it
+	hub.watch_song(writer, "a", "s");
+	hub.watch_song(reader, "a", "s");
+	hub.invalidate("a", "s", writer.get());
+	assert(next_invalidation(*readerLink.second) == "a/s");
+	hub.invalidate("a", "s", nullptr);
+	marker(writer);
+	assert(next_invalidation(*writerLink.second) == "marker/m");
+
+	// subscriber whose connection is gone is dropped on the first push
+	hub.watch_song(writer, "a", "s");
+	hub.watch_song(reader, "a", "s");
+	writerLink.second.reset();
+	hub.invalidate("a", "s", nullptr);
+	assert(next_invalidation(*readerLink.second) == "a/s");
+	hub.watch_song(writer, "a", "s");
+	marker(reader);
+	assert(next_invalidation(*readerLink.second) == "marker/m");
+
+	// nothing is pushed after unsubscribe
+	hub.watch_song(reader, "a", "s");
+	hub.unsubscribe(reader);
+	hub.watch_song(reader, "a", "s");
+	hub.invalidate("a", "s", nullptr);
+	assert(!readerLink.second->wait_readable(std::chrono::milliseconds(50)));
+}
+
+static void test_song_cache()
+{
+	// entry size is key ("s" + author length + ":" + author + song) plus text
+	song_cache cache(40);
+	std::string text;
+	std::vector<std::string> songs;
+	cache.put_song("a", "x", "0123456789");
+	cache.put_song("a", "y", "0123456789");
+	assert(cache.get_song("a", "x", text) && text == "0123456789");
+	// third one is over capacity, y is the least recently used
+	cache.put_song("a", "z", "0123456789");
+	assert(!cache.get_song("a", "y", text));
+	assert(cache.get_song("a", "x", text) && cache.get_song("a", "z", text));
+	assert(cache.hits() == 3 && cache.misses() == 1);
+
+	// replacing keeps one entry, too large text isn't cached and drops the old one
+	cache.put_song("a", "x", "new");
+	assert(cache.get_song("a", "x", text) && text == "new");
+	cache.put_song("a", "x", std::string(100, 'x'));
+	assert(!cache.get_song("a", "x", text));
+	assert(cache.get_song("a", "z", text));
+
+	// invalidation drops the song and its author's list, not other authors
+	cache.put_song_list("a", { "x", "z" });
+	cache.put_song_list("b", { "x" });
+	assert(cache.get_song_list("a", songs) && songs.size() == 2);
+	cache.invalidate("a", "z");
+	assert(!cache.get_song("a", "z", text) && !cache.get_song_list("a", songs));
+	assert(cache.get_song_list("b", songs) && songs == std::vector<std::string>{ "x" });
+
+	// list size counts song names, lists are evicted like songs
+	cache.put_song_list("c", { std::string(38, 'c') });
+	assert(cache.get_song_list("c", songs) && !cache.get_song_list("b", songs));
+}
+
+static void test_requester_invalidations()
+{
+	auto listener = make_server_socket(TEST_ADDR, CACHE_TEST_PORT);
+	std::thread server([&listener] () {
+		socket_ptr peer = listener->accept_one_client();
+		assert(std::dynamic_pointer_cast<subscribe_request>(recv_message(*peer)));
+		send_message(*peer, add_song_response("OK"));
+
+		// song changes while its read is in flight, invalidation overtakes the response
+		assert(std::dynamic_pointer_cast<find_song_request>(recv_message(*peer)));
+		send_message(*peer, invalidate_message("a", "s"));
+		send_message(*peer, get_song_response("old", std::vector<song_name>()));
+		// so the old text isn't cached and the next get asks again
+		assert(std::dynamic_pointer_cast<find_song_request>(recv_message(*peer)));
+		send_message(*peer, get_song_response("new", std::vector<song_name>()));
+		// pushed between requests, taken before the next one
+		send_message(*peer, invalidate_message("a", "s"));
+		assert(std::dynamic_pointer_cast<find_song_request>(recv_message(*peer)));
+		send_message(*peer, get_song_response("newer", std::vector<song_name>()));
+
+		// invalidation of another author doesn't affect the read
+		assert(std::dynamic_pointer_cast<get_song_list_request>(recv_message(*peer)));
+		send_message(*peer, invalidate_message("c", "s"));
+		send_message(*peer, get_song_list_response({ "s" }));
+		// list read is invalidated by any song of its author
+		assert(std::dynamic_pointer_cast<get_song_list_request>(recv_message(*peer)));
+		send_message(*peer, invalidate_message("a", "t"));
+		send_message(*peer, get_song_list_response({ "s", "t" }));
+		assert(std::dynamic_pointer_cast<get_song_list_request>(recv_message(*peer)));
+		send_message(*peer, get_song_list_response({ "s", "t" }));
+		try {
+			recv_message(*peer);
+			assert(false);
+		} catch (socket_exception const &) {
+			// client disconnected
+		}
+	});
+
+	{
+		auto socket = make_client_socket(TEST_ADDR, CACHE_TEST_PORT, true);
+		requester r(socket);
+		std::vector<song_name> suggestions;
+		assert(r.request_get_song("a", "s", suggestions) == "old");
+		assert(r.request_get_song("a", "s", suggestions) == "new");
+		assert(socket->wait_readable(std::chrono::seconds(5)));
+		assert(r.request_get_song("a", "s", suggestions) == "newer");
+		assert(r.request_get_song("a", "s", suggestions) == "newer");
+
+		assert(r.request_get_song_list("b") == std::vector<std::string>{ "s" });
+		assert(r.request_get_song_list("b") == std::vector<std::string>{ "s" });
+		for (int i = 0; i < 3; ++i)
+			assert(r.request_get_song_list("a").size() == 2);
+		assert(r.cache().hits() == 3 && r.cache().misses() == 6);
+	}
+	server.join();
+}
+
+static void test_corpus()
+{
+	namespace fs = std::filesystem;
+	fs::path root = fs::temp_directory_path() / ("lyricsdb-corpus-" + std::to_string(getpid()));
+	fs::remove_all(root);
+	fs::create_directories(root / "tree" / "Queen" / "live");
+	std::ofstream(root / "tree" / "Queen" / "Bohemian Rhapsody.txt") << "mama";
+	std::ofstream(root / "tree" / "Queen" / "live" / "Wembley") << "live";
+	// files next to author directories are not songs
+	std::ofstream(root / "tree" / "README") << "readme";
+
+	auto sorted = [] (std::vector<song_file> songs) {
+		std::sort(songs.begin(), songs.end(), [] (song_file const & a, song_file const & b) {
+			return a.song < b.song;
+		});
+		return songs;
+	};
+	auto songs = sorted(list_songs((root / "tree").string()));
+	assert(songs.size() == 2);
+	assert(songs[0].author == "Queen" && songs[0].song == "Bohemian Rhapsody");
+	assert(read_text(songs[0].path) == "mama");
+	assert(songs[1].song == "live/Wembley" && read_text(songs[1].path) == "live");
+
+	// relative paths are resolved against the manifest, comments and empty lines skipped
+	std::ofstream(root / "manifest") << "# author\tsong\tpath\n"
+		<< "\n"
+		<< "Queen\tBohemian Rhapsody\ttree/Queen/Bohemian Rhapsody.txt\n"
+		<< "The Beatles\tLet It Be\t" << (root / "tree" / "Queen" / "live" / "Wembley").string() << "\n";
+	songs = list_songs((root / "manifest").string());
+	assert(songs.size() == 2);
+	assert(songs[0].author == "Queen" && songs[0].song == "Bohemian Rhapsody" && read_text(songs[0].path) == "mama");
+	assert(songs[1].author == "The Beatles" && songs[1].song == "Let It Be" && read_text(songs[1].path) == "live");
+
+	auto error = [] (auto && fn) {
+		try {
+			fn();
+		} catch (std::runtime_error const & e) {
+			return std::string(e.what());
+		}
+		return std::string();
+	};
+	// a line without path names its number
+	std::ofstream(root / "malformed") << "# comment\nQueen\tBohemian Rhapsody\tpath\nQueen\tno path\n";
+	assert(error([&] () { list_songs((root / "malformed").string()); }) == "malformed manifest line 3");
+	std::ofstream(root / "no tabs") << "just a line\n";
+	assert(error([&] () { list_songs((root / "no tabs").string()); }) == "malformed manifest line 1");
+
+	// missing source and missing song file
+	assert(!error([&] () { list_songs((root / "missing").string()); }).empty());
+	std::ofstream(root / "dangling") << "Queen\tGone\tmissing.txt\n";
+	songs = list_songs((root / "dangling").string());
+	assert(songs.size() == 1 && songs[0].path == (root / "missing.txt").string());
+	assert(error([&] () { read_text(songs[0].path); }).find("failed to open") == 0);
+
+	// empty file reads as empty text
+	std::ofstream(root / "empty");
+	assert(read_text((root / "empty").string()).empty());
+	fs::remove_all(root);
+}
+
+static void test_tracing()
+{
+	trace_options options;
+	options.sampleEvery = 1;
+	options.ringCapacity = 4;
+	configure_tracing(options);
+	{
+		trace_request request;
+		assert(request.sampled());
+		trace_span outer("outer");
+		trace_span inner("inner");
+	}
+	std::thread other([] () {
+		trace_request request;
+		trace_span span("other \"thread\"");
+	});
+	other.join();
+
+	// ring of finished thread is still dumped
+	std::stringstream out;
+	write_chrome_trace(out);
+	std::string json = out.str();
+	for (auto name: { "\"outer\"", "\"inner\"", "\"request\"", "\"other \\\"thread\\\"\"" })
+		assert(json.find(std::string("\"name\":") + name) != std::string::npos);
+	assert(json.find("\"ph\":\"X\"") != std::string::npos);
+
+	options.sampleEvery = 2;
+	configure_tracing(options);
+	trace_stats before = tracing_stats();
+	for (int i = 0; i < 10; ++i) {
+		trace_request request;
+		trace_span span("sampled");
+	}
+	trace_stats after = tracing_stats();
+	assert(after.sampledRequests - before.sampledRequests == 5);
+	assert(after.spans - before.spans == 10);
+	assert(after.droppedSpans > before.droppedSpans);
+
+	configure_tracing(trace_options());
+	trace_request request;
+	assert(!request.sampled());
+	trace_span span("ignored");
+}
+
+static void test_catalog_scan()
+{
+	database_options options;
+	// most texts are evicted and read back from blob file by the scan
+	options.memoryBudget = 16 * 1024;
+	options.scanThreads = 4;
+	database db(options);
+
+	uint64_t songs = 0, loveSongs = 0, longSongs = 0, loves = 0;
+	std::map<std::string, uint64_t> authorLoves;
+	for (int a = 0; a < 20; ++a) {
+		std::string author = "author" + std::to_string(a);
+		for (int i = 0; i < 50; ++i) {
+			int lines = 1 + (a * 7 + i) % 40;
+			int love = (a + i) % 3;
+			std::string text;
+			for (int l = 0; l < lines; ++l)
+				text += (l < love ? "love love " : "line ") + std::to_string(l) + "\n";
+			db.add_song(author, "song" + std::to_string(i), text);
+			int occurrences = std::min(lines, love) * 2;
+			++songs;
+			loveSongs += occurrences > 0;
+			longSongs += lines >= 30;
+			loves += occurrences;
+			if (occurrences)
+				authorLoves[author] += occurrences;
+		}
+	}
+	assert(db.stats().spilledBytes > 0);
+
+	scan_query query;
+	scan_result result = db.scan(query);
+	assert(result.scannedSongs == songs && result.total == songs && result.groups.empty());
+
+	query.pattern = "love";
+	assert(db.scan(query).total == loveSongs);
+	query.pattern.clear();
+	query.minLines = 30;
+	assert(db.scan(query).total == longSongs);
+
+	query.minLines = 0;
+	query.pattern = "love";
+	query.aggregate = scan_aggregate::OCCURRENCES_PER_AUTHOR;
+	result = db.scan(query);
+	assert(result.total == loves && result.groups.size() == authorLoves.size());
+	for (size_t i = 0; i < result.groups.size(); ++i) {
+		assert(result.groups[i].value == authorLoves[result.groups[i].author]);
+		assert(!i || result.groups[i - 1].value >= result.groups[i].value);
+	}
+
+	query.aggregate = scan_aggregate::SONGS_PER_AUTHOR;
+	query.pattern = "nothing like this";
+	result = db.scan(query);
+	assert(result.total == 0 && result.groups.empty());
+
+	// writes go on during scans, every scan sees a whole number of them
+	std::thread writer([&db] () {
+		for (int i = 0; i < 200; ++i)
+			db.add_song("writer", std::to_string(i), "love\n");
+	});
+	query.pattern.clear();
+	uint64_t seen = 0;
+	while (seen < 200) {
+		result = db.scan(query);
+		uint64_t written = 0;
+		for (auto const & group: result.groups)
+			written += group.author == "writer" ? group.value : 0;
+		assert(written >= seen && result.scannedSongs == songs + written);
+		seen = written;
+	}
+	writer.join();
+
+	// concurrent scans share the helpers, each one is still complete
+	query = scan_query();
+	std::vector<std::thread> scanners;
+	for (int i = 0; i < 4; ++i)
+		scanners.emplace_back([&db, &query, songs] () {
+			for (int j = 0; j < 5; ++j)
+				assert(db.scan(query).total == songs + 200);
+		});
+	for (auto & scanner: scanners)
+		scanner.join();
+
+	scan_thread_budget helpers(3);
+	assert(helpers.take(5) == 3 && helpers.take(1) == 0);
+	catalog_snapshot snapshot;
+	snapshot.authors = { "a" };
+	for (int i = 0; i < 5000; ++i)
+		snapshot.songs.push_back({ 0, std::make_shared<std::string const>("text\n"), 0, 5 });
+	// nothing left, scan runs in the calling thread alone
+	assert(run_catalog_scan(snapshot, query, helpers).total == 5000);
+	helpers.give_back(3);
+	// scan gives its helpers back
+	assert(run_catalog_scan(snapshot, query, helpers).total == 5000);
+	assert(helpers.take(2) == 2 && helpers.take(2) == 1);
+}
+
+static void test_popularity()
+{
+	popularity_options options;
+	options.window = std::chrono::milliseconds(200);
+	options.windows = 2;
+	options.candidates = 8;
+	popularity_tracker tracker(options);
+
+	// hot songs are read from two threads among many cold ones
+	auto reads = [&tracker] (int thread) {
+		for (int i = 0; i < 100; ++i) {
+			tracker.record("a", "hot");
+			if (i % 2 == 0)
+				tracker.record("b", "warm");
+			if (i % 10 == 0)
+				tracker.record("a", "mild");
+			tracker.record("cold " + std::to_string(thread), std::to_string(i));
+		}
+	};
+	std::thread other(reads, 1);
+	reads(0);
+	other.join();
+
+	std::vector<song_popularity> songs;
+	std::vector<author_popularity> authors;
+	tracker.top(3, 1, songs, authors);
+	assert(songs.size() == 3 && authors.size() == 3);
+	assert(songs[0].author == "a" && songs[0].song == "hot" && songs[0].requests >= 200);
+	assert(songs[1].song == "warm" && songs[1].requests >= 100 && songs[1].requests < 200);
+	assert(songs[2].song == "mild" && songs[2].requests >= 20 && songs[2].requests < 100);
+	assert(authors[0].author == "a" && authors[0].requests >= 220);
+	assert(authors[1].requests >= 100 && authors[2].requests >= 100);
+	tracker.top(100, 1, songs, authors);
+	assert(songs.size() <= options.candidates);
+
+	// old windows fall out of the requested range
+	std::this_thread::sleep_for(options.window);
+	tracker.record("b", "new");
+	tracker.top(3, 1, songs, authors);
+	assert(songs.size() == 1 && songs[0].song == "new" && songs[0].requests == 1);
+	tracker.top(3, 2, songs, authors);
+	assert(songs.size() == 3 && songs[0].song == "hot");
+	tracker.top(3, 0, songs, authors);
+	assert(songs.empty() && authors.empty());
+
+	auto roundtrip = [] (message const & m) { return parse_message(m.serialize()); };
+	auto request = std::dynamic_pointer_cast<top_songs_request>(roundtrip(top_songs_request(10, 3)));
+	assert(request && request->get_count() == 10 && request->get_windows() == 3);
+	auto response = std::dynamic_pointer_cast<top_songs_response>(roundtrip(top_songs_response(
+		{ { "a", "hot", 200 }, { "b", "warm", 100 } }, { { "a", 220 } })));
+	assert(response && response->get_songs().size() == 2 && response->get_authors().size() == 1);
+	assert(response->get_songs()[1].song == "warm" && response->get_songs()[1].requests == 100);
+	assert(response->get_authors()[0].author == "a" && response->get_authors()[0].requests == 220);
+	message_bytes malformed = top_songs_response({ { "a", "hot", 200 } }, {}).serialize();
+	malformed[1 + 8 + 8] = 2;
+	bool thrown = false;
+	try {
+		parse_message(malformed);
+	} catch (protocol_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+}
+
+static void test_socket_timeouts(socket_backend backend, std::string const & address = TEST_ADDR)
+{
+	auto listener = make_server_socket(address, TIMEOUT_TEST_PORT, backend);
+	auto peer = make_client_socket(address, TIMEOUT_TEST_PORT, true, backend);
+	auto accepted = listener->accept_one_client();
+
+	socket_limits limits;
+	limits.recvTimeout = std::chrono::milliseconds(50);
+	limits.sendTimeout = std::chrono::milliseconds(50);
+	limits.sendBufferSize = 4096;
+	accepted->set_limits(limits);
+
+	assert(!accepted->wait_readable(std::chrono::milliseconds(20)));
+	assert(!accepted->poll_readable());
+	uint32_t half = 42;
+	peer->send(&half, sizeof(half));
+	peer->flush();
+	assert(accepted->wait_readable(std::chrono::milliseconds(1000)));
+	assert(accepted->poll_readable());
+
+	// half of the value arrived, the rest never will
+	uint64_t value;
+	bool thrown = false;
+	auto start = std::chrono::steady_clock::now();
+	try {
+		accepted->recv(&value, sizeof(value));
+	} catch (socket_timeout_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+
+	// peer doesn't read, so send can't complete
+	auto reader = make_client_socket(address, TIMEOUT_TEST_PORT, true, backend);
+	auto writer = listener->accept_one_client();
+	writer->set_limits(limits);
+	std::vector<uint8_t> big(16 * 1024 * 1024);
+	thrown = false;
+	try {
+		writer->send(big.data(), big.size());
+		writer->flush();
+	} catch (socket_timeout_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+}
+
+static void test_database_catalog_handoff()
+{
+	database_options options;
+	options.memoryBudget = 2 * 1024;
+	database old(options);
+	auto text = [] (int i) { return std::string(100, 'a' + i % 26) + std::to_string(i); };
+	for (int i = 0; i < 50; ++i)
+		old.add_song("author" + std::to_string(i % 5), "song" + std::to_string(i), text(i));
+	old.add_song("cover", "song", text(7));
+	old.add_song("Queen", "Bohemian Rhapsody", "text");
+	assert(old.stats().evictions > 0);
+
+	std::string found;
+	std::vector<std::string> songs;
+	uint64_t songVersion, listVersion;
+	old.get_song_if_modified("author2", "song7", 0, found, songVersion);
+	old.get_song_list_if_modified("author2", 0, songs, listVersion);
+
+	int catalog = old.export_catalog();
+	database taken(options);
+	taken.import_catalog(catalog);
+
+	// evicted texts came along, shared one is stored once again
+	for (int i = 0; i < 50; ++i)
+		assert(taken.get_song("author" + std::to_string(i % 5), "song" + std::to_string(i)) == text(i));
+	assert(taken.get_song("cover", "song") == text(7));
+	assert(taken.stats().uniqueTexts == old.stats().uniqueTexts);
+	assert(taken.stats().residentBytes <= options.memoryBudget);
+	auto sorted = [] (std::vector<std::string> names) {
+		std::sort(names.begin(), names.end());
+		return names;
+	};
+	assert(sorted(taken.get_song_list("author2")) == sorted(old.get_song_list("author2")));
+
+	// clients polling with known versions see no change
+	uint64_t version;
+	assert(!taken.get_song_if_modified("author2", "song7", songVersion, found, version));
+	assert(version == songVersion);
+	assert(!taken.get_song_list_if_modified("author2", listVersion, songs, version));
+	taken.add_song("author2", "song7", "new text");
+	assert(taken.get_song_if_modified("author2", "song7", songVersion, found, version));
+	assert(found == "new text" && version > songVersion);
+	assert(taken.suggest_songs("Queen", "Bohemian Rapsody", 1).at(0).song == "Bohemian Rhapsody");
+
+	bool thrown = false;
+	try {
+		taken.import_catalog(catalog);
+	} catch (std::runtime_error const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	close(catalog);
+
+	image_writer truncated;
+	truncated.write_number(0x313074616372796c);
+	truncated.write_number(1);
+	truncated.write_number(3);
+	int malformed = truncated.finish();
+	thrown = false;
+	try {
+		database empty;
+		empty.import_catalog(malformed);
+	} catch (std::runtime_error const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	close(malformed);
+}
+
+/*
+ * Listening socket keeps working for its new owner, unix socket file stays.
+ */
+static void test_listener_hand_over(socket_backend backend, std::string const & address = TEST_ADDR)
+{
+	auto listener = make_server_socket(address, HANDOVER_TEST_PORT, backend);
+	assert(listener->descriptor() >= 0);
+	bool thrown = false;
+	std::thread acceptor([&listener, &thrown] () {
+		try {
+			listener->accept_one_client();
+		} catch (socket_exception const &) {
+			thrown = true;
+		}
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	listener->hand_over();
+	acceptor.join();
+	assert(thrown);
+
+	// connects before the new owner accepts, waits in the queue
+	auto peer = make_client_socket(address, HANDOVER_TEST_PORT, true, backend);
+	auto adopted = adopt_server_socket(dup(listener->descriptor()), backend);
+	listener.reset();
+	if (!address.compare(0, 6, "unix:/"))
+		assert(access(address.c_str() + 5, F_OK) == 0);
+
+	auto accepted = adopted->accept_one_client();
+	uint32_t value = 42;
+	peer->send(&value, sizeof(value));
+	peer->flush();
+	uint32_t received = 0;
+	accepted->recv(&received, sizeof(received));
+	assert(received == value);
+
+	// two owners wake for every connection, the one losing it must still notice hand_over
+	auto second = adopt_server_socket(dup(adopted->descriptor()), backend);
+	std::mutex guard;
+	std::vector<socket_ptr> accepts;
+	auto accept_all = [&guard, &accepts] (server_socket_ptr owner) {
+		try {
+			while (true) {
+				auto client = owner->accept_one_client();
+				std::lock_guard<std::mutex> g(guard);
+				accepts.push_back(client);
+			}
+		} catch (socket_exception const &) {
+		}
+	};
+	std::thread first(accept_all, adopted);
+	std::thread other(accept_all, second);
+	std::vector<client_socket_ptr> peers;
+	for (int i = 0; i < 10; ++i)
+		peers.push_back(make_client_socket(address, HANDOVER_TEST_PORT, true, backend));
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		std::lock_guard<std::mutex> g(guard);
+		if (accepts.size() == peers.size())
+			break;
+	}
+	adopted->hand_over();
+	second->hand_over();
+	first.join();
+	other.join();
+}
+
+/*
+ * Timeouts hold for whole messages, a peer trickling one in pieces that
+ * each come in time still runs out of it.
+ */
+static void test_message_timeouts(socket_backend backend, std::string const & address = TEST_ADDR)
+{
+	auto listener = make_server_socket(address, TIMEOUT_TEST_PORT, backend);
+	auto peer = make_client_socket(address, TIMEOUT_TEST_PORT, true, backend);
+	auto accepted = listener->accept_one_client();
+
+	socket_limits limits;
+	limits.recvTimeout = std::chrono::milliseconds(150);
+	limits.sendTimeout = std::chrono::milliseconds(150);
+	limits.sendBufferSize = 4096;
+	accepted->set_limits(limits);
+
+	// 512 bytes every 30 ms, never a pause of 150 ms, but 10 KB take 600 ms
+	std::thread trickler([&peer] () {
+		uint64_t size = 10 * 1024;
+		std::vector<uint8_t> piece(512, 1);
+		try {
+			peer->send(&size, sizeof(size));
+			peer->flush();
+			for (uint64_t sent = 0; sent < size; sent += piece.size()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(30));
+				peer->send(piece.data(), piece.size());
+				peer->flush();
+			}
+		} catch (socket_exception const &) {
+		}
+	});
+	bool thrown = false;
+	auto start = std::chrono::steady_clock::now();
+	try {
+		recv_message(*accepted);
+	} catch (socket_timeout_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(450));
+	trickler.join();
+
+	// reader takes 64 KB every 20 ms, a 4 MB response would take over a second
+	auto reader = make_client_socket(address, TIMEOUT_TEST_PORT, true, backend);
+	auto writer = listener->accept_one_client();
+	writer->set_limits(limits);
+	std::thread slow([&reader] () {
+		std::vector<uint8_t> buffer(64 * 1024);
+		try {
+			while (true) {
+				reader->recv(buffer.data(), buffer.size());
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			}
+		} catch (socket_exception const &) {
+		}
+	});
+	thrown = false;
+	start = std::chrono::steady_clock::now();
+	try {
+		send_message(*writer, get_song_response(std::string(4 * 1024 * 1024, 'x')));
+	} catch (socket_timeout_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(600));
+	writer.reset();
+	slow.join();
+
+	// keep-alive connection idles longer than read timeout, then is served
+	drain_control drain;
+	drain_control const * controls[] = { nullptr, &drain };
+	for (drain_control const * control: controls) {
+		auto idle = make_client_socket(address, TIMEOUT_TEST_PORT, true, backend);
+		auto served = listener->accept_one_client();
+		served->set_limits(limits);
+		std::thread late([&idle] () {
+			std::this_thread::sleep_for(std::chrono::milliseconds(400));
+			send_message(*idle, get_song_request("author", "song"));
+		});
+		assert(wait_for_request(*served, std::chrono::seconds(0), control) == idle_wait::REQUEST);
+		auto request = recv_message(*served);
+		assert(dynamic_cast<get_song_request *>(request.get()));
+		late.join();
+	}
+}
+
+static link_stats test_impaired_link_round_trips(link_options const & options)
+{
+	auto pair = make_impaired_socket_pair(options);
+	std::thread echo([&] () {
+		for (size_t i = 0; i < 40; ++i)
+			send_message(*pair.second, *recv_message(*pair.second));
+	});
+	for (size_t i = 0; i < 40; ++i) {
+		std::string text(i * 997 % 20000, char('a' + i % 26));
+		send_message(*pair.first, get_song_response(text));
+		auto reply = recv_message(*pair.first);
+		assert(static_cast<get_song_response &>(*reply).get_text() == text);
+	}
+	echo.join();
+	return get_link_stats(*pair.first);
+}
+
+static void test_impaired_link()
+{
+	// stream stays intact under loss, jitter and reordering, same seed same fate
+	link_options options;
+	options.delay = std::chrono::microseconds(200);
+	options.jitter = std::chrono::microseconds(300);
+	options.loss = 0.1;
+	options.reorder = 0.2;
+	options.segmentSize = 512;
+	options.seed = 7;
+	link_stats stats = test_impaired_link_round_trips(options);
+	assert(stats.lost > 0 && stats.reordered > 0);
+	link_stats again = test_impaired_link_round_trips(options);
+	assert(again.segments == stats.segments && again.bytes == stats.bytes);
+	assert(again.lost == stats.lost && again.reordered == stats.reordered);
+	options.seed = 8;
+	assert(test_impaired_link_round_trips(options).lost != stats.lost);
+
+	// bandwidth bounds throughput
+	options = link_options();
+	options.bandwidth = 4 * 1024 * 1024;
+	auto pair = make_impaired_socket_pair(options);
+	std::vector<uint8_t> sent(512 * 1024), received(sent.size());
+	for (size_t i = 0; i < sent.size(); ++i)
+		sent[i] = uint8_t(i * 31);
+	auto start = std::chrono::steady_clock::now();
+	std::thread writer([&] () { pair.first->send(sent.data(), sent.size()); });
+	pair.second->recv(received.data(), received.size());
+	writer.join();
+	assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+	assert(sent == received);
+
+	// limits, readiness and peer going away
+	options.delay = std::chrono::milliseconds(20);
+	options.queueSize = 4096;
+	pair = make_impaired_socket_pair(options);
+	socket_limits limits;
+	limits.recvTimeout = std::chrono::milliseconds(30);
+	limits.sendTimeout = std::chrono::milliseconds(30);
+	pair.first->set_limits(limits);
+	pair.second->set_limits(limits);
+	assert(!pair.second->poll_readable());
+	pair.first->send("Hi", 2);
+	assert(!pair.second->poll_readable());
+	assert(pair.second->wait_readable(std::chrono::milliseconds(1000)));
+	bool thrown = false;
+	try {
+		pair.first->send(sent.data(), sent.size());
+	} catch (socket_timeout_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+	char buf[4];
+	pair.second->recv(buf, 2);
+	assert(!memcmp(buf, "Hi", 2));
+	pair.first.reset();
+	// segments queued before the timeout are still delivered
+	pair.second->recv(received.data(), 2 * options.segmentSize);
+	assert(!memcmp(received.data(), sent.data(), 2 * options.segmentSize));
+	thrown = false;
+	try {
+		pair.second->recv(buf, 1);
+	} catch (socket_timeout_exception const &) {
+	} catch (socket_exception const &) {
+		thrown = true;
+	}
+	assert(thrown);
+
+	thrown = false;
+	try {
+		options.loss = 1;
+		make_impaired_socket_pair(options);
+	} catch (std::invalid_argument const &) {
+		thrown = true;
+	}
+	assert(thrown);
+}
+
+struct test_request_visitor: public request_visitor {
+	explicit test_request_visitor(database & d)
+		: db(d)
+	{}
+
+	void visit(get_song_list_request & request) override
+	{
+		read = true;
+		if (!request.is_versioned()) {
+			msg = std::make_shared<get_song_list_response>(db.get_song_list(request.get_author()));
+			return;
+		}
+
+		std::vector<std::string> songs;
+		uint64_t version;
+		if (db.get_song_list_if_modified(request.get_author(), request.get_known_version(), songs, version))
+			msg = std::make_shared<get_song_list_response>(std::move(songs), version);
+		else
+			msg = std::make_shared<not_modified_response>(version);
+	}
+
+	void visit(get_song_request & request) override
+	{
+		read = true;
+		if (!request.is_versioned()) {
+			msg = std::make_shared<get_song_response>(
+				db.get_song(request.get_author(), request.get_song()));
+			return;
+		}
+
+		std::string text;
+		uint64_t version;
+		if (db.get_song_if_modified(request.get_author(), request.get_song(), request.get_known_version(), text, version))
+			msg = std::make_shared<get_song_response>(std::move(text), version);
+		else
+			msg = std::make_shared<not_modified_response>(version);
+	}
+
+	void visit(add_song_request & request) override
+	{
+		db.add_song(request.get_author(), request.get_song(), request.get_text());
+		msg = std::make_shared<add_song_response>("OK");
+	}
+
+	void visit(update_song_request & request) override
+	{
+		std::string base;
+		text_digest digest;
+		bool applied = db.find_song(request.get_author(), request.get_song(), base, digest)
+			&& digest == request.get_base_digest()
+			&& db.replace_song(request.get_author(), request.get_song(), digest,
+				apply_text_delta(base, request.get_delta()));
+		msg = std::make_shared<add_song_response>(applied ? "OK" : UPDATE_BASE_MISMATCH);
+	}
+
+	void visit(subscribe_request &) override
+	{
+		msg = std::make_shared<add_song_response>(SUBSCRIBE_UNSUPPORTED);
+	}
+
+	void visit(top_songs_request &) override
+	{
+		read = true;
+		msg = std::make_shared<top_songs_response>(std::vector<song_popularity>(), std::vector<author_popularity>());
+	}
+
+	void visit(scan_request & request) override
+	{
+		read = true;
+		msg = std::make_shared<scan_response>(db.scan(request.get_query()));
+	}
+
+	void visit(find_song_request & request) override
+	{
+		read = true;
+		std::string text;
+		text_digest digest;
+		if (db.find_song(request.get_author(), request.get_song(), text, digest))
+			msg = std::make_shared<get_song_response>(std::move(text), std::vector<song_name>());
+		else
+			msg = std::make_shared<get_song_response>(std::string(),
+				db.suggest_songs(request.get_author(), request.get_song(), request.get_suggestions()));
+	}
+
+	message_ptr msg;
+	bool read = false;
+	database & db;
+};
+
+static task<void> async_client_worker(async_client & c, int worker, int songs, int & done)
+{
+	std::string author = "author" + std::to_string(worker);
+	for (int i = 0; i < songs; ++i) {
+		std::string song = "song" + std::to_string(i);
+		assert(co_await c.add_song(author, song, std::to_string(i)) == "OK");
+		assert(co_await c.get_song(author, song) == std::to_string(i));
+	}
+	assert((co_await c.get_song_list(author)).size() == size_t(songs));
+	++done;
+}
+
+static task<void> async_client_run(async_client & c, event_loop & loop, int workers, int songs)
+{
+	co_await c.connect();
+
+	int done = 0;
+	for (int w = 0; w < workers; ++w)
+		loop.spawn(async_client_worker(c, w, songs, done));
+	// workers finish in background, poll until all of them did
+	while (done < workers) {
+		// any request yields to the loop and lets workers progress
+		co_await c.get_song_list("nobody");
+	}
+}
+
+static void test_song_suggestions()
+{
+	database db;
+	db.add_song("The Beatles", "Yesterday", "text");
+	db.add_song("The Beatles", "Let It Be", "text");
+	db.add_song("Queen", "Don't Stop Me Now", "text");
+	db.add_song("Queen", "Bohemian Rhapsody", "text");
+	for (int i = 0; i < 200; ++i)
+		db.add_song("filler" + std::to_string(i % 10), "song number " + std::to_string(i), "text");
+
+	auto first = [&db] (std::string const & author, std::string const & song) {
+		auto suggestions = db.suggest_songs(author, song, 3);
+		return suggestions.empty() ? std::string() : suggestions[0].author + "/" + suggestions[0].song;
+	};
+	// case, punctuation, typos and a missing article
+	assert(first("the beatles", "yesterday") == "The Beatles/Yesterday");
+	assert(first("Queen", "dont stop me now") == "Queen/Don't Stop Me Now");
+	assert(first("Quen", "Bohemian Rapsody") == "Queen/Bohemian Rhapsody");
+	assert(first("Beatles", "Let it be") == "The Beatles/Let It Be");
+	assert(first("filler3", "song numbr 13") == "filler3/song number 13");
+	// nothing close
+	assert(db.suggest_songs("Nobody", "Completely different", 3).empty());
+	assert(db.suggest_songs("Queen", "Bohemian Rhapsody", 0).empty());
+	assert(db.suggest_songs("filler1", "song number", 5).size() == 5);
+
+	// more concurrent queries than idle counters kept, each gets its own
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; ++t)
+		threads.emplace_back([&first, t] () {
+			for (int i = 0; i < 50; ++i) {
+				assert(first("Quen", "Bohemian Rapsody") == "Queen/Bohemian Rhapsody");
+				assert(first("filler" + std::to_string(t), "song numbr " + std::to_string(10 + t))
+					== "filler" + std::to_string(t) + "/song number " + std::to_string(10 + t));
+			}
+		});
+	for (auto & thread: threads)
+		thread.join();
+
+	// suggestions come with the miss only
+	test_request_visitor v(db);
+	find_song_request hit("Queen", "Bohemian Rhapsody", 5);
+	hit.accept(v);
+	auto response = std::dynamic_pointer_cast<get_song_response>(parse_message(v.msg->serialize()));
+	assert(response->get_text() == "text" && response->get_suggestions().empty());
+	find_song_request miss("queen", "bohemian rhapsody", 5);
+	miss.accept(v);
+	response = std::dynamic_pointer_cast<get_song_response>(parse_message(v.msg->serialize()));
+	assert(response->get_text().empty() && response->has_suggestions());
+	assert(response->get_suggestions().at(0).song == "Bohemian Rhapsody");
+}
+
+static void test_async_client()
+{
+	const int connections = 2;
+	database db;
+	fair_scheduler scheduler(1, std::chrono::microseconds(100));
+	load_shedder shedder(scheduler, std::chrono::milliseconds(0));
+	auto listener = make_server_socket(TEST_ADDR, ASYNC_TEST_PORT);
+	std::vector<std::thread> handlers;
+	std::thread acceptor([&] () {
+		for (int i = 0; i < connections; ++i) {
+			socket_ptr peer = listener->accept_one_client();
+			handlers.emplace_back([peer, &db, &scheduler, &shedder] () {
+				auto flow = scheduler.open_flow();
+				try {
+					while (true) {
+						auto request = recv_message(*peer);
+						auto received = load_shedder::clock::now();
+						test_request_visitor v(db);
+						auto outcome = shedder.serve(*flow, *request, [&] () {
+							request->accept(v);
+							// every request takes a while, so short budgets run out
+							std::this_thread::sleep_for(std::chrono::microseconds(100));
+							return processed_request{ v.msg, v.read };
+						}, received);
+						send_message(*peer, *outcome.response);
+					}
+				} catch (socket_exception const &) {
+					// client disconnected
+				}
+			});
+		}
+	});
+
+	{
+		event_loop loop;
+		async_client c(loop, TEST_ADDR, ASYNC_TEST_PORT, connections);
+		loop.run_until_complete(async_client_run(c, loop, 16, 20));
+		assert(loop.run_until_complete(c.get_song("author3", "song7")) == "7");
+
+		std::string text(10000, 'x');
+		assert(loop.run_until_complete(c.add_song("author3", "song7", text)) == "OK");
+		std::string typo = text;
+		typo[5000] = 'y';
+		assert(loop.run_until_complete(c.update_song("author3", "song7", text, typo)) == "OK");
+		assert(loop.run_until_complete(c.get_song("author3", "song7")) == typo);
+		// wrong base, client falls back to full upload
+		assert(loop.run_until_complete(c.update_song("author3", "song7", text, text)) == "OK");
+		assert(loop.run_until_complete(c.get_song("author3", "song7")) == text);
+
+		auto song = loop.run_until_complete(c.get_song_if_modified("author3", "song7", 0));
+		assert(song.modified && song.text == text && song.version > 0);
+		auto same = loop.run_until_complete(c.get_song_if_modified("author3", "song7", song.version));
+		assert(!same.modified && same.version == song.version && same.text.empty());
+		auto list = loop.run_until_complete(c.get_song_list_if_modified("author3", 0));
+		assert(list.modified && list.songs.size() == 20);
+		assert(!loop.run_until_complete(c.get_song_list_if_modified("author3", list.version)).modified);
+		loop.run_until_complete(c.add_song("author3", "song7", "changed"));
+		assert(loop.run_until_complete(c.get_song_if_modified("author3", "song7", song.version)).text == "changed");
+
+		c.set_deadline(std::chrono::seconds(1));
+		assert(loop.run_until_complete(c.get_song("author3", "song7")) == "changed");
+		c.set_deadline(std::chrono::microseconds(10));
+		bool thrown = false;
+		try {
+			loop.run_until_complete(c.get_song("author3", "song7"));
+		} catch (overloaded_exception const & e) {
+			thrown = std::string(e.what()) == OVERLOADED_DEADLINE_EXPIRED;
+		}
+		assert(thrown);
+		c.set_deadline(std::chrono::microseconds(0));
+		assert(loop.run_until_complete(c.get_song("author3", "song7")) == "changed");
+	}
+
+	acceptor.join();
+	for (auto & t: handlers)
+		t.join();
+}
+
+/*
+ * Accept failing for lack of descriptors doesn't stop the listener, the
+ * client waiting meanwhile is served once descriptors are freed.
+ */
+static void test_listener_accept_errors()
+{
+	listener_options options;
+	options.hostname = TEST_ADDR;
+	options.port = ACCEPT_TEST_PORT;
+	listener_group listeners(options);
+	std::atomic<int> served { 0 };
+	std::thread runner([&listeners, &served] () {
+		listeners.run([&served] (socket_ptr, listener_stats &) { ++served; });
+	});
+
+	rlimit original;
+	getrlimit(RLIMIT_NOFILE, &original);
+	rlimit lowered = original;
+	lowered.rlim_cur = std::min<rlim_t>(original.rlim_cur, 256);
+	setrlimit(RLIMIT_NOFILE, &lowered);
+	std::vector<int> fillers;
+	for (int fd; (fd = dup(STDERR_FILENO)) >= 0; )
+		fillers.push_back(fd);
+	assert(errno == EMFILE && !fillers.empty());
+	// just enough for the client, the accepted end doesn't fit
+	close(fillers.back());
+	fillers.pop_back();
+	auto peer = make_client_socket(TEST_ADDR, ACCEPT_TEST_PORT);
+	peer->connect();
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	assert(served == 0);
+
+	for (int fd: fillers)
+		close(fd);
+	setrlimit(RLIMIT_NOFILE, &original);
+	for (int i = 0; i < 500 && !served; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	assert(served == 1);
+
+	listeners.hand_over();
+	runner.join();
+}
+
 int main()
 {
 	test_tcp_stream_sockets();
+	test_uring_stream_sockets();
+	test_unix_stream_sockets();
+	test_shm_client_gone_before_accept();
+	test_unix_socket_path_reuse();
 	test_au_stream_sockets();
+	test_database_concurrent_writes();
+	test_database_memory_budget();
+	test_database_dedup();
+	test_text_delta();
+	test_message_schema();
+	test_database_versions();
+	test_deadline_messages();
+	test_drr_queue();
+	test_token_bucket();
+	test_load_shedder();
+	test_invalidation_hub();
+	test_song_cache();
+	test_requester_invalidations();
+	test_catalog_scan();
+	test_corpus();
+	test_async_client();
+	test_song_suggestions();
+	test_tracing();
+	test_popularity();
+	test_socket_timeouts(socket_backend::TCP);
+	test_socket_timeouts(socket_backend::URING);
+	test_socket_timeouts(socket_backend::SHM, UNIX_ABSTRACT_TEST_PATH);
+	test_message_timeouts(socket_backend::TCP);
+	test_message_timeouts(socket_backend::URING);
+	test_message_timeouts(socket_backend::SHM, UNIX_ABSTRACT_TEST_PATH);
+	test_impaired_link();
+	test_database_catalog_handoff();
+	test_listener_hand_over(socket_backend::TCP);
+	test_listener_hand_over(socket_backend::URING);
+	test_listener_hand_over(socket_backend::TCP, UNIX_TEST_PATH);
+	test_listener_accept_errors();
 
 	std::cerr << "ALL TESTS PASSED" << std::endl;
 